@@ -7,9 +7,21 @@
 //   the Pepper Graphics2D interface and ppapi_simple.
 //
 //   See http://www.antigrain.com for more information on Anti-Grain Geometry
+//
+//   Frames are rendered in horizontal bands on a pool of threads.  Passing
+//   --threads=N sets the pool size, and --bench=FRAMES renders that many
+//   frames offscreen for each pool size up to N and reports frame times
+//   instead of running the demo.
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <vector>
 
 #include <agg-2.5/agg_basics.h>
 #include <agg-2.5/agg_conv_stroke.h>
@@ -25,70 +37,256 @@
 
 #include "ppapi_simple/ps_context_2d.h"
 
+namespace {
+
+const int kMaxThreads = 16;
+// Bands per thread; more than one so that a slow band does not hold up
+// the whole frame.
+const int kBandsPerThread = 4;
+const int kBenchWidth = 512;
+const int kBenchHeight = 512;
+
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+}  // namespace
+
+
+// Calls a function for every band of a frame, spread over a fixed set of
+// threads.  The calling thread is thread 0 and works on bands as well.
+class BandPool {
+ public:
+  typedef void (*BandFunc)(void* arg, int thread, int y0, int y1);
+
+  explicit BandPool(int num_threads);
+  ~BandPool();
+  int num_threads() const { return num_threads_; }
+  // Returns once fn has been called for all bands of height rows.
+  void Run(int height, BandFunc fn, void* arg);
+
+ private:
+  static void* WorkerMain(void* arg);
+  void DoBands(int thread);
+
+  int num_threads_;
+  std::vector<pthread_t> threads_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t start_;
+  pthread_cond_t done_;
+  unsigned generation_;
+  int pending_;
+  bool quit_;
+
+  // The frame in progress.
+  BandFunc fn_;
+  void* arg_;
+  int height_;
+  int band_rows_;
+  int num_bands_;
+  int next_band_;
+};
+
+struct BandWorkerStart {
+  BandPool* pool;
+  int thread;
+};
+
+BandPool::BandPool(int num_threads)
+    : num_threads_(num_threads), generation_(0), pending_(0), quit_(false),
+      fn_(NULL), arg_(NULL), height_(0), band_rows_(0), num_bands_(0),
+      next_band_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&start_, NULL);
+  pthread_cond_init(&done_, NULL);
+  for (int i = 1; i < num_threads_; i++) {
+    BandWorkerStart* start = new BandWorkerStart;
+    start->pool = this;
+    start->thread = i;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, WorkerMain, start) != 0) {
+      fprintf(stderr, "BandPool: pthread_create failed, %d threads\n", i);
+      delete start;
+      num_threads_ = i;
+      break;
+    }
+    threads_.push_back(tid);
+  }
+}
+
+BandPool::~BandPool() {
+  pthread_mutex_lock(&mutex_);
+  quit_ = true;
+  pthread_cond_broadcast(&start_);
+  pthread_mutex_unlock(&mutex_);
+  for (size_t i = 0; i < threads_.size(); i++)
+    pthread_join(threads_[i], NULL);
+  pthread_cond_destroy(&done_);
+  pthread_cond_destroy(&start_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void BandPool::Run(int height, BandFunc fn, void* arg) {
+  pthread_mutex_lock(&mutex_);
+  fn_ = fn;
+  arg_ = arg;
+  height_ = height;
+  num_bands_ = num_threads_ > 1 ? num_threads_ * kBandsPerThread : 1;
+  if (num_bands_ > height)
+    num_bands_ = height > 0 ? height : 1;
+  band_rows_ = (height + num_bands_ - 1) / num_bands_;
+  next_band_ = 0;
+  pending_ = num_threads_ - 1;
+  generation_++;
+  pthread_cond_broadcast(&start_);
+  pthread_mutex_unlock(&mutex_);
+
+  DoBands(0);
+
+  pthread_mutex_lock(&mutex_);
+  while (pending_ > 0)
+    pthread_cond_wait(&done_, &mutex_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void BandPool::DoBands(int thread) {
+  int band;
+  while ((band = __sync_fetch_and_add(&next_band_, 1)) < num_bands_) {
+    int y0 = band * band_rows_;
+    int y1 = y0 + band_rows_ < height_ ? y0 + band_rows_ : height_;
+    if (y0 < y1)
+      fn_(arg_, thread, y0, y1);
+  }
+}
+
+void* BandPool::WorkerMain(void* arg) {
+  BandWorkerStart* start = static_cast<BandWorkerStart*>(arg);
+  BandPool* pool = start->pool;
+  int thread = start->thread;
+  delete start;
+
+  unsigned seen = 0;
+  pthread_mutex_lock(&pool->mutex_);
+  for (;;) {
+    while (pool->generation_ == seen && !pool->quit_)
+      pthread_cond_wait(&pool->start_, &pool->mutex_);
+    if (pool->quit_)
+      break;
+    seen = pool->generation_;
+    pthread_mutex_unlock(&pool->mutex_);
+
+    pool->DoBands(thread);
+
+    pthread_mutex_lock(&pool->mutex_);
+    if (--pool->pending_ == 0)
+      pthread_cond_signal(&pool->done_);
+  }
+  pthread_mutex_unlock(&pool->mutex_);
+  return NULL;
+}
+
 
 // Drawing class holds information and functionality needed to render
 class DrawingDemo {
  public:
-  DrawingDemo(); ~DrawingDemo();
+  DrawingDemo(int num_threads, bool headless); ~DrawingDemo();
   void Display();
   void Update();
   bool PumpEvents();
   void Run();
+  void RunBenchmark(int frames);
 
  private:
+  struct Circle {
+    double x, y;
+    agg::rgba color;
+  };
+  // What each pool thread keeps between frames.
+  struct BandState {
+    agg::rasterizer_scanline_aa<> ras;
+    agg::scanline_u8 sl;
+  };
+
+  void BuildFrame(int width, int height);
+  void Render(unsigned char* data, int width, int height, int stride);
+  static void RenderBand(void* arg, int thread, int y0, int y1);
+
   PSContext2D_t* ps_context_;
+  BandPool* pool_;
+  BandState band_state_[kMaxThreads];
+  double outer_cycle_;
+  double delta_outer_cycle_;
+
+  // The frame being rendered.
+  std::vector<Circle> circles_;
+  agg::rendering_buffer rbuf_;
 };
 
 
-// This update loop is run once per frame.
-// All of the Anti-Grain Geometry (AGG) rendering is done in this function.
-// AGG renders straight into the DrawingDemo's ps_context_.
-void DrawingDemo::Update() {
-  unsigned int i;
-  agg::rendering_buffer rbuf((unsigned char *)ps_context_->data,
-                             ps_context_->width,
-                             ps_context_->height,
-                             ps_context_->stride);
-  // Setup agg and clear the framebuffer.
-  // Use Native Client's bgra pixel format.
-  agg::pixfmt_bgra32 pixf(rbuf);
-  typedef agg::renderer_base<agg::pixfmt_bgra32> ren_base;
-  ren_base ren(pixf);
-  ren.clear(agg::rgba(0, 0, 0));
-  agg::rasterizer_scanline_aa<> ras;
-  agg::scanline_u8 sl;
-  ras.reset();
-  ras.gamma(agg::gamma_none());
+const double kSpectrumViolet = 380.0;
+const double kSpectrumRed = 780.0;
+const double kCircleRadius = 16.0;
 
-  // Draw an array of filled circles with a cycling color spectrum.
-  const double spectrum_violet = 380.0;
-  const double spectrum_red = 780.0;
-  static double outer_cycle = spectrum_violet;
-  static double delta_outer_cycle = 0.4;
-  double inner_cycle = outer_cycle;
+// Works out this frame's circles, an array of filled circles with a
+// cycling color spectrum.  The colors depend on the order, so this is
+// done once per frame before the bands are rendered.
+void DrawingDemo::BuildFrame(int width, int height) {
+  circles_.clear();
+  double inner_cycle = outer_cycle_;
   double delta_inner_cycle = 0.75;
-  for (double y = 0.0; y <= ps_context_->height; y += 32.0) {
-    for (double x = 0.0; x <= ps_context_->width; x += 32.0) {
-      // Draw a small filled circle at x, y with radius 16
-      // using inner_cycle as the fill color.
-      agg::rgba color(inner_cycle, 1.0);
-      agg::ellipse elp;
-      elp.init(x, y, 16, 16, 80);
-      ras.add_path(elp);
-      agg::render_scanlines_aa_solid(ras, sl, ren, color);
+  for (double y = 0.0; y <= height; y += 32.0) {
+    for (double x = 0.0; x <= width; x += 32.0) {
+      Circle circle = {x, y, agg::rgba(inner_cycle, 1.0)};
+      circles_.push_back(circle);
       // Bounce color cycle between red & violet.
       inner_cycle += delta_inner_cycle;
-      if ((inner_cycle > spectrum_red) || (inner_cycle < spectrum_violet)) {
+      if ((inner_cycle > kSpectrumRed) || (inner_cycle < kSpectrumViolet)) {
         delta_inner_cycle = -delta_inner_cycle;
         inner_cycle += delta_inner_cycle;
       }
     }
   }
   // Bounce outer starting color between red & violet.
-  outer_cycle += delta_outer_cycle;
-  if ((outer_cycle > spectrum_red) || (outer_cycle < spectrum_violet)) {
-    delta_outer_cycle = -delta_outer_cycle;
-    outer_cycle += delta_outer_cycle;
+  outer_cycle_ += delta_outer_cycle_;
+  if ((outer_cycle_ > kSpectrumRed) || (outer_cycle_ < kSpectrumViolet)) {
+    delta_outer_cycle_ = -delta_outer_cycle_;
+    outer_cycle_ += delta_outer_cycle_;
+  }
+}
+
+
+// Renders rows y0 up to y1 of the frame.  The renderer and the rasterizer
+// are both clipped to the band, so that nothing outside it is touched and
+// shapes are only rasterized as far as they reach into it.
+void DrawingDemo::RenderBand(void* arg, int thread, int y0, int y1) {
+  DrawingDemo* demo = static_cast<DrawingDemo*>(arg);
+  BandState& state = demo->band_state_[thread];
+  agg::rasterizer_scanline_aa<>& ras = state.ras;
+  agg::scanline_u8& sl = state.sl;
+
+  // Use Native Client's bgra pixel format.
+  agg::pixfmt_bgra32 pixf(demo->rbuf_);
+  typedef agg::renderer_base<agg::pixfmt_bgra32> ren_base;
+  ren_base ren(pixf);
+  const int width = demo->rbuf_.width();
+  ren.clip_box(0, y0, width - 1, y1 - 1);
+  ren.copy_bar(0, y0, width - 1, y1 - 1, agg::rgba(0, 0, 0));
+  ras.reset();
+  ras.clip_box(0, y0, width, y1);
+  ras.gamma(agg::gamma_none());
+
+  const std::vector<Circle>& circles = demo->circles_;
+  for (size_t i = 0; i < circles.size(); i++) {
+    // Draw a small filled circle if it reaches into the band.
+    const Circle& circle = circles[i];
+    if (circle.y + kCircleRadius < y0 || circle.y - kCircleRadius > y1)
+      continue;
+    agg::ellipse elp;
+    elp.init(circle.x, circle.y, kCircleRadius, kCircleRadius, 80);
+    ras.add_path(elp);
+    agg::render_scanlines_aa_solid(ras, sl, ren, circle.color);
   }
 
   // Draw a semi-translucent triangle over the background.
@@ -109,6 +307,23 @@ void DrawingDemo::Update() {
 }
 
 
+void DrawingDemo::Render(unsigned char* data, int width, int height,
+                         int stride) {
+  BuildFrame(width, height);
+  rbuf_.attach(data, width, height, stride);
+  pool_->Run(height, RenderBand, this);
+}
+
+
+// This update loop is run once per frame.
+// All of the Anti-Grain Geometry (AGG) rendering is done in this function.
+// AGG renders straight into the DrawingDemo's ps_context_.
+void DrawingDemo::Update() {
+  Render((unsigned char *)ps_context_->data, ps_context_->width,
+         ps_context_->height, ps_context_->stride);
+}
+
+
 // Displays software rendered image on the screen
 void DrawingDemo::Display() {
 }
@@ -125,8 +340,16 @@ bool DrawingDemo::PumpEvents() {
 }
 
 
-// Sets up and initializes DrawingDemo.
-DrawingDemo::DrawingDemo() {
+// Sets up and initializes DrawingDemo.  A headless demo only renders
+// offscreen, and never binds a context.
+DrawingDemo::DrawingDemo(int num_threads, bool headless)
+    : ps_context_(NULL),
+      pool_(new BandPool(num_threads)),
+      outer_cycle_(kSpectrumViolet),
+      delta_outer_cycle_(0.4) {
+  if (headless)
+    return;
+
   PSEventSetFilter(PSE_ALL);
   ps_context_ = PSContext2DAllocate(PP_IMAGEDATAFORMAT_BGRA_PREMUL);
 
@@ -142,7 +365,9 @@ DrawingDemo::DrawingDemo() {
 
 // Frees up resources.
 DrawingDemo::~DrawingDemo() {
-  PSContext2DFree(ps_context_);
+  delete pool_;
+  if (ps_context_)
+    PSContext2DFree(ps_context_);
 }
 
 
@@ -162,8 +387,65 @@ void DrawingDemo::Run() {
 }
 
 
+// Renders frames offscreen with 1 up to the demo's number of threads, and
+// prints the time per frame.  Every thread count must produce the same
+// pixels as one thread does.
+void DrawingDemo::RunBenchmark(int frames) {
+  const int stride = kBenchWidth * 4;
+  const size_t size = (size_t)stride * kBenchHeight;
+  std::vector<unsigned char> buffer(size), reference(size);
+  const int max_threads = pool_->num_threads();
+  double single = 0;
+
+  printf("%d frames of %dx%d\n", frames, kBenchWidth, kBenchHeight);
+  printf("%8s %12s %8s\n", "threads", "ms/frame", "speedup");
+  for (int threads = 1; threads <= max_threads; threads++) {
+    delete pool_;
+    pool_ = new BandPool(threads);
+    outer_cycle_ = kSpectrumViolet;
+    delta_outer_cycle_ = 0.4;
+
+    double start = Now();
+    for (int i = 0; i < frames; i++)
+      Render(&buffer[0], kBenchWidth, kBenchHeight, stride);
+    double ms = (Now() - start) * 1e3 / frames;
+    if (threads == 1) {
+      single = ms;
+      reference = buffer;
+    }
+    printf("%8d %12.3f %8.2f%s\n", pool_->num_threads(), ms, single / ms,
+           memcmp(&buffer[0], &reference[0], size) ? "  (pixels differ)" : "");
+  }
+}
+
+
 int main(int argc, char **argv) {
-  DrawingDemo demo;
-  demo.Run();
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int num_threads = cpus > 0 ? (int)cpus : 1;
+  int bench_frames = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--threads=", 10) == 0) {
+      num_threads = atoi(argv[i] + 10);
+    } else if (strncmp(argv[i], "--bench=", 8) == 0) {
+      bench_frames = atoi(argv[i] + 8);
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      bench_frames = 200;
+    } else {
+      fprintf(stderr, "usage: %s [--threads=N] [--bench[=FRAMES]]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (num_threads < 1)
+    num_threads = 1;
+  if (num_threads > kMaxThreads)
+    num_threads = kMaxThreads;
+
+  DrawingDemo demo(num_threads, bench_frames > 0);
+  if (bench_frames > 0)
+    demo.RunBenchmark(bench_frames);
+  else
+    demo.Run();
   return 0;
 }
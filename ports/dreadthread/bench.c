@@ -0,0 +1,701 @@
+/*
+ * Copyright 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * dreadthread benchmarks.
+ *
+ *   bench -b fanout [-w maxworkers] [-t ntasks] [-c work] [-m]
+ *   bench -b self [-t nthreads] [-c calls]
+ *   bench -b pingpong [-c switches]
+ *   bench -b echo [-w maxworkers] [-t nclients] [-c roundtrips] [-m]
+ *   bench -b tasks [-w workers] [-t ntasks] [-c rounds]
+ *   bench -b pipeline [-w maxworkers] [-c items]
+ *
+ * Threads' stacks come out of their worker's C stack.  self and tasks keep
+ * all of their threads alive at once, so they default to few enough of
+ * them to fit in a default worker stack and an 8 MB ulimit -s.  For more,
+ * raise -W (and ulimit -s for worker 0), or use -m to give every thread
+ * an mmap'ed stack; natively a worker falls back to those by itself once
+ * its own stack is used up.
+ *
+ * fanout: one thread spawns ntasks threads that each spin for a while and
+ * report back through a counting semaphore; run once per worker count
+ * from 1 to maxworkers.
+ *
+ * self: time dthr_this_thread with nthreads threads parked on an event.
+ *
+ * pingpong: two threads yielding to each other.  Build with
+ * -DDREAD_THREAD_USE_SETJMP to measure the setjmp/longjmp switch instead
+ * of the assembly one.
+ *
+ * echo: a loopback echo server with one thread per connection, and
+ * nclients client threads that connect to it and share roundtrips
+ * request/response pairs between them, all using dthr_read and friends.
+ * Every client costs two threads and two descriptors.
+ *
+ * tasks: spawn ntasks threads with empty bodies, rounds times over, with
+ * DThr_Thread_Run one at a time, with DThr_Thread_Run_Batch, and with
+ * dthr_thread_init/dthr_thread_run on a preallocated array for comparison.
+ * After the first round the DThr descriptors all come off free lists.
+ *
+ * pipeline: items pass through a chain of threads, first over queues
+ * built from a semaphore and two events, then over buffered and
+ * unbuffered channels.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dreadthread.h"
+
+#define STACKSIZE   (16 * 1024)
+#define NTASKS      10000
+#define NTASKS_LIVE 256         /* for self and tasks */
+
+int     nworkers = 4;
+int     ntasks = 0;             /* 0 for the benchmark's default */
+int     work = 100000;
+size_t  stacksize = STACKSIZE;
+size_t  worker_stacksize = 0;
+int     use_mmap = 0;
+char    *me;
+
+static double now(void)
+{
+  struct timeval  tv;
+
+  gettimeofday(&tv,0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * fan-out / fan-in
+ */
+struct dthr_semaphore   fanout_done;
+struct dthr_thread      *fanout_th;
+volatile unsigned long  fanout_sink;
+
+void *fanout_task(void *arg)
+{
+  unsigned long h = (uintptr_t) arg;
+  int           i;
+
+  for (i = 0; i < work; i++)
+    h = h * 6364136223846793005ul + 1442695040888963407ul;
+  fanout_sink = h;
+  dthr_semaphore_drop(&fanout_done);
+  return 0;
+}
+
+void *fanout_root(void *unused)
+{
+  int i;
+
+  for (i = 0; i < ntasks; i++) {
+    dthr_thread_init(&fanout_th[i],fanout_task,(void *) (uintptr_t) i,
+                     stacksize);
+    (void) dthr_thread_detach(dthr_thread_run(&fanout_th[i]));
+  }
+  for (i = 0; i < ntasks; i++)
+    dthr_semaphore_take(&fanout_done);
+  return 0;
+}
+
+void bench_fanout(void)
+{
+  struct dthr_thread      root;
+  struct dthr_stack_stats st;
+  double                  start, base = 0, t;
+  int                     w;
+
+  fanout_th = (struct dthr_thread *) malloc(ntasks * sizeof *fanout_th);
+  if (!fanout_th) {
+    perror(me);
+    exit(1);
+  }
+  printf("%8s %10s %12s %8s %8s %10s\n",
+         "workers","seconds","tasks/s","speedup","stacks","stack KB");
+  for (w = 1; w <= nworkers; w++) {
+    dthr_init();
+    if (!dthr_set_concurrency(w,worker_stacksize)) {
+      fprintf(stderr,"%s:  cannot use %d workers\n",me,w);
+      exit(1);
+    }
+    dthr_set_stack_mmap(use_mmap);
+    dthr_semaphore_init(&fanout_done,0);
+    dthr_thread_init(&root,fanout_root,0,stacksize);
+    start = now();
+    dthr_thread_multithread(&root);
+    t = now() - start;
+    if (w == 1) base = t;
+    dthr_get_stack_stats(&st);
+    printf("%8d %10.3f %12.0f %8.2f %8lu %10lu\n",w,t,ntasks / t,base / t,
+           st.active + st.cached,
+           (unsigned long) (st.active_bytes + st.cached_bytes) / 1024);
+  }
+  free(fanout_th);
+}
+
+/*
+ * dthr_this_thread with many live threads
+ */
+struct dthr_semaphore   self_lock;
+struct dthr_event       self_ev;
+int                     self_parked;
+
+void *self_park(void *unused)
+{
+  dthr_semaphore_take(&self_lock);
+  self_parked++;
+  dthr_event_wait(&self_ev,&self_lock);
+  dthr_semaphore_drop(&self_lock);
+  return 0;
+}
+
+void *self_root(void *unused)
+{
+  struct dthr_thread  *th;
+  double              start, t;
+  int                 i, bad = 0;
+
+  th = (struct dthr_thread *) malloc(ntasks * sizeof *th);
+  if (!th) {
+    perror(me);
+    exit(1);
+  }
+  for (i = 0; i < ntasks; i++) {
+    dthr_thread_init(&th[i],self_park,0,stacksize);
+    (void) dthr_thread_detach(dthr_thread_run(&th[i]));
+  }
+  while (self_parked < ntasks)
+    dthr_thread_yield();
+
+  start = now();
+  for (i = 0; i < work; i++)
+    bad += dthr_this_thread() != dthr_cur_thread;
+  t = now() - start;
+  printf("%d threads: %d calls in %.3f s, %.1f ns/call%s\n",
+         ntasks,work,t,t * 1e9 / work,bad ? " (WRONG THREAD)" : "");
+
+  dthr_semaphore_take(&self_lock);
+  dthr_event_broadcast_no_yield(&self_ev);
+  dthr_semaphore_drop(&self_lock);
+  return 0;
+}
+
+void bench_self(void)
+{
+  struct dthr_thread  root;
+
+  dthr_init();
+  dthr_set_stack_mmap(use_mmap);
+  dthr_semaphore_init(&self_lock,1);
+  dthr_event_init(&self_ev);
+  dthr_thread_init(&root,self_root,0,stacksize);
+  dthr_thread_multithread(&root);
+}
+
+/*
+ * context switch ping-pong
+ */
+struct dthr_semaphore pingpong_done;
+/* not on pingpong_root's stack: it may return before the players exit */
+struct dthr_thread    pingpong_a, pingpong_b;
+
+void *pingpong_player(void *unused)
+{
+  int i;
+
+  for (i = 0; i < work / 2; i++)
+    dthr_thread_yield();
+  dthr_semaphore_drop(&pingpong_done);
+  return 0;
+}
+
+void *pingpong_root(void *unused)
+{
+  double  start, t;
+
+  dthr_thread_init(&pingpong_a,pingpong_player,0,stacksize);
+  dthr_thread_init(&pingpong_b,pingpong_player,0,stacksize);
+  (void) dthr_thread_detach(dthr_thread_run(&pingpong_a));
+  (void) dthr_thread_detach(dthr_thread_run(&pingpong_b));
+  /* park ourselves so that only the players are runnable */
+  start = now();
+  dthr_semaphore_take(&pingpong_done);
+  dthr_semaphore_take(&pingpong_done);
+  t = now() - start;
+  printf("%s: %d switches in %.3f s, %.0f switches/s, %.1f ns/switch\n",
+#if defined(DREAD_THREAD_MD_SWAP)
+         "asm",
+#else
+         "setjmp",
+#endif
+         work,t,work / t,t * 1e9 / work);
+  return 0;
+}
+
+void bench_pingpong(void)
+{
+  struct dthr_thread  root;
+
+  dthr_init();
+  dthr_semaphore_init(&pingpong_done,0);
+  dthr_thread_init(&root,pingpong_root,0,stacksize);
+  dthr_thread_multithread(&root);
+}
+
+/*
+ * loopback echo server and client swarm
+ */
+#define ECHO_MSG  64
+
+struct sockaddr_in      echo_addr;
+int                     echo_listener, echo_stop, echo_errors;
+struct dthr_semaphore   echo_done;
+struct dthr_thread      *echo_th;         /* clients, then connections */
+struct dthr_thread      echo_server_th;
+
+void echo_fail(const char *what)
+{
+  if (!echo_errors++) perror(what);
+}
+
+void *echo_conn(void *arg)
+{
+  int     fd = (intptr_t) arg;
+  char    buf[ECHO_MSG];
+  ssize_t n, off, m;
+
+  while ((n = dthr_read(fd,buf,sizeof buf)) > 0) {
+    for (off = 0; off < n; off += m) {
+      if ((m = dthr_write(fd,buf + off,n - off)) < 0) {
+        echo_fail("echo server write");
+        goto out;
+      }
+    }
+  }
+  if (n < 0) echo_fail("echo server read");
+out:
+  close(fd);
+  return 0;
+}
+
+void *echo_server(void *unused)
+{
+  struct dthr_thread  *th = &echo_th[ntasks];
+  int                 fd;
+
+  while ((fd = dthr_accept(echo_listener,0,0)) >= 0) {
+    if (echo_stop || th == &echo_th[2 * ntasks]) {
+      close(fd);
+      break;
+    }
+    dthr_thread_init(th,echo_conn,(void *) (intptr_t) fd,stacksize);
+    (void) dthr_thread_detach(dthr_thread_run(th++));
+  }
+  if (fd < 0) echo_fail("echo accept");
+  close(echo_listener);
+  return 0;
+}
+
+void *echo_client(void *arg)
+{
+  int     rounds = (intptr_t) arg;
+  int     fd, i;
+  char    msg[ECHO_MSG], buf[ECHO_MSG];
+  ssize_t n, off;
+
+  memset(msg,'x',sizeof msg);
+  if ((fd = socket(AF_INET,SOCK_STREAM,0)) < 0
+      || dthr_connect(fd,(struct sockaddr *) &echo_addr,sizeof echo_addr)) {
+    echo_fail("echo connect");
+    goto out;
+  }
+  for (i = 0; i < rounds; i++) {
+    for (off = 0; off < (ssize_t) sizeof msg; off += n)
+      if ((n = dthr_write(fd,msg + off,sizeof msg - off)) < 0) {
+        echo_fail("echo client write");
+        goto out;
+      }
+    for (off = 0; off < (ssize_t) sizeof buf; off += n)
+      if ((n = dthr_read(fd,buf + off,sizeof buf - off)) <= 0) {
+        echo_fail("echo client read");
+        goto out;
+      }
+  }
+out:
+  if (fd >= 0) close(fd);
+  dthr_semaphore_drop(&echo_done);
+  return 0;
+}
+
+void *echo_root(void *unused)
+{
+  int i, fd, rounds = work / ntasks;
+
+  dthr_thread_init(&echo_server_th,echo_server,0,stacksize);
+  (void) dthr_thread_detach(dthr_thread_run(&echo_server_th));
+  for (i = 0; i < ntasks; i++) {
+    dthr_thread_init(&echo_th[i],echo_client,
+                     (void *) (intptr_t) (rounds ? rounds : 1),stacksize);
+    (void) dthr_thread_detach(dthr_thread_run(&echo_th[i]));
+  }
+  for (i = 0; i < ntasks; i++)
+    dthr_semaphore_take(&echo_done);
+
+  /* poke the server out of accept */
+  echo_stop = 1;
+  if ((fd = socket(AF_INET,SOCK_STREAM,0)) >= 0) {
+    (void) dthr_connect(fd,(struct sockaddr *) &echo_addr,sizeof echo_addr);
+    close(fd);
+  }
+  return 0;
+}
+
+void bench_echo(void)
+{
+  struct dthr_thread  root;
+  struct rlimit       rl;
+  socklen_t           len = sizeof echo_addr;
+  double              start, base = 0, t;
+  int                 w, rounds = work / ntasks;
+
+  /* two descriptors per client */
+  if (getrlimit(RLIMIT_NOFILE,&rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    (void) setrlimit(RLIMIT_NOFILE,&rl);
+  }
+  echo_th = (struct dthr_thread *) malloc(2 * ntasks * sizeof *echo_th);
+  if (!echo_th) {
+    perror(me);
+    exit(1);
+  }
+  if (!rounds) rounds = 1;
+  printf("%8s %8s %10s %12s %8s\n",
+         "workers","clients","seconds","roundtrips/s","speedup");
+  for (w = 1; w <= nworkers; w++) {
+    memset(&echo_addr,0,sizeof echo_addr);
+    echo_addr.sin_family = AF_INET;
+    echo_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((echo_listener = socket(AF_INET,SOCK_STREAM,0)) < 0
+        || bind(echo_listener,(struct sockaddr *) &echo_addr,len) < 0
+        || getsockname(echo_listener,(struct sockaddr *) &echo_addr,&len) < 0
+        || listen(echo_listener,SOMAXCONN) < 0) {
+      perror(me);
+      exit(1);
+    }
+    echo_stop = 0;
+    dthr_init();
+    if (!dthr_set_concurrency(w,worker_stacksize)) {
+      fprintf(stderr,"%s:  cannot use %d workers\n",me,w);
+      exit(1);
+    }
+    dthr_set_stack_mmap(use_mmap);
+    dthr_semaphore_init(&echo_done,0);
+    dthr_thread_init(&root,echo_root,0,stacksize);
+    start = now();
+    dthr_thread_multithread(&root);
+    t = now() - start;
+    if (w == 1) base = t;
+    printf("%8d %8d %10.3f %12.0f %8.2f\n",w,ntasks,t,
+           (double) rounds * ntasks / t,base / t);
+    if (echo_errors) {
+      fprintf(stderr,"%s:  %d echo errors\n",me,echo_errors);
+      exit(1);
+    }
+  }
+  free(echo_th);
+}
+
+/*
+ * spawn cost of empty threads
+ */
+struct dthr_semaphore   tasks_done;
+int                     tasks_left;
+int                     tasks_rounds;
+struct dthr_thread      *tasks_th;
+void                    **tasks_args;
+
+void *tasks_empty(void *unused)
+{
+  if (__sync_sub_and_fetch(&tasks_left,1) == 0)
+    dthr_semaphore_drop(&tasks_done);
+  return 0;
+}
+
+void *tasks_root(void *unused)
+{
+  const char          *how[] = { "DThr_Thread_Run",
+                                 "DThr_Thread_Run_Batch",
+                                 "dthr_thread_run" };
+  struct dthr_thread  *th;
+  double              start, t;
+  int                 m, r, i;
+
+  printf("%-24s %10s %12s\n","spawned with","seconds","tasks/s");
+  for (m = 0; m < 3; m++) {
+    start = now();
+    for (r = 0; r < tasks_rounds; r++) {
+      tasks_left = ntasks;
+      switch (m) {
+      case 0:
+        for (i = 0; i < ntasks; i++)
+          if (!DThr_Thread_Run(tasks_empty,0,stacksize)) {
+            perror(me);
+            exit(1);
+          }
+        break;
+      case 1:
+        if (DThr_Thread_Run_Batch(tasks_empty,tasks_args,ntasks,stacksize)
+            != ntasks) {
+          perror(me);
+          exit(1);
+        }
+        break;
+      case 2:
+        /*
+         * The last few tasks of a round may still be on their way out when
+         * we wake, so alternate between two arrays of descriptors.
+         */
+        th = tasks_th + (r & 1) * ntasks;
+        for (i = 0; i < ntasks; i++) {
+          dthr_thread_init(&th[i],tasks_empty,0,stacksize);
+          (void) dthr_thread_detach(dthr_thread_run(&th[i]));
+        }
+        break;
+      }
+      dthr_semaphore_take(&tasks_done);
+    }
+    t = now() - start;
+    printf("%-24s %10.3f %12.0f\n",how[m],t,
+           (double) ntasks * tasks_rounds / t);
+  }
+  return 0;
+}
+
+void bench_tasks(void)
+{
+  tasks_th = (struct dthr_thread *) malloc(2 * ntasks * sizeof *tasks_th);
+  tasks_args = (void **) calloc(ntasks,sizeof *tasks_args);
+  if (!tasks_th || !tasks_args) {
+    perror(me);
+    exit(1);
+  }
+  tasks_rounds = work / ntasks;
+  if (!tasks_rounds) tasks_rounds = 1;
+  dthr_semaphore_init(&tasks_done,0);
+  /* the first call does dthr_init, so only now can we add workers */
+  (void) DThr_Thread_Run(tasks_root,0,stacksize);
+  if (!dthr_set_concurrency(nworkers,worker_stacksize)) {
+    fprintf(stderr,"%s:  cannot use %d workers\n",me,nworkers);
+    exit(1);
+  }
+  dthr_set_stack_mmap(use_mmap);
+  (void) DThr_Thread_Run(0,0,0);
+  free(tasks_args);
+  free(tasks_th);
+}
+
+/*
+ * pipeline
+ */
+#define PIPE_STAGES 4
+#define PIPE_QCAP   16
+
+struct pipe_queue {
+  struct dthr_semaphore lock;
+  struct dthr_event     nonempty, nonfull;
+  int                   buf[PIPE_QCAP];
+  int                   head, len;
+};
+
+struct pipe_queue     pipe_q[PIPE_STAGES];
+struct dthr_chan      pipe_ch[PIPE_STAGES];
+struct dthr_thread    pipe_th[3][PIPE_STAGES + 1];  /* one set per kind */
+struct dthr_semaphore pipe_done;
+int                   pipe_kind;        /* 0 queues, 1 buffered, 2 not */
+long long             pipe_sum;
+int                   pipe_workers;
+
+static void pipe_put(int q, int v)
+{
+  struct pipe_queue *pq = &pipe_q[q];
+
+  if (pipe_kind) {
+    (void) dthr_chan_send(&pipe_ch[q],&v);
+    return;
+  }
+  dthr_semaphore_take(&pq->lock);
+  while (pq->len == PIPE_QCAP)
+    dthr_event_wait(&pq->nonfull,&pq->lock);
+  pq->buf[(pq->head + pq->len++) % PIPE_QCAP] = v;
+  dthr_event_signal_no_yield(&pq->nonempty);
+  dthr_semaphore_drop(&pq->lock);
+}
+
+static int pipe_get(int q)
+{
+  struct pipe_queue *pq = &pipe_q[q];
+  int               v;
+
+  if (pipe_kind) {
+    if (!dthr_chan_recv(&pipe_ch[q],&v)) v = -1;
+    return v;
+  }
+  dthr_semaphore_take(&pq->lock);
+  while (pq->len == 0)
+    dthr_event_wait(&pq->nonempty,&pq->lock);
+  v = pq->buf[pq->head];
+  pq->head = (pq->head + 1) % PIPE_QCAP;
+  pq->len--;
+  dthr_event_signal_no_yield(&pq->nonfull);
+  dthr_semaphore_drop(&pq->lock);
+  return v;
+}
+
+/* stage 0 makes the items, the last one adds them up */
+void *pipe_stage(void *arg)
+{
+  int stage = (int) (uintptr_t) arg;
+  int i, v;
+
+  if (stage == 0) {
+    for (i = 0; i < work; i++)
+      pipe_put(0,i);
+    pipe_put(0,-1);
+  } else if (stage < PIPE_STAGES) {
+    do {
+      v = pipe_get(stage - 1);
+      pipe_put(stage,v);
+    } while (v >= 0);
+  } else {
+    while ((v = pipe_get(stage - 1)) >= 0)
+      pipe_sum += v;
+    dthr_semaphore_drop(&pipe_done);
+  }
+  return 0;
+}
+
+void *pipe_root(void *unused)
+{
+  const char  *kinds[] = { "semaphore+event", "channel, 16 buffered",
+                           "channel, unbuffered" };
+  double      start, t;
+  int         i;
+
+  for (pipe_kind = 0; pipe_kind < 3; pipe_kind++) {
+    for (i = 0; i < PIPE_STAGES; i++) {
+      pipe_q[i].head = pipe_q[i].len = 0;
+      dthr_semaphore_init(&pipe_q[i].lock,1);
+      dthr_event_init(&pipe_q[i].nonempty);
+      dthr_event_init(&pipe_q[i].nonfull);
+      if (!dthr_chan_init(&pipe_ch[i],sizeof (int),
+                          pipe_kind == 1 ? PIPE_QCAP : 0)) {
+        perror(me);
+        exit(1);
+      }
+    }
+    pipe_sum = 0;
+    start = now();
+    for (i = 0; i <= PIPE_STAGES; i++) {
+      dthr_thread_init(&pipe_th[pipe_kind][i],pipe_stage,
+                       (void *) (uintptr_t) i,stacksize);
+      (void) dthr_thread_detach(dthr_thread_run(&pipe_th[pipe_kind][i]));
+    }
+    dthr_semaphore_take(&pipe_done);
+    t = now() - start;
+    if (pipe_sum != (long long) work * (work - 1) / 2) {
+      fprintf(stderr,"%s:  pipeline lost items\n",me);
+      exit(1);
+    }
+    printf("%8d %-24s %10.3f %12.0f\n",pipe_workers,
+           kinds[pipe_kind],t,work / t);
+    for (i = 0; i < PIPE_STAGES; i++)
+      dthr_chan_destroy(&pipe_ch[i]);
+  }
+  return 0;
+}
+
+void bench_pipeline(void)
+{
+  struct dthr_thread  root;
+  int                 w;
+
+  printf("%8s %-24s %10s %12s\n","workers","passed over","seconds",
+         "items/s");
+  for (w = 1; w <= nworkers; w++) {
+    dthr_init();
+    if (!dthr_set_concurrency(w,worker_stacksize)) {
+      fprintf(stderr,"%s:  cannot use %d workers\n",me,w);
+      exit(1);
+    }
+    dthr_set_stack_mmap(use_mmap);
+    pipe_workers = w;
+    dthr_semaphore_init(&pipe_done,0);
+    dthr_thread_init(&root,pipe_root,0,stacksize);
+    dthr_thread_multithread(&root);
+  }
+}
+
+void usage()
+{
+  fprintf(stderr,
+          "Usage: %s -b fanout|self|pingpong|echo|tasks|pipeline"
+          " [-w workers] [-t ntasks] [-c work]"
+          " [-s stackbytes] [-W workerstackbytes] [-m]\n",
+          me);
+}
+
+int main(int ac, char **av)
+{
+  char  *which = "fanout";
+  int   opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"b:c:ms:t:w:W:")) != EOF) switch (opt) {
+  case 'b': which = optarg;           break;
+  case 'c': work = atoi(optarg);      break;
+  case 'm': use_mmap = 1;             break;
+  case 's': stacksize = atoi(optarg); break;
+  case 't': ntasks = atoi(optarg);    break;
+  case 'w': nworkers = atoi(optarg);  break;
+  case 'W': worker_stacksize = strtoul(optarg,0,0); break;
+  default:  usage(); exit(1);
+  }
+
+  if (!ntasks)
+    ntasks = !strcmp(which,"self") || !strcmp(which,"tasks") ?
+        NTASKS_LIVE : NTASKS;
+  if (use_mmap && !dthr_set_stack_mmap(1)) {
+    fprintf(stderr,"%s:  no mmap'ed stacks on this machine\n",me);
+    exit(1);
+  }
+  if (!strcmp(which,"fanout")) {
+    bench_fanout();
+  } else if (!strcmp(which,"self")) {
+    bench_self();
+  } else if (!strcmp(which,"pingpong")) {
+    bench_pingpong();
+  } else if (!strcmp(which,"echo")) {
+    bench_echo();
+  } else if (!strcmp(which,"tasks")) {
+    bench_tasks();
+  } else if (!strcmp(which,"pipeline")) {
+    bench_pipeline();
+  } else {
+    usage();
+    exit(1);
+  }
+  return 0;
+}
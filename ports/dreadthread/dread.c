@@ -48,18 +48,32 @@
  * Created, bsy@cs.cmu.edu, 1994.
  * Added stack overflow checks, bsy@cs.ucsd.edu, 1996.
  *
+ * Multiple worker OS threads, 2016.
+ * I/O thread wait via poll, 2016.
+ *
  * To do:
  *
- * I/O thread wait.
  * Preemption via timers / signals.
  */
 #include <stdio.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include "dreadthread.h"
 
+#if defined(DREAD_THREAD_MD_START)
+# include <sys/mman.h>
+#endif
+#if DREAD_THREAD_POLL
+# include <fcntl.h>
+#endif
+
 #define MAGIC_TEST      1
 
 #define DEBUG           0
@@ -100,83 +114,414 @@ void dbprint(char *fmt, ...)
 #define DREAD_THREAD_CSW_EXIT   3
 #define DREAD_THREAD_CSW_MAX    4
 
-struct dthr_thread            *dthr_cur_thread = 0;
+#define DREAD_THREAD_MAX_WORKERS  64
+#define DREAD_THREAD_WORKER_STACK (16 * 1024 * 1024)
+#define DREAD_THREAD_OBJ_LOCKS    64
+
+/*
+ * How much of a worker's C stack is never carved into thread stacks: the
+ * launcher runs below the last one, and the far end of a pthread's stack
+ * holds its guard page and thread-local storage.
+ */
+#define DREAD_THREAD_STACK_RESERVE  (64 * 1024)
+
+/*
+ * Free stacks are kept on one list per power-of-two size class, starting
+ * at DREAD_THREAD_STACK_MIN bytes; the last class holds everything bigger
+ * and is the only one that needs searching.
+ */
+#define DREAD_THREAD_STACK_MIN      1024
+#define DREAD_THREAD_STACK_CLASSES  16
+
+/*
+ * Stack painting for high-water marks: the pattern, how far short of the
+ * painting frame to stop, and how many entry functions are remembered.
+ */
+#define DREAD_THREAD_STACK_PAINT    0xa5a5a5a5ul
+#define DREAD_THREAD_STACK_MARGIN   256
+#define DREAD_THREAD_STACK_FNS      256
+
+/*
+ * Timeouts live on a timer wheel with 1ms ticks: 256 slots of a tick
+ * each, then three levels of 64 slots, each slot as long as the whole
+ * level below, which covers about 18 hours.  Timers and threads blocked in
+ * I/O are looked at every DREAD_THREAD_TICK_INTERVAL scheduling decisions
+ * even when there are threads to run, so that busy threads cannot starve
+ * them.
+ */
+#define DREAD_THREAD_WHEEL0_BITS    8
+#define DREAD_THREAD_WHEELN_BITS    6
+#define DREAD_THREAD_WHEEL0_SLOTS   (1 << DREAD_THREAD_WHEEL0_BITS)
+#define DREAD_THREAD_WHEELN_SLOTS   (1 << DREAD_THREAD_WHEELN_BITS)
+#define DREAD_THREAD_WHEEL_LEVELS   4
+#define DREAD_THREAD_TICK_INTERVAL  64
+
+/*
+ * Thread descriptors of finished DThr_Thread_Run threads and on-exit
+ * records are kept on per-worker free lists of up to this many each.
+ */
+#define DREAD_THREAD_POOL_MAX       1024
+
+#if DREAD_THREAD_STATS
+/*
+ * One slice of a thread running on a worker, for dthr_trace_write.
+ */
+struct dthr_trace_event {
+  long long           start, dur;       /* ns */
+  long long           latency;          /* ns runnable before start */
+  struct dthr_thread  *thread;
+  void                *(*fn)(void *);
+};
+#endif
+
+struct dthr_timer {
+  struct dthr_chain   link;             /* wheel slot */
+  long long           expires;          /* dthr_now_ms() time */
+  int                 armed;
+  int                 level;            /* of the wheel it is on */
+  void                (*fn)(struct dthr_timer *);
+};
 
-static struct dthr_stack      dthr_topmost_stack;
-static struct dthr_thread     dthr_topmost_thread;
-static struct dthr_chain      dthr_free_stacks, dthr_active_stacks,
-                              dthr_runq, dthr_newq;
-static struct dthr_semaphore  dthr_newq_sema;
-static struct dthr_event      dthr_newq_event;
-static dthr_ctxt_t            dthr_deadlock;
+/*
+ * A thread waiting in dthr_io_wait, kept on its own stack.
+ */
+struct dthr_io_wait {
+  struct dthr_chain   link;             /* worker's ioq */
+  struct dthr_timer   timer;
+  struct dthr_thread  *thread;
+  int                 fd;
+  short               events, revents;
+};
+
+/*
+ * Scheduler state of one worker OS thread.
+ *
+ * Every worker has its own topmost (launcher) thread, and thread stacks
+ * are carved out of that worker's C stack.  A thread's saved context
+ * therefore only makes sense on the worker that launched it, so started
+ * threads always run there; threads that are still on a new queue have
+ * no stack yet and may be stolen by any idle worker.
+ *
+ * The run queue and new queue are locked by the worker's mutex since other
+ * workers wake threads and steal from them; the stack lists and their
+ * statistics are private.
+ */
+struct dthr_worker {
+  struct dthr_stack     topmost_stack;
+  struct dthr_thread    topmost_thread;
+  struct dthr_chain     free_stacks[DREAD_THREAD_STACK_CLASSES];
+  struct dthr_chain     active_stacks, runq, newq;
+  struct dthr_stack_stats stack_stats;
+  struct dthr_stack     *starting;      /* see dthr_start_mapped_stack */
+  caddr_t               stack_limit;    /* carve no further, 0 if unknown */
+  dthr_ctxt_t           *continuation;
+  int                   newq_len;
+  struct dthr_semaphore newq_sema;
+  struct dthr_event     newq_event;
+  dthr_ctxt_t           deadlock;
+  struct dthr_chain     wheel0[DREAD_THREAD_WHEEL0_SLOTS];
+  struct dthr_chain     wheeln[DREAD_THREAD_WHEEL_LEVELS - 1]
+                              [DREAD_THREAD_WHEELN_SLOTS];
+  long long             wheel_now;      /* next tick to expire */
+  int                   ntimers, wheel0_count;
+  int                   ticks;          /* see dthr_worker_tick */
+  unsigned              chan_rr;        /* where dthr_chan_select starts */
+  struct dthr_chain     task_pool;      /* free DThr_Thread_Run descriptors */
+  int                   task_pool_len;
+  struct dthr_thread_exit *exit_pool;
+  int                   exit_pool_len;
+#if DREAD_THREAD_STATS
+  struct dthr_sched_stats stats;        /* runnable is under lock */
+  struct dthr_thread    *stats_cur;     /* thread being charged, if any */
+  long long             stats_since;    /* ns, when it was switched to */
+  long long             stats_latency;  /* ns it was runnable before that */
+  struct dthr_trace_event *trace;       /* ring of dthr_trace_size */
+  unsigned long         trace_len;      /* events recorded */
+#endif
+#if DREAD_THREAD_POLL
+  struct dthr_chain     ioq;
+  int                   io_nwaiting;
+  struct pollfd         *io_fds;
+  int                   io_nfds;        /* allocated */
+  int                   io_wake[2];     /* pipe to interrupt poll */
+  int                   io_wake_open;
+#endif
+  int                   id;
+  int                   sleeping;       /* 1 on wakeup, 2 in poll */
+  pthread_t             pthread;
+  pthread_mutex_t       lock;
+  pthread_cond_t        wakeup;
+};
+
+DREAD_THREAD_TLS struct dthr_thread   *dthr_cur_thread = 0;
+static DREAD_THREAD_TLS struct dthr_worker *dthr_cur_worker = 0;
+
+static struct dthr_worker     dthr_worker0;
+static struct dthr_worker     *dthr_workers[DREAD_THREAD_MAX_WORKERS] = {
+  &dthr_worker0
+};
+static int                    dthr_nworkers = 1;
+static size_t                 dthr_worker_stack_size;
+static int                    dthr_stack_mmap;
 int       (*dthr_on_deadlock)() = 0;
 
+/*
+ * Idle workers sleep on their wakeup condition under dthr_idle_lock.
+ * When the last worker runs out of work the process is deadlocked (or
+ * simply done), and every worker unwinds to its deadlock context.
+ */
+static pthread_mutex_t        dthr_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static int                    dthr_idle_workers, dthr_done;
+
+/*
+ * Semaphores and events may be shared by threads on different workers.
+ * Rather than growing the public structures, their queues are guarded by
+ * a small table of locks hashed on the object address.  None of this
+ * costs anything beyond a test while there is only one worker.
+ */
+static pthread_mutex_t        dthr_obj_locks[DREAD_THREAD_OBJ_LOCKS];
+
+#define DTHR_OBJ_LOCK(obj) \
+  (&dthr_obj_locks[((uintptr_t) (obj) >> 4) % DREAD_THREAD_OBJ_LOCKS])
+#define DTHR_LOCK(m) \
+  do { if (dthr_nworkers > 1) pthread_mutex_lock(m); } while (0)
+#define DTHR_UNLOCK(m) \
+  do { if (dthr_nworkers > 1) pthread_mutex_unlock(m); } while (0)
+
+#if DREAD_THREAD_POLL
+# define DTHR_IO_PENDING(w) ((w)->io_nwaiting > 0)
+static int dthr_io_poll(struct dthr_worker *w, int block);
+#else
+# define DTHR_IO_PENDING(w) 0
+# define dthr_io_poll(w,block) 0
+#endif
+#define DTHR_WAITING(w)     ((w)->ntimers > 0 || DTHR_IO_PENDING(w))
+static int dthr_timer_run(struct dthr_worker *w);
+static void dthr_timer_sleep(struct dthr_worker *w);
+static void dthr_worker_tick(struct dthr_worker *w);
+
+#if DREAD_THREAD_STATS
+/*
+ * Instrumentation.  Each worker charges the time between switches to the
+ * thread it was running and counts into its own dthr_sched_stats, so the
+ * only locking is for the list of live threads that dthr_dump_threads
+ * walks.  Run queue lengths are kept under the worker lock along with the
+ * queue.  With DREAD_THREAD_STATS off the hooks below compile to nothing.
+ */
+static pthread_mutex_t        dthr_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dthr_thread     *dthr_all_threads;
+static unsigned long          dthr_trace_size;  /* events per ring */
+static int                    dthr_tracing;
+static long long              dthr_trace_epoch;
+
+static long long dthr_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* w's current thread stops running at now */
+static void dthr_stats_charge(struct dthr_worker *w, long long now)
+{
+  struct dthr_thread      *th = w->stats_cur;
+  struct dthr_trace_event *ev;
+
+  th->run_ns += now - w->stats_since;
+  if (dthr_tracing) {
+    if (!w->trace
+        && !(w->trace = (struct dthr_trace_event *)
+             malloc(dthr_trace_size * sizeof *w->trace))) {
+      dthr_tracing = 0;
+      return;
+    }
+    ev = &w->trace[w->trace_len++ % dthr_trace_size];
+    ev->start = w->stats_since;
+    ev->dur = now - w->stats_since;
+    ev->latency = w->stats_latency;
+    ev->thread = th;
+    ev->fn = th == &w->topmost_thread ? 0 : th->fn;
+  }
+}
+
+static void dthr_stats_switch(struct dthr_worker *w, struct dthr_thread *to)
+{
+  struct dthr_sched_stats *st = &w->stats;
+  long long               now;
+
+  if (to == w->stats_cur) return;
+  now = dthr_now_ns();
+  if (w->stats_cur) dthr_stats_charge(w,now);
+  st->switches++;
+  w->stats_cur = to;
+  w->stats_since = now;
+  w->stats_latency = 0;
+  if (to->ready_ns) {
+    w->stats_latency = now - to->ready_ns;
+    to->ready_ns = 0;
+    st->latency_samples++;
+    st->latency_ns += w->stats_latency;
+    if (w->stats_latency > (long long) st->latency_max_ns)
+      st->latency_max_ns = w->stats_latency;
+  }
+}
+
+/* w's current thread blocks, or exits if it is going away */
+static void dthr_stats_stop(struct dthr_worker *w, int leave)
+{
+  struct dthr_thread  *th = w->stats_cur;
+
+  if (!th) return;
+  dthr_stats_charge(w,dthr_now_ns());
+  w->stats_cur = 0;
+  if (!leave || th == &w->topmost_thread) return;
+  DTHR_LOCK(&dthr_stats_lock);
+  if (th->all_next) th->all_next->all_prev = th->all_prev;
+  if (th->all_prev) th->all_prev->all_next = th->all_next;
+  else if (dthr_all_threads == th) dthr_all_threads = th->all_next;
+  DTHR_UNLOCK(&dthr_stats_lock);
+}
+
+static void dthr_stats_started(struct dthr_thread *th)
+{
+  DTHR_LOCK(&dthr_stats_lock);
+  th->all_prev = 0;
+  if ((th->all_next = dthr_all_threads) != 0)
+    dthr_all_threads->all_prev = th;
+  dthr_all_threads = th;
+  DTHR_UNLOCK(&dthr_stats_lock);
+}
+
+static void dthr_stats_sema_wait(long long since)
+{
+  struct dthr_sched_stats *st = &dthr_cur_worker->stats;
+  long long               ns = dthr_now_ns() - since;
+
+  st->sema_waits++;
+  st->sema_wait_ns += ns;
+  if (ns > (long long) st->sema_wait_max_ns) st->sema_wait_max_ns = ns;
+}
+
+/* called with th's run queue locked */
+# define DTHR_STATS_READY(w,th) do { \
+    if (!(th)->ready_ns) (th)->ready_ns = dthr_now_ns(); \
+    if (++(w)->stats.runnable > (w)->stats.runnable_max) \
+      (w)->stats.runnable_max = (w)->stats.runnable; \
+  } while (0)
+# define DTHR_STATS_DEQUEUED(w)       ((w)->stats.runnable--)
+# define DTHR_STATS_SWITCH(w,th)      dthr_stats_switch(w,th)
+# define DTHR_STATS_STOP(w,leave)     dthr_stats_stop(w,leave)
+# define DTHR_STATS_WAIT(obj)         (dthr_cur_thread->wait_obj = (obj))
+# define DTHR_STATS_DEADLOCK()        do { \
+    if (dthr_all_threads) { \
+      fprintf(stderr,"dthr_thread:  DEADLOCK\n"); \
+      (void) dthr_dump_threads(stderr); \
+    } \
+  } while (0)
+#else
+# define DTHR_STATS_READY(w,th)       do { ;} while (0)
+# define DTHR_STATS_DEQUEUED(w)       do { ;} while (0)
+# define DTHR_STATS_SWITCH(w,th)      do { ;} while (0)
+# define DTHR_STATS_STOP(w,leave)     do { ;} while (0)
+# define DTHR_STATS_WAIT(obj)         do { ;} while (0)
+# define DTHR_STATS_DEADLOCK()        do { ;} while (0)
+#endif
+
 #if DEBUG_QUEUES
 void dthr_show_queues(void)
 {
+  struct dthr_worker  *w = dthr_cur_worker;
+  int                 i;
 #define SHOW(var) fprintf(stderr,"\n" #var ":\n"); dthr_chain_show(stderr,&var);
-  SHOW(dthr_free_stacks);
-  SHOW(dthr_active_stacks);
-  SHOW(dthr_runq);
-  SHOW(dthr_newq);
-  SHOW(dthr_newq_event.threadq);
-  SHOW(dthr_newq_sema.threadq);
+  for (i = 0; i < DREAD_THREAD_STACK_CLASSES; i++) {
+    fprintf(stderr,"\nclass %d ",i);
+    SHOW(w->free_stacks[i]);
+  }
+  SHOW(w->active_stacks);
+  SHOW(w->runq);
+  SHOW(w->newq);
+  SHOW(w->newq_event.threadq);
+  SHOW(w->newq_sema.threadq);
 }
 #else
 # define  dthr_show_queues()  do { ;} while (0)
 #endif
 
+/*
+ * Put a thread that already owns a stack onto its worker's run queue,
+ * waking the worker if it is idle.
+ */
+static void dthr_make_runnable(struct dthr_thread *th)
+{
+  struct dthr_worker  *w = th->stack->worker;
+  int                 wake;
+
+  th->state = DREAD_THREAD_TH_RUNNABLE;
+  DTHR_LOCK(&w->lock);
+  dthr_chain_enqueue(&w->runq,&th->link);
+  DTHR_STATS_READY(w,th);
+  wake = w->sleeping;
+  w->sleeping = 0;
+  DTHR_UNLOCK(&w->lock);
+#if DREAD_THREAD_POLL
+  if (wake == 2) {
+    /* if the pipe is full, poll is being interrupted anyway */
+    if (write(w->io_wake[1],"",1) < 0) DBOUT(("wake pipe full\n"));
+    return;
+  }
+#endif
+  if (wake) {
+    pthread_mutex_lock(&dthr_idle_lock);
+    pthread_cond_signal(&w->wakeup);
+    pthread_mutex_unlock(&dthr_idle_lock);
+  }
+}
+
 
-/* may eventually want to sort stacks by addresses */
+/*
+ * dthr_csw and the launcher keep the per-worker dthr_cur_thread up to
+ * date, so there is no need to search the active stacks for the one we
+ * are running on.  Before going multithreaded, and while an exited
+ * thread is on its way out, we are the topmost thread as far as anyone
+ * can tell.
+ */
 struct dthr_thread  *dthr_this_thread(void)
 {
-  int                         stack_var;
-  register caddr_t            stack_addr = (caddr_t) &stack_var;
-  register struct dthr_chain  *p;
+  struct dthr_thread  *th = dthr_cur_thread;
 
-  DBOUT(("dthr_this_thread:  scanning for stack addr %p\n",
-         (void *) stack_addr));
-  for (p = dthr_active_stacks.next; p != &dthr_active_stacks; p = p->next) {
+  if (!th || !th->stack) th = &dthr_cur_worker->topmost_thread;
 #if MAGIC_TEST
-    if (((struct dthr_stack *) p)->magic != DREAD_THREAD_STACK_MAGIC) {
-      fprintf(stderr,
-              "dthr_thread: stack descriptor corruption"
-              " detected by dthr_this_thread()\n");
-      abort();
-    }
-#endif
-#if DREAD_THREAD_STACK_GROWS_DOWN
-    if (((struct dthr_stack *) p)->stack_top <= stack_addr
-        && stack_addr <= ((struct dthr_stack *) p)->stack_base)
-      break;
-#else
-    if (((struct dthr_stack *) p)->stack_base <= stack_addr
-        && stack_addr <= ((struct dthr_stack *) p)->stack_top)
-      break;
-#endif
-  }
-  if (DEBUG) {  /* DCE */
-    if (p == &dthr_active_stacks) {
-      printf("dthr_this_thread: NOT FOUND, assuming TOPMOST (%p)\n",
-             (void *) &dthr_topmost_thread);
-    } else {
-      printf("dthr_this_thread: thread %p",
-             (void *) ((struct dthr_stack *) p)->thread);
-    }
+  if (th->magic != DREAD_THREAD_TH_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  thread structure corruption detected"
+            " in dthr_this_thread()\n");
+    abort();
   }
-  return (p == &dthr_active_stacks) ?
-      &dthr_topmost_thread : ((struct dthr_stack *) p)->thread;
+#endif
+  DBOUT(("dthr_this_thread: thread %p\n",(void *) th));
+  return th;
 }
 
 static void dthr_csw(struct dthr_stack  *target, int  op);
 
 void dthr_thread_yield(void)
 {
+  struct dthr_worker  *w = dthr_cur_worker;
   struct dthr_thread  *next_runnable;
 
   SHOWTHREAD;
   DBOUT(("dthr_thread_yield\n"));
-  next_runnable = (struct dthr_thread *) DREAD_THREAD_CHAIN_DEQUEUE(&dthr_runq);
+  if (DTHR_WAITING(w)) dthr_worker_tick(w);
+  DTHR_LOCK(&w->lock);
+  next_runnable = (struct dthr_thread *) DREAD_THREAD_CHAIN_DEQUEUE(&w->runq);
+  if (next_runnable) {
+    (void) dthr_chain_enqueue(&w->runq,&dthr_cur_thread->link);
+#if DREAD_THREAD_STATS
+    dthr_cur_thread->ready_ns = dthr_now_ns();
+#endif
+  }
+  DTHR_UNLOCK(&w->lock);
   if (next_runnable) {
 #if MAGIC_TEST
     if (next_runnable->magic != DREAD_THREAD_TH_MAGIC) {
@@ -187,7 +532,6 @@ void dthr_thread_yield(void)
     }
 #endif
     DBOUT((" found runnable thread %p\n",(void *) next_runnable));
-    (void) dthr_chain_enqueue(&dthr_runq,&dthr_cur_thread->link);
     dthr_csw(next_runnable->stack,DREAD_THREAD_CSW_NORM);
   }
   SHOWTHREAD;
@@ -199,27 +543,392 @@ struct dthr_semaphore *dthr_semaphore_init(struct dthr_semaphore  *sema,
 {
   sema->value = init;
   (void) dthr_chain_init(&sema->threadq);
+#if DREAD_THREAD_STATS
+  sema->holder = 0;
+#endif
   sema->magic = DREAD_THREAD_SEMA_MAGIC;
   return sema;
 }
 
+/*
+ * Move up to half of another worker's not yet started threads onto our
+ * own new queue and wake our launcher.  Returns 0 if there was nothing to
+ * steal.
+ */
+static int dthr_steal(struct dthr_worker *w)
+{
+  struct dthr_chain   loot;
+  struct dthr_chain   *p;
+  struct dthr_worker  *victim;
+  int                 i, n, stolen;
+
+  (void) dthr_chain_init(&loot);
+  for (stolen = 0, i = 1; !stolen && i < dthr_nworkers; i++) {
+    victim = dthr_workers[(w->id + i) % dthr_nworkers];
+    pthread_mutex_lock(&victim->lock);
+    for (n = (victim->newq_len + 1) / 2; n > 0; n--, stolen++) {
+      p = DREAD_THREAD_CHAIN_DEQUEUE(&victim->newq);
+      dthr_chain_enqueue(&loot,p);
+    }
+    victim->newq_len -= stolen;
+    pthread_mutex_unlock(&victim->lock);
+  }
+  if (!stolen) return 0;
+
+  DBOUT(("dthr_steal: worker %d took %d threads\n",w->id,stolen));
+  pthread_mutex_lock(&w->lock);
+  while ((p = DREAD_THREAD_CHAIN_DEQUEUE(&loot)) != 0)
+    dthr_chain_enqueue(&w->newq,p);
+  w->newq_len += stolen;
+  pthread_mutex_unlock(&w->lock);
+  dthr_event_signal_no_yield(&w->newq_event);
+  return 1;
+}
+
+/*
+ * Nothing to run or steal: sleep until another worker hands us a thread.
+ * Returns 0 once every worker is idle and dthr_on_deadlock declined to
+ * help, i.e. the whole process is deadlocked.
+ */
+static int dthr_worker_idle(struct dthr_worker *w)
+{
+  struct dthr_worker  *v;
+  int                 i, busy;
+
+  pthread_mutex_lock(&dthr_idle_lock);
+  if (dthr_done) {
+    pthread_mutex_unlock(&dthr_idle_lock);
+    return 0;
+  }
+  pthread_mutex_lock(&w->lock);
+  busy = !DREAD_THREAD_CHAIN_EMPTY(&w->runq);
+  w->sleeping = !busy;
+  pthread_mutex_unlock(&w->lock);
+  if (busy) {
+    pthread_mutex_unlock(&dthr_idle_lock);
+    return 1;
+  }
+
+  if (++dthr_idle_workers == dthr_nworkers) {
+    for (i = 0; !busy && i < dthr_nworkers; i++) {
+      v = dthr_workers[i];
+      pthread_mutex_lock(&v->lock);
+      busy = !DREAD_THREAD_CHAIN_EMPTY(&v->runq) || v->newq_len > 0;
+      pthread_mutex_unlock(&v->lock);
+    }
+    /* Either a wakeup is in flight, or there is work left to steal. */
+    pthread_mutex_lock(&w->lock);
+    w->sleeping = 0;
+    pthread_mutex_unlock(&w->lock);
+    --dthr_idle_workers;
+    pthread_mutex_unlock(&dthr_idle_lock);
+    if (busy || (dthr_on_deadlock && (*dthr_on_deadlock)()))
+      return 1;
+
+    DBOUT(("dthr_worker_idle: all %d workers idle\n",dthr_nworkers));
+    DTHR_STATS_DEADLOCK();
+    pthread_mutex_lock(&dthr_idle_lock);
+    dthr_done = 1;
+    for (i = 0; i < dthr_nworkers; i++)
+      pthread_cond_signal(&dthr_workers[i]->wakeup);
+    pthread_mutex_unlock(&dthr_idle_lock);
+    return 0;
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&w->lock);
+    busy = !w->sleeping;
+    pthread_mutex_unlock(&w->lock);
+    if (busy || dthr_done) break;
+    pthread_cond_wait(&w->wakeup,&dthr_idle_lock);
+  }
+  --dthr_idle_workers;
+  busy = !dthr_done;
+  pthread_mutex_unlock(&dthr_idle_lock);
+  return busy;
+}
+
+/*
+ * Next thread to switch to on worker w, or 0 if the process deadlocked.
+ */
+static struct dthr_thread *dthr_next_runnable(struct dthr_worker *w)
+{
+  struct dthr_thread  *th;
+
+  for (;;) {
+    DTHR_LOCK(&w->lock);
+    th = (struct dthr_thread *) DREAD_THREAD_CHAIN_DEQUEUE(&w->runq);
+    if (th) DTHR_STATS_DEQUEUED(w);
+    DTHR_UNLOCK(&w->lock);
+    if (th) {
+      if (DTHR_WAITING(w)) dthr_worker_tick(w);
+      return th;
+    }
+    if (w->ntimers && dthr_timer_run(w)) continue;
+    if (DTHR_IO_PENDING(w) && dthr_io_poll(w,0)) continue;
+    if (dthr_nworkers > 1 && dthr_steal(w)) continue;
+    /* threads waiting for I/O or a timeout are not deadlocked */
+    if (DTHR_IO_PENDING(w)) {
+      (void) dthr_io_poll(w,1);
+      continue;
+    }
+    if (w->ntimers) {
+      dthr_timer_sleep(w);
+      continue;
+    }
+    if (dthr_nworkers == 1) {
+      if (dthr_on_deadlock && (*dthr_on_deadlock)()) continue;
+      DTHR_STATS_DEADLOCK();
+      return 0;
+    }
+    if (!dthr_worker_idle(w)) return 0;
+  }
+}
+
+/*
+ * Stack high-water marks.  When a thread starts, its stack beyond the
+ * starting frame is painted with DREAD_THREAD_STACK_PAINT, out to
+ * DREAD_THREAD_STACK_EXTRA past stack_size, which is all it may use
+ * before reaching the next stack or the guard page.  When it exits, the
+ * first word no longer painted shows how deep it went.  Paint beyond
+ * that mark is still intact, so a reused stack only needs repainting up
+ * to it.  Every thread is painted while dthr_set_stack_tracking is on,
+ * DREAD_THREAD_STACK_AUTO threads always.
+ *
+ * The marks are summed per entry function in a small open-addressed
+ * table, which is what DREAD_THREAD_STACK_AUTO sizes stacks from.  It
+ * outlives dthr_init.
+ */
+struct dthr_stack_fn {
+  void                *(*fn)(void *);
+  unsigned long       threads, overflows;
+  size_t              max_used;
+  unsigned long long  total_used;
+};
+
+static int                    dthr_stack_tracking;
+static struct dthr_stack_fn   dthr_stack_fns[DREAD_THREAD_STACK_FNS];
+static pthread_mutex_t        dthr_stack_fn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the far end of what a thread on stk may use */
+static unsigned long *dthr_stack_limit(struct dthr_stack *stk)
+{
+  size_t  reach = stk->stack_size + DREAD_THREAD_STACK_EXTRA;
+
+#if DREAD_THREAD_STACK_GROWS_DOWN
+  return (unsigned long *) (((uintptr_t) (stk->stack_base - reach)
+                             + sizeof (long) - 1) & ~(sizeof (long) - 1));
+#else
+  return (unsigned long *) ((uintptr_t) (stk->stack_base + reach)
+                            & ~(sizeof (long) - 1));
+#endif
+}
+
+/* called on stk, by the thread about to run on it */
+static void dthr_stack_paint(struct dthr_stack *stk)
+{
+  char          here;
+  unsigned long *p, *end;
+
+#if DREAD_THREAD_STACK_GROWS_DOWN
+  p = stk->painted ? (unsigned long *) stk->painted : dthr_stack_limit(stk);
+  end = (unsigned long *) (((uintptr_t) &here - DREAD_THREAD_STACK_MARGIN)
+                           & ~(sizeof (long) - 1));
+  while (p < end)
+    *p++ = DREAD_THREAD_STACK_PAINT;
+  stk->painted = (caddr_t) end;
+#else
+  p = stk->painted ? (unsigned long *) stk->painted : dthr_stack_limit(stk);
+  end = (unsigned long *) (((uintptr_t) &here + DREAD_THREAD_STACK_MARGIN
+                            + sizeof (long) - 1) & ~(sizeof (long) - 1));
+  while (p > end)
+    *--p = DREAD_THREAD_STACK_PAINT;
+  stk->painted = (caddr_t) end;
+#endif
+}
+
+/* how far from stack_base the paint on stk has been disturbed */
+static size_t dthr_stack_scan(struct dthr_stack *stk)
+{
+  unsigned long *p = dthr_stack_limit(stk);
+  unsigned long *end = (unsigned long *) stk->painted;
+
+#if DREAD_THREAD_STACK_GROWS_DOWN
+  while (p < end && *p == DREAD_THREAD_STACK_PAINT)
+    p++;
+  return stk->stack_base - (caddr_t) p;
+#else
+  while (p > end && p[-1] == DREAD_THREAD_STACK_PAINT)
+    p--;
+  return (caddr_t) p - stk->stack_base;
+#endif
+}
+
+static struct dthr_stack_fn *dthr_stack_fn_find(void  *(*fn)(void *),
+                                                int   add)
+{
+  struct dthr_stack_fn  *f;
+  unsigned              h = ((uintptr_t) fn >> 4) % DREAD_THREAD_STACK_FNS;
+  unsigned              i;
+
+  for (i = 0; i < DREAD_THREAD_STACK_FNS; i++) {
+    f = &dthr_stack_fns[(h + i) % DREAD_THREAD_STACK_FNS];
+    if (f->fn == fn) return f;
+    if (!f->fn) {
+      if (!add) return 0;
+      f->fn = fn;
+      return f;
+    }
+  }
+  return 0;
+}
+
+/* half again the deepest use so far; the size class rounds it up more */
+static size_t dthr_stack_auto_size(struct dthr_stack_fn *f)
+{
+  if (!f || !f->threads) return DREAD_THREAD_STACK_AUTO_FIRST;
+  return f->max_used + f->max_used / 2;
+}
+
+static size_t dthr_stack_auto_lookup(void *(*fn)(void *))
+{
+  size_t  size;
+
+  DTHR_LOCK(&dthr_stack_fn_lock);
+  size = dthr_stack_auto_size(dthr_stack_fn_find(fn,0));
+  DTHR_UNLOCK(&dthr_stack_fn_lock);
+  return size;
+}
+
+/* th is exiting and still on its painted stack */
+static void dthr_stack_measure(struct dthr_thread *th)
+{
+  struct dthr_stack     *stk = th->stack;
+  struct dthr_stack_fn  *f;
+  size_t                used = dthr_stack_scan(stk);
+
+  th->stack_used = used;
+#if DREAD_THREAD_STACK_GROWS_DOWN
+  stk->painted = stk->stack_base - used;
+#else
+  stk->painted = stk->stack_base + used;
+#endif
+  DTHR_LOCK(&dthr_stack_fn_lock);
+  if ((f = dthr_stack_fn_find(th->fn,1)) != 0) {
+    f->threads++;
+    if (used > stk->stack_size) f->overflows++;
+    if (used > f->max_used) f->max_used = used;
+    f->total_used += used;
+  }
+  DTHR_UNLOCK(&dthr_stack_fn_lock);
+}
+
+/*
+ * Give an exited thread's stack back to the free list.  Nothing touches
+ * the thread descriptor after its stack pointer is cleared, so whoever
+ * owns the descriptor may reuse or free it from then on even if this
+ * worker has not switched away yet.
+ */
+static void dthr_release_stack(struct dthr_thread *th)
+{
+  struct dthr_stack       *stk = th->stack;
+  struct dthr_stack_stats *st = &stk->worker->stack_stats;
+
+  memset(&stk->regs,0,sizeof stk->regs);
+  (void) dthr_chain_delete(&stk->link);
+  dthr_chain_push(&stk->worker->free_stacks[stk->size_class],&stk->link);
+  st->active--;
+  st->active_bytes -= stk->stack_size;
+  st->cached++;
+  st->cached_bytes += stk->stack_size;
+
+  th->fn = 0;
+  th->fn_arg = 0;
+  th->stack_size = 0;
+  __sync_synchronize();
+  th->stack = 0;
+}
+
+/*
+ * Free lists.  Each worker keeps its own, so they need no locking; a
+ * descriptor or record simply ends up on the list of whichever worker the
+ * thread finished on.  Before dthr_init there is no worker to keep them.
+ */
+static struct dthr_thread *dthr_task_alloc(void)
+{
+  struct dthr_worker  *w = dthr_cur_worker;
+  struct dthr_thread  *th;
+
+  if (w && (th = (struct dthr_thread *)
+            DREAD_THREAD_CHAIN_DEQUEUE(&w->task_pool)) != 0) {
+    w->task_pool_len--;
+    return th;
+  }
+  return (struct dthr_thread *) malloc(sizeof *th);
+}
+
+static void dthr_task_free(struct dthr_thread *th)
+{
+  struct dthr_worker  *w = dthr_cur_worker;
+
+  if (!w || w->task_pool_len >= DREAD_THREAD_POOL_MAX) {
+    free(th);
+    return;
+  }
+  dthr_chain_push(&w->task_pool,&th->link);
+  w->task_pool_len++;
+}
+
+static struct dthr_thread_exit *dthr_exit_alloc(void)
+{
+  struct dthr_worker      *w = dthr_cur_worker;
+  struct dthr_thread_exit *x;
+
+  if (w && (x = w->exit_pool) != 0) {
+    w->exit_pool = x->next;
+    w->exit_pool_len--;
+    return x;
+  }
+  return (struct dthr_thread_exit *) malloc(sizeof *x);
+}
+
+static void dthr_exit_free(struct dthr_thread_exit *x)
+{
+  struct dthr_worker  *w = dthr_cur_worker;
+
+  if (!w || w->exit_pool_len >= DREAD_THREAD_POOL_MAX) {
+    free(x);
+    return;
+  }
+  x->next = w->exit_pool;
+  w->exit_pool = x;
+  w->exit_pool_len++;
+}
+
 /* current thread must already be enqueued somewhere */
 static void dthr_thread_sleep(int leave)
 {
+  struct dthr_worker  *w = dthr_cur_worker;
   struct dthr_thread  *next_thread;
 
   SHOWTHREAD;
   DBOUT(("dthr_thread_sleep(%d):",leave));
   dthr_show_queues();
 
-  do {
-    next_thread = (struct dthr_thread *) DREAD_THREAD_CHAIN_DEQUEUE(&dthr_runq);
-    DBOUT((" %sthread found %p\n",next_thread?"":"NO ",(void *) next_thread));
-
-  } while (!next_thread && dthr_on_deadlock && (*dthr_on_deadlock)());
+  DTHR_STATS_STOP(w,leave);
+  if (leave) {
+    next_thread = dthr_cur_thread;
+    if (next_thread->stack->painted) dthr_stack_measure(next_thread);
+    dthr_release_stack(next_thread);
+    /* nobody can wait for a DThr_Thread_Run thread, so recycle it now */
+    if (next_thread->flags & DREAD_THREAD_TH_POOLED)
+      dthr_task_free(next_thread);
+  }
+  next_thread = dthr_next_runnable(w);
+  DBOUT((" %sthread found %p\n",next_thread?"":"NO ",(void *) next_thread));
 
   if (!next_thread) {
-    dthr_load_ctxt(&dthr_deadlock,1);
+    dthr_load_ctxt(&w->deadlock,1);
     fprintf(stderr,"dthr_thread:  DEADLOCK load context returned\n");
     abort();
   }
@@ -240,7 +949,8 @@ static void dthr_thread_sleep(int leave)
 
 int dthr_semaphore_try(struct dthr_semaphore  *sema)
 {
-  register int  rv;
+  register int    rv;
+  pthread_mutex_t *lock = DTHR_OBJ_LOCK(sema);
 
   SHOWTHREAD;
   DBOUT(("dthr_semaphore_try(%p):",(void *) sema));
@@ -253,18 +963,28 @@ int dthr_semaphore_try(struct dthr_semaphore  *sema)
     abort();
   }
 #endif
+  DTHR_LOCK(lock);
   if (sema->value == 0) {
     rv = 0;
   } else {
     sema->value--;
+#if DREAD_THREAD_STATS
+    sema->holder = dthr_cur_thread;
+#endif
     rv = 1;
   }
+  DTHR_UNLOCK(lock);
   DBOUT(("\n"));
   return rv;
 }
 
 static void dthr_semaphore_take_no_yield(struct dthr_semaphore  *sema)
 {
+  pthread_mutex_t *lock = DTHR_OBJ_LOCK(sema);
+#if DREAD_THREAD_STATS
+  long long       since = 0;
+#endif
+
   SHOWTHREAD;
   DBOUT(("dthr_semaphore_take_no_yield(%p)\n",(void *) sema));
 #if MAGIC_TEST
@@ -276,10 +996,16 @@ static void dthr_semaphore_take_no_yield(struct dthr_semaphore  *sema)
     abort();
   }
 #endif
+  DTHR_LOCK(lock);
   while (sema->value == 0) {
     DBOUT(("dthr_semaphore_take_no_yield: not available\n"));
+#if DREAD_THREAD_STATS
+    if (!since) since = dthr_now_ns();
+#endif
     dthr_chain_enqueue(&sema->threadq,&dthr_cur_thread->link);
     dthr_cur_thread->state = DREAD_THREAD_TH_SEMA_WAIT;
+    DTHR_STATS_WAIT(sema);
+    DTHR_UNLOCK(lock);
     dthr_thread_sleep(0);
 #if MAGIC_TEST
     if (sema->magic != DREAD_THREAD_SEMA_MAGIC) {
@@ -290,8 +1016,16 @@ static void dthr_semaphore_take_no_yield(struct dthr_semaphore  *sema)
       abort();
     }
 #endif
+    DTHR_LOCK(lock);
   }
   sema->value--;
+#if DREAD_THREAD_STATS
+  sema->holder = dthr_cur_thread;
+#endif
+  DTHR_UNLOCK(lock);
+#if DREAD_THREAD_STATS
+  if (since) dthr_stats_sema_wait(since);
+#endif
   SHOWTHREAD;
   DBOUT(("LV dthr_semaphore_take_no_yield\n"));
 }
@@ -310,6 +1044,7 @@ void  dthr_semaphore_take(struct dthr_semaphore *sema)
 static void dthr_semaphore_drop_no_yield(struct dthr_semaphore  *sema)
 {
   struct dthr_thread  *waker;
+  pthread_mutex_t     *lock = DTHR_OBJ_LOCK(sema);
 
   SHOWTHREAD;
   DBOUT(("dthr_semaphore_drop_no_yield(%p)\n",(void *) sema));
@@ -322,12 +1057,14 @@ static void dthr_semaphore_drop_no_yield(struct dthr_semaphore  *sema)
     abort();
   }
 #endif
+  DTHR_LOCK(lock);
   ++sema->value;
   waker = (struct dthr_thread *) DREAD_THREAD_CHAIN_DEQUEUE(&sema->threadq);
-  if (waker) {
-    waker->state = DREAD_THREAD_TH_RUNNABLE;
-    dthr_chain_enqueue(&dthr_runq,&waker->link);
-  }
+  /* under the lock, for dthr_wait_timeout */
+  if (waker) waker->state = DREAD_THREAD_TH_RUNNABLE;
+  DTHR_UNLOCK(lock);
+  if (waker)
+    dthr_make_runnable(waker);
   SHOWTHREAD;
   DBOUT(("LV dthr_semaphore_drop_no_yield\n"));
 }
@@ -365,8 +1102,11 @@ void  dthr_event_wait(struct dthr_event *event,
 #if DEBUG
   dthr_chain_show(stderr,&event->threadq);
 #endif
+  DTHR_LOCK(DTHR_OBJ_LOCK(event));
   dthr_chain_enqueue(&event->threadq,&dthr_cur_thread->link);
   dthr_cur_thread->state = DREAD_THREAD_TH_EVENT_WAIT;
+  DTHR_STATS_WAIT(event);
+  DTHR_UNLOCK(DTHR_OBJ_LOCK(event));
   DBOUT(("p_e_w: dropping lock %p\n",(void *) lock));
   dthr_semaphore_drop_no_yield(lock);
 
@@ -392,6 +1132,7 @@ static void dthr_eventq_to_runq(struct dthr_event *event,
             unsigned int  max)
 {
   struct dthr_thread  *th;
+  pthread_mutex_t     *lock = DTHR_OBJ_LOCK(event);
 
 #if MAGIC_TEST
   if (event->magic != DREAD_THREAD_EV_MAGIC) {
@@ -402,9 +1143,12 @@ static void dthr_eventq_to_runq(struct dthr_event *event,
     abort();
   }
 #endif
-  while (max > 0 &&
-         NULL != (th = (struct dthr_thread *)
-                  DREAD_THREAD_CHAIN_DEQUEUE(&event->threadq))) {
+  while (max > 0) {
+    DTHR_LOCK(lock);
+    th = (struct dthr_thread *) DREAD_THREAD_CHAIN_DEQUEUE(&event->threadq);
+    if (th) th->state = DREAD_THREAD_TH_RUNNABLE;
+    DTHR_UNLOCK(lock);
+    if (!th) break;
 #if MAGIC_TEST
     if (th->magic != DREAD_THREAD_TH_MAGIC) {
       fprintf(stderr,
@@ -417,8 +1161,7 @@ static void dthr_eventq_to_runq(struct dthr_event *event,
 #if DEBUG
     dthr_chain_show(stderr,&event->threadq);
 #endif
-    th->state = DREAD_THREAD_TH_RUNNABLE;
-    dthr_chain_enqueue(&dthr_runq,&th->link);
+    dthr_make_runnable(th);
     DBOUT(("dthr_eventq_move: %p is now runnable\n",(void *) th));
     --max;
   }
@@ -442,72 +1185,1473 @@ void  dthr_event_broadcast_no_yield(struct dthr_event *event)
 
 void  dthr_event_broadcast(struct dthr_event  *event)
 {
-  SHOWTHREAD;
-  DBOUT(("dthr_event_broadcast(%p)\n",(void *) event));
+  SHOWTHREAD;
+  DBOUT(("dthr_event_broadcast(%p)\n",(void *) event));
+
+  dthr_eventq_to_runq(event,UINT_MAX);
+  dthr_thread_yield();
+  SHOWTHREAD;
+  DBOUT(("LV dthr_event_broadcast\n"));
+#if DEBUG
+  dthr_chain_show(stderr,&event->threadq);
+#endif
+}
+
+void  dthr_event_signal_no_yield(struct dthr_event  *event)
+{
+  SHOWTHREAD;
+  DBOUT(("dthr_event_signal_no_yield(%p)\n",(void *) event));
+
+#if DEBUG
+  dthr_chain_show(stderr,&event->threadq);
+#endif
+  dthr_eventq_to_runq(event,1);
+  SHOWTHREAD;
+  DBOUT(("LV dthr_event_signal_no_yield\n"));
+#if DEBUG
+  dthr_chain_show(stderr,&event->threadq);
+#endif
+}
+
+void  dthr_event_signal(struct dthr_event *event)
+{
+  SHOWTHREAD;
+  DBOUT(("dthr_event_signal(%p)\n",(void *) event));
+
+  dthr_eventq_to_runq(event,1);
+  dthr_thread_yield();
+  SHOWTHREAD;
+  DBOUT(("LV dthr_event_signal\n"));
+#if DEBUG
+  dthr_chain_show(stderr,&event->threadq);
+#endif
+}
+
+struct dthr_event *dthr_event_init(struct dthr_event  *ev)
+{
+  (void) dthr_chain_init(&ev->threadq);
+  ev->magic = DREAD_THREAD_EV_MAGIC;
+  return ev;
+}
+
+/*
+ * Timers.  Every worker has a wheel of its own that only it touches, so
+ * there is nothing to lock.
+ *
+ * The wheel is hierarchical: timers due within DREAD_THREAD_WHEEL0_SLOTS
+ * ticks sit in the slot for their tick on the first level, later ones in
+ * the coarser slots of the upper levels, which get emptied into the level
+ * below as time reaches them.  Timers beyond the last level wait in its
+ * furthest slot and are placed again from there.
+ */
+static long long dthr_now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* log2 of the ticks covered by one slot on level */
+#define DTHR_WHEEL_SHIFT(level) \
+  ((level) ? DREAD_THREAD_WHEEL0_BITS \
+             + ((level) - 1) * DREAD_THREAD_WHEELN_BITS : 0)
+
+static struct dthr_chain *dthr_wheel_slot(struct dthr_worker *w,
+                                          int                level,
+                                          long long          tick)
+{
+  if (!level)
+    return &w->wheel0[tick & (DREAD_THREAD_WHEEL0_SLOTS - 1)];
+  return &w->wheeln[level - 1][(tick >> DTHR_WHEEL_SHIFT(level))
+                               & (DREAD_THREAD_WHEELN_SLOTS - 1)];
+}
+
+static void dthr_timer_place(struct dthr_worker *w, struct dthr_timer *t)
+{
+  long long when = t->expires, span;
+  int       level;
+
+  if (when < w->wheel_now) when = w->wheel_now;
+  for (level = 0; level < DREAD_THREAD_WHEEL_LEVELS - 1; level++)
+    if (when - w->wheel_now < 1ll << DTHR_WHEEL_SHIFT(level + 1)) break;
+  span = 1ll << DTHR_WHEEL_SHIFT(DREAD_THREAD_WHEEL_LEVELS);
+  if (when - w->wheel_now >= span) when = w->wheel_now + span - 1;
+  t->level = level;
+  if (!level) w->wheel0_count++;
+  dthr_chain_enqueue(dthr_wheel_slot(w,level,when),&t->link);
+}
+
+static void dthr_timer_add(struct dthr_worker *w,
+                           struct dthr_timer  *t,
+                           long               ms)
+{
+  long long now = dthr_now_ms();
+
+  if (!w->ntimers) w->wheel_now = now;
+  /* now is rounded down, so wait one tick more than asked */
+  t->expires = now + ms + 1;
+  t->armed = 1;
+  w->ntimers++;
+  dthr_timer_place(w,t);
+}
+
+static void dthr_timer_cancel(struct dthr_worker *w, struct dthr_timer *t)
+{
+  if (!t->armed) return;
+  (void) dthr_chain_delete(&t->link);
+  t->armed = 0;
+  w->ntimers--;
+  if (!t->level) w->wheel0_count--;
+}
+
+/* Move the timers in one upper level slot down to where they belong now. */
+static void dthr_timer_cascade(struct dthr_worker *w, int level)
+{
+  struct dthr_chain moving, *slot, *p;
+
+  (void) dthr_chain_init(&moving);
+  slot = dthr_wheel_slot(w,level,w->wheel_now);
+  while ((p = DREAD_THREAD_CHAIN_DEQUEUE(slot)) != 0)
+    dthr_chain_enqueue(&moving,p);
+  while ((p = DREAD_THREAD_CHAIN_DEQUEUE(&moving)) != 0)
+    dthr_timer_place(w,(struct dthr_timer *) p);
+}
+
+/*
+ * Fire every timer that is due; returns how many did.
+ */
+static int dthr_timer_run(struct dthr_worker *w)
+{
+  struct dthr_chain *slot, *p;
+  struct dthr_timer *t;
+  long long         now, tick, next;
+  int               level, fired = 0;
+
+  if (!w->ntimers) return 0;
+  now = dthr_now_ms();
+  while ((tick = w->wheel_now) <= now && w->ntimers) {
+    if (!(tick & (DREAD_THREAD_WHEEL0_SLOTS - 1))) {
+      for (level = DREAD_THREAD_WHEEL_LEVELS - 1; level > 0; level--)
+        if (!(tick & ((1ll << DTHR_WHEEL_SHIFT(level)) - 1)))
+          dthr_timer_cascade(w,level);
+    } else if (!w->wheel0_count) {
+      /* nothing on the first level before the next cascade */
+      next = (tick | (DREAD_THREAD_WHEEL0_SLOTS - 1)) + 1;
+      w->wheel_now = next <= now ? next : now + 1;
+      continue;
+    }
+    slot = dthr_wheel_slot(w,0,tick);
+    while ((p = DREAD_THREAD_CHAIN_DEQUEUE(slot)) != 0) {
+      t = (struct dthr_timer *) p;
+      t->armed = 0;
+      w->ntimers--;
+      w->wheel0_count--;
+      (*t->fn)(t);
+      fired++;
+    }
+    w->wheel_now = tick + 1;
+  }
+  if (!w->ntimers && now >= w->wheel_now) w->wheel_now = now + 1;
+  return fired;
+}
+
+/*
+ * Milliseconds until the wheel next needs attention, or -1 if there are
+ * no timers: when the first timer on the first level is due or, failing
+ * that, when the nearest upper level slot gets cascaded.  Only meaningful
+ * right after dthr_timer_run.
+ */
+static int dthr_timer_next(struct dthr_worker *w)
+{
+  long long tick, when = -1, now;
+  int       level, i, first, shift;
+
+  if (!w->ntimers) return -1;
+  for (i = 0; w->wheel0_count && i < DREAD_THREAD_WHEEL0_SLOTS; i++) {
+    tick = w->wheel_now + i;
+    if (!DREAD_THREAD_CHAIN_EMPTY(dthr_wheel_slot(w,0,tick))) {
+      when = tick;
+      break;
+    }
+  }
+  for (level = 1; when < 0 && level < DREAD_THREAD_WHEEL_LEVELS; level++) {
+    shift = DTHR_WHEEL_SHIFT(level);
+    /* a slot that is due now has not been cascaded yet */
+    first = (w->wheel_now & ((1ll << shift) - 1)) != 0;
+    for (i = first; i < first + DREAD_THREAD_WHEELN_SLOTS; i++) {
+      tick = ((w->wheel_now >> shift) + i) << shift;
+      if (!DREAD_THREAD_CHAIN_EMPTY(dthr_wheel_slot(w,level,tick))) {
+        when = tick;
+        break;
+      }
+    }
+  }
+  if (when < 0) return -1;
+  now = dthr_now_ms();
+  if (when <= now) return 0;
+  return when - now < INT_MAX ? (int) (when - now) : INT_MAX;
+}
+
+/*
+ * Nothing to run and no I/O to poll for, but timers pending: sleep until
+ * the wheel needs attention or another worker hands us a thread.
+ */
+static void dthr_timer_sleep(struct dthr_worker *w)
+{
+  struct timespec ts;
+  int             ms, asleep;
+
+  pthread_mutex_lock(&dthr_idle_lock);
+  ms = dthr_timer_next(w);
+  pthread_mutex_lock(&w->lock);
+  asleep = w->sleeping = ms > 0 && DREAD_THREAD_CHAIN_EMPTY(&w->runq);
+  pthread_mutex_unlock(&w->lock);
+  if (asleep) {
+    DBOUT(("dthr_timer_sleep: %d ms\n",ms));
+    clock_gettime(CLOCK_REALTIME,&ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000l;
+    if (ts.tv_nsec >= 1000000000l) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000l;
+    }
+    while (asleep && pthread_cond_timedwait(&w->wakeup,&dthr_idle_lock,&ts)
+           != ETIMEDOUT) {
+      pthread_mutex_lock(&w->lock);
+      asleep = w->sleeping;
+      pthread_mutex_unlock(&w->lock);
+    }
+    pthread_mutex_lock(&w->lock);
+    w->sleeping = 0;
+    pthread_mutex_unlock(&w->lock);
+  }
+  pthread_mutex_unlock(&dthr_idle_lock);
+  (void) dthr_timer_run(w);
+}
+
+/*
+ * Every so often, even while there are threads to run, look for timers
+ * that are due and descriptors that are ready.
+ */
+static void dthr_worker_tick(struct dthr_worker *w)
+{
+  if (++w->ticks < DREAD_THREAD_TICK_INTERVAL) return;
+  w->ticks = 0;
+  if (DTHR_IO_PENDING(w)) (void) dthr_io_poll(w,0);
+  else (void) dthr_timer_run(w);
+}
+
+/*
+ * Timed waits.  The record lives on the waiting thread's stack.  When the
+ * timer fires the thread may be in the middle of being woken by another
+ * worker, which takes it off the semaphore or event queue and marks it
+ * runnable under the queue's lock; so the timer only takes it off itself
+ * if it is still in the waiting state.
+ */
+struct dthr_timed_wait {
+  struct dthr_timer   timer;
+  struct dthr_thread  *thread;
+  pthread_mutex_t     *lock;            /* for the queue it waits on, if any */
+  int                 state;            /* what it waits as */
+  int                 timed_out;        /* taken off the queue by the timer */
+};
+
+static void dthr_wait_timeout(struct dthr_timer *t)
+{
+  struct dthr_timed_wait  *tw = (struct dthr_timed_wait *) t;
+  struct dthr_thread      *th = tw->thread;
+
+  if (tw->lock) DTHR_LOCK(tw->lock);
+  if ((tw->timed_out = th->state == tw->state) && tw->lock)
+    (void) dthr_chain_delete(&th->link);
+  if (tw->lock) DTHR_UNLOCK(tw->lock);
+  DBOUT(("dthr_wait_timeout: thread %p%s\n",(void *) th,
+         tw->timed_out ? "" : " already woken"));
+  if (tw->timed_out) dthr_make_runnable(th);
+}
+
+static void dthr_timed_wait_start(struct dthr_timed_wait *tw,
+                                  pthread_mutex_t        *lock,
+                                  int                    state,
+                                  long                   ms)
+{
+  tw->thread = dthr_cur_thread;
+  tw->lock = lock;
+  tw->state = state;
+  tw->timed_out = 0;
+  tw->timer.fn = dthr_wait_timeout;
+  dthr_timer_add(dthr_cur_worker,&tw->timer,ms);
+}
+
+/*
+ * dthr_semaphore_take, giving up after timeout_ms (< 0 for never).
+ * Returns 1 if the semaphore was taken, 0 on timeout.
+ */
+int dthr_semaphore_take_timed(struct dthr_semaphore *sema, long timeout_ms)
+{
+  struct dthr_timed_wait  tw;
+  pthread_mutex_t         *lock = DTHR_OBJ_LOCK(sema);
+#if DREAD_THREAD_STATS
+  long long               since = 0;
+#endif
+
+  SHOWTHREAD;
+  DBOUT(("dthr_semaphore_take_timed(%p,%ld)\n",(void *) sema,timeout_ms));
+#if MAGIC_TEST
+  if (sema->magic != DREAD_THREAD_SEMA_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  semaphore structure corruption detected"
+            " in dthr_semaphore_take_timed(%p,%ld)\n",
+            (void *) sema,timeout_ms);
+    abort();
+  }
+#endif
+  dthr_thread_yield();
+  tw.timer.armed = 0;
+  DTHR_LOCK(lock);
+  if (sema->value == 0 && timeout_ms >= 0)
+    dthr_timed_wait_start(&tw,lock,DREAD_THREAD_TH_SEMA_WAIT,timeout_ms);
+  while (sema->value == 0) {
+    if (timeout_ms >= 0 && !tw.timer.armed) {
+      DTHR_UNLOCK(lock);
+#if DREAD_THREAD_STATS
+      if (since) dthr_stats_sema_wait(since);
+#endif
+      DBOUT(("LV dthr_semaphore_take_timed: timed out\n"));
+      return 0;
+    }
+#if DREAD_THREAD_STATS
+    if (!since) since = dthr_now_ns();
+#endif
+    dthr_chain_enqueue(&sema->threadq,&dthr_cur_thread->link);
+    dthr_cur_thread->state = DREAD_THREAD_TH_SEMA_WAIT;
+    DTHR_STATS_WAIT(sema);
+    DTHR_UNLOCK(lock);
+    dthr_thread_sleep(0);
+    DTHR_LOCK(lock);
+  }
+  sema->value--;
+#if DREAD_THREAD_STATS
+  sema->holder = dthr_cur_thread;
+#endif
+  DTHR_UNLOCK(lock);
+#if DREAD_THREAD_STATS
+  if (since) dthr_stats_sema_wait(since);
+#endif
+  dthr_timer_cancel(dthr_cur_worker,&tw.timer);
+  DBOUT(("LV dthr_semaphore_take_timed\n"));
+  return 1;
+}
+
+/*
+ * dthr_event_wait, giving up after timeout_ms (< 0 for never).  The lock
+ * is held again on return either way.  Returns 1 if the event was
+ * signalled, 0 on timeout.
+ */
+int dthr_event_wait_timed(struct dthr_event     *event,
+                          struct dthr_semaphore *lock,
+                          long                  timeout_ms)
+{
+  struct dthr_timed_wait  tw;
+
+  SHOWTHREAD;
+  DBOUT(("dthr_event_wait_timed(%p,%p,%ld)\n",
+         (void *) event,(void *) lock,timeout_ms));
+#if MAGIC_TEST
+  if (event->magic != DREAD_THREAD_EV_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  event structure corruption detected"
+            " in dthr_event_wait_timed(%p,%p,%ld)\n",
+            (void *) event,(void *) lock,timeout_ms);
+    abort();
+  }
+#endif
+  tw.timer.armed = 0;
+  tw.timed_out = 0;
+  if (timeout_ms >= 0)
+    dthr_timed_wait_start(&tw,DTHR_OBJ_LOCK(event),
+                          DREAD_THREAD_TH_EVENT_WAIT,timeout_ms);
+  DTHR_LOCK(DTHR_OBJ_LOCK(event));
+  dthr_chain_enqueue(&event->threadq,&dthr_cur_thread->link);
+  dthr_cur_thread->state = DREAD_THREAD_TH_EVENT_WAIT;
+  DTHR_STATS_WAIT(event);
+  DTHR_UNLOCK(DTHR_OBJ_LOCK(event));
+  dthr_semaphore_drop_no_yield(lock);
+  dthr_thread_sleep(0);
+  dthr_timer_cancel(dthr_cur_worker,&tw.timer);
+  dthr_semaphore_take_no_yield(lock);
+  DBOUT(("LV dthr_event_wait_timed: %s\n",
+         tw.timed_out ? "timed out" : "signalled"));
+  return !tw.timed_out;
+}
+
+/*
+ * Let the other threads run for ms milliseconds.  The worker's OS thread
+ * sleeps if none of them wants to.
+ */
+void  dthr_sleep(long ms)
+{
+  struct dthr_timed_wait  tw;
+
+  SHOWTHREAD;
+  DBOUT(("dthr_sleep(%ld)\n",ms));
+  if (ms <= 0) {
+    dthr_thread_yield();
+    return;
+  }
+  dthr_cur_thread->state = DREAD_THREAD_TH_SLEEP;
+  dthr_timed_wait_start(&tw,0,DREAD_THREAD_TH_SLEEP,ms);
+  dthr_thread_sleep(0);
+  DBOUT(("LV dthr_sleep\n"));
+}
+
+/*
+ * Channels.  A thread that cannot complete any of its operations right
+ * away leaves its dthr_chan_ops on the channels' receive or send queues,
+ * all pointing at one dthr_chan_sel on its stack, and sleeps.  Whoever
+ * can complete one of them first claims the select by setting done,
+ * copies the element straight to or from the sleeper and wakes it; the
+ * sleeper then takes its other ops off their queues.  Ops of a select
+ * that has already been claimed are dropped as they are come across.
+ *
+ * A send that finds a receiver waiting on our own worker switches to it
+ * at once and queues the sender behind the other runnable threads, so an
+ * item moving down a pipeline costs one switch instead of a wakeup now
+ * and a switch later.
+ */
+struct dthr_chan_sel {
+  struct dthr_timer   timer;
+  struct dthr_thread  *thread;
+  int                 done;             /* index of the op that completed */
+#define DTHR_CHAN_PENDING   (-1)
+#define DTHR_CHAN_TIMEOUT   (-2)
+};
+
+#define DTHR_CHAN_SLOT(ch,i) \
+  ((ch)->buf + (((ch)->head + (i)) % (ch)->nslots) * (ch)->elem_size)
+
+struct dthr_chan *dthr_chan_init(struct dthr_chan  *ch,
+                                 size_t            elem_size,
+                                 long              capacity)
+{
+  ch->elem_size = elem_size;
+  ch->capacity = capacity;
+  ch->nslots = capacity > 0 ? (size_t) capacity : capacity < 0 ? 16 : 0;
+  ch->buf = 0;
+  if (ch->nslots && !(ch->buf = (char *) malloc(ch->nslots * elem_size)))
+    return 0;
+  ch->head = ch->len = 0;
+  ch->closed = 0;
+  (void) dthr_chain_init(&ch->recvq);
+  (void) dthr_chain_init(&ch->sendq);
+  ch->magic = DREAD_THREAD_CHAN_MAGIC;
+  return ch;
+}
+
+void  dthr_chan_destroy(struct dthr_chan *ch)
+{
+  free(ch->buf);
+  ch->buf = 0;
+  ch->magic = 0;
+}
+
+/* double an unbounded channel's ring, keeping the elements in order */
+static int dthr_chan_grow(struct dthr_chan *ch)
+{
+  size_t  sz = ch->elem_size, first = ch->nslots - ch->head;
+  char    *buf = (char *) malloc(2 * ch->nslots * sz);
+
+  if (!buf) return 0;
+  if (first > ch->len) first = ch->len;
+  memcpy(buf,ch->buf + ch->head * sz,first * sz);
+  memcpy(buf + first * sz,ch->buf,(ch->len - first) * sz);
+  free(ch->buf);
+  ch->buf = buf;
+  ch->nslots *= 2;
+  ch->head = 0;
+  return 1;
+}
+
+/*
+ * First waiter on q whose select we get to complete, dropping the ones
+ * somebody else got to first.  Called with the channel locked.
+ */
+static struct dthr_chan_op *dthr_chan_claim(struct dthr_chain *q)
+{
+  struct dthr_chan_op *op;
+
+  while ((op = (struct dthr_chan_op *) DREAD_THREAD_CHAIN_DEQUEUE(q)) != 0)
+    if (__sync_bool_compare_and_swap(&op->sel->done,DTHR_CHAN_PENDING,
+                                     op->index))
+      return op;
+  return 0;
+}
+
+/*
+ * Complete op if it can be done without waiting, with its channel locked.
+ * Returns 0 if it cannot; otherwise *wake is the waiter it completed
+ * along the way, if any.  An unbounded channel that cannot grow acts as a
+ * full one.
+ */
+static int dthr_chan_try(struct dthr_chan_op *op, struct dthr_thread **wake)
+{
+  struct dthr_chan    *ch = op->chan;
+  struct dthr_chan_op *peer;
+  size_t              sz = ch->elem_size;
+
+  *wake = 0;
+  op->ok = 0;
+  if (op->dir == DREAD_THREAD_CHAN_SEND) {
+    if (ch->closed) return 1;
+    if ((peer = dthr_chan_claim(&ch->recvq)) != 0) {
+      /* receivers only wait while the buffer is empty */
+      memcpy(peer->elem,op->elem,sz);
+      peer->ok = 1;
+      *wake = peer->sel->thread;
+    } else if (ch->capacity < 0 ? ch->len < ch->nslots || dthr_chan_grow(ch)
+               : ch->len < (size_t) ch->capacity) {
+      memcpy(DTHR_CHAN_SLOT(ch,ch->len),op->elem,sz);
+      ch->len++;
+    } else {
+      return 0;
+    }
+  } else if (ch->len > 0) {
+    memcpy(op->elem,DTHR_CHAN_SLOT(ch,0),sz);
+    ch->head = (ch->head + 1) % ch->nslots;
+    ch->len--;
+    /* a sender waiting for room gets it */
+    if ((peer = dthr_chan_claim(&ch->sendq)) != 0) {
+      memcpy(DTHR_CHAN_SLOT(ch,ch->len),peer->elem,sz);
+      ch->len++;
+      peer->ok = 1;
+      *wake = peer->sel->thread;
+    }
+  } else if ((peer = dthr_chan_claim(&ch->sendq)) != 0) {
+    memcpy(op->elem,peer->elem,sz);
+    peer->ok = 1;
+    *wake = peer->sel->thread;
+  } else if (ch->closed) {
+    return 1;
+  } else {
+    return 0;
+  }
+  op->ok = 1;
+  return 1;
+}
+
+/*
+ * Lock or unlock the channels of ops, in address order of their locks
+ * since a select may share them with another one.
+ */
+static void dthr_chan_lock_all(struct dthr_chan_op *ops, int n, int lock)
+{
+  pthread_mutex_t *m, *last = 0, *next;
+  int             i;
+
+  if (dthr_nworkers == 1) return;
+  for (;;) {
+    for (next = 0, i = 0; i < n; i++) {
+      m = DTHR_OBJ_LOCK(ops[i].chan);
+      if ((!last || m > last) && (!next || m < next)) next = m;
+    }
+    if (!next) return;
+    if (lock) pthread_mutex_lock(next);
+    else pthread_mutex_unlock(next);
+    last = next;
+  }
+}
+
+/*
+ * Wake th, which we completed a select for.  If it was waiting to
+ * receive on our own worker, run it now.
+ */
+static void dthr_chan_wake(struct dthr_thread *th, int handoff)
+{
+  struct dthr_worker  *w = dthr_cur_worker;
+
+  if (!handoff || th->stack->worker != w) {
+    dthr_make_runnable(th);
+    return;
+  }
+  th->state = DREAD_THREAD_TH_RUNNABLE;
+  if (DTHR_WAITING(w)) dthr_worker_tick(w);
+  DTHR_LOCK(&w->lock);
+  dthr_chain_enqueue(&w->runq,&dthr_cur_thread->link);
+  DTHR_STATS_READY(w,dthr_cur_thread);
+  DTHR_UNLOCK(&w->lock);
+  DBOUT(("dthr_chan_wake: handing off to %p\n",(void *) th));
+  dthr_csw(th->stack,DREAD_THREAD_CSW_NORM);
+}
+
+static void dthr_chan_timeout(struct dthr_timer *t)
+{
+  struct dthr_chan_sel  *sel = (struct dthr_chan_sel *) t;
+
+  if (__sync_bool_compare_and_swap(&sel->done,DTHR_CHAN_PENDING,
+                                   DTHR_CHAN_TIMEOUT))
+    dthr_make_runnable(sel->thread);
+}
+
+/*
+ * Complete one of the n operations in ops, waiting up to timeout_ms for
+ * one to become possible (< 0 for ever, 0 not at all).  When several can
+ * go ahead, where we start looking rotates.  Returns the index of the one
+ * that completed, or -1 on timeout.
+ */
+int dthr_chan_select(struct dthr_chan_op *ops, int n, long timeout_ms)
+{
+  struct dthr_worker    *w = dthr_cur_worker;
+  struct dthr_chan_sel  sel;
+  struct dthr_thread    *wake;
+  int                   i, k, start;
+
+  SHOWTHREAD;
+  DBOUT(("dthr_chan_select(%p,%d,%ld)\n",(void *) ops,n,timeout_ms));
+#if MAGIC_TEST
+  for (i = 0; i < n; i++) {
+    if (ops[i].chan->magic != DREAD_THREAD_CHAN_MAGIC) {
+      fprintf(stderr,
+              "dthr_thread:  channel structure corruption detected"
+              " in dthr_chan_select(%p)\n",
+              (void *) ops[i].chan);
+      abort();
+    }
+  }
+#endif
+  start = n > 1 ? w->chan_rr++ % n : 0;
+  dthr_chan_lock_all(ops,n,1);
+  for (k = 0; k < n; k++) {
+    i = (start + k) % n;
+    if (dthr_chan_try(&ops[i],&wake)) {
+      dthr_chan_lock_all(ops,n,0);
+      if (wake) dthr_chan_wake(wake,ops[i].dir == DREAD_THREAD_CHAN_SEND);
+      DBOUT(("LV dthr_chan_select: %d\n",i));
+      return i;
+    }
+  }
+  if (timeout_ms == 0) {
+    dthr_chan_lock_all(ops,n,0);
+    return -1;
+  }
+
+  sel.thread = dthr_cur_thread;
+  sel.done = DTHR_CHAN_PENDING;
+  sel.timer.armed = 0;
+  for (i = 0; i < n; i++) {
+    ops[i].sel = &sel;
+    ops[i].index = i;
+    dthr_chain_enqueue(ops[i].dir == DREAD_THREAD_CHAN_SEND
+                       ? &ops[i].chan->sendq : &ops[i].chan->recvq,
+                       &ops[i].link);
+  }
+  dthr_cur_thread->state = DREAD_THREAD_TH_CHAN_WAIT;
+  DTHR_STATS_WAIT(ops[0].chan);
+  if (timeout_ms > 0) {
+    sel.timer.fn = dthr_chan_timeout;
+    dthr_timer_add(w,&sel.timer,timeout_ms);
+  }
+  dthr_chan_lock_all(ops,n,0);
+  dthr_thread_sleep(0);
+
+  dthr_timer_cancel(w,&sel.timer);
+  dthr_chan_lock_all(ops,n,1);
+  for (i = 0; i < n; i++)
+    if (!DREAD_THREAD_CHAIN_EMPTY(&ops[i].link))
+      (void) dthr_chain_delete(&ops[i].link);
+  dthr_chan_lock_all(ops,n,0);
+  DBOUT(("LV dthr_chan_select: %d\n",sel.done));
+  return sel.done == DTHR_CHAN_TIMEOUT ? -1 : sel.done;
+}
+
+/*
+ * Returns 1 once elem has been sent, 0 if the channel is closed.
+ */
+int dthr_chan_send(struct dthr_chan *ch, const void *elem)
+{
+  struct dthr_chan_op op;
+
+  op.chan = ch;
+  op.dir = DREAD_THREAD_CHAN_SEND;
+  op.elem = (void *) elem;
+  (void) dthr_chan_select(&op,1,-1);
+  return op.ok;
+}
+
+/*
+ * Returns 1 once an element has been received into elem, 0 if the
+ * channel is closed and empty.
+ */
+int dthr_chan_recv(struct dthr_chan *ch, void *elem)
+{
+  struct dthr_chan_op op;
+
+  op.chan = ch;
+  op.dir = DREAD_THREAD_CHAN_RECV;
+  op.elem = elem;
+  (void) dthr_chan_select(&op,1,-1);
+  return op.ok;
+}
+
+/*
+ * dthr_chan_send and dthr_chan_recv without waiting: 1 if done, 0 if it
+ * would have had to wait, -1 if the channel is closed.
+ */
+int dthr_chan_try_send(struct dthr_chan *ch, const void *elem)
+{
+  struct dthr_chan_op op;
+
+  op.chan = ch;
+  op.dir = DREAD_THREAD_CHAN_SEND;
+  op.elem = (void *) elem;
+  if (dthr_chan_select(&op,1,0) < 0) return 0;
+  return op.ok ? 1 : -1;
+}
+
+int dthr_chan_try_recv(struct dthr_chan *ch, void *elem)
+{
+  struct dthr_chan_op op;
+
+  op.chan = ch;
+  op.dir = DREAD_THREAD_CHAN_RECV;
+  op.elem = elem;
+  if (dthr_chan_select(&op,1,0) < 0) return 0;
+  return op.ok ? 1 : -1;
+}
+
+/*
+ * No more sends.  Waiting senders fail; receivers get what is buffered,
+ * and then fail too.
+ */
+void  dthr_chan_close(struct dthr_chan *ch)
+{
+  struct dthr_chain   woken;
+  struct dthr_chan_op *op;
+  struct dthr_thread  *th;
+
+  SHOWTHREAD;
+  DBOUT(("dthr_chan_close(%p)\n",(void *) ch));
+#if MAGIC_TEST
+  if (ch->magic != DREAD_THREAD_CHAN_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  channel structure corruption detected"
+            " in dthr_chan_close(%p)\n",
+            (void *) ch);
+    abort();
+  }
+#endif
+  /* threads waiting in a select are on no other queue */
+  (void) dthr_chain_init(&woken);
+  DTHR_LOCK(DTHR_OBJ_LOCK(ch));
+  ch->closed = 1;
+  while ((op = dthr_chan_claim(&ch->recvq)) != 0
+         || (op = dthr_chan_claim(&ch->sendq)) != 0) {
+    op->ok = 0;
+    dthr_chain_enqueue(&woken,&op->sel->thread->link);
+  }
+  DTHR_UNLOCK(DTHR_OBJ_LOCK(ch));
+  while ((th = (struct dthr_thread *) DREAD_THREAD_CHAIN_DEQUEUE(&woken)))
+    dthr_make_runnable(th);
+}
+
+#if DREAD_THREAD_POLL
+/*
+ * I/O wait.  A thread blocked on a descriptor sits on its worker's ioq
+ * until the worker polls and finds the descriptor ready, or until its
+ * timeout fires.  Workers poll when they run out of runnable threads, and
+ * every so often from dthr_worker_tick.
+ */
+static void dthr_io_wake(struct dthr_worker *w, struct dthr_io_wait *wt)
+{
+  (void) dthr_chain_delete(&wt->link);
+  w->io_nwaiting--;
+  dthr_timer_cancel(w,&wt->timer);
+  dthr_make_runnable(wt->thread);
+}
+
+static void dthr_io_timeout(struct dthr_timer *t)
+{
+  struct dthr_io_wait *wt = (struct dthr_io_wait *)
+      ((char *) t - offsetof(struct dthr_io_wait,timer));
+
+  DBOUT(("dthr_io_timeout: fd %d\n",wt->fd));
+  wt->revents = 0;
+  dthr_io_wake(dthr_cur_worker,wt);
+}
+
+/*
+ * Wake the threads whose descriptors are ready or whose timeouts are up.
+ * With block set and nothing to wake yet, sleep in poll until there is,
+ * or until another worker hands us a thread.  Returns the number of
+ * threads woken.
+ */
+static int dthr_io_poll(struct dthr_worker *w, int block)
+{
+  struct dthr_chain   *p, *next;
+  struct pollfd       *fds;
+  int                 nfds, n, i, timeout = 0, asleep = 0, woken;
+  char                drain[64];
+
+  w->ticks = 0;
+  woken = dthr_timer_run(w);
+  if (w->io_nfds < w->io_nwaiting + 1) {
+    n = 2 * (w->io_nwaiting + 1);
+    fds = (struct pollfd *) realloc(w->io_fds,n * sizeof *fds);
+    if (!fds) {
+      fprintf(stderr,"dthr_thread:  no space for poll descriptors\n");
+      abort();
+    }
+    w->io_fds = fds;
+    w->io_nfds = n;
+  }
+  fds = w->io_fds;
+  for (nfds = 0, p = w->ioq.next; p != &w->ioq; p = p->next, nfds++) {
+    fds[nfds].fd = ((struct dthr_io_wait *) p)->fd;
+    fds[nfds].events = ((struct dthr_io_wait *) p)->events;
+    fds[nfds].revents = 0;
+  }
+
+  if (block && !woken) {
+    timeout = dthr_timer_next(w);
+    if (dthr_nworkers > 1) {
+      if (!w->io_wake_open && pipe(w->io_wake) == 0) {
+        (void) fcntl(w->io_wake[0],F_SETFL,O_NONBLOCK);
+        (void) fcntl(w->io_wake[1],F_SETFL,O_NONBLOCK);
+        w->io_wake_open = 1;
+      }
+      pthread_mutex_lock(&w->lock);
+      if (!DREAD_THREAD_CHAIN_EMPTY(&w->runq)) {
+        timeout = 0;
+      } else if (w->io_wake_open) {
+        w->sleeping = asleep = 2;
+      } else if (timeout < 0 || timeout > 1) {
+        timeout = 1;  /* no pipe: check back for wakeups every tick */
+      }
+      pthread_mutex_unlock(&w->lock);
+      if (asleep) {
+        fds[nfds].fd = w->io_wake[0];
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+      }
+    }
+  }
+  DBOUT(("dthr_io_poll: %d fds, timeout %d\n",nfds,timeout));
+  n = poll(fds,nfds + (asleep != 0),timeout);
+  if (asleep) {
+    pthread_mutex_lock(&w->lock);
+    w->sleeping = 0;
+    pthread_mutex_unlock(&w->lock);
+    if (n > 0 && fds[nfds].revents)
+      while (read(w->io_wake[0],drain,sizeof drain) > 0)
+        ;
+  }
+
+  if (n > 0) {
+    for (i = 0, p = w->ioq.next; p != &w->ioq; p = next, i++) {
+      next = p->next;
+      if (!fds[i].revents) continue;
+      ((struct dthr_io_wait *) p)->revents = fds[i].revents;
+      dthr_io_wake(w,(struct dthr_io_wait *) p);
+      woken++;
+    }
+  }
+  return woken + dthr_timer_run(w);
+}
+
+/*
+ * Block the calling thread until fd is ready for events (POLLIN, POLLOUT,
+ * ...), letting the other threads run meanwhile.  Returns the revents
+ * poll(2) reported, 0 if timeout_ms ran out first (< 0 waits forever), or
+ * -1.  With a negative fd this just sleeps.
+ */
+int dthr_io_wait(int fd, int events, long timeout_ms)
+{
+  struct dthr_worker  *w = dthr_cur_worker;
+  struct dthr_io_wait wt;
+
+  SHOWTHREAD;
+  DBOUT(("dthr_io_wait(%d,0x%x,%ld)\n",fd,events,timeout_ms));
+#if MAGIC_TEST
+  if (dthr_cur_thread->magic != DREAD_THREAD_TH_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  thread structure corruption detected"
+            " in dthr_io_wait(%d,0x%x,%ld)\n",
+            fd,events,timeout_ms);
+    abort();
+  }
+#endif
+  if (fd < 0 && timeout_ms < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  wt.thread = dthr_cur_thread;
+  wt.fd = fd;
+  wt.events = events;
+  wt.revents = 0;
+  wt.timer.armed = 0;
+  wt.timer.fn = dthr_io_timeout;
+  dthr_chain_enqueue(&w->ioq,&wt.link);
+  w->io_nwaiting++;
+  if (timeout_ms >= 0)
+    dthr_timer_add(w,&wt.timer,timeout_ms);
+  dthr_cur_thread->state = DREAD_THREAD_TH_IO_WAIT;
+  dthr_thread_sleep(0);
+  SHOWTHREAD;
+  DBOUT(("LV dthr_io_wait: 0x%x\n",wt.revents));
+  return wt.revents;
+}
+
+/*
+ * Timeout for each wait of dthr_read and friends, which then fail with
+ * ETIMEDOUT; negative for none, which is the default.
+ */
+void  dthr_set_io_timeout(long timeout_ms)
+{
+  dthr_cur_thread->io_timeout = timeout_ms;
+}
+
+/*
+ * The wrappers below only yield if fd would block, which they cannot tell
+ * unless it is in non-blocking mode.  dthr_accept and dthr_connect set
+ * that up themselves; use this on anything else.
+ */
+int dthr_io_nonblock(int fd)
+{
+  int flags;
+
+  if ((flags = fcntl(fd,F_GETFL)) < 0) return -1;
+  if (flags & O_NONBLOCK) return 0;
+  return fcntl(fd,F_SETFL,flags | O_NONBLOCK);
+}
+
+/*
+ * Wait on behalf of a wrapper whose call returned EAGAIN.  Returns 0 when
+ * it is worth retrying.
+ */
+static int dthr_io_block(int fd, int events)
+{
+  switch (dthr_io_wait(fd,events,dthr_cur_thread->io_timeout)) {
+  case -1:
+    return -1;
+  case 0:
+    errno = ETIMEDOUT;
+    return -1;
+  default:
+    return 0;
+  }
+}
+
+#define DTHR_IO_AGAIN(fd,events) \
+  (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) \
+                      && dthr_io_block(fd,events) == 0))
+
+ssize_t dthr_read(int fd, void *buf, size_t nbytes)
+{
+  ssize_t n;
+
+  while ((n = read(fd,buf,nbytes)) < 0 && DTHR_IO_AGAIN(fd,POLLIN))
+    ;
+  return n;
+}
+
+/* Like write(2), this may write less than asked. */
+ssize_t dthr_write(int fd, const void *buf, size_t nbytes)
+{
+  ssize_t n;
+
+  while ((n = write(fd,buf,nbytes)) < 0 && DTHR_IO_AGAIN(fd,POLLOUT))
+    ;
+  return n;
+}
+
+/* Leaves fd in non-blocking mode; the new socket comes back in it too. */
+int dthr_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+  int s;
+
+  if (dthr_io_nonblock(fd) < 0) return -1;
+  while ((s = accept(fd,addr,addrlen)) < 0)
+    if (!DTHR_IO_AGAIN(fd,POLLIN)) return -1;
+  if (dthr_io_nonblock(s) < 0) {
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+/* Leaves fd in non-blocking mode. */
+int dthr_connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+  int       err;
+  socklen_t len = sizeof err;
+
+  if (dthr_io_nonblock(fd) < 0) return -1;
+  if (connect(fd,addr,addrlen) == 0) return 0;
+  if (errno != EINPROGRESS && errno != EINTR) return -1;
+  if (dthr_io_block(fd,POLLOUT) < 0) return -1;
+  if (getsockopt(fd,SOL_SOCKET,SO_ERROR,&err,&len) < 0) return -1;
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+#endif
+
+static void dthr_worker_init(struct dthr_worker *w, int id)
+{
+  int i, j;
+
+  for (i = 0; i < DREAD_THREAD_STACK_CLASSES; i++)
+    (void) dthr_chain_init(&w->free_stacks[i]);
+  memset(&w->stack_stats,0,sizeof w->stack_stats);
+  (void) dthr_chain_init(&w->active_stacks);
+  (void) dthr_chain_init(&w->runq);
+  (void) dthr_chain_init(&w->newq);
+  w->newq_len = 0;
+  w->topmost_stack.worker = w;
+  w->topmost_thread.stack = 0;
+  w->stack_limit = 0;
+  w->topmost_thread.magic = DREAD_THREAD_TH_MAGIC;
+  (void) dthr_semaphore_init(&w->newq_sema,1);
+  (void) dthr_event_init(&w->newq_event);
+  for (i = 0; i < DREAD_THREAD_WHEEL0_SLOTS; i++)
+    (void) dthr_chain_init(&w->wheel0[i]);
+  for (i = 0; i < DREAD_THREAD_WHEEL_LEVELS - 1; i++)
+    for (j = 0; j < DREAD_THREAD_WHEELN_SLOTS; j++)
+      (void) dthr_chain_init(&w->wheeln[i][j]);
+  w->wheel_now = 0;
+  w->ntimers = 0;
+  w->wheel0_count = 0;
+  w->ticks = 0;
+  w->chan_rr = 0;
+  (void) dthr_chain_init(&w->task_pool);
+  w->task_pool_len = 0;
+  w->exit_pool = 0;
+  w->exit_pool_len = 0;
+#if DREAD_THREAD_STATS
+  memset(&w->stats,0,sizeof w->stats);
+  w->stats_cur = 0;
+  w->trace = 0;
+  w->trace_len = 0;
+  w->topmost_thread.run_ns = 0;
+  w->topmost_thread.ready_ns = 0;
+  w->topmost_thread.wait_obj = 0;
+#endif
+#if DREAD_THREAD_POLL
+  (void) dthr_chain_init(&w->ioq);
+  w->io_nwaiting = 0;
+  w->io_fds = 0;
+  w->io_nfds = 0;
+  w->io_wake_open = 0;
+#endif
+  w->id = id;
+  w->sleeping = 0;
+  pthread_mutex_init(&w->lock,0);
+  pthread_cond_init(&w->wakeup,0);
+}
+
+/*
+ * Release what a worker picked up while running, before it is freed or
+ * initialized again.
+ */
+static void dthr_worker_fini(struct dthr_worker *w)
+{
+  struct dthr_thread_exit *x;
+  struct dthr_chain       *p;
+  struct dthr_stack       *stk;
+  int                     c;
+
+  if (w->task_pool.next) {  /* dthr_worker0 before its first dthr_init */
+    while ((p = DREAD_THREAD_CHAIN_DEQUEUE(&w->task_pool)) != 0)
+      free(p);
+    /*
+     * Carved stacks on the free lists point into the C stack of a run that
+     * is over, and for other workers of a pthread that has exited.
+     */
+    for (c = 0; c < DREAD_THREAD_STACK_CLASSES; c++)
+      while ((p = DREAD_THREAD_CHAIN_DEQUEUE(&w->free_stacks[c])) != 0) {
+        stk = (struct dthr_stack *) p;
+#if defined(DREAD_THREAD_MD_START)
+        if (stk->map_base) munmap(stk->map_base,stk->map_size);
+#endif
+        free(stk);
+      }
+  }
+  w->task_pool_len = 0;
+  while ((x = w->exit_pool) != 0) {
+    w->exit_pool = x->next;
+    free(x);
+  }
+  w->exit_pool_len = 0;
+#if DREAD_THREAD_STATS
+  free(w->trace);
+  w->trace = 0;
+#endif
+#if DREAD_THREAD_POLL
+  free(w->io_fds);
+  w->io_fds = 0;
+  w->io_nfds = 0;
+  if (w->io_wake_open) {
+    close(w->io_wake[0]);
+    close(w->io_wake[1]);
+    w->io_wake_open = 0;
+  }
+#endif
+}
+
+/*
+ * Back to just the calling OS thread as worker 0.
+ */
+static void dthr_drop_workers(void)
+{
+  int i;
+
+  for (i = 1; i < dthr_nworkers; i++) {
+    dthr_worker_fini(dthr_workers[i]);
+    free(dthr_workers[i]);
+    dthr_workers[i] = 0;
+  }
+  dthr_nworkers = 1;
+}
+
+/*
+ * Should be first dthr_* routine to be called.  Calling it again after
+ * dthr_thread_multithread returns starts over with a single worker.
+ */
+void  dthr_init(void)
+{
+#if DEBUG
+  setbuf(stdout,0);
+#endif
+  dthr_drop_workers();
+  dthr_worker_fini(&dthr_worker0);
+  dthr_worker_init(&dthr_worker0,0);
+  dthr_cur_worker = &dthr_worker0;
+#if DREAD_THREAD_STATS
+  /* whatever was left from a deadlock is gone */
+  dthr_all_threads = 0;
+#endif
+}
+
+/*
+ * Run threads on nworkers OS threads instead of one.  Call after
+ * dthr_init and before going multithreaded.  The calling OS thread is
+ * worker 0; the others get worker_stack_size bytes of C stack (0 for a
+ * default) out of which their threads' stacks are carved.  Returns 0 on
+ * failure.
+ */
+int dthr_set_concurrency(int nworkers, size_t worker_stack_size)
+{
+  struct dthr_worker  *w;
+  int                 i;
+
+  if (nworkers < 1 || nworkers > DREAD_THREAD_MAX_WORKERS) return 0;
+  dthr_drop_workers();
+  for (i = 1; i < nworkers; i++) {
+    if (!(w = (struct dthr_worker *) malloc(sizeof *w))) return 0;
+    dthr_worker_init(w,i);
+    dthr_workers[i] = w;
+    dthr_nworkers = i + 1;
+  }
+  for (i = 0; i < DREAD_THREAD_OBJ_LOCKS; i++)
+    pthread_mutex_init(&dthr_obj_locks[i],0);
+  dthr_worker_stack_size = worker_stack_size ? worker_stack_size
+      : DREAD_THREAD_WORKER_STACK;
+  return 1;
+}
+
+/*
+ * Totals over all workers.  Other workers keep running, so the numbers
+ * are only a snapshot.
+ */
+void  dthr_get_stack_stats(struct dthr_stack_stats *stats)
+{
+  struct dthr_stack_stats *st;
+  int                     i;
+
+  memset(stats,0,sizeof *stats);
+  for (i = 0; i < dthr_nworkers; i++) {
+    st = &dthr_workers[i]->stack_stats;
+    stats->active += st->active;
+    stats->cached += st->cached;
+    stats->active_bytes += st->active_bytes;
+    stats->cached_bytes += st->cached_bytes;
+    stats->mapped_bytes += st->mapped_bytes;
+  }
+}
+
+/*
+ * Give the calling worker's unused mmap'ed stacks back to the system.
+ * Stacks carved from the topmost thread's stack cannot be returned.
+ */
+void  dthr_trim_stacks(void)
+{
+#if defined(DREAD_THREAD_MD_START)
+  struct dthr_worker  *w = dthr_cur_worker;
+  struct dthr_chain   *p, *next;
+  struct dthr_stack   *stk;
+  int                 c;
+
+  for (c = 0; c < DREAD_THREAD_STACK_CLASSES; c++) {
+    for (p = w->free_stacks[c].next; p != &w->free_stacks[c]; p = next) {
+      next = p->next;
+      stk = (struct dthr_stack *) p;
+      if (!stk->map_base) continue;
+      (void) dthr_chain_delete(p);
+      w->stack_stats.cached--;
+      w->stack_stats.cached_bytes -= stk->stack_size;
+      w->stack_stats.mapped_bytes -= stk->map_size;
+      munmap(stk->map_base,stk->map_size);
+      free(stk);
+    }
+  }
+#endif
+}
+
+/*
+ * Paint every thread started from now on, not only the
+ * DREAD_THREAD_STACK_AUTO ones, so that all of them are measured.
+ */
+void  dthr_set_stack_tracking(int on)
+{
+  dthr_stack_tracking = on;
+}
+
+/*
+ * The deepest th has gone into its stack so far, or went before exiting.
+ * 0 if its stack was not painted.
+ */
+size_t  dthr_thread_stack_used(struct dthr_thread *th)
+{
+  struct dthr_stack *stk = th->stack;
+
+  if (!stk || !stk->painted || th->state == DREAD_THREAD_TH_EXITED)
+    return th->stack_used;
+  return dthr_stack_scan(stk);
+}
+
+/*
+ * Copies up to n entry functions' stack use into usage, and returns how
+ * many functions there are.
+ */
+int dthr_get_stack_usage(struct dthr_stack_usage *usage, int n)
+{
+  struct dthr_stack_fn  *f;
+  int                   i, nfns = 0;
+
+  DTHR_LOCK(&dthr_stack_fn_lock);
+  for (i = 0; i < DREAD_THREAD_STACK_FNS; i++) {
+    f = &dthr_stack_fns[i];
+    if (!f->fn) continue;
+    if (nfns < n) {
+      usage[nfns].fn = f->fn;
+      usage[nfns].threads = f->threads;
+      usage[nfns].overflows = f->overflows;
+      usage[nfns].max_used = f->max_used;
+      usage[nfns].mean_used = f->threads ? f->total_used / f->threads : 0;
+      usage[nfns].auto_size = dthr_stack_auto_size(f);
+    }
+    nfns++;
+  }
+  DTHR_UNLOCK(&dthr_stack_fn_lock);
+  return nfns;
+}
+
+#if DREAD_THREAD_STATS
+/*
+ * Totals over all workers, a snapshot like dthr_get_stack_stats.
+ */
+void  dthr_get_sched_stats(struct dthr_sched_stats *stats)
+{
+  struct dthr_sched_stats *st;
+  int                     i;
+
+  memset(stats,0,sizeof *stats);
+  for (i = 0; i < dthr_nworkers; i++) {
+    st = &dthr_workers[i]->stats;
+    stats->switches += st->switches;
+    stats->runnable += st->runnable;
+    stats->runnable_max += st->runnable_max;
+    stats->sema_waits += st->sema_waits;
+    stats->sema_wait_ns += st->sema_wait_ns;
+    if (st->sema_wait_max_ns > stats->sema_wait_max_ns)
+      stats->sema_wait_max_ns = st->sema_wait_max_ns;
+    stats->latency_samples += st->latency_samples;
+    stats->latency_ns += st->latency_ns;
+    if (st->latency_max_ns > stats->latency_max_ns)
+      stats->latency_max_ns = st->latency_max_ns;
+  }
+}
+
+/*
+ * Time th has spent running, including the current slice if it is the
+ * caller.
+ */
+long long dthr_thread_run_ns(struct dthr_thread *th)
+{
+  struct dthr_worker  *w = dthr_cur_worker;
+
+  if (w && th == w->stats_cur)
+    return th->run_ns + dthr_now_ns() - w->stats_since;
+  return th->run_ns;
+}
+
+static int dthr_ptr_cmp(const void *a, const void *b)
+{
+  uintptr_t x = (uintptr_t) *(void **) a, y = (uintptr_t) *(void **) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Who th waits for: the last thread to take the semaphore it is blocked
+ * on, if that one is still in live (sorted, n long).  Semaphores have no
+ * owner, so this is a guess at who ought to drop it -- right for locks.
+ */
+static struct dthr_thread *dthr_waits_for(struct dthr_thread *th,
+                                          struct dthr_thread **live,
+                                          int                n)
+{
+  struct dthr_thread  *holder;
 
-  dthr_eventq_to_runq(event,UINT_MAX);
-  dthr_thread_yield();
-  SHOWTHREAD;
-  DBOUT(("LV dthr_event_broadcast\n"));
-#if DEBUG
-  dthr_chain_show(stderr,&event->threadq);
-#endif
+  if (th->state != DREAD_THREAD_TH_SEMA_WAIT || !th->wait_obj) return 0;
+  holder = ((struct dthr_semaphore *) th->wait_obj)->holder;
+  if (!holder
+      || !bsearch(&holder,live,n,sizeof *live,dthr_ptr_cmp)) return 0;
+  return holder;
 }
 
-void  dthr_event_signal_no_yield(struct dthr_event  *event)
+/*
+ * List the threads that have started and not exited with what each is
+ * blocked on, followed by every cycle of threads waiting on semaphores
+ * last taken by one another.  Printed on deadlock; may be called at any
+ * other time too.  Returns the number of threads listed.
+ */
+int dthr_dump_threads(FILE *fp)
 {
-  SHOWTHREAD;
-  DBOUT(("dthr_event_signal_no_yield(%p)\n",(void *) event));
-
-#if DEBUG
-  dthr_chain_show(stderr,&event->threadq);
-#endif
-  dthr_eventq_to_runq(event,1);
-  SHOWTHREAD;
-  DBOUT(("LV dthr_event_signal_no_yield\n"));
-#if DEBUG
-  dthr_chain_show(stderr,&event->threadq);
-#endif
+  struct dthr_thread    **live, *th, *p;
+  struct dthr_semaphore *sema;
+  int                   n = 0, i, j;
+
+  DTHR_LOCK(&dthr_stats_lock);
+  for (th = dthr_all_threads; th; th = th->all_next) n++;
+  fprintf(fp,"dthr_thread:  %d live threads\n",n);
+  if ((live = (struct dthr_thread **) malloc(n * sizeof *live + 1)) != 0) {
+    for (i = 0, th = dthr_all_threads; th; th = th->all_next)
+      live[i++] = th;
+    qsort(live,n,sizeof *live,dthr_ptr_cmp);
+  }
+  for (th = dthr_all_threads; th; th = th->all_next) {
+    fprintf(fp,"  thread %p fn %p ran %.3f ms: ",
+            (void *) th,(void *) (uintptr_t) th->fn,th->run_ns / 1e6);
+    switch (th->state) {
+    case DREAD_THREAD_TH_RUNNABLE:
+      fprintf(fp,"%s\n",th == dthr_cur_thread ? "running" : "runnable");
+      break;
+    case DREAD_THREAD_TH_SEMA_WAIT:
+      sema = (struct dthr_semaphore *) th->wait_obj;
+      fprintf(fp,"waits for semaphore %p, value %d, last taken by %p\n",
+              (void *) sema,sema->value,(void *) sema->holder);
+      break;
+    case DREAD_THREAD_TH_EVENT_WAIT:
+      fprintf(fp,"waits for event %p\n",th->wait_obj);
+      break;
+    case DREAD_THREAD_TH_IO_WAIT:
+      fprintf(fp,"waits for I/O\n");
+      break;
+    case DREAD_THREAD_TH_SLEEP:
+      fprintf(fp,"sleeps\n");
+      break;
+    case DREAD_THREAD_TH_CHAN_WAIT:
+      fprintf(fp,"waits for channel %p\n",th->wait_obj);
+      break;
+    default:
+      fprintf(fp,"state %d\n",th->state);
+      break;
+    }
+  }
+  /* each cycle is reported once, starting from its lowest address */
+  for (i = 0; live && i < n; i++) {
+    th = live[i];
+    for (p = dthr_waits_for(th,live,n), j = 0; p && p != th && j < n;
+         p = dthr_waits_for(p,live,n), j++)
+      if ((uintptr_t) p < (uintptr_t) th) break;
+    if (p != th) continue;
+    fprintf(fp,"  cycle: %p",(void *) th);
+    do {
+      p = dthr_waits_for(p,live,n);
+      fprintf(fp," -> %p",(void *) p);
+    } while (p != th);
+    fprintf(fp,"\n");
+  }
+  free(live);
+  DTHR_UNLOCK(&dthr_stats_lock);
+  return n;
 }
 
-void  dthr_event_signal(struct dthr_event *event)
+/*
+ * Record which thread ran on which worker and when, keeping the last
+ * nevents slices per worker.  Rings are allocated by each worker as it
+ * first needs one and belong to it, so start tracing before going
+ * multithreaded and write the trace out before dthr_init or
+ * dthr_set_concurrency throws the workers away.
+ */
+void  dthr_trace_start(unsigned long nevents)
 {
-  SHOWTHREAD;
-  DBOUT(("dthr_event_signal(%p)\n",(void *) event));
+  int i;
 
-  dthr_eventq_to_runq(event,1);
-  dthr_thread_yield();
-  SHOWTHREAD;
-  DBOUT(("LV dthr_event_signal\n"));
-#if DEBUG
-  dthr_chain_show(stderr,&event->threadq);
-#endif
+  for (i = 0; i < dthr_nworkers; i++) {
+    free(dthr_workers[i]->trace);
+    dthr_workers[i]->trace = 0;
+    dthr_workers[i]->trace_len = 0;
+  }
+  dthr_trace_epoch = dthr_now_ns();
+  dthr_trace_size = nevents;
+  dthr_tracing = nevents > 0;
 }
 
-struct dthr_event *dthr_event_init(struct dthr_event  *ev)
+void  dthr_trace_stop(void)
 {
-  (void) dthr_chain_init(&ev->threadq);
-  ev->magic = DREAD_THREAD_EV_MAGIC;
-  return ev;
+  dthr_tracing = 0;
 }
 
 /*
- * Should be first dthr_* routine to be called.
+ * Write the slices recorded so far in the Trace Event format that
+ * chrome://tracing and Perfetto load: one track per worker, one complete
+ * event per slice named after the thread function, with the time the
+ * thread was runnable before it got the worker as latency_us.  Returns
+ * the number of slices written.
  */
-void  dthr_init(void)
+int dthr_trace_write(FILE *fp)
 {
-#if DEBUG
-  setbuf(stdout,0);
-#endif
-  (void) dthr_chain_init(&dthr_free_stacks);
-  (void) dthr_chain_init(&dthr_active_stacks);
-  (void) dthr_chain_init(&dthr_runq);
-  (void) dthr_chain_init(&dthr_newq);
-  dthr_topmost_thread.stack = 0;
-  dthr_topmost_thread.magic = DREAD_THREAD_TH_MAGIC;
-  (void) dthr_semaphore_init(&dthr_newq_sema,1);
-  (void) dthr_event_init(&dthr_newq_event);
+  struct dthr_worker      *w;
+  struct dthr_trace_event *ev;
+  unsigned long           size = dthr_trace_size, k, first;
+  int                     i, n = 0;
+
+  fprintf(fp,"{\"traceEvents\":[\n");
+  for (i = 0; i < dthr_nworkers; i++) {
+    w = dthr_workers[i];
+    fprintf(fp,"%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+            i ? ",\n" : "",i,i);
+    if (!w->trace) continue;
+    first = w->trace_len > size ? w->trace_len - size : 0;
+    for (k = first; k < w->trace_len; k++, n++) {
+      ev = &w->trace[k % size];
+      fprintf(fp,",\n{\"name\":\"%p\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+              "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"thread\":\"%p\","
+              "\"latency_us\":%.3f}}",
+              (void *) (uintptr_t) ev->fn,i,
+              (ev->start - dthr_trace_epoch) / 1e3,ev->dur / 1e3,
+              (void *) ev->thread,ev->latency / 1e3);
+    }
+  }
+  fprintf(fp,"\n]}\n");
+  return n;
 }
+#endif
 
 void  dthr_thread_exit(void *status)
 {
@@ -518,7 +2662,7 @@ void  dthr_thread_exit(void *status)
   while ((x = dthr_cur_thread->on_exit) != 0) {
     dthr_cur_thread->on_exit = x->next;
     (*x->fn)(dthr_cur_thread,x->arg);
-    free(x);
+    dthr_exit_free(x);
   }
 #if MAGIC_TEST
   if (dthr_cur_thread->magic != DREAD_THREAD_TH_MAGIC) {
@@ -557,6 +2701,16 @@ struct dthr_thread  *dthr_thread_init(struct dthr_thread  *th,
   th->stack = 0;
   (void) dthr_semaphore_init(&th->exit_sema,0);
   th->on_exit = 0;
+  th->io_timeout = -1;
+  th->flags = requested_stack_size == DREAD_THREAD_STACK_AUTO ?
+      DREAD_THREAD_TH_AUTO_STACK : 0;
+  th->stack_used = 0;
+#if DREAD_THREAD_STATS
+  th->wait_obj = 0;
+  th->run_ns = 0;
+  th->ready_ns = 0;
+  th->all_next = th->all_prev = 0;
+#endif
   th->magic = DREAD_THREAD_TH_MAGIC;
   /*
    * no stack bound to this thread yet
@@ -571,7 +2725,7 @@ int dthr_thread_on_exit(struct dthr_thread  *th,
   struct dthr_thread_exit *x;
 
   DBOUT(("on exit thread %p, fn %p\n",(void *) th,(void *) fn));
-  if (!(x = (struct dthr_thread_exit *) malloc(sizeof *x))) return 0;
+  if (!(x = dthr_exit_alloc())) return 0;
 #if MAGIC_TEST
   if (th->magic != DREAD_THREAD_TH_MAGIC) {
     fprintf(stderr,
@@ -595,6 +2749,9 @@ int dthr_thread_on_exit(struct dthr_thread  *th,
  */
 struct dthr_thread  *dthr_thread_run(struct dthr_thread *th)
 {
+  struct dthr_worker  *w, *idle;
+  int                 i;
+
 #if MAGIC_TEST
   if (th->magic != DREAD_THREAD_TH_MAGIC) {
     fprintf(stderr,
@@ -606,16 +2763,80 @@ struct dthr_thread  *dthr_thread_run(struct dthr_thread *th)
 #endif
   SHOWTHREAD;
   DBOUT(("dthr_thread_run(%p)\n",(void *) th));
-  dthr_semaphore_take_no_yield(&dthr_newq_sema);
-  dthr_chain_enqueue(&dthr_newq,&th->link);
-  dthr_event_signal_no_yield(&dthr_newq_event);
-  dthr_semaphore_drop_no_yield(&dthr_newq_sema);
+  /*
+   * Hand the thread to an idle worker if there is one; otherwise it waits
+   * on our own new queue, where idle workers can still steal it.
+   */
+  w = dthr_cur_worker;
+  for (i = 1; i < dthr_nworkers; i++) {
+    idle = dthr_workers[(w->id + i) % dthr_nworkers];
+    if (*(volatile int *) &idle->sleeping) {
+      w = idle;
+      break;
+    }
+  }
+#if DREAD_THREAD_STATS
+  th->ready_ns = dthr_now_ns();
+#endif
+  dthr_semaphore_take_no_yield(&w->newq_sema);
+  DTHR_LOCK(&w->lock);
+  dthr_chain_enqueue(&w->newq,&th->link);
+  w->newq_len++;
+  DTHR_UNLOCK(&w->lock);
+  dthr_event_signal_no_yield(&w->newq_event);
+  dthr_semaphore_drop_no_yield(&w->newq_sema);
   dthr_thread_yield();
   SHOWTHREAD;
   DBOUT(("LV dthr_thread_run\n"));
   return th;
 }
 
+/*
+ * dthr_thread_run for a chain of n threads, linked through their link
+ * fields.  They are split between us and the workers that are asleep, and
+ * each share goes onto its new queue with one lock and one wakeup.
+ */
+static void dthr_thread_run_chain(struct dthr_chain *batch, int n)
+{
+  struct dthr_worker  *targets[DREAD_THREAD_MAX_WORKERS], *w;
+  struct dthr_chain   *p;
+  int                 ntargets = 0, i, share;
+
+  targets[ntargets++] = dthr_cur_worker;
+  for (i = 1; i < dthr_nworkers; i++) {
+    w = dthr_workers[(dthr_cur_worker->id + i) % dthr_nworkers];
+    if (*(volatile int *) &w->sleeping) targets[ntargets++] = w;
+  }
+  for (i = 0; i < ntargets && n > 0; i++) {
+    w = targets[i];
+    share = (n + ntargets - i - 1) / (ntargets - i);
+    n -= share;
+    dthr_semaphore_take_no_yield(&w->newq_sema);
+    DTHR_LOCK(&w->lock);
+    w->newq_len += share;
+    while (share-- > 0) {
+      p = DREAD_THREAD_CHAIN_DEQUEUE(batch);
+#if MAGIC_TEST
+      if (((struct dthr_thread *) p)->magic != DREAD_THREAD_TH_MAGIC) {
+        fprintf(stderr,
+                "dthr_thread:  thread structure corruption detected"
+                " in dthr_thread_run_chain(%p)\n",
+                (void *) p);
+        abort();
+      }
+#endif
+#if DREAD_THREAD_STATS
+      ((struct dthr_thread *) p)->ready_ns = dthr_now_ns();
+#endif
+      dthr_chain_enqueue(&w->newq,p);
+    }
+    DTHR_UNLOCK(&w->lock);
+    dthr_event_signal_no_yield(&w->newq_event);
+    dthr_semaphore_drop_no_yield(&w->newq_sema);
+  }
+  dthr_thread_yield();
+}
+
 struct dthr_thread  *dthr_thread_wait(struct dthr_thread *th)
 {
 #if MAGIC_TEST
@@ -649,34 +2870,98 @@ struct dthr_thread  *dthr_thread_detach(struct dthr_thread *th)
 }
 
 /*
- * Returns a stack descriptor from free list -- best fit.
+ * Size class for a stack of size bytes, and what the stack gets rounded
+ * up to so that it can be reused by anything else in its class.
+ */
+static int dthr_stack_class(size_t size)
+{
+  int c;
+
+  for (c = 0; c < DREAD_THREAD_STACK_CLASSES - 1; c++)
+    if (size <= (size_t) DREAD_THREAD_STACK_MIN << c) break;
+  return c;
+}
+
+static size_t dthr_stack_class_size(size_t size)
+{
+  int c = dthr_stack_class(size);
+
+  return c < DREAD_THREAD_STACK_CLASSES - 1 ?
+      (size_t) DREAD_THREAD_STACK_MIN << c : size;
+}
+
+/*
+ * Returns a stack descriptor from the free lists, taking it off the list:
+ * the most recently freed stack of the smallest class that fits.
  */
-static struct dthr_stack  *dthr_find_free_stack(int size)
+static struct dthr_stack  *dthr_find_free_stack(struct dthr_worker *w,
+                                                size_t             size)
 {
-  struct dthr_stack *stk, *best_so_far;
-  int     best_size_diff = INT_MAX, size_diff;
+  struct dthr_stack *stk;
+  int               c;
 
   DBOUT(("dthr_find_free_stack\n"));
-  for (best_so_far = 0, stk = (struct dthr_stack *) dthr_free_stacks.next;
-       (struct dthr_chain *) stk != &dthr_free_stacks;
-       stk = (struct dthr_stack *) stk->link.next) {
+  for (c = dthr_stack_class(size); c < DREAD_THREAD_STACK_CLASSES; c++) {
+    for (stk = (struct dthr_stack *) w->free_stacks[c].next;
+         (struct dthr_chain *) stk != &w->free_stacks[c];
+         stk = (struct dthr_stack *) stk->link.next) {
 #if MAGIC_TEST
-    if (stk->magic != DREAD_THREAD_STACK_MAGIC) {
-      fprintf(stderr,
-              "dthr_thread: stack descriptor corruption detected"
-              " by dthr_find_free_stack(0x%08x)\n",
-              size);
-      abort();
-    }
+      if (stk->magic != DREAD_THREAD_STACK_MAGIC) {
+        fprintf(stderr,
+                "dthr_thread: stack descriptor corruption detected"
+                " by dthr_find_free_stack(0x%08lx)\n",
+                (unsigned long) size);
+        abort();
+      }
 #endif
-    if ((size_diff = stk->stack_size - size) > 0
-        && size_diff < best_size_diff) {
-      best_size_diff = size_diff;
-      best_so_far = stk;
+      /* only the last class has stacks of assorted sizes */
+      if (stk->stack_size >= size) {
+        (void) dthr_chain_delete(&stk->link);
+        w->stack_stats.cached--;
+        w->stack_stats.cached_bytes -= stk->stack_size;
+        DBOUT(("dthr_find_free_stack -> %p\n",(void *) stk));
+        return stk;
+      }
     }
   }
-  DBOUT(("dthr_find_free_stack -> %p\n",(void *) best_so_far));
-  return best_so_far;
+  DBOUT(("dthr_find_free_stack -> 0\n"));
+  return 0;
+}
+
+/*
+ * Note how far threads may be carved out of worker w's C stack, which is
+ * size bytes deep and in use down to about here.
+ */
+static void dthr_set_stack_limit(struct dthr_worker *w, size_t size)
+{
+  char      mark;
+  uintptr_t here = (uintptr_t) &mark;
+
+  size = size > DREAD_THREAD_STACK_RESERVE ?
+      size - DREAD_THREAD_STACK_RESERVE : 0;
+#if DREAD_THREAD_STACK_GROWS_DOWN
+  w->stack_limit = (caddr_t) (here - size);
+#else
+  w->stack_limit = (caddr_t) (here + size);
+#endif
+}
+
+/*
+ * Whether a stack of size bytes can still be carved out below the
+ * launcher without passing the worker's limit.
+ */
+static int dthr_stack_room(struct dthr_worker *w, size_t size)
+{
+  caddr_t base = w->topmost_stack.stack_base;
+
+  if (!w->stack_limit) return 1;
+#if DREAD_THREAD_STACK_GROWS_DOWN
+  return base > w->stack_limit
+      && (size_t) (base - w->stack_limit) >= size + DREAD_THREAD_STACK_EXTRA;
+#else
+  return w->stack_limit > base
+      && (size_t) (w->stack_limit - base) >= size + DREAD_THREAD_STACK_EXTRA;
+#endif
 }
 
 static void dthr_thread_launcher(void);
@@ -751,37 +3036,159 @@ static void dthr_new_topmost_thread(struct dthr_stack *stk,
    */
   DBOUT(("dthr_new_topmost_thread:  marking thread %p as runnable\n",
          (void *) stk->thread));
-  dthr_chain_enqueue(&dthr_runq,&stk->thread->link);
+  dthr_make_runnable(stk->thread);
 
   DBOUT(("dthr_new_topmost_thread -> launcher\n"));
   dthr_thread_launcher();
 }
 
+static struct dthr_thread *dthr_newq_dequeue(struct dthr_worker *w)
+{
+  struct dthr_thread  *th;
+
+  DTHR_LOCK(&w->lock);
+  th = (struct dthr_thread *) DREAD_THREAD_CHAIN_DEQUEUE(&w->newq);
+  if (th) w->newq_len--;
+  DTHR_UNLOCK(&w->lock);
+  return th;
+}
+
+/*
+ * Run the thread bound to stk, which is the stack we are on, to
+ * completion.  Stacks are reused by jumping back to just before this is
+ * called, so it never returns.
+ */
+static void dthr_run_thread(struct dthr_stack *stk)
+{
+  struct dthr_thread      *new_th = stk->thread;
+  struct dthr_thread_exit *x;
+
+  DTHR_STATS_SWITCH(stk->worker,new_th);
+  dthr_cur_thread = new_th;
+  if (dthr_stack_tracking || (new_th->flags & DREAD_THREAD_TH_AUTO_STACK))
+    dthr_stack_paint(stk);
+  else
+    stk->painted = 0;
+#if MAGIC_TEST
+  if (new_th->magic != DREAD_THREAD_TH_MAGIC) {
+    fprintf(stderr,
+            "dthr_thread:  thread structure corruption detected"
+            " in dthr_thread_launcher(), base launch\n");
+    abort();
+  }
+#endif
+#if DREAD_THREAD_STATS
+  dthr_stats_started(new_th);
+#endif
+  new_th->exit_value = (*new_th->fn)(new_th->fn_arg);
+
+  while ((x = new_th->on_exit) != 0) {
+    new_th->on_exit = x->next;
+    (*x->fn)(new_th,x->arg);
+    dthr_exit_free(x);
+  }
+
+  DBOUT(("p_t_l: thread %p exited\n",(void *) dthr_cur_thread));
+  /* same as dthr_thread_exit here */
+  new_th->state = DREAD_THREAD_TH_EXITED;
+
+  dthr_thread_sleep(1);
+  fprintf(stderr,"dthr_thread_launcher: exited thread still runs\n");
+  abort();
+}
+
+/*
+ * Stacks of their own, with an inaccessible guard page below them, for
+ * when stack overflow should fault rather than trample the next thread.
+ * Only possible where dreadthread_ctxt.h knows how to switch stacks.
+ */
+int dthr_set_stack_mmap(int on)
+{
+#if defined(DREAD_THREAD_MD_START)
+  dthr_stack_mmap = on;
+  return 1;
+#else
+  return !on;
+#endif
+}
+
+#if defined(DREAD_THREAD_MD_START)
+static struct dthr_stack *dthr_map_stack(struct dthr_worker *w, size_t size)
+{
+  struct dthr_stack *stk;
+  size_t            page = sysconf(_SC_PAGESIZE), len;
+  caddr_t           mem;
+
+  len = (size + DREAD_THREAD_STACK_EXTRA + 2 * page - 1) & ~(page - 1);
+  mem = mmap(0,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if (mem == MAP_FAILED) return 0;
+  if (mprotect(mem,page,PROT_NONE) != 0
+      || !(stk = (struct dthr_stack *) malloc(sizeof *stk))) {
+    munmap(mem,len);
+    return 0;
+  }
+  stk->map_base = mem;
+  stk->map_size = len;
+  stk->painted = 0;
+  stk->stack_top = mem + page;
+  stk->stack_base = mem + len;
+  w->stack_stats.mapped_bytes += len;
+  return stk;
+}
+
+/*
+ * First thing on a fresh mapped stack: note where the thread body starts,
+ * and go back to the launcher until the thread is scheduled.
+ */
+static void dthr_stack_trampoline(void)
+{
+  struct dthr_worker  *w = dthr_cur_worker;
+  struct dthr_stack   *stk = w->starting;
+
+  if (!dthr_save_ctxt(&stk->base))
+    dthr_load_ctxt(w->continuation,1);
+  dthr_run_thread(stk);
+}
+
+static void dthr_start_mapped_stack(struct dthr_worker *w,
+                                    struct dthr_stack  *stk)
+{
+  dthr_ctxt_t continuation;
+
+  w->starting = stk;
+  w->continuation = &continuation;
+  if (!dthr_save_ctxt(&continuation))
+    DREAD_THREAD_MD_START((void *) ((uintptr_t) stk->stack_base & ~15ul),
+                          dthr_stack_trampoline);
+  memcpy((void *) &stk->regs,(void *) &stk->base,sizeof stk->regs);
+}
+#endif
+
 static void dthr_thread_launcher(void)
 {
   unsigned long           magic = DREAD_THREAD_MAGIC2;
+  struct dthr_worker      *w = dthr_cur_worker;
   struct dthr_thread      *new_th;
   struct dthr_stack       *new_stk;
   dthr_ctxt_t             continuation;
-  struct dthr_thread_exit *x;
+  size_t                  size;
 
   DBOUT(("dthr_thread_launcher\n"));
 
-  dthr_topmost_stack.stack_size = 0;
-  dthr_topmost_stack.stack_base = (void *) &magic;
-  dthr_topmost_stack.stack_top = 0;
-  dthr_topmost_stack.thread = &dthr_topmost_thread;
-  dthr_topmost_stack.magic = DREAD_THREAD_STACK_MAGIC;
+  w->topmost_stack.stack_size = 0;
+  w->topmost_stack.stack_base = (void *) &magic;
+  w->topmost_stack.stack_top = 0;
+  w->topmost_stack.thread = &w->topmost_thread;
+  w->topmost_stack.magic = DREAD_THREAD_STACK_MAGIC;
 
-  dthr_topmost_thread.stack = &dthr_topmost_stack;
+  w->topmost_thread.stack = &w->topmost_stack;
 
   DBOUT(("p_t_l: grabbing new thread queue lock\n"));
-  dthr_semaphore_take_no_yield(&dthr_newq_sema);
+  dthr_semaphore_take_no_yield(&w->newq_sema);
   for (;;) {
     DBOUT(("p_t_l: getting thread\n"));
     dthr_show_queues();
-    while ((new_th = (struct dthr_thread *)
-            DREAD_THREAD_CHAIN_DEQUEUE(&dthr_newq)) != 0) {
+    while ((new_th = dthr_newq_dequeue(w)) != 0) {
 #if MAGIC_TEST
       if (new_th->magic != DREAD_THREAD_TH_MAGIC) {
         fprintf(stderr,
@@ -791,8 +3198,24 @@ static void dthr_thread_launcher(void)
       }
 #endif
       DBOUT(("p_t_l: launching thread %p\n",(void *) new_th));
+      if (new_th->flags & DREAD_THREAD_TH_AUTO_STACK)
+        new_th->stack_size = dthr_stack_auto_lookup(new_th->fn);
+      size = dthr_stack_class_size(new_th->stack_size);
+      new_stk = dthr_find_free_stack(w,size);
+#if defined(DREAD_THREAD_MD_START)
+      /* also when the worker's own stack is used up */
+      if (!new_stk && (dthr_stack_mmap || !dthr_stack_room(w,size))
+          && 0 != (new_stk = dthr_map_stack(w,size))) {
+        DBOUT(("p_t_l:  mapped new stack %p\n",(void *) new_stk));
+        new_stk->stack_size = size;
+        new_stk->size_class = dthr_stack_class(size);
+        new_stk->magic = DREAD_THREAD_STACK_MAGIC;
+        new_stk->worker = w;
+        dthr_start_mapped_stack(w,new_stk);
+      }
+#endif
       /* dthr_find_free_stack does magic test */
-      if (0 != (new_stk = dthr_find_free_stack(new_th->stack_size))) {
+      if (0 != new_stk) {
         /*
          * Found a stack for this thread,
          * so now we can just bind them together
@@ -804,13 +3227,22 @@ static void dthr_thread_launcher(void)
         DBOUT(("p_t_l:  reverting regs\n"));
         memcpy((void *) &new_stk->regs,(void *) &new_stk->base,
                sizeof new_stk->regs);
+        dthr_chain_push(&w->active_stacks,&new_stk->link);
+        w->stack_stats.active++;
+        w->stack_stats.active_bytes += new_stk->stack_size;
         new_stk->thread = new_th;
         new_th->stack = new_stk;
-        new_th->state = DREAD_THREAD_TH_RUNNABLE;
-        dthr_chain_enqueue(&dthr_runq,&new_th->link);
+        dthr_make_runnable(new_th);
       } else {
         DBOUT(("p_t_l:  no sufficiently large stack on free list,"
                " allocating new stack descriptor\n"));
+        if (!dthr_stack_room(w,size)) {
+          fprintf(stderr,
+                  "dthr_thread:  top_thread:  worker %d has no C stack left"
+                  " for a %lu byte thread\n",
+                  w->id,(unsigned long) size);
+          abort();
+        }
         new_stk = (struct dthr_stack *) malloc(sizeof *new_stk);
         if (!new_stk) {
           fprintf(stderr,
@@ -818,14 +3250,19 @@ static void dthr_thread_launcher(void)
           abort();
         }
         /* copy and correct */
-        new_stk->stack_base = dthr_topmost_stack.stack_base;
-        new_stk->stack_size = new_th->stack_size;
+        new_stk->stack_base = w->topmost_stack.stack_base;
+        new_stk->stack_size = size;
+        new_stk->size_class = dthr_stack_class(size);
+        new_stk->map_base = 0;
+        new_stk->map_size = 0;
+        new_stk->painted = 0;
 #if DREAD_THREAD_STACK_GROWS_DOWN
         new_stk->stack_top = new_stk->stack_base - new_stk->stack_size;
 #else
         new_stk->stack_top = new_stk->stack_base + new_stk->stack_size;
 #endif
         new_stk->magic = DREAD_THREAD_STACK_MAGIC;
+        new_stk->worker = w;
 
         /*
          * Turn into new thread; note that temporarily
@@ -837,58 +3274,34 @@ static void dthr_thread_launcher(void)
         new_th->stack = new_stk;
         new_th->state = DREAD_THREAD_TH_RUNNABLE;
         /*
-         * Ensure that dthr_this_thread will make sense
+         * Active until the thread exits
          */
-        dthr_chain_push(&dthr_active_stacks,&new_stk->link);
+        dthr_chain_push(&w->active_stacks,&new_stk->link);
+        w->stack_stats.active++;
+        w->stack_stats.active_bytes += size;
         /*
-         * Grow stack; dthr_topmost_stack is updated
+         * Grow stack; w->topmost_stack is updated
          * as a side effect.
          */
         DBOUT(("p_t_l: dropping new thread queue lock\n"));
-        dthr_semaphore_drop_no_yield(&dthr_newq_sema);
+        dthr_semaphore_drop_no_yield(&w->newq_sema);
         DBOUT(("p_t_l: growing stack\n"));
         DBOUT(("p_t_l.save_ctxt(%p) [cont]\n",(void *) &continuation));
         if (!dthr_save_ctxt(&continuation))
-          dthr_new_topmost_thread(new_stk,new_th->stack_size,1,&continuation);
-        for (;;) {
-          /* base, allowing for stack reuse */
-          DBOUT(("p_t_l.dthr_save_ctxt(%p) [base]\n",(void *) &new_stk->base));
-          (void) dthr_save_ctxt(&new_stk->base);
-
-          /* launch the thread */
-          new_th = new_stk->thread;
-          dthr_cur_thread = new_th;
-#if MAGIC_TEST
-          if (new_th->magic != DREAD_THREAD_TH_MAGIC) {
-            fprintf(stderr,
-                    "dthr_thread:  thread structure corruption detected"
-                    " in dthr_thread_launcher(), base launch\n");
-            abort();
-          }
-#endif
-          new_th->exit_value = (*new_th->fn)(new_th->fn_arg);
-
-          while ((x = new_th->on_exit) != 0) {
-            new_th->on_exit = x->next;
-            (*x->fn)(new_th,x->arg);
-            free(x);
-          }
-
-          DBOUT(("p_t_l: thread %p exited\n",(void *) dthr_cur_thread));
-          /* same as dthr_thread_exit here */
-          new_th->state = DREAD_THREAD_TH_EXITED;
-
-          dthr_thread_sleep(1);
-          fprintf(stderr,"dthr_thread_launcher: exited thread still runs\n");
-          abort();
-        }
+          dthr_new_topmost_thread(new_stk,size,1,&continuation);
+        /* base, allowing for stack reuse */
+        DBOUT(("p_t_l.dthr_save_ctxt(%p) [base]\n",(void *) &new_stk->base));
+        (void) dthr_save_ctxt(&new_stk->base);
+
+        /* launch the thread */
+        dthr_run_thread(new_stk);
       }
     }
     /*
      * wait for more threads to launch
      */
     DBOUT(("p_t_l: waiting for a new thread to launch\n"));
-    dthr_event_wait(&dthr_newq_event,&dthr_newq_sema);
+    dthr_event_wait(&w->newq_event,&w->newq_sema);
     DBOUT(("p_t_l: event wait returned\n"));
   }
 }
@@ -900,20 +3313,64 @@ static void dthr_thread_launcher(void)
  * be at least one runnable thread when the process
  * goes multithreaded.
  */
+static void *dthr_worker_main(void *arg)
+{
+  struct dthr_worker  *w = (struct dthr_worker *) arg;
+
+  dthr_cur_worker = w;
+  dthr_cur_thread = &w->topmost_thread;
+  dthr_set_stack_limit(w,dthr_worker_stack_size);
+  DBOUT(("dthr_worker_main(%d) -> launch\n",w->id));
+  if (!dthr_save_ctxt(&w->deadlock))
+    dthr_thread_launcher();
+  return 0;
+}
+
 void  dthr_thread_multithread(struct dthr_thread  *th)
 {
+  struct dthr_worker  *w = &dthr_worker0;
+  pthread_attr_t      attr;
+  int                 i;
+#if defined(RLIMIT_STACK)
+  struct rlimit       rl;
+#endif
+
   DBOUT(("dthr_thread_multithread\n"));
 
   dthr_show_queues();
 
   /* no need to lock it yet, since we are only thread running */
-  dthr_chain_enqueue(&dthr_newq,&th->link);
-  dthr_cur_thread = &dthr_topmost_thread;
+  dthr_chain_enqueue(&w->newq,&th->link);
+  w->newq_len++;
+  dthr_cur_thread = &w->topmost_thread;
+#if defined(RLIMIT_STACK)
+  /* an unlimited stack can grow as far as it likes */
+  if (getrlimit(RLIMIT_STACK,&rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+    dthr_set_stack_limit(w,rl.rlim_cur);
+#endif
+  dthr_idle_workers = 0;
+  dthr_done = 0;
+
+  if (dthr_nworkers > 1) {
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr,dthr_worker_stack_size);
+    for (i = 1; i < dthr_nworkers; i++) {
+      if (pthread_create(&dthr_workers[i]->pthread,&attr,
+                         dthr_worker_main,dthr_workers[i])) {
+        perror("dthr_thread_multithread");
+        abort();
+      }
+    }
+    pthread_attr_destroy(&attr);
+  }
 
   dthr_show_queues();
   DBOUT(("dthr_thread_multithread -> launch\n"));
-  if (!dthr_save_ctxt(&dthr_deadlock))
+  if (!dthr_save_ctxt(&w->deadlock))
     dthr_thread_launcher();
+
+  for (i = 1; i < dthr_nworkers; i++)
+    pthread_join(dthr_workers[i]->pthread,0);
 }
 
 
@@ -931,42 +3388,42 @@ static void dthr_csw(struct dthr_stack  *target, int  op)
 
   dthr_show_queues();
   DBOUT(("dthr_csw(%p,%d)\n",(void *) target,op));
-  this_stack = dthr_cur_thread->stack;
-  DBOUT((" old stack = %p\n",(void *) this_stack));
-  if (!this_stack) {
-    fprintf(stderr,"dthr_csw:  no current stack\n");
-    abort();
-  }
+  DTHR_STATS_SWITCH(target->worker,target->thread);
   if (op == DREAD_THREAD_CSW_EXIT) {
+    /* dthr_thread_sleep already gave the stack back */
     DBOUT((" leaving exited thread\n"));
-
-    dthr_cur_thread->stack = 0;
-
-    memset(&this_stack->regs,0,sizeof this_stack->regs);
-    dthr_show_queues();
-    (void) dthr_chain_delete(&this_stack->link);
-    dthr_show_queues();
-    dthr_chain_enqueue(&dthr_free_stacks,&this_stack->link);
-    dthr_show_queues();
-
-    dthr_cur_thread->fn = 0;
-    dthr_cur_thread->fn_arg = 0;
-    dthr_cur_thread->stack_size = 0;
-
     DBOUT(("dthr_csw.long(%p,DREAD_THREAD_CSW_NORM)\n",(void *) &target->regs));
     dthr_load_ctxt(&target->regs,DREAD_THREAD_CSW_NORM);
     fprintf(stderr,"dthr_csw:  exit load context returned\n");
     abort();
   }
 
+  this_stack = dthr_cur_thread->stack;
+  DBOUT((" old stack = %p\n",(void *) this_stack));
+  if (!this_stack) {
+    fprintf(stderr,"dthr_csw:  no current stack\n");
+    abort();
+  }
+  if (target == this_stack) {
+    /* woken by another worker before we got around to sleeping */
+    DBOUT((" switch to self\n"));
+    return;
+  }
+
+#if defined(DREAD_THREAD_MD_SWAP)
+  DBOUT(("dthr_csw.swap_ctxt(%p,%p,%d)\n",
+         (void *) &this_stack->regs,(void *) &target->regs,op));
+  rv = dthr_swap_ctxt(&this_stack->regs,&target->regs,op);
+#else
   DBOUT(("dthr_csw.save_ctxt(%p)\n",(void *) &this_stack->regs));
-  switch (rv = dthr_save_ctxt(&this_stack->regs)) {
-  case DREAD_THREAD_CSW_CSW:
+  if ((rv = dthr_save_ctxt(&this_stack->regs)) == DREAD_THREAD_CSW_CSW) {
     DBOUT(("dthr_csw.load_ctxt(%p,%d)\n",(void *) &target->regs,op));
     dthr_load_ctxt(&target->regs,op);
     fprintf(stderr,"dthr_csw:  csw failed\n");
     abort();
-    break;
+  }
+#endif
+  switch (rv) {
   case DREAD_THREAD_CSW_CREATE:
     if (magic != DREAD_THREAD_MAGIC) {
       fprintf(stderr,
@@ -974,7 +3431,8 @@ static void dthr_csw(struct dthr_stack  *target, int  op)
               (void *) dthr_cur_thread);
       abort();
     }
-    if ((dthr_cur_thread = this_stack->thread) != &dthr_topmost_thread) {
+    if ((dthr_cur_thread = this_stack->thread)
+        != &this_stack->worker->topmost_thread) {
       fprintf(stderr,"dthr_csw:  create csw, am not topmost\n");
       abort();
     }
@@ -996,6 +3454,104 @@ static void dthr_csw(struct dthr_stack  *target, int  op)
   }
 }
 
+#if defined(DREAD_THREAD_MD_SWAP)
+/*
+ * Context save/load/swap for dreadthread_ctxt.h.  dthr_md_save returns 0
+ * and dthr_md_load(regs,val) makes it return again with val.
+ * dthr_md_swap(save,load,val) saves into save and loads load in one go;
+ * it returns whatever value save is later loaded with.  Contexts from
+ * either are interchangeable.
+ */
+# if __x86_64__
+#  define DTHR_MD_SAVE(r) \
+  "  movq %rbx,0(" r ")\n" \
+  "  movq %rbp,8(" r ")\n" \
+  "  movq %r12,16(" r ")\n" \
+  "  movq %r13,24(" r ")\n" \
+  "  movq %r14,32(" r ")\n" \
+  "  movq %r15,40(" r ")\n" \
+  "  leaq 8(%rsp),%rcx\n" \
+  "  movq %rcx,48(" r ")\n" \
+  "  movq (%rsp),%rcx\n" \
+  "  movq %rcx,56(" r ")\n"
+#  define DTHR_MD_LOAD(r,val) \
+  "  movq 0(" r "),%rbx\n" \
+  "  movq 8(" r "),%rbp\n" \
+  "  movq 16(" r "),%r12\n" \
+  "  movq 24(" r "),%r13\n" \
+  "  movq 32(" r "),%r14\n" \
+  "  movq 40(" r "),%r15\n" \
+  "  movq 48(" r "),%rsp\n" \
+  "  movl " val ",%eax\n" \
+  "  jmpq *56(" r ")\n"
+#  define DTHR_MD_SAVE_FN  DTHR_MD_SAVE("%rdi") "  xorl %eax,%eax\n  ret\n"
+#  define DTHR_MD_LOAD_FN  DTHR_MD_LOAD("%rdi","%esi")
+#  define DTHR_MD_SWAP_FN  DTHR_MD_SAVE("%rdi") DTHR_MD_LOAD("%rsi","%edx")
+# elif __i386__
+#  define DTHR_MD_SAVE \
+  "  movl %ebx,0(%ecx)\n" \
+  "  movl %esi,4(%ecx)\n" \
+  "  movl %edi,8(%ecx)\n" \
+  "  movl %ebp,12(%ecx)\n" \
+  "  leal 4(%esp),%edx\n" \
+  "  movl %edx,16(%ecx)\n" \
+  "  movl (%esp),%edx\n" \
+  "  movl %edx,20(%ecx)\n"
+#  define DTHR_MD_LOAD \
+  "  movl 0(%ecx),%ebx\n" \
+  "  movl 4(%ecx),%esi\n" \
+  "  movl 8(%ecx),%edi\n" \
+  "  movl 12(%ecx),%ebp\n" \
+  "  movl 16(%ecx),%esp\n" \
+  "  jmp *20(%ecx)\n"
+#  define DTHR_MD_SAVE_FN \
+  "  movl 4(%esp),%ecx\n" DTHR_MD_SAVE "  xorl %eax,%eax\n  ret\n"
+#  define DTHR_MD_LOAD_FN \
+  "  movl 4(%esp),%ecx\n  movl 8(%esp),%eax\n" DTHR_MD_LOAD
+#  define DTHR_MD_SWAP_FN \
+  "  movl 4(%esp),%ecx\n" DTHR_MD_SAVE \
+  "  movl 8(%esp),%ecx\n  movl 12(%esp),%eax\n" DTHR_MD_LOAD
+# elif __arm__
+#  if defined(__ARM_PCS_VFP) || (defined(__VFP_FP__) && !defined(__SOFTFP__))
+#   define DTHR_MD_SAVE_VFP(r)  "  add r3," r ",#40\n  vstmia r3,{d8-d15}\n"
+#   define DTHR_MD_LOAD_VFP(r)  "  add r3," r ",#40\n  vldmia r3,{d8-d15}\n"
+#  else
+#   define DTHR_MD_SAVE_VFP(r)  ""
+#   define DTHR_MD_LOAD_VFP(r)  ""
+#  endif
+#  define DTHR_MD_SAVE(r) \
+  "  mov ip,sp\n" \
+  "  stmia " r ",{r4-r11,ip,lr}\n" DTHR_MD_SAVE_VFP(r)
+#  define DTHR_MD_LOAD(r,val) \
+  DTHR_MD_LOAD_VFP(r) \
+  "  ldmia " r ",{r4-r11,ip,lr}\n" \
+  "  mov sp,ip\n" \
+  "  mov r0," val "\n" \
+  "  bx lr\n"
+#  define DTHR_MD_SAVE_FN  DTHR_MD_SAVE("r0") "  mov r0,#0\n  bx lr\n"
+#  define DTHR_MD_LOAD_FN  DTHR_MD_LOAD("r0","r1")
+#  define DTHR_MD_SWAP_FN  DTHR_MD_SAVE("r0") DTHR_MD_LOAD("r1","r2")
+# endif
+
+# if __arm__
+#  define DTHR_MD_FN_START(name) \
+  "  .globl " name "\n  .type " name ",%function\n  .align 2\n  .arm\n" \
+  name ":\n"
+# else
+#  define DTHR_MD_FN_START(name) \
+  "  .globl " name "\n  .type " name ",@function\n  .p2align 4\n" name ":\n"
+# endif
+# define DTHR_MD_FN_END(name)  "  .size " name ",.-" name "\n"
+
+__asm__("  .text\n"
+        DTHR_MD_FN_START("dthr_md_save") DTHR_MD_SAVE_FN
+        DTHR_MD_FN_END("dthr_md_save")
+        DTHR_MD_FN_START("dthr_md_load") DTHR_MD_LOAD_FN
+        DTHR_MD_FN_END("dthr_md_load")
+        DTHR_MD_FN_START("dthr_md_swap") DTHR_MD_SWAP_FN
+        DTHR_MD_FN_END("dthr_md_swap"));
+#endif
+
 /*
  * A simpler, higher level threads interface:  one function,
  * DThr_Thread_Run, which queues threads to be run before going
@@ -1012,44 +3568,19 @@ static void dthr_csw(struct dthr_stack  *target, int  op)
 
 static struct dthr_thread     *dthr_thread_q = 0;
 static int                    DThr_Thread_State = 0;
-static struct dthr_semaphore  to_be_freed_sema, numDThr_Threads;
-static struct dthr_event      to_be_freed_ev;
-static struct dthr_thread     *to_be_freed = 0;
 
 /*
- * Things break horribly if we yield here, since the malloc'ed thread
- * descriptor could get free'd prior to actually finishing up with
- * the thread.  In particular, we do not wish the reaper thread to
- * run until we have csw'd out of the exiting thread.
+ * Descriptors come from the worker's free list and go back on one as soon
+ * as the thread has left its stack (see dthr_thread_sleep), so there is
+ * no reaper and no on-exit record involved.
  */
-static void mark_of_death(struct dthr_thread *th, void *arg)
-{
-  DBOUT(("thread %p, going to the guillotine\n", (void *) th));
-  dthr_semaphore_take_no_yield(&to_be_freed_sema);
-  th->data = (void *) to_be_freed;
-  to_be_freed = th;
-  dthr_semaphore_drop_no_yield(&to_be_freed_sema);
-  dthr_event_signal_no_yield(&to_be_freed_ev);
-}
-
-static void reaper(void)
+static void dthr_task_init(struct dthr_thread *th,
+                           void               *(*fn)(void *),
+                           void               *fn_arg,
+                           size_t             req_stack_size)
 {
-  struct dthr_thread  *th;
-
-  dthr_semaphore_take(&to_be_freed_sema);
-  for (;;) {
-    while ((th = to_be_freed) != 0) {
-      to_be_freed = (struct dthr_thread *) th->data;
-      DBOUT(("Grim reaper:  got thread %p\n",(void *) th));
-      free(th);
-      dthr_semaphore_drop(&numDThr_Threads);
-    }
-    if (!dthr_semaphore_try(&numDThr_Threads)) break; /* thread exits */
-    DBOUT(("reaper event wait\n"));
-    dthr_event_wait(&to_be_freed_ev,&to_be_freed_sema);
-    DBOUT(("reaper event occurred\n"));
-  }
-  dthr_semaphore_drop(&to_be_freed_sema);
+  (void) dthr_thread_init(th,fn,fn_arg,req_stack_size);
+  th->flags |= DREAD_THREAD_TH_POOLED;
 }
 
 static void *DThr_MultiThread(void *arg)
@@ -1059,17 +3590,9 @@ static void *DThr_MultiThread(void *arg)
   DBOUT(("Entered DThr_MultiThread\n"));
   while ((th = dthr_thread_q) != 0) {
     dthr_thread_q = (struct dthr_thread *) th->data;
-    dthr_thread_init(th,th->fn,th->fn_arg,th->stack_size);
-    if (!dthr_thread_on_exit(th,mark_of_death,0)) {
-      perror("DThr_Thread");
-      fprintf(stderr,
-              "DThr_Thread:  startup failure while setting up on-exit fn\n");
-      abort();
-    }
+    dthr_task_init(th,th->fn,th->fn_arg,th->stack_size);
     (void) dthr_thread_run(th);
-    (void) dthr_thread_detach(th);
   }
-  reaper();
   DBOUT(("Leaving DThr_MultiThread\n"));
   return 0;
 }
@@ -1084,9 +3607,6 @@ int DThr_Thread_Run(void    *(*fn)(void *),
   switch (DThr_Thread_State) {
   case 0:
     dthr_init();
-    (void) dthr_semaphore_init(&to_be_freed_sema,0);
-    (void) dthr_semaphore_init(&numDThr_Threads,0);
-    (void) dthr_event_init(&to_be_freed_ev);
     DThr_Thread_State = 1;
     /* fall thru */
   case 1:
@@ -1097,8 +3617,7 @@ int DThr_Thread_Run(void    *(*fn)(void *),
       dthr_thread_multithread(&main_th);
       return 1;
     }
-    th = (struct dthr_thread *) malloc(sizeof *th);
-    if (!th) return 0;
+    if (!(th = dthr_task_alloc())) return 0;
     th->fn = fn;
     th->fn_arg = fn_arg;
     th->stack_size = req_stack_size;
@@ -1106,27 +3625,13 @@ int DThr_Thread_Run(void    *(*fn)(void *),
     th->data = (void *) dthr_thread_q;
     dthr_thread_q = th;
 
-    dthr_semaphore_drop(&numDThr_Threads);
-
     DBOUT(("Leaving DThr_Thread_Run\n"));
     return 1;
   case 2:
-    th = (struct dthr_thread *) malloc(sizeof *th);
-    if (!th) return 0;
-    th->fn = fn;
-    th->fn_arg = fn_arg;
-    th->stack_size = req_stack_size;
-
-    dthr_semaphore_drop(&numDThr_Threads);
-
-    if (!dthr_thread_on_exit(th,mark_of_death,0)) {
-      perror("DThr_Thread");
-      fprintf(stderr,
-              "DThr_Thread:  runtime failure while setting up on-exit fn\n");
-      abort();
-    }
+    if (!(th = dthr_task_alloc())) return 0;
+    dthr_task_init(th,fn,fn_arg,req_stack_size);
+    /* th may be recycled as soon as this returns */
     (void) dthr_thread_run(th);
-    (void) dthr_thread_detach(th);
 
     DBOUT(("Leaving DThr_Thread_Run\n"));
     return 1;
@@ -1134,3 +3639,35 @@ int DThr_Thread_Run(void    *(*fn)(void *),
   /* NOTREACHED -- make lint happy */
   return 1;
 }
+
+/*
+ * DThr_Thread_Run(fn,fn_args[i],req_stack_size) for each of n arguments,
+ * but once multithreaded the whole batch is queued in one go.  Returns
+ * how many threads were queued, which is fewer than n only if we ran out
+ * of memory.
+ */
+int DThr_Thread_Run_Batch(void    *(*fn)(void *),
+                          void    **fn_args,
+                          int     n,
+                          size_t  req_stack_size)
+{
+  struct dthr_chain   batch;
+  struct dthr_thread  *th;
+  int                 i;
+
+  DBOUT(("Entered DThr_Thread_Run_Batch(%d)\n",n));
+  if (DThr_Thread_State != 2) {
+    for (i = 0; i < n; i++)
+      if (!DThr_Thread_Run(fn,fn_args[i],req_stack_size)) break;
+    return i;
+  }
+  (void) dthr_chain_init(&batch);
+  for (i = 0; i < n; i++) {
+    if (!(th = dthr_task_alloc())) break;
+    dthr_task_init(th,fn,fn_args[i],req_stack_size);
+    dthr_chain_enqueue(&batch,&th->link);
+  }
+  if (i > 0) dthr_thread_run_chain(&batch,i);
+  DBOUT(("Leaving DThr_Thread_Run_Batch\n"));
+  return i;
+}
@@ -56,6 +56,35 @@
 #include <errno.h>
 #include <unistd.h>
 
+/*
+ * Threads can wait for file descriptors wherever there is a poll(2).  NaCl
+ * only has one with nacl_io, so it has to be asked for there.
+ */
+#if !defined(DREAD_THREAD_POLL)
+# if defined(__native_client__)
+#  define DREAD_THREAD_POLL 0
+# else
+#  define DREAD_THREAD_POLL 1
+# endif
+#endif
+#if DREAD_THREAD_POLL
+# include <poll.h>
+# include <sys/socket.h>
+#endif
+
+/*
+ * Scheduler counters, per-thread CPU time, a wait-for dump on deadlock
+ * and a trace of who ran when.  Off unless asked for, in which case the
+ * library and everything using it must be built with the same setting
+ * since it adds to the structures below.
+ */
+#if !defined(DREAD_THREAD_STATS)
+# define DREAD_THREAD_STATS 0
+#endif
+#if DREAD_THREAD_STATS
+# include <stdio.h>
+#endif
+
 #define DREAD_THREAD_MAGIC    0x31415926ul
   /* for stack corruption test dthr_csw */
 #define DREAD_THREAD_MAGIC2   0x27182818ul
@@ -67,6 +96,13 @@
  * providing a very generous value here, building stack_est, and see what
  * it outputs.  Beware of limit stacksize / ulimit -s.
  */
+#define DREAD_THREAD_STACK_AUTO   0
+/*
+ * A requested stack size of DREAD_THREAD_STACK_AUTO sizes the stack from
+ * what earlier threads with the same entry function used; until one has
+ * exited they get DREAD_THREAD_STACK_AUTO_FIRST bytes.
+ */
+#define DREAD_THREAD_STACK_AUTO_FIRST (64 * 1024)
 
 /*
  * Private data.
@@ -89,15 +125,45 @@ struct dthr_stack {
   caddr_t             stack_base,   /* approximate */
                       stack_top;
   struct dthr_thread  *thread;
+  struct dthr_worker  *worker;  /* OS thread whose stack this was cut from */
+  int                 size_class;
+  caddr_t             map_base; /* 0 unless mmap'ed, guard page included */
+  size_t              map_size;
+  caddr_t             painted;  /* paint intact beyond this, or 0 */
   dthr_ctxt_t         regs,     /* user thread regs */
                       base;     /* stack reuse */
 };
 
+/*
+ * Stack memory accounting, see dthr_get_stack_stats.
+ */
+struct dthr_stack_stats {
+  unsigned long active, cached;           /* stacks in use / on free lists */
+  size_t        active_bytes, cached_bytes;
+  size_t        mapped_bytes;             /* mmap'ed part of both */
+};
+
+/*
+ * Stack high-water marks of exited threads, per entry function, see
+ * dthr_get_stack_usage.  auto_size is what DREAD_THREAD_STACK_AUTO asks
+ * for now.
+ */
+struct dthr_stack_usage {
+  void          *(*fn)(void *);
+  unsigned long threads;                  /* exits measured */
+  unsigned long overflows;                /* went past their stack_size */
+  size_t        max_used, mean_used;
+  size_t        auto_size;
+};
+
 struct dthr_semaphore {
   unsigned long     magic;
 #define DREAD_THREAD_SEMA_MAGIC   0x68657265ul
   int               value;      /* binary for lock */
   struct dthr_chain threadq;
+#if DREAD_THREAD_STATS
+  struct dthr_thread *holder;   /* last to take it */
+#endif
 };
 
 struct dthr_event {
@@ -106,6 +172,42 @@ struct dthr_event {
   struct dthr_chain threadq;
 };
 
+/*
+ * A channel carries elements of elem_size bytes from senders to
+ * receivers in order.  capacity bounds how many may be buffered; with 0
+ * every send waits for a receiver, and DREAD_THREAD_CHAN_UNBOUNDED lets
+ * the buffer grow as needed.
+ */
+struct dthr_chan {
+  unsigned long     magic;
+#define DREAD_THREAD_CHAN_MAGIC   0x6368616eul
+  size_t            elem_size;
+  long              capacity;
+#define DREAD_THREAD_CHAN_UNBOUNDED (-1)
+  char              *buf;       /* ring of nslots elements */
+  size_t            nslots, head, len;
+  int               closed;
+  struct dthr_chain recvq, sendq;
+};
+/*
+ * One of the operations handed to dthr_chan_select.  The caller fills in
+ * chan, dir and elem; ok is set to 0 if the operation completed because
+ * the channel was closed.
+ */
+struct dthr_chan_sel;
+struct dthr_chan_op {
+  /* Private stuff */
+  struct dthr_chain     link;   /* on the channel's recvq or sendq */
+  struct dthr_chan_sel  *sel;
+  int                   index;
+  /* Public stuff */
+  struct dthr_chan      *chan;
+  int                   dir;
+#define DREAD_THREAD_CHAN_RECV  0
+#define DREAD_THREAD_CHAN_SEND  1
+  void                  *elem;
+  int                   ok;
+};
 struct dthr_thread_exit {
   struct dthr_thread_exit *next;
   void                    (*fn)(struct dthr_thread *,void *);
@@ -125,10 +227,24 @@ struct dthr_thread {
 #define   DREAD_THREAD_TH_RUNNABLE  0
 #define   DREAD_THREAD_TH_SEMA_WAIT 1
 #define   DREAD_THREAD_TH_EVENT_WAIT  2
+#define   DREAD_THREAD_TH_IO_WAIT   3
+#define   DREAD_THREAD_TH_SLEEP     4
+#define   DREAD_THREAD_TH_CHAN_WAIT 5
   struct dthr_stack       *stack;
   struct dthr_semaphore   exit_sema;
   struct dthr_thread_exit *on_exit;
-  jmp_buf                 io_timeout;
+  long                    io_timeout;   /* ms, < 0 for none */
+  int                     flags;
+#define   DREAD_THREAD_TH_POOLED    1   /* recycled once it exits */
+#define   DREAD_THREAD_TH_AUTO_STACK  2 /* DREAD_THREAD_STACK_AUTO */
+  size_t                  stack_used;   /* high-water mark, once exited */
+#if DREAD_THREAD_STATS
+  void                    *wait_obj;    /* semaphore or event blocked on */
+  long long               run_ns;       /* time spent running */
+  long long               ready_ns;     /* when it became runnable, or 0 */
+  struct dthr_thread      *all_next,    /* started and not yet exited */
+                          *all_prev;
+#endif
   /* Public stuff */
   void                    *exit_value;
   void                    *data;
@@ -143,7 +259,26 @@ struct dthr_thread {
    */
 };
 
-extern struct dthr_thread *dthr_cur_thread;
+/*
+ * Scheduler counters, summed over all workers by dthr_get_sched_stats.
+ * Latency is the time from becoming runnable to running.
+ */
+struct dthr_sched_stats {
+  unsigned long       switches;
+  unsigned long       runnable, runnable_max;   /* run queue length */
+  unsigned long       sema_waits;               /* takes that blocked */
+  unsigned long long  sema_wait_ns, sema_wait_max_ns;
+  unsigned long       latency_samples;
+  unsigned long long  latency_ns, latency_max_ns;
+};
+
+/*
+ * Each worker OS thread has its own current thread.
+ */
+#if !defined(DREAD_THREAD_TLS)
+# define DREAD_THREAD_TLS  __thread
+#endif
+extern DREAD_THREAD_TLS struct dthr_thread *dthr_cur_thread;
 struct dthr_thread *dthr_this_thread(void);
 /* signal handlers? who needs it? */
 void  dthr_thread_yield(void);
@@ -152,9 +287,13 @@ struct dthr_semaphore *dthr_semaphore_init(struct dthr_semaphore  *sema,
 int dthr_semaphore_try(struct dthr_semaphore  *sema);
 void  dthr_semaphore_take(struct dthr_semaphore *sema);
 void  dthr_semaphore_drop(struct dthr_semaphore *sema);
+int dthr_semaphore_take_timed(struct dthr_semaphore *sema, long timeout_ms);
 
 void  dthr_event_wait(struct dthr_event     *event,
                       struct dthr_semaphore *lock);
+int dthr_event_wait_timed(struct dthr_event     *event,
+                          struct dthr_semaphore *lock,
+                          long                  timeout_ms);
 void  dthr_event_broadcast_no_yield(struct dthr_event *event);
 void  dthr_event_broadcast(struct dthr_event *event);
 void  dthr_event_signal_no_yield(struct dthr_event *event);
@@ -163,7 +302,15 @@ void  dthr_event_signal(struct dthr_event *event);
 struct dthr_event *dthr_event_init(struct dthr_event *ev);
 
 void  dthr_init(void);
+int dthr_set_concurrency(int nworkers, size_t worker_stack_size);
+int dthr_set_stack_mmap(int on);
+void  dthr_get_stack_stats(struct dthr_stack_stats *stats);
+void  dthr_trim_stacks(void);
+void  dthr_set_stack_tracking(int on);
+size_t  dthr_thread_stack_used(struct dthr_thread *th);
+int dthr_get_stack_usage(struct dthr_stack_usage *usage, int n);
 void  dthr_thread_exit(void *status);
+void  dthr_sleep(long ms);
 struct dthr_thread  *dthr_thread_init(struct dthr_thread  *th,
                                       void                *(*fn)(void *),
                                       void                *fn_arg,
@@ -178,9 +325,54 @@ struct dthr_thread  *dthr_thread_detach(struct dthr_thread *th);
 
 void  dthr_thread_multithread(struct dthr_thread  *th);
 
+struct dthr_chan *dthr_chan_init(struct dthr_chan  *ch,
+                                 size_t            elem_size,
+                                 long              capacity);
+void  dthr_chan_destroy(struct dthr_chan *ch);
+int dthr_chan_send(struct dthr_chan *ch, const void *elem);
+int dthr_chan_recv(struct dthr_chan *ch, void *elem);
+int dthr_chan_try_send(struct dthr_chan *ch, const void *elem);
+int dthr_chan_try_recv(struct dthr_chan *ch, void *elem);
+void  dthr_chan_close(struct dthr_chan *ch);
+int dthr_chan_select(struct dthr_chan_op *ops, int n, long timeout_ms);
+/*
+ * DREAD_THREAD_CHAN_TYPE(name,type) declares name_init, name_send and
+ * name_recv for channels of type, so that the compiler checks what goes
+ * in and comes out.
+ */
+#define DREAD_THREAD_CHAN_TYPE(name,type) \
+  static inline struct dthr_chan *name##_init(struct dthr_chan *ch, \
+                                              long capacity) \
+  { return dthr_chan_init(ch,sizeof (type),capacity); } \
+  static inline int name##_send(struct dthr_chan *ch, type v) \
+  { return dthr_chan_send(ch,&v); } \
+  static inline int name##_recv(struct dthr_chan *ch, type *v) \
+  { return dthr_chan_recv(ch,v); }
+#if DREAD_THREAD_POLL
+int dthr_io_wait(int fd, int events, long timeout_ms);
+void  dthr_set_io_timeout(long timeout_ms);
+int dthr_io_nonblock(int fd);
+ssize_t dthr_read(int fd, void *buf, size_t nbytes);
+ssize_t dthr_write(int fd, const void *buf, size_t nbytes);
+int dthr_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int dthr_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+#endif
+
+#if DREAD_THREAD_STATS
+void  dthr_get_sched_stats(struct dthr_sched_stats *stats);
+long long dthr_thread_run_ns(struct dthr_thread *th);
+int dthr_dump_threads(FILE *fp);
+void  dthr_trace_start(unsigned long nevents);
+void  dthr_trace_stop(void);
+int dthr_trace_write(FILE *fp);
+#endif
 int DThr_Thread_Run(void    *(*fn)(void *),
                     void    *fn_arg,
                     size_t  req_stack_size);
+int DThr_Thread_Run_Batch(void    *(*fn)(void *),
+                          void    **fn_args,
+                          int     n,
+                          size_t  req_stack_size);
 
 extern int  (*dthr_on_deadlock)();
 
@@ -5,7 +5,34 @@
 
 #define DREAD_THREAD_CTXT_MAGIC   1
 
-#if i386 || sparc || __x86_64__ || __x86_32__ || __native_client__
+/*
+ * A cooperative switch only has to preserve what a called function
+ * would: the callee-saved registers, the stack pointer and the return
+ * address.  For gcc on x86-64, i386 and ARM outside NaCl, dread.c has
+ * assembly that saves exactly that, skipping the signal mask and pointer
+ * mangling some libcs' setjmp does, plus a swap that saves one context
+ * and loads another in a single call.  Define DREAD_THREAD_USE_SETJMP to
+ * get the portable setjmp/longjmp version instead.
+ */
+#if defined(__GNUC__) && !defined(__native_client__) \
+    && !defined(DREAD_THREAD_USE_SETJMP) \
+    && (__x86_64__ || __i386__ || __arm__)
+# if __x86_64__
+#  define DREAD_THREAD_MD_NREGS  8   /* rbx rbp r12-r15 rsp rip */
+# elif __i386__
+#  define DREAD_THREAD_MD_NREGS  6   /* ebx esi edi ebp esp eip */
+# else
+#  define DREAD_THREAD_MD_NREGS  26  /* r4-r11 sp lr, d8-d15 */
+# endif
+typedef void  *dthr_md_regs_t[DREAD_THREAD_MD_NREGS];
+int   dthr_md_save(dthr_md_regs_t regs) __attribute__((returns_twice));
+void  dthr_md_load(dthr_md_regs_t regs, int val) __attribute__((noreturn));
+int   dthr_md_swap(dthr_md_regs_t save, dthr_md_regs_t load, int val);
+# define DREAD_THREAD_MD_SAVE(regs)         dthr_md_save((regs)->r)
+# define DREAD_THREAD_MD_LOAD(regs,val)     dthr_md_load((regs)->r,val)
+# define DREAD_THREAD_MD_SWAP(from,to,val)  \
+  dthr_md_swap((from)->r,(to)->r,val)
+#elif i386 || sparc || __x86_64__ || __x86_32__ || __native_client__
 # include <setjmp.h>
 # if  posix_signals
 #  define DREAD_THREAD_MD_SAVE(regs)   setjmp((regs)->r)
@@ -27,11 +54,45 @@
 # error "What kind of machine am I being compiled on?"
 #endif
 
+#if !defined(DREAD_THREAD_MD_SWAP)
+typedef jmp_buf dthr_md_regs_t;
+#endif
+
+/*
+ * DREAD_THREAD_MD_START(sp,fn) switches to the stack whose (suitably
+ * aligned) high end is sp and calls fn(), which must never return.  It is
+ * only needed for stacks that do not come out of the topmost thread's
+ * stack, and is left undefined where we cannot simply load the stack
+ * pointer -- including under NaCl, whose validator insists on sandboxed
+ * stack pointer updates and indirect calls.
+ */
+#if defined(__GNUC__) && !defined(__native_client__)
+# if __x86_64__
+#  define DREAD_THREAD_MD_START(sp,fn) do { \
+    __asm__ __volatile__("mov %0,%%rsp\n\tcall *%1" \
+                         : : "r" (sp), "r" (fn) : "memory"); \
+    __builtin_unreachable(); \
+  } while (0)
+# elif i386 || __i386__
+#  define DREAD_THREAD_MD_START(sp,fn) do { \
+    __asm__ __volatile__("mov %0,%%esp\n\tcall *%1" \
+                         : : "r" (sp), "r" (fn) : "memory"); \
+    __builtin_unreachable(); \
+  } while (0)
+# elif __arm__
+#  define DREAD_THREAD_MD_START(sp,fn) do { \
+    __asm__ __volatile__("mov sp,%0\n\tblx %1" \
+                         : : "r" (sp), "r" (fn) : "memory"); \
+    __builtin_unreachable(); \
+  } while (0)
+# endif
+#endif
+
 #if DREAD_THREAD_CTXT_MAGIC
 typedef struct {
   unsigned long magic1;
 # define  DREAD_THREAD_CTXT_MAGIC_1 0x38127483ul
-  jmp_buf   r;
+  dthr_md_regs_t  r;
   unsigned long magic2;
 # define  DREAD_THREAD_CTXT_MAGIC_2 0xc843fa73ul
 } dthr_ctxt_t;
@@ -49,14 +110,27 @@ typedef struct {
     } \
     DREAD_THREAD_MD_LOAD((regs),val); \
   } while (0)
+# if defined(DREAD_THREAD_MD_SWAP)
+#  define dthr_swap_ctxt(from,to,val) \
+  (((to)->magic1 != DREAD_THREAD_CTXT_MAGIC_1 || \
+    (to)->magic2 != DREAD_THREAD_CTXT_MAGIC_2) ? \
+   (fprintf(stderr,"dthr_swap_ctxt detected context corruption\n"), \
+    abort(), 0) : \
+   ((from)->magic1 = DREAD_THREAD_CTXT_MAGIC_1, \
+    (from)->magic2 = DREAD_THREAD_CTXT_MAGIC_2, \
+    DREAD_THREAD_MD_SWAP((from),(to),val)))
+# endif
 
 #else
 
 typedef struct {
-  jmp_buf   r;
+  dthr_md_regs_t  r;
 } dthr_ctxt_t;
 # define  dthr_save_ctxt(regs)      DREAD_THREAD_MD_SAVE((regs))
 # define  dthr_load_ctxt(regs,val)  DREAD_THREAD_MD_LOAD((regs),val)
+# if defined(DREAD_THREAD_MD_SWAP)
+#  define dthr_swap_ctxt(from,to,val) DREAD_THREAD_MD_SWAP((from),(to),val)
+# endif
 #endif
 
 #endif
@@ -124,8 +124,9 @@ void usage()
 int main(int ac, char **av)
 {
   int   opt;
-  int   i;
+  int   i, n;
   unsigned long offset;
+  struct dthr_stack_usage marks[8];
 
   if (!(me = rindex(*av,'/'))) me = *av;
   else ++me;
@@ -146,6 +147,8 @@ int main(int ac, char **av)
     exit(1);
   }
 
+  /* the library's own measurement, for comparison */
+  dthr_set_stack_tracking(1);
   for (i = 0; i < nthreads; i++) {
     priv[i].id = i;
     (void) DThr_Thread_Run(myThread,(void *) &priv[i],stacksize);
@@ -160,5 +163,11 @@ int main(int ac, char **av)
     offset = priv[i].stack_use;
     printf("%d: %lu 0x%08lx\n",i,offset,offset);
   }
+  n = dthr_get_stack_usage(marks,8);
+  for (i = 0; i < n && i < 8; i++)
+    printf("%s: high-water %lu max, %lu mean over %lu threads\n",
+           marks[i].fn == myThread ? "myThread" : "other",
+           (unsigned long) marks[i].max_used,
+           (unsigned long) marks[i].mean_used,marks[i].threads);
   return 0;
 }
@@ -0,0 +1,203 @@
+/*
+ * Copyright 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Timed waits: dthr_sleep accuracy, CPU use while every thread sleeps,
+ * and timeouts of dthr_semaphore_take_timed and dthr_event_wait_timed.
+ * Exits non-zero if anything is off by more than the tolerance.
+ *
+ *   test5 [-t nthreads] [-l maxms] [-e tolerancems] [-w workers]
+ *
+ * Sleeps are spread over 1..maxms; use an -l of over 16384 to get timers
+ * onto the third level of the wheel.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include "dreadthread.h"
+
+#define NTHREADS  200
+#define STACKSIZE (16 * 1024)
+#define MAXMS     2000
+#define TOLERANCE 20
+
+int                   nthreads = NTHREADS;
+long                  maxms = MAXMS;
+long                  tolerance = TOLERANCE;
+int                   nworkers = 1;
+int                   failures;
+char                  *me;
+
+struct dthr_thread    *th;
+long                  *late;
+struct dthr_semaphore sleepers_done;
+
+static double now_ms(void)
+{
+  struct timeval  tv;
+
+  gettimeofday(&tv,0);
+  return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+static double cpu_ms(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF,&ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e3
+      + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e3;
+}
+
+static void check(int ok, const char *what, double ms)
+{
+  printf("%-44s %8.1f ms  %s\n",what,ms,ok ? "ok" : "FAILED");
+  if (!ok) failures++;
+}
+
+void *sleeper(void *arg)
+{
+  int     i = (int) (long) arg;
+  long    ms = 1 + (long) i * (maxms - 1) / (nthreads > 1 ? nthreads - 1 : 1);
+  double  start = now_ms();
+
+  dthr_sleep(ms);
+  late[i] = (long) (now_ms() - start) - ms;
+  dthr_semaphore_drop(&sleepers_done);
+  return 0;
+}
+
+struct dthr_semaphore sema;
+struct dthr_semaphore ev_lock;
+struct dthr_event     ev;
+struct dthr_thread    helper;
+
+void *delayed_drop(void *unused)
+{
+  dthr_sleep(50);
+  dthr_semaphore_drop(&sema);
+  return 0;
+}
+
+void *delayed_signal(void *unused)
+{
+  dthr_sleep(50);
+  dthr_semaphore_take(&ev_lock);
+  dthr_event_signal_no_yield(&ev);
+  dthr_semaphore_drop(&ev_lock);
+  return 0;
+}
+
+void *root(void *unused)
+{
+  double  start, cpu, t;
+  long    worst = 0, early = 0;
+  int     i, rv;
+
+  /* sleep accuracy, and CPU time while nothing is runnable */
+  dthr_semaphore_init(&sleepers_done,0);
+  cpu = cpu_ms();
+  start = now_ms();
+  for (i = 0; i < nthreads; i++) {
+    dthr_thread_init(&th[i],sleeper,(void *) (long) i,STACKSIZE);
+    (void) dthr_thread_detach(dthr_thread_run(&th[i]));
+  }
+  for (i = 0; i < nthreads; i++)
+    dthr_semaphore_take(&sleepers_done);
+  t = now_ms() - start;
+  cpu = cpu_ms() - cpu;
+  for (i = 0; i < nthreads; i++) {
+    if (late[i] > worst) worst = late[i];
+    if (late[i] < early) early = late[i];
+  }
+  printf("%d sleepers over 1..%ld ms\n",nthreads,maxms);
+  check(early >= -1,"earliest wakeup (ms early)",(double) -early);
+  check(worst <= tolerance,"latest wakeup (ms late)",(double) worst);
+  check(cpu < 0.05 * t,"CPU time while sleeping",cpu);
+
+  /* semaphore timeout, then a drop before the timeout */
+  dthr_semaphore_init(&sema,0);
+  start = now_ms();
+  rv = dthr_semaphore_take_timed(&sema,100);
+  t = now_ms() - start;
+  check(!rv && t >= 99 && t <= 100 + tolerance,
+        "dthr_semaphore_take_timed(100), no drop",t);
+
+  dthr_thread_init(&helper,delayed_drop,0,STACKSIZE);
+  (void) dthr_thread_detach(dthr_thread_run(&helper));
+  start = now_ms();
+  rv = dthr_semaphore_take_timed(&sema,500);
+  t = now_ms() - start;
+  check(rv && t >= 49 && t <= 50 + tolerance,
+        "dthr_semaphore_take_timed(500), drop at 50",t);
+
+  /* event timeout, then a signal before the timeout */
+  dthr_semaphore_init(&ev_lock,1);
+  dthr_event_init(&ev);
+  dthr_semaphore_take(&ev_lock);
+  start = now_ms();
+  rv = dthr_event_wait_timed(&ev,&ev_lock,100);
+  t = now_ms() - start;
+  check(!rv && t >= 99 && t <= 100 + tolerance,
+        "dthr_event_wait_timed(100), no signal",t);
+
+  dthr_thread_init(&helper,delayed_signal,0,STACKSIZE);
+  (void) dthr_thread_detach(dthr_thread_run(&helper));
+  start = now_ms();
+  rv = dthr_event_wait_timed(&ev,&ev_lock,500);
+  t = now_ms() - start;
+  dthr_semaphore_drop(&ev_lock);
+  check(rv && t >= 49 && t <= 50 + tolerance,
+        "dthr_event_wait_timed(500), signal at 50",t);
+  return 0;
+}
+
+void usage()
+{
+  fprintf(stderr,
+          "Usage: %s [-t nthreads] [-l maxms] [-e tolerancems] [-w workers]\n",
+          me);
+}
+
+int main(int ac, char **av)
+{
+  struct dthr_thread  main_th;
+  int                 opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"e:l:t:w:")) != EOF) switch (opt) {
+  case 'e': tolerance = atol(optarg); break;
+  case 'l': maxms = atol(optarg);     break;
+  case 't': nthreads = atoi(optarg);  break;
+  case 'w': nworkers = atoi(optarg);  break;
+  default:  usage(); exit(1);
+  }
+
+  th = (struct dthr_thread *) malloc(nthreads * sizeof *th);
+  late = (long *) malloc(nthreads * sizeof *late);
+  if (!th || !late) {
+    perror(me);
+    exit(1);
+  }
+
+  dthr_init();
+  if (!dthr_set_concurrency(nworkers,0)) {
+    fprintf(stderr,"%s:  cannot use %d workers\n",me,nworkers);
+    exit(1);
+  }
+  dthr_thread_init(&main_th,root,0,STACKSIZE);
+  dthr_thread_multithread(&main_th);
+  if (failures) {
+    fprintf(stderr,"%s:  %d checks failed\n",me,failures);
+    return 1;
+  }
+  fprintf(stderr,"All threads exited, all done!\n");
+  return 0;
+}
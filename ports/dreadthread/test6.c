@@ -0,0 +1,237 @@
+/*
+ * Copyright 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Scheduler instrumentation: counters and per-thread run time for a
+ * semaphore ping-pong next to a thread that spins, the same again after
+ * dthr_init on more workers, then a lock-order deadlock on one worker
+ * whose wait-for dump must name both threads.  Needs the library and this
+ * file built with -DDREAD_THREAD_STATS=1, which the Makefile does.
+ *
+ *   test6 [-c rounds] [-w workers] [-o trace.json]
+ *
+ * The trace can be loaded into chrome://tracing or ui.perfetto.dev.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "dreadthread.h"
+
+#define STACKSIZE (16 * 1024)
+#define ROUNDS    10000
+#define SPIN_MS   20
+
+int                   rounds = ROUNDS;
+int                   nworkers = 1;
+char                  *trace_file;
+int                   failures;
+char                  *me;
+
+#if DREAD_THREAD_STATS
+static void check(int ok, const char *what, double val)
+{
+  printf("%-36s %12.1f  %s\n",what,val,ok ? "ok" : "FAILED");
+  if (!ok) failures++;
+}
+
+struct dthr_semaphore ping, pong, done;
+struct dthr_thread    pinger, ponger, spinner, locker_a, locker_b;
+volatile double       spin_sink;
+
+static double now_ms(void)
+{
+  struct timeval  tv;
+
+  gettimeofday(&tv,0);
+  return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+void *ping_fn(void *unused)
+{
+  int i;
+
+  for (i = 0; i < rounds; i++) {
+    dthr_semaphore_drop(&ping);
+    dthr_semaphore_take(&pong);
+  }
+  dthr_semaphore_drop(&done);
+  return 0;
+}
+
+void *pong_fn(void *unused)
+{
+  int i;
+
+  for (i = 0; i < rounds; i++) {
+    dthr_semaphore_take(&ping);
+    dthr_semaphore_drop(&pong);
+  }
+  dthr_semaphore_drop(&done);
+  return 0;
+}
+
+void *spin_fn(void *unused)
+{
+  double  end = now_ms() + SPIN_MS;
+  double  x = 1;
+
+  while (now_ms() < end)
+    x = x * 1.0000001 + 1e-9;
+  spin_sink = x;
+  dthr_semaphore_drop(&done);
+  return 0;
+}
+
+void *stats_root(void *unused)
+{
+  struct dthr_sched_stats st;
+  int                     i;
+
+  dthr_semaphore_init(&ping,0);
+  dthr_semaphore_init(&pong,0);
+  dthr_semaphore_init(&done,0);
+  dthr_thread_init(&pinger,ping_fn,0,STACKSIZE);
+  dthr_thread_init(&ponger,pong_fn,0,STACKSIZE);
+  dthr_thread_init(&spinner,spin_fn,0,STACKSIZE);
+  (void) dthr_thread_run(&pinger);
+  (void) dthr_thread_run(&ponger);
+  (void) dthr_thread_run(&spinner);
+  for (i = 0; i < 3; i++)
+    dthr_semaphore_take(&done);
+
+  dthr_get_sched_stats(&st);
+  check(st.switches >= 2ul * rounds,"context switches",st.switches);
+  check(st.sema_waits > 0,"semaphore takes that blocked",st.sema_waits);
+  check(st.sema_waits == 0 || st.sema_wait_max_ns * st.sema_waits
+        >= st.sema_wait_ns,"mean semaphore wait (us)",
+        st.sema_waits ? st.sema_wait_ns / 1e3 / st.sema_waits : 0);
+  check(st.runnable_max >= 1,"longest run queue",st.runnable_max);
+  check(st.latency_samples > 0 && st.latency_max_ns > 0,
+        "worst scheduling latency (us)",st.latency_max_ns / 1e3);
+  check(dthr_thread_run_ns(&spinner) >= (SPIN_MS - 1) * 1e6,
+        "spinner run time (ms)",dthr_thread_run_ns(&spinner) / 1e6);
+  check(dthr_thread_run_ns(&pinger) > 0,
+        "pinger run time (ms)",dthr_thread_run_ns(&pinger) / 1e6);
+  (void) dthr_thread_detach(&pinger);
+  (void) dthr_thread_detach(&ponger);
+  (void) dthr_thread_detach(&spinner);
+  return 0;
+}
+
+/*
+ * Two threads taking two locks in opposite orders.
+ */
+struct dthr_semaphore lock_a, lock_b;
+volatile int          nlocked;
+int                   deadlock_listed = -1;
+
+void *locker_fn(void *arg)
+{
+  struct dthr_semaphore *first = arg ? &lock_b : &lock_a;
+  struct dthr_semaphore *second = arg ? &lock_a : &lock_b;
+
+  dthr_semaphore_take(first);
+  __sync_add_and_fetch(&nlocked,1);
+  while (nlocked < 2)
+    dthr_thread_yield();
+  dthr_semaphore_take(second);
+  fprintf(stderr,"%s:  took both locks, no deadlock\n",me);
+  return 0;
+}
+
+void *deadlock_root(void *unused)
+{
+  dthr_semaphore_init(&lock_a,1);
+  dthr_semaphore_init(&lock_b,1);
+  dthr_thread_init(&locker_a,locker_fn,(void *) 0,STACKSIZE);
+  dthr_thread_init(&locker_b,locker_fn,(void *) 1,STACKSIZE);
+  (void) dthr_thread_detach(dthr_thread_run(&locker_a));
+  (void) dthr_thread_detach(dthr_thread_run(&locker_b));
+  return 0;
+}
+
+int on_deadlock(void)
+{
+  deadlock_listed = dthr_dump_threads(stdout);
+  return 0;
+}
+
+void stats_run(int workers)
+{
+  struct dthr_thread  main_th;
+
+  printf("%d worker(s):\n",workers);
+  dthr_init();
+  if (!dthr_set_concurrency(workers,0)) {
+    fprintf(stderr,"%s:  cannot use %d workers\n",me,workers);
+    exit(1);
+  }
+  dthr_trace_start(4096);
+  dthr_thread_init(&main_th,stats_root,0,STACKSIZE);
+  dthr_thread_multithread(&main_th);
+  dthr_trace_stop();
+}
+#endif
+
+void usage()
+{
+  fprintf(stderr,"Usage: %s [-c rounds] [-w workers] [-o trace.json]\n",me);
+}
+
+int main(int ac, char **av)
+{
+  int                 opt;
+#if DREAD_THREAD_STATS
+  struct dthr_thread  main_th;
+  FILE                *fp;
+  int                 n;
+#endif
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"c:o:w:")) != EOF) switch (opt) {
+  case 'c': rounds = atoi(optarg);    break;
+  case 'o': trace_file = optarg;      break;
+  case 'w': nworkers = atoi(optarg);  break;
+  default:  usage(); exit(1);
+  }
+
+#if !DREAD_THREAD_STATS
+  fprintf(stderr,"%s:  built without DREAD_THREAD_STATS, nothing to test\n",
+          me);
+  return 0;
+#else
+  stats_run(nworkers);
+  if (!(fp = fopen(trace_file ? trace_file : "/dev/null","w"))) {
+    perror(trace_file);
+    exit(1);
+  }
+  n = dthr_trace_write(fp);
+  fclose(fp);
+  check(n > 0,"trace events",n);
+
+  /*
+   * Start over on several workers, and then on one, so that dthr_init has
+   * to get rid of the workers of the run before.
+   */
+  stats_run(nworkers > 1 ? nworkers + 1 : 3);
+
+  dthr_init();
+  dthr_on_deadlock = on_deadlock;
+  dthr_thread_init(&main_th,deadlock_root,0,STACKSIZE);
+  dthr_thread_multithread(&main_th);
+  check(deadlock_listed == 2,"deadlocked threads listed",deadlock_listed);
+
+  if (failures) {
+    fprintf(stderr,"%s:  %d checks failed\n",me,failures);
+    return 1;
+  }
+  fprintf(stderr,"All threads exited, all done!\n");
+  return 0;
+#endif
+}
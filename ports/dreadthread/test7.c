@@ -0,0 +1,226 @@
+/*
+ * Copyright 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Channels: nproducers threads each send count numbered items through a
+ * bounded, an unbounded and an unbuffered channel to nconsumers threads,
+ * which check that nothing is lost, duplicated or reordered per producer.
+ * Then the try variants, close, and dthr_chan_select with a timeout.
+ * Exits non-zero if anything is off.
+ *
+ *   test7 [-p nproducers] [-n nconsumers] [-c count] [-w workers]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "dreadthread.h"
+
+#define STACKSIZE   (16 * 1024)
+#define NPRODUCERS  4
+#define NCONSUMERS  3
+#define COUNT       20000
+#define MAXTHREADS  64
+
+int                   nproducers = NPRODUCERS;
+int                   nconsumers = NCONSUMERS;
+int                   count = COUNT;
+int                   nworkers = 1;
+int                   failures;
+char                  *me;
+
+struct item {
+  int producer, seq;
+};
+
+DREAD_THREAD_CHAN_TYPE(item_chan,struct item)
+
+struct dthr_chan      items;
+struct dthr_semaphore finished;
+struct dthr_thread    th[4][MAXTHREADS];  /* one set per run_pipe */
+int                   *last_seq;        /* per consumer and producer */
+long                  received;
+int                   misordered;
+
+static void check(int ok, const char *what)
+{
+  printf("%-52s %s\n",what,ok ? "ok" : "FAILED");
+  if (!ok) failures++;
+}
+
+void *producer(void *arg)
+{
+  struct item it;
+
+  it.producer = (int) (long) arg;
+  for (it.seq = 0; it.seq < count; it.seq++)
+    if (!item_chan_send(&items,it)) break;
+  dthr_semaphore_drop(&finished);
+  return 0;
+}
+
+void *consumer(void *arg)
+{
+  int         *last = last_seq + (long) arg * nproducers;
+  struct item it;
+
+  while (item_chan_recv(&items,&it)) {
+    if (it.seq <= last[it.producer]) __sync_add_and_fetch(&misordered,1);
+    last[it.producer] = it.seq;
+    __sync_add_and_fetch(&received,1);
+  }
+  dthr_semaphore_drop(&finished);
+  return 0;
+}
+
+static void run_pipe(int round, long capacity, const char *what)
+{
+  struct dthr_thread  *t = th[round];
+  int                 i, n = 0;
+
+  item_chan_init(&items,capacity);
+  for (i = 0; i < nproducers * nconsumers; i++)
+    last_seq[i] = -1;
+  received = 0;
+  misordered = 0;
+  for (i = 0; i < nconsumers; i++, n++) {
+    dthr_thread_init(&t[n],consumer,(void *) (long) i,STACKSIZE);
+    (void) dthr_thread_detach(dthr_thread_run(&t[n]));
+  }
+  for (i = 0; i < nproducers; i++, n++) {
+    dthr_thread_init(&t[n],producer,(void *) (long) i,STACKSIZE);
+    (void) dthr_thread_detach(dthr_thread_run(&t[n]));
+  }
+  for (i = 0; i < nproducers; i++)
+    dthr_semaphore_take(&finished);
+  dthr_chan_close(&items);
+  for (i = 0; i < nconsumers; i++)
+    dthr_semaphore_take(&finished);
+  check(received == (long) nproducers * count && !misordered,what);
+  dthr_chan_destroy(&items);
+}
+
+static double now_ms(void)
+{
+  struct timeval  tv;
+
+  gettimeofday(&tv,0);
+  return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+struct dthr_chan      a, b;
+struct dthr_thread    helper;           /* may outlive root's frame */
+
+void *late_send(void *unused)
+{
+  int v = 42;
+
+  dthr_sleep(30);
+  (void) dthr_chan_send(&b,&v);
+  return 0;
+}
+
+void *root(void *unused)
+{
+  struct dthr_chan_op ops[2];
+  double              start, t;
+  int                 v, w, i, rv;
+
+  dthr_semaphore_init(&finished,0);
+  run_pipe(0,16,"bounded channel, capacity 16");
+  run_pipe(1,1,"bounded channel, capacity 1");
+  run_pipe(2,DREAD_THREAD_CHAN_UNBOUNDED,"unbounded channel");
+  run_pipe(3,0,"unbuffered channel");
+
+  /* try variants and close */
+  dthr_chan_init(&a,sizeof (int),2);
+  v = 1;
+  rv = dthr_chan_try_send(&a,&v) + dthr_chan_try_send(&a,&v);
+  check(rv == 2 && dthr_chan_try_send(&a,&v) == 0,
+        "dthr_chan_try_send fills capacity 2, then fails");
+  dthr_chan_close(&a);
+  check(dthr_chan_try_send(&a,&v) == -1 && !dthr_chan_send(&a,&v),
+        "send on a closed channel fails");
+  rv = dthr_chan_recv(&a,&w) + dthr_chan_try_recv(&a,&w);
+  check(rv == 2 && !dthr_chan_recv(&a,&w) && dthr_chan_try_recv(&a,&w) == -1,
+        "closed channel drains, then reports closed");
+  dthr_chan_destroy(&a);
+
+  /* select: timeout, then whichever channel has something */
+  dthr_chan_init(&a,sizeof (int),0);
+  dthr_chan_init(&b,sizeof (int),0);
+  for (i = 0; i < 2; i++) {
+    ops[i].chan = i ? &b : &a;
+    ops[i].dir = DREAD_THREAD_CHAN_RECV;
+    ops[i].elem = &w;
+  }
+  start = now_ms();
+  rv = dthr_chan_select(ops,2,50);
+  t = now_ms() - start;
+  check(rv == -1 && t >= 49,"dthr_chan_select times out");
+  check(dthr_chan_select(ops,2,0) == -1,"dthr_chan_select polls");
+  dthr_thread_init(&helper,late_send,0,STACKSIZE);
+  (void) dthr_thread_detach(dthr_thread_run(&helper));
+  w = 0;
+  start = now_ms();
+  rv = dthr_chan_select(ops,2,1000);
+  t = now_ms() - start;
+  check(rv == 1 && ops[1].ok && w == 42 && t < 500,
+        "dthr_chan_select receives from the second channel");
+  /* nobody must still be on a's queue */
+  check(dthr_chan_try_send(&a,&v) == 0,"other select op withdrawn");
+  dthr_chan_destroy(&a);
+  dthr_chan_destroy(&b);
+  return 0;
+}
+
+void usage()
+{
+  fprintf(stderr,
+          "Usage: %s [-p nproducers] [-n nconsumers] [-c count]"
+          " [-w workers]\n",
+          me);
+}
+
+int main(int ac, char **av)
+{
+  struct dthr_thread  main_th;
+  int                 opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"c:n:p:w:")) != EOF) switch (opt) {
+  case 'c': count = atoi(optarg);       break;
+  case 'n': nconsumers = atoi(optarg);  break;
+  case 'p': nproducers = atoi(optarg);  break;
+  case 'w': nworkers = atoi(optarg);    break;
+  default:  usage(); exit(1);
+  }
+  if (nproducers + nconsumers > MAXTHREADS) {
+    fprintf(stderr,"%s:  at most %d threads\n",me,MAXTHREADS);
+    exit(1);
+  }
+  if (!(last_seq = (int *) malloc(nproducers * nconsumers
+                                  * sizeof *last_seq))) {
+    perror(me);
+    exit(1);
+  }
+
+  dthr_init();
+  if (!dthr_set_concurrency(nworkers,0)) {
+    fprintf(stderr,"%s:  cannot use %d workers\n",me,nworkers);
+    exit(1);
+  }
+  dthr_thread_init(&main_th,root,0,STACKSIZE);
+  dthr_thread_multithread(&main_th);
+  if (failures) {
+    fprintf(stderr,"%s:  %d checks failed\n",me,failures);
+    return 1;
+  }
+  fprintf(stderr,"All threads exited, all done!\n");
+  return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Stack high-water marks and DREAD_THREAD_STACK_AUTO: two rounds of
+ * nthreads shallow and nthreads deep threads, all alive at once.  The
+ * first round runs on DREAD_THREAD_STACK_AUTO_FIRST stacks and is
+ * measured; the second must ask for smaller stacks that are still deep
+ * enough.  Free stacks fit any smaller request, so how much stack memory
+ * the second round holds depends on dthr_trim_stacks having unmapped the
+ * first round's; it is only printed.  Then explicit sizes with and
+ * without dthr_set_stack_tracking.  Exits non-zero if anything is off.
+ *
+ *   test8 [-t nthreads] [-d depth] [-w workers]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dreadthread.h"
+
+#define NTHREADS  200
+#define DEPTH     12
+#define FRAME     1024
+#define STACKSIZE (64 * 1024)
+
+int                   nthreads = NTHREADS;
+int                   depth = DEPTH;
+int                   nworkers = 1;
+int                   failures;
+char                  *me;
+
+struct dthr_thread    *th[2];           /* one set per round */
+struct dthr_thread    fixed_th[2];
+struct dthr_semaphore arrived, gate, finished;
+
+static void check(int ok, const char *what, double val)
+{
+  printf("%-44s %10.0f  %s\n",what,val,ok ? "ok" : "FAILED");
+  if (!ok) failures++;
+}
+
+void *shallow(void *unused)
+{
+  dthr_semaphore_drop(&arrived);
+  dthr_semaphore_take(&gate);
+  dthr_semaphore_drop(&finished);
+  return 0;
+}
+
+static int descend(int d)
+{
+  volatile char frame[FRAME];
+
+  frame[0] = (char) d;
+  if (d == 0) {
+    dthr_semaphore_drop(&arrived);
+    dthr_semaphore_take(&gate);
+    return frame[0];
+  }
+  return descend(d - 1) + frame[0];
+}
+
+void *deep(void *unused)
+{
+  (void) descend(depth);
+  dthr_semaphore_drop(&finished);
+  return 0;
+}
+
+static struct dthr_stack_usage *usage_of(void *(*fn)(void *))
+{
+  static struct dthr_stack_usage  usage[16];
+  int                             i, n;
+
+  n = dthr_get_stack_usage(usage,16);
+  for (i = 0; i < n && i < 16; i++)
+    if (usage[i].fn == fn) return &usage[i];
+  return 0;
+}
+
+/* threads are measured as they leave their stacks, after saying goodbye */
+static void wait_measured(void *(*fn)(void *), unsigned long n)
+{
+  struct dthr_stack_usage *u;
+
+  while (!(u = usage_of(fn)) || u->threads < n)
+    dthr_thread_yield();
+}
+
+/*
+ * Returns the stack bytes asked for while all of the round's threads
+ * wait, and the bytes actually in use in *active.
+ */
+static size_t run_round(int round, size_t *active)
+{
+  struct dthr_stack_stats st;
+  struct dthr_thread      *t = th[round];
+  size_t                  asked = 0;
+  int                     i;
+
+  for (i = 0; i < 2 * nthreads; i++) {
+    dthr_thread_init(&t[i],i & 1 ? deep : shallow,0,DREAD_THREAD_STACK_AUTO);
+    (void) dthr_thread_detach(dthr_thread_run(&t[i]));
+  }
+  for (i = 0; i < 2 * nthreads; i++)
+    dthr_semaphore_take(&arrived);
+  dthr_get_stack_stats(&st);
+  *active = st.active_bytes;
+  for (i = 0; i < 2 * nthreads; i++)
+    asked += t[i].stack_size;
+  if (round == 1)
+    check(dthr_thread_stack_used(&t[1]) >= (size_t) depth * FRAME,
+          "live deep thread's mark (bytes)",dthr_thread_stack_used(&t[1]));
+  for (i = 0; i < 2 * nthreads; i++)
+    dthr_semaphore_drop(&gate);
+  for (i = 0; i < 2 * nthreads; i++)
+    dthr_semaphore_take(&finished);
+  wait_measured(shallow,(round + 1ul) * nthreads);
+  wait_measured(deep,(round + 1ul) * nthreads);
+  return asked;
+}
+
+void *root(void *unused)
+{
+  struct dthr_stack_usage *u;
+  size_t                  first, second, active[2];
+
+  dthr_semaphore_init(&arrived,0);
+  dthr_semaphore_init(&gate,0);
+  dthr_semaphore_init(&finished,0);
+
+  first = run_round(0,&active[0]);
+  dthr_trim_stacks();
+  second = run_round(1,&active[1]);
+  printf("%d threads: %lu KB of stacks in use, then %lu KB\n",2 * nthreads,
+         (unsigned long) active[0] / 1024,(unsigned long) active[1] / 1024);
+  check(second < first,"stack asked for, second round (KB)",
+        second / 1024.0);
+
+  u = usage_of(deep);
+  check(u && u->threads == 2ul * nthreads && !u->overflows,
+        "deep threads measured",
+        u ? u->threads : 0);
+  check(u && u->max_used >= (size_t) depth * FRAME
+        && u->max_used < DREAD_THREAD_STACK_AUTO_FIRST,
+        "deep high-water mark (bytes)",u ? u->max_used : 0);
+  check(u && u->auto_size > u->max_used,
+        "deep automatic size (bytes)",u ? u->auto_size : 0);
+  u = usage_of(shallow);
+  check(u && u->max_used > 0 && u->max_used < 4096,
+        "shallow high-water mark (bytes)",u ? u->max_used : 0);
+
+  /* explicit sizes are only measured while tracking is on */
+  dthr_thread_init(&fixed_th[0],deep,0,STACKSIZE);
+  (void) dthr_thread_detach(dthr_thread_run(&fixed_th[0]));
+  dthr_semaphore_take(&arrived);
+  check(dthr_thread_stack_used(&fixed_th[0]) == 0,
+        "explicit size, not tracked (bytes)",
+        dthr_thread_stack_used(&fixed_th[0]));
+  dthr_semaphore_drop(&gate);
+  dthr_semaphore_take(&finished);
+
+  dthr_set_stack_tracking(1);
+  dthr_thread_init(&fixed_th[1],deep,0,STACKSIZE);
+  (void) dthr_thread_detach(dthr_thread_run(&fixed_th[1]));
+  dthr_semaphore_take(&arrived);
+  dthr_semaphore_drop(&gate);
+  dthr_semaphore_take(&finished);
+  wait_measured(deep,2ul * nthreads + 1);
+  dthr_set_stack_tracking(0);
+  check(dthr_thread_stack_used(&fixed_th[1]) >= (size_t) depth * FRAME,
+        "explicit size, tracked (bytes)",
+        dthr_thread_stack_used(&fixed_th[1]));
+  return 0;
+}
+
+void usage()
+{
+  fprintf(stderr,"Usage: %s [-t nthreads] [-d depth] [-w workers]\n",me);
+}
+
+int main(int ac, char **av)
+{
+  struct dthr_thread  main_th;
+  int                 opt;
+
+  if (!(me = strrchr(*av,'/'))) me = *av;
+  else ++me;
+
+  while ((opt = getopt(ac,av,"d:t:w:")) != EOF) switch (opt) {
+  case 'd': depth = atoi(optarg);     break;
+  case 't': nthreads = atoi(optarg);  break;
+  case 'w': nworkers = atoi(optarg);  break;
+  default:  usage(); exit(1);
+  }
+  if ((size_t) (depth + 2) * FRAME > DREAD_THREAD_STACK_AUTO_FIRST) {
+    fprintf(stderr,"%s:  depth %d does not fit a first stack\n",me,depth);
+    exit(1);
+  }
+
+  th[0] = (struct dthr_thread *) malloc(2 * nthreads * sizeof *th[0]);
+  th[1] = (struct dthr_thread *) malloc(2 * nthreads * sizeof *th[1]);
+  if (!th[0] || !th[1]) {
+    perror(me);
+    exit(1);
+  }
+
+  dthr_init();
+  if (!dthr_set_concurrency(nworkers,0)) {
+    fprintf(stderr,"%s:  cannot use %d workers\n",me,nworkers);
+    exit(1);
+  }
+  /* keeps the first round's big stacks off the C stack where possible */
+  (void) dthr_set_stack_mmap(1);
+  dthr_thread_init(&main_th,root,0,STACKSIZE);
+  dthr_thread_multithread(&main_th);
+  if (failures) {
+    fprintf(stderr,"%s:  %d checks failed\n",me,failures);
+    return 1;
+  }
+  fprintf(stderr,"All threads exited, all done!\n");
+  return 0;
+}
@@ -4,15 +4,35 @@
  * found in the LICENSE file.
  */
 
+/*
+ * Downloads a URL to a file.  Files of kParallelMinSize or more are split
+ * into kMaxConnections byte ranges fetched at once, each written at its
+ * offset.  Every connection reads into one of two buffers while the main
+ * thread writes the other, so the network and the disk overlap.  Progress
+ * is kept in <dst>.geturl along with the file's ETag or Last-Modified;
+ * after a failure the partial file and its state are left behind and
+ * running the same command again resumes from them.  Ranged requests carry
+ * that validator in If-Range, so if the remote file has changed the
+ * download starts over from zero.
+ */
+
 #define __STDC_FORMAT_MACROS
 
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <deque>
+#include <string>
+#include <vector>
+
 #include "ppapi_simple/ps.h"
 
 #include "ppapi/c/pp_errors.h"
@@ -22,6 +42,54 @@
 #include "ppapi/cpp/url_loader.h"
 #include "ppapi/cpp/url_request_info.h"
 #include "ppapi/cpp/url_response_info.h"
+#include "ppapi/cpp/var.h"
+
+// Files at least this big are fetched over several connections.
+static const int64_t kParallelMinSize = 8 << 20;
+static const int kMaxConnections = 4;
+static const size_t kBufferSize = 256 << 10;
+// The resume state is saved each time this much more has been written.
+static const int64_t kStateInterval = 4 << 20;
+
+struct DownloadState;
+
+// A byte range of the file and the connection fetching it.
+struct Segment {
+  DownloadState* state;
+  int64_t start;
+  int64_t end;   // One past the last byte, or -1 if the size is unknown.
+  int64_t done;  // Bytes written from start.
+  char* buffers[2];
+  bool busy[2];  // Queued for, or being, written.
+  pthread_t thread;
+  bool started;  // thread is running and must be joined.
+};
+
+// A filled buffer waiting for the writer.
+struct Chunk {
+  Segment* segment;
+  int buffer;
+  int32_t len;
+};
+
+struct DownloadState {
+  const char* url;
+  const char* dst;
+  std::string state_path;
+  int quiet;
+  int fh;
+  int64_t total;          // -1 if unknown.
+  std::string validator;  // ETag or Last-Modified, or empty if neither.
+  std::vector<Segment> segments;
+
+  // Guards everything below; cond is broadcast on every change.
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::deque<Chunk> queue;
+  int readers_running;
+  bool failed;
+  bool changed;  // A ranged request got the whole (new) file back.
+};
 
 static bool IsTTY() {
   if (getenv("NO_TTY") != NULL)
@@ -29,99 +97,455 @@ static bool IsTTY() {
   return isatty(STDOUT_FILENO) != 0;
 }
 
-static int Download(int quiet, const char* url, const char* dst) {
-  int32_t result;
-  int percent_recieved = 0;
-  int percent_recieved_previous = 0;
+// Returns the value of a response header without surrounding blanks, or
+// an empty string.
+static std::string HeaderString(const std::string& headers,
+                                const char* name) {
+  size_t name_len = strlen(name);
+  size_t pos = 0;
+  while (pos < headers.size()) {
+    size_t eol = headers.find('\n', pos);
+    if (eol == std::string::npos)
+      eol = headers.size();
+    if (eol - pos > name_len && headers[pos + name_len] == ':' &&
+        strncasecmp(headers.c_str() + pos, name, name_len) == 0) {
+      size_t begin = headers.find_first_not_of(" \t", pos + name_len + 1);
+      size_t end = headers.find_last_not_of(" \t\r", eol - 1);
+      if (begin == std::string::npos || begin >= eol || end < begin)
+        return std::string();
+      return headers.substr(begin, end + 1 - begin);
+    }
+    pos = eol + 1;
+  }
+  return std::string();
+}
 
-  pp::InstanceHandle instance(PSGetInstanceId());
+// Returns the value of a numeric response header, or -1.
+static int64_t HeaderValue(const std::string& headers, const char* name) {
+  std::string value = HeaderString(headers, name);
+  if (value.empty())
+    return -1;
+  return strtoll(value.c_str(), NULL, 10);
+}
 
+// Opens url, asking for bytes [start, end) unless that is the whole file
+// (end < 0), and only if the file still matches if_range when that is not
+// empty.  Returns the HTTP status, or a PP_ERROR code.
+static int32_t OpenUrl(pp::URLLoader* loader, const char* url,
+                       const char* method, int64_t start, int64_t end,
+                       const std::string& if_range) {
+  pp::InstanceHandle instance(PSGetInstanceId());
   pp::URLRequestInfo url_request(instance);
   url_request.SetURL(url);
-  url_request.SetMethod("GET");
+  url_request.SetMethod(method);
   url_request.SetAllowCrossOriginRequests(true);
-  url_request.SetRecordDownloadProgress(true);
+  if (end >= 0) {
+    char range[64];
+    snprintf(range, sizeof range, "Range: bytes=%" PRId64 "-%" PRId64,
+             start, end - 1);
+    std::string headers = range;
+    if (!if_range.empty())
+      headers += "\nIf-Range: " + if_range;
+    url_request.SetHeaders(headers);
+  }
 
-  pp::URLLoader url_loader(instance);
-  result = url_loader.Open(url_request, pp::BlockUntilComplete());
-  if (result != PP_OK) {
-    fprintf(stderr, "ERROR: Can't open url (%d): %s\n", result, url);
-    return 1;
+  *loader = pp::URLLoader(instance);
+  int32_t result = loader->Open(url_request, pp::BlockUntilComplete());
+  if (result != PP_OK)
+    return result;
+  return loader->GetResponseInfo().GetStatusCode();
+}
+
+// Finds the file's size and validator with a HEAD request.  A weak ETag
+// cannot be used in If-Range, so Last-Modified stands in for it.  The size
+// of an encoded response is that of the encoded entity, while URLLoader
+// hands over the decoded body, so it is left unknown and the file is
+// fetched in one stream.
+static void ProbeFile(DownloadState* d) {
+  pp::URLLoader loader;
+  d->total = -1;
+  d->validator.clear();
+  if (OpenUrl(&loader, d->url, "HEAD", 0, -1, std::string()) != 200)
+    return;
+  pp::Var headers = loader.GetResponseInfo().GetHeaders();
+  if (!headers.is_string())
+    return;
+  std::string text = headers.AsString();
+  std::string encoding = HeaderString(text, "Content-Encoding");
+  if (encoding.empty() || strcasecmp(encoding.c_str(), "identity") == 0)
+    d->total = HeaderValue(text, "Content-Length");
+  d->validator = HeaderString(text, "ETag");
+  if (d->validator.empty() || d->validator.compare(0, 2, "W/") == 0)
+    d->validator = HeaderString(text, "Last-Modified");
+}
+
+static bool SupportsRanges(const char* url) {
+  pp::URLLoader loader;
+  return OpenUrl(&loader, url, "GET", 0, 1, std::string()) == 206;
+}
+
+static void SaveState(DownloadState* d) {
+  if (d->total < 0)
+    return;
+  FILE* f = fopen(d->state_path.c_str(), "w");
+  if (f == NULL)
+    return;
+  pthread_mutex_lock(&d->mutex);
+  fprintf(f, "geturl %" PRId64 " %d\n", d->total, (int)d->segments.size());
+  fprintf(f, "validator %s\n", d->validator.c_str());
+  for (size_t i = 0; i < d->segments.size(); i++) {
+    // A stream read to EOF resumes as a range up to the known size.
+    Segment& seg = d->segments[i];
+    fprintf(f, "%" PRId64 " %" PRId64 " %" PRId64 "\n", seg.start,
+            seg.end < 0 ? d->total : seg.end, seg.done);
   }
+  pthread_mutex_unlock(&d->mutex);
+  fclose(f);
+}
 
-  int fh = open(dst, O_WRONLY | O_CREAT);
-  if (fh < 0) {
-    fprintf(stderr, "ERROR: Can't open file (%d): %s\n", errno, dst);
-    return 1;
+// Reads back the segments saved for a file of total bytes, provided they
+// were saved for the same version of it.
+static bool LoadState(DownloadState* d) {
+  FILE* f = fopen(d->state_path.c_str(), "r");
+  if (f == NULL)
+    return false;
+  int64_t total;
+  int count;
+  char line[512];
+  bool ok = fscanf(f, "geturl %" SCNd64 " %d", &total, &count) == 2 &&
+            total == d->total && count > 0 && count <= kMaxConnections &&
+            fgets(line, sizeof line, f) != NULL &&
+            fgets(line, sizeof line, f) != NULL &&
+            strncmp(line, "validator ", 10) == 0;
+  if (ok) {
+    std::string validator = line + 10;
+    if (!validator.empty() && validator[validator.size() - 1] == '\n')
+      validator.erase(validator.size() - 1);
+    ok = validator == d->validator;
   }
+  for (int i = 0; ok && i < count; i++) {
+    Segment seg = Segment();
+    ok = fscanf(f, "%" SCNd64 " %" SCNd64 " %" SCNd64, &seg.start, &seg.end,
+                &seg.done) == 3 &&
+         seg.start >= 0 && seg.start <= seg.end && seg.end <= total &&
+         seg.done >= 0 && seg.done <= seg.end - seg.start;
+    d->segments.push_back(seg);
+  }
+  fclose(f);
+  if (!ok)
+    d->segments.clear();
+  return ok;
+}
 
-  char buffer[0x10000];
-  ssize_t len;
-  int64_t received = 0;
-  int64_t total = 0;
-  pp::URLResponseInfo info = url_loader.GetResponseInfo();
-  if (info.GetStatusCode() != 200) {
-    fprintf(stderr, "ERROR: got http error code %d for: %s\n",
-        info.GetStatusCode(), url);
-    close(fh);
-    goto fail;
+static void Fail(DownloadState* d) {
+  pthread_mutex_lock(&d->mutex);
+  d->failed = true;
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->mutex);
+}
+
+// Fetches what is left of a segment, handing each filled buffer to the
+// writer and carrying on with the other one.
+static void* ReadSegment(void* arg) {
+  Segment* seg = static_cast<Segment*>(arg);
+  DownloadState* d = seg->state;
+  int64_t offset = seg->start + seg->done;
+  bool ranged = offset > 0 || (seg->end >= 0 && seg->end < d->total);
+
+  pp::URLLoader loader;
+  int32_t result = OpenUrl(&loader, d->url, "GET", offset,
+                           ranged ? seg->end : -1, d->validator);
+  if (result < 0) {
+    fprintf(stderr, "ERROR: Can't open url (%d): %s\n", result, d->url);
+    Fail(d);
+  } else if (ranged && result == 200) {
+    // If-Range did not match: the bytes already fetched, by this run or
+    // the one being resumed, belong to another version of the file.
+    pthread_mutex_lock(&d->mutex);
+    d->changed = true;
+    pthread_mutex_unlock(&d->mutex);
+    Fail(d);
+  } else if (result != (ranged ? 206 : 200)) {
+    fprintf(stderr, "ERROR: got http error code %d for: %s\n", result,
+            d->url);
+    Fail(d);
+  } else {
+    int b = 0;
+    for (;;) {
+      pthread_mutex_lock(&d->mutex);
+      while (seg->busy[b] && !d->failed)
+        pthread_cond_wait(&d->cond, &d->mutex);
+      bool failed = d->failed;
+      pthread_mutex_unlock(&d->mutex);
+      if (failed)
+        break;
+
+      int32_t want = kBufferSize;
+      if (seg->end >= 0 && seg->end - offset < want)
+        want = seg->end - offset;
+      if (want == 0)
+        break;
+      result = loader.ReadResponseBody(seg->buffers[b], want,
+                                       pp::BlockUntilComplete());
+      if (result == 0 && seg->end < 0)
+        break;
+      if (result <= 0) {
+        fprintf(stderr, "ERROR: Failed downloading url (%d): %s\n", result,
+                d->url);
+        Fail(d);
+        break;
+      }
+      offset += result;
+
+      Chunk chunk = { seg, b, result };
+      pthread_mutex_lock(&d->mutex);
+      seg->busy[b] = true;
+      d->queue.push_back(chunk);
+      pthread_cond_broadcast(&d->cond);
+      pthread_mutex_unlock(&d->mutex);
+      b ^= 1;
+    }
   }
 
+  pthread_mutex_lock(&d->mutex);
+  d->readers_running--;
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->mutex);
+  return NULL;
+}
+
+static void ShowProgress(DownloadState* d, int64_t received,
+                         int* percent_previous) {
+  if (d->quiet || d->total <= 0)
+    return;
+  int percent = received * 100 / d->total;
+  if (IsTTY()) {
+    printf("[%" PRId64 "/%" PRId64 " KiB %d%%]\r", received / 1024,
+           d->total / 1024, percent);
+    fflush(stdout);
+  } else if (percent / 10 > *percent_previous / 10) {
+    printf(".");
+    *percent_previous = percent;
+  }
+}
+
+// Writes chunks from the readers at their segments' offsets until every
+// reader has finished.
+static void WriteChunks(DownloadState* d, int64_t received) {
+  int percent_previous = 0;
+  int64_t unsaved = 0;
+
+  pthread_mutex_lock(&d->mutex);
   for (;;) {
-    result = url_loader.ReadResponseBody(
-        buffer, sizeof buffer, pp::BlockUntilComplete());
-    if (result <= 0)
+    while (d->queue.empty() && d->readers_running > 0)
+      pthread_cond_wait(&d->cond, &d->mutex);
+    if (d->queue.empty())
       break;
-    len = write(fh, buffer, result);
-    if (len != result) {
-      fprintf(stderr, "ERROR: Failed writing to file (%d): %s\n", errno, dst);
-      close(fh);
-      goto fail;
-    }
-    url_loader.GetDownloadProgress(&received, &total);
-    if (!quiet) {
-      percent_recieved = received * 100 / total;
-      if (IsTTY()) {
-        printf("[%"PRId64"/%"PRId64" KiB %d%%]\r",
-               received / 1024, total / 1024, percent_recieved);
-        fflush(stdout);
-      } else {
-        if (percent_recieved / 10 > percent_recieved_previous / 10) {
-          printf(".");
-          percent_recieved_previous = percent_recieved;
-        }
+    Chunk chunk = d->queue.front();
+    d->queue.pop_front();
+    Segment* seg = chunk.segment;
+    int64_t offset = seg->start + seg->done;
+    bool failed = d->failed;
+    pthread_mutex_unlock(&d->mutex);
+
+    bool ok = false;
+    if (!failed) {
+      ok = lseek(d->fh, offset, SEEK_SET) == offset &&
+           write(d->fh, seg->buffers[chunk.buffer], chunk.len) == chunk.len;
+      if (!ok) {
+        fprintf(stderr, "ERROR: Failed writing to file (%d): %s\n", errno,
+                d->dst);
+        Fail(d);
       }
     }
-  } while (result > 0);
-  if (!quiet) {
-    if (IsTTY()) {
-      printf("                                           \r");
-      printf("[%"PRId64"/%"PRId64" KiB 100%%] Done.\n",
-             received / 1024, total / 1024);
+
+    pthread_mutex_lock(&d->mutex);
+    if (ok) {
+      seg->done += chunk.len;
+      received += chunk.len;
+      unsaved += chunk.len;
+    }
+    seg->busy[chunk.buffer] = false;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->mutex);
+
+    ShowProgress(d, received, &percent_previous);
+    if (unsaved >= kStateInterval) {
+      SaveState(d);
+      unsaved = 0;
+    }
+    pthread_mutex_lock(&d->mutex);
+  }
+  pthread_mutex_unlock(&d->mutex);
+}
+
+// Decides which byte ranges are left to fetch and opens dst to match.
+// Only a file with a state file from an earlier run of this download is
+// resumed; anything else at dst is overwritten.
+static bool PlanSegments(DownloadState* d) {
+  int flags = O_WRONLY | O_CREAT;
+  struct stat st;
+
+  if (d->total >= 0 && stat(d->dst, &st) == 0 && LoadState(d)) {
+    // Carry on where an earlier run of this download stopped.  A stream
+    // that had not got anywhere is started over as one.
+    if (d->segments.size() == 1 && d->segments[0].done == 0)
+      d->segments[0].end = -1;
+  } else {
+    // A single stream is read to EOF rather than to the size HEAD gave.
+    int count = 1;
+    if (d->total >= kParallelMinSize)
+      count = kMaxConnections;
+    for (int i = 0; i < count; i++) {
+      Segment seg = Segment();
+      seg.start = count == 1 ? 0 : d->total * i / count;
+      seg.end = count == 1 ? -1 : d->total * (i + 1) / count;
+      d->segments.push_back(seg);
+    }
+    flags |= O_TRUNC;
+  }
+
+  bool need_ranges = d->segments.size() > 1 || d->segments[0].done > 0;
+  if (need_ranges && !SupportsRanges(d->url)) {
+    // Fetch it all in one go, from the start.
+    d->segments.clear();
+    Segment seg = Segment();
+    seg.end = -1;
+    d->segments.push_back(seg);
+    flags |= O_TRUNC;
+  }
+
+  d->fh = open(d->dst, flags, 0666);
+  if (d->fh < 0) {
+    fprintf(stderr, "ERROR: Can't open file (%d): %s\n", errno, d->dst);
+    return false;
+  }
+  return true;
+}
+
+// Runs one attempt at the download.  Sets *changed, and leaves dst for the
+// next attempt to overwrite, if the remote file turned out to have changed.
+static int DownloadOnce(int quiet, const char* url, const char* dst,
+                        bool* changed) {
+  DownloadState d;
+  d.url = url;
+  d.dst = dst;
+  d.state_path = std::string(dst) + ".geturl";
+  d.quiet = quiet;
+  d.fh = -1;
+  ProbeFile(&d);
+  d.readers_running = 0;
+  d.failed = false;
+  d.changed = false;
+  pthread_mutex_init(&d.mutex, NULL);
+  pthread_cond_init(&d.cond, NULL);
+
+  if (!PlanSegments(&d)) {
+    pthread_cond_destroy(&d.cond);
+    pthread_mutex_destroy(&d.mutex);
+    return 1;
+  }
+
+  int64_t resumed = 0;
+  for (size_t i = 0; i < d.segments.size(); i++)
+    resumed += d.segments[i].done;
+  if (resumed > 0 && !quiet)
+    printf("Resuming at %" PRId64 " KiB\n", resumed / 1024);
+  SaveState(&d);
+
+  for (size_t i = 0; i < d.segments.size(); i++) {
+    Segment& seg = d.segments[i];
+    seg.state = &d;
+    seg.buffers[0] = new char[kBufferSize];
+    seg.buffers[1] = new char[kBufferSize];
+    if (seg.end >= 0 && seg.done == seg.end - seg.start)
+      continue;
+    d.readers_running++;
+    if (pthread_create(&seg.thread, NULL, ReadSegment, &seg) == 0) {
+      seg.started = true;
     } else {
-        printf(" Done.\n");
+      fprintf(stderr, "ERROR: Can't start download thread\n");
+      d.readers_running--;
+      Fail(&d);
+    }
+  }
+
+  WriteChunks(&d, resumed);
+
+  int64_t received = 0;
+  for (size_t i = 0; i < d.segments.size(); i++) {
+    Segment& seg = d.segments[i];
+    if (seg.end >= 0 && seg.done != seg.end - seg.start)
+      d.failed = true;
+    // A stream may run past the size HEAD gave, but not stop short of it.
+    if (seg.end < 0 && d.total >= 0 && seg.done < d.total && !d.failed) {
+      fprintf(stderr, "ERROR: Download ended after %" PRId64 " of %" PRId64
+              " bytes: %s\n", seg.done, d.total, url);
+      d.failed = true;
     }
+    if (seg.started)
+      pthread_join(seg.thread, NULL);
+    received += seg.done;
+    delete[] seg.buffers[0];
+    delete[] seg.buffers[1];
   }
 
-  if (result != PP_OK) {
-    fprintf(stderr, "ERROR: Failed downloading url (%d): %s\n", result, url);
-    close(fh);
-    goto fail;
+  if (!quiet) {
+    if (IsTTY()) {
+      printf("                                           \r");
+      if (!d.failed)
+        printf("[%" PRId64 "/%" PRId64 " KiB 100%%] Done.\n",
+               received / 1024, received / 1024);
+    } else if (!d.failed) {
+      printf(" Done.\n");
+    }
   }
 
-  if (close(fh) < 0) {
+  if (close(d.fh) < 0 && !d.failed) {
     fprintf(stderr, "ERROR: Failed closing file (%d): %s\n", errno, dst);
-    goto fail;
+    d.failed = true;
   }
 
-  return 0;
+  int rtn = 0;
+  *changed = d.changed;
+  if (!d.failed) {
+    remove(d.state_path.c_str());
+  } else if (d.changed) {
+    remove(d.state_path.c_str());
+    rtn = 1;
+  } else if (received > 0 && d.total >= 0) {
+    SaveState(&d);
+    fprintf(stderr, "Kept %" PRId64 " KiB of %s; run again to resume.\n",
+            received / 1024, dst);
+    rtn = 1;
+  } else {
+    remove(d.state_path.c_str());
+    if (remove(dst) < 0)
+      fprintf(stderr, "ERROR: Failed removing file (%d): %s\n", errno, dst);
+    rtn = 1;
+  }
+  pthread_cond_destroy(&d.cond);
+  pthread_mutex_destroy(&d.mutex);
+  return rtn;
+}
 
-fail:
-  result = remove(dst);
-  if (result < 0) {
-    fprintf(stderr, "ERROR: Failed removing file (%d): %s\n", errno, dst);
+// Downloads url to dst, starting over once if the remote file changes
+// under a resumed or parallel download.
+static int Download(int quiet, const char* url, const char* dst) {
+  bool changed;
+  int rtn = DownloadOnce(quiet, url, dst, &changed);
+  if (changed) {
+    if (!quiet)
+      printf("Remote file has changed; starting over.\n");
+    rtn = DownloadOnce(quiet, url, dst, &changed);
+    if (changed) {
+      fprintf(stderr, "ERROR: %s keeps changing\n", url);
+      if (remove(dst) < 0)
+        fprintf(stderr, "ERROR: Failed removing file (%d): %s\n", errno,
+                dst);
+    }
   }
-  return 1;
+  return rtn;
 }
 
 int main(int argc, char *argv[]) {
@@ -134,6 +558,11 @@ int main(int argc, char *argv[]) {
   fprintf(stderr, "\n");
   fprintf(stderr, "-q = quiet mode\n");
   fprintf(stderr, "\n");
+  fprintf(stderr, "Files of %d MiB or more are fetched over %d connections.\n",
+          (int)(kParallelMinSize >> 20), kMaxConnections);
+  fprintf(stderr, "If a download fails, running the same command again\n");
+  fprintf(stderr, "resumes it, unless the file has changed since.\n");
+  fprintf(stderr, "\n");
   fprintf(stderr, "NOTE: This utility can only be used to download URLs\n");
   fprintf(stderr, "from the same origin or that have been whitelisted\n");
   fprintf(stderr, "in an extension manifest\n");
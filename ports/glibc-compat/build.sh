@@ -5,6 +5,9 @@
 BUILD_DIR=${SRC_DIR}
 if [ "${TOOLCHAIN}" != "emscripten" ]; then
   EXECUTABLES=out/glibc_compat_test
+  if [ "${NACL_LIBC}" = "newlib" ]; then
+    EXECUTABLES+=" out/lock_bench out/fts_bench out/qsort_bench"
+  fi
 fi
 
 ConfigureStep() {
@@ -30,6 +33,18 @@ BuildStep() {
   DefaultBuildStep
 }
 
+# Runs one of the benchmarks with reduced sizes.  A failure is reported
+# without failing the build.
+RunBench() {
+  local name=$1
+  shift
+  if [ "${TOOLCHAIN}" = "pnacl" ]; then
+    RunSelLdrCommand ./out/${name} "$@"
+  else
+    LogExecute ./out/${name}.sh "$@"
+  fi || echo "${name} failed"
+}
+
 TestStep() {
   if [ "${TOOLCHAIN}" = "emscripten" ]; then
     return
@@ -39,6 +54,11 @@ TestStep() {
   else
     LogExecute ./out/glibc_compat_test.sh
   fi
+  if [ "${NACL_LIBC}" = "newlib" ]; then
+    RunBench lock_bench --ops=10000
+    RunBench fts_bench --files=10000
+    RunBench qsort_bench --count=100000
+  fi
 }
 
 InstallStep() {
@@ -20,6 +20,10 @@ extern void qsort_r(void *base, size_t nmemb, size_t size,
                     int (*compar)(const void *, const void *, void *),
                     void *arg);
 
+extern int mergesort_r(void *base, size_t nmemb, size_t size,
+                       int (*compar)(const void *, const void *, void *),
+                       void *arg);
+
 __END_DECLS
 
 #endif
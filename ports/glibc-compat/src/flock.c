@@ -34,6 +34,8 @@
 #include <errno.h>
 #include <unistd.h>
 
+#include "lock_table.h"
+
 #define OP_MASK (LOCK_SH | LOCK_EX | LOCK_UN)
 
 int flock(int fd, int operation)
@@ -53,15 +55,15 @@ int flock(int fd, int operation)
   switch (operation & OP_MASK) {
   case LOCK_UN:
     arg.l_type = F_UNLCK;
-    code = fcntl(fd, F_SETLK, &arg);
+    code = __lock_table_setlk(fd, fd, F_SETLK, &arg);
     break;
   case LOCK_SH:
     arg.l_type = F_RDLCK;
-    code = fcntl(fd, cmd, &arg);
+    code = __lock_table_setlk(fd, fd, cmd, &arg);
     break;
   case LOCK_EX:
     arg.l_type = F_WRLCK;
-    code = fcntl(fd, cmd, &arg);
+    code = __lock_table_setlk(fd, fd, cmd, &arg);
     break;
   default:
     errno = EINVAL;
@@ -92,11 +92,14 @@ struct statfs {
 
 static FTSENT  *fts_alloc(FTS *, char *, size_t);
 static FTSENT  *fts_build(FTS *, int);
-static void   fts_lfree(FTSENT *);
+static void   fts_free(FTS *, FTSENT *);
+static void   fts_lfree(FTS *, FTSENT *);
 static void   fts_load(FTS *, FTSENT *);
 static size_t   fts_maxarglen(char * const *);
 static void   fts_padjust(FTS *, FTSENT *);
 static int   fts_palloc(FTS *, size_t);
+static FTSENT  *fts_pool_get(FTS *, size_t);
+static void   fts_pool_release(FTS *);
 static FTSENT  *fts_sort(FTS *, FTSENT *, size_t);
 static int   fts_stat(FTS *, FTSENT *, int);
 static int   fts_safe_changedir(FTS *, FTSENT *, int, char *);
@@ -110,6 +113,25 @@ static int   fts_ufslinks(FTS *, const FTSENT *);
 
 #define  FCHDIR(sp, fd)  (!ISSET(FTS_NOCHDIR) && fchdir(fd))
 
+/*
+ * FTSENTs whose names fit in FTS_POOL_NAMELEN bytes are carved out of
+ * slabs of FTS_POOL_SLABSIZE entries and recycled through a per-stream
+ * free list, so walking a large tree doesn't malloc/free every directory
+ * entry.  Slabs are only handed back to malloc by fts_close.
+ *
+ * The pool belongs to the stream rather than to each directory: entries
+ * outlive the fts_build that made them (a directory's FTSENT stays the
+ * parent of everything below it, and fts_children lists stay valid until
+ * the next call), so a per-directory arena could not be dropped when its
+ * directory is done.  Entries of finished directories go back on the free
+ * list instead, which keeps the pool at the size of the widest point of
+ * the walk.  fts_bench counts the stat calls of a walk.
+ */
+#define  FTS_POOL_NAMELEN  64
+#define  FTS_POOL_SLABSIZE  128
+#define  FTS_POOL_ALIGN    16
+#define  FTS_POOLED  0x80    /* (private) entry belongs to the pool */
+
 /* fts_build flags */
 #define  BCHILD    1    /* fts_children */
 #define  BNAMES    2    /* fts_children, names only */
@@ -125,6 +147,13 @@ struct _fts_private {
   struct statfs  ftsp_statfs;
   dev_t    ftsp_dev;
   int    ftsp_linksreliable;
+  FTSENT    *ftsp_free;  /* recycled pool entries */
+  void    *ftsp_slabs;  /* pool slabs, freed by fts_close */
+};
+
+struct ftsent_withstat {
+  FTSENT  ent;
+  struct  stat statbuf;
 };
 
 /*
@@ -183,6 +212,14 @@ fts_open(argv, options, compar)
   if (ISSET(FTS_LOGICAL))
     SET(FTS_NOCHDIR);
 
+#ifdef __native_client__
+  /*
+   * fchdir is not implemented in sel_ldr and chdir is emulated by
+   * nacl_io, so always walk by path rather than changing directories.
+   */
+  SET(FTS_NOCHDIR);
+#endif
+
   /*
    * Start out with 1K of path space, and enough, in any case,
    * to hold the user's paths.
@@ -252,9 +289,10 @@ fts_open(argv, options, compar)
 
   return (sp);
 
-mem3:  fts_lfree(root);
-  free(parent);
-mem2:  free(sp->fts_path);
+mem3:  fts_lfree(sp, root);
+  fts_free(sp, parent);
+mem2:  fts_pool_release(sp);
+  free(sp->fts_path);
 mem1:  free(sp);
   return (NULL);
 }
@@ -298,17 +336,18 @@ fts_close(FTS *sp)
     for (p = sp->fts_cur; p->fts_level >= FTS_ROOTLEVEL;) {
       freep = p;
       p = p->fts_link != NULL ? p->fts_link : p->fts_parent;
-      free(freep);
+      fts_free(sp, freep);
     }
-    free(p);
+    fts_free(sp, p);
   }
 
-  /* Free up child linked list, sort array, path buffer. */
+  /* Free up child linked list, sort array, path buffer, entry pool. */
   if (sp->fts_child)
-    fts_lfree(sp->fts_child);
+    fts_lfree(sp, sp->fts_child);
   if (sp->fts_array)
     free(sp->fts_array);
   free(sp->fts_path);
+  fts_pool_release(sp);
 
   /* Return to original directory, save errno if necessary. */
   if (!ISSET(FTS_NOCHDIR)) {
@@ -390,7 +429,7 @@ fts_read(FTS *sp)
       if (p->fts_flags & FTS_SYMFOLLOW)
         (void)close(p->fts_symfd);
       if (sp->fts_child) {
-        fts_lfree(sp->fts_child);
+        fts_lfree(sp, sp->fts_child);
         sp->fts_child = NULL;
       }
       p->fts_info = FTS_DP;
@@ -400,7 +439,7 @@ fts_read(FTS *sp)
     /* Rebuild if only read the names and now traversing. */
     if (sp->fts_child != NULL && ISSET(FTS_NAMEONLY)) {
       CLR(FTS_NAMEONLY);
-      fts_lfree(sp->fts_child);
+      fts_lfree(sp, sp->fts_child);
       sp->fts_child = NULL;
     }
 
@@ -447,7 +486,7 @@ next:  tmp = p;
         SET(FTS_STOP);
         return (NULL);
       }
-      free(tmp);
+      fts_free(sp, tmp);
       fts_load(sp, p);
       return (sp->fts_cur = p);
     }
@@ -458,7 +497,7 @@ next:  tmp = p;
      * get back if necessary.
      */
     if (p->fts_instr == FTS_SKIP) {
-      free(tmp);
+      fts_free(sp, tmp);
       goto next;
     }
     if (p->fts_instr == FTS_FOLLOW) {
@@ -474,7 +513,7 @@ next:  tmp = p;
       p->fts_instr = FTS_NOINSTR;
     }
 
-    free(tmp);
+    fts_free(sp, tmp);
 
 name:    t = sp->fts_path + NAPPEND(p->fts_parent);
     *t++ = '/';
@@ -490,8 +529,8 @@ name:    t = sp->fts_path + NAPPEND(p->fts_parent);
      * Done; free everything up and set errno to 0 so the user
      * can distinguish between error and EOF.
      */
-    free(tmp);
-    free(p);
+    fts_free(sp, tmp);
+    fts_free(sp, p);
     errno = 0;
     return (sp->fts_cur = NULL);
   }
@@ -523,7 +562,7 @@ name:    t = sp->fts_path + NAPPEND(p->fts_parent);
     SET(FTS_STOP);
     return (NULL);
   }
-  free(tmp);
+  fts_free(sp, tmp);
   p->fts_info = p->fts_errno ? FTS_ERR : FTS_DP;
   return (sp->fts_cur = p);
 }
@@ -585,7 +624,7 @@ fts_children(FTS *sp, int instr)
 
   /* Free up any previous child list. */
   if (sp->fts_child != NULL)
-    fts_lfree(sp->fts_child);
+    fts_lfree(sp, sp->fts_child);
 
   if (instr == FTS_NAMEONLY) {
     SET(FTS_NAMEONLY);
@@ -705,7 +744,11 @@ fts_build(FTS *sp, int type)
     nostat = 0;
   } else if (ISSET(FTS_NOSTAT) && ISSET(FTS_PHYSICAL)) {
 #ifdef __native_client__
-    nlinks = cur->fts_nlink - (ISSET(FTS_SEEDOT) ? 0 : 2);
+    /*
+     * nacl_io filesystems don't keep UFS-style directory link counts, so
+     * only the d_type of each entry can be used to avoid stat calls.
+     */
+    nlinks = -1;
 #else
     if (fts_ufslinks(sp, cur))
       nlinks = cur->fts_nlink - (ISSET(FTS_SEEDOT) ? 0 : 2);
@@ -793,8 +836,8 @@ fts_build(FTS *sp, int type)
          */
 mem1:        saved_errno = errno;
         if (p)
-          free(p);
-        fts_lfree(head);
+          fts_free(sp, p);
+        fts_lfree(sp, head);
         (void)closedir(dirp);
         cur->fts_info = FTS_ERR;
         SET(FTS_STOP);
@@ -1036,24 +1079,27 @@ fts_alloc(FTS *sp, char *name, size_t namelen)
 {
   FTSENT *p;
   size_t len;
-
-  struct ftsent_withstat {
-    FTSENT  ent;
-    struct  stat statbuf;
-  };
+  int pooled;
 
   /*
    * The file name is a variable length array and no stat structure is
    * necessary if the user has set the nostat bit.  Allocate the FTSENT
    * structure, the file name and the stat structure in one chunk, but
-   * be careful that the stat structure is reasonably aligned.
+   * be careful that the stat structure is reasonably aligned.  Short
+   * names come from the pool, which always reserves FTS_POOL_NAMELEN
+   * bytes for the name.
    */
   if (ISSET(FTS_NOSTAT))
-    len = sizeof(FTSENT) + namelen + 1;
+    len = sizeof(FTSENT);
   else
-    len = sizeof(struct ftsent_withstat) + namelen + 1;
+    len = sizeof(struct ftsent_withstat);
 
-  if ((p = malloc(len)) == NULL)
+  pooled = namelen < FTS_POOL_NAMELEN;
+  if (pooled)
+    p = fts_pool_get(sp, len + FTS_POOL_NAMELEN);
+  else
+    p = malloc(len + namelen + 1);
+  if (p == NULL)
     return (NULL);
 
   if (ISSET(FTS_NOSTAT)) {
@@ -1070,7 +1116,7 @@ fts_alloc(FTS *sp, char *name, size_t namelen)
   p->fts_namelen = namelen;
   p->fts_path = sp->fts_path;
   p->fts_errno = 0;
-  p->fts_flags = 0;
+  p->fts_flags = pooled ? FTS_POOLED : 0;
   p->fts_instr = FTS_NOINSTR;
   p->fts_number = 0;
   p->fts_pointer = NULL;
@@ -1079,15 +1125,73 @@ fts_alloc(FTS *sp, char *name, size_t namelen)
 }
 
 static void
-fts_lfree(FTSENT *head)
+fts_free(FTS *sp, FTSENT *p)
+{
+  struct _fts_private *priv;
+
+  if (p->fts_flags & FTS_POOLED) {
+    priv = (struct _fts_private *)sp;
+    p->fts_link = priv->ftsp_free;
+    priv->ftsp_free = p;
+  } else
+    free(p);
+}
+
+static void
+fts_lfree(FTS *sp, FTSENT *head)
 {
   FTSENT *p;
 
   /* Free a linked list of structures. */
   while ((p = head)) {
     head = head->fts_link;
-    free(p);
+    fts_free(sp, p);
+  }
+}
+
+/*
+ * Take an entry of the given size from the pool, carving a new slab when
+ * the free list is empty.  The size must not change over the life of the
+ * stream; it only depends on FTS_NOSTAT.
+ */
+static FTSENT *
+fts_pool_get(FTS *sp, size_t size)
+{
+  struct _fts_private *priv;
+  FTSENT *p;
+  char *slab;
+  size_t i;
+
+  priv = (struct _fts_private *)sp;
+  if (priv->ftsp_free == NULL) {
+    size = roundup(size, FTS_POOL_ALIGN);
+    if ((slab = malloc(FTS_POOL_ALIGN + size * FTS_POOL_SLABSIZE)) == NULL)
+      return (NULL);
+    *(void **)slab = priv->ftsp_slabs;
+    priv->ftsp_slabs = slab;
+    for (i = FTS_POOL_SLABSIZE; i-- > 0;) {
+      p = (FTSENT *)(slab + FTS_POOL_ALIGN + i * size);
+      p->fts_link = priv->ftsp_free;
+      priv->ftsp_free = p;
+    }
+  }
+  p = priv->ftsp_free;
+  priv->ftsp_free = p->fts_link;
+  return (p);
+}
+
+static void
+fts_pool_release(FTS *sp)
+{
+  struct _fts_private *priv;
+  void *slab;
+
+  priv = (struct _fts_private *)sp;
+  while ((slab = priv->ftsp_slabs) != NULL) {
+    priv->ftsp_slabs = *(void **)slab;
+    free(slab);
   }
+  priv->ftsp_free = NULL;
 }
 
 /*
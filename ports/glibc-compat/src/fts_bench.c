@@ -0,0 +1,170 @@
+/*
+ * Copyright 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Builds a tree of --files empty files (100000), a thousand to a directory,
+ * and walks it with fts in several modes, reporting how many entries each
+ * walk returned, how many stat calls it made and how long it took.  The
+ * calls are counted by wrapping stat, lstat and fstat at link time
+ * (-Wl,--wrap, see the Makefile), which catches the calls fts.c makes.
+ *
+ *   fts_bench [--files=N] [--per-dir=N]
+ *
+ * FTS_NOSTAT walks should only stat directories where the libc reports
+ * d_type.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define BENCH_ROOT "fts_bench_tree"
+
+static long g_stats;
+
+int __real_stat(const char* path, struct stat* buf);
+int __real_lstat(const char* path, struct stat* buf);
+int __real_fstat(int fd, struct stat* buf);
+
+int __wrap_stat(const char* path, struct stat* buf) {
+  g_stats++;
+  return __real_stat(path, buf);
+}
+
+int __wrap_lstat(const char* path, struct stat* buf) {
+  g_stats++;
+  return __real_lstat(path, buf);
+}
+
+int __wrap_fstat(int fd, struct stat* buf) {
+  g_stats++;
+  return __real_fstat(fd, buf);
+}
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int make_tree(long files, long per_dir) {
+  char path[64];
+  long i;
+  int fd;
+
+  if (mkdir(BENCH_ROOT, 0777) < 0) {
+    perror(BENCH_ROOT);
+    return 0;
+  }
+  for (i = 0; i < files; i++) {
+    if (i % per_dir == 0) {
+      snprintf(path, sizeof(path), "%s/dir%ld", BENCH_ROOT, i / per_dir);
+      if (mkdir(path, 0777) < 0) {
+        perror(path);
+        return 0;
+      }
+    }
+    snprintf(path, sizeof(path), "%s/dir%ld/file%ld", BENCH_ROOT,
+             i / per_dir, i % per_dir);
+    if ((fd = open(path, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR)) < 0) {
+      perror(path);
+      return 0;
+    }
+    close(fd);
+  }
+  return 1;
+}
+
+/* Walks the tree once and prints a row; returns 0 if fts failed. */
+static int walk(const char* name, int options) {
+  char root[] = BENCH_ROOT;
+  char* const paths[] = { root, NULL };
+  long entries = 0, errors = 0;
+  double start;
+  FTSENT* ent;
+  FTS* fts;
+
+  g_stats = 0;
+  start = now();
+  if ((fts = fts_open(paths, options, NULL)) == NULL) {
+    perror("fts_open");
+    return 0;
+  }
+  errno = 0;
+  while ((ent = fts_read(fts)) != NULL) {
+    entries++;
+    if (ent->fts_info == FTS_ERR || ent->fts_info == FTS_DNR ||
+        ent->fts_info == FTS_NS)
+      errors++;
+  }
+  if (errno)
+    errors++;
+  fts_close(fts);
+  printf("%-18s %9ld %9ld %9.3f\n", name, entries, g_stats, now() - start);
+  return errors == 0;
+}
+
+/* Removes the tree in post-order. */
+static void remove_tree(void) {
+  char root[] = BENCH_ROOT;
+  char* const paths[] = { root, NULL };
+  FTSENT* ent;
+  FTS* fts;
+
+  if ((fts = fts_open(paths, FTS_PHYSICAL, NULL)) == NULL)
+    return;
+  while ((ent = fts_read(fts)) != NULL) {
+    if (ent->fts_info == FTS_DP)
+      rmdir(ent->fts_accpath);
+    else if (ent->fts_info == FTS_F)
+      unlink(ent->fts_accpath);
+  }
+  fts_close(fts);
+}
+
+int main(int argc, char** argv) {
+  long files = 100000;
+  long per_dir = 1000;
+  int i, ok = 1;
+
+  for (i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--files=", 8) == 0) {
+      files = atol(argv[i] + 8);
+    } else if (strncmp(argv[i], "--per-dir=", 10) == 0) {
+      per_dir = atol(argv[i] + 10);
+    } else {
+      files = 0;
+      break;
+    }
+  }
+  if (files <= 0 || per_dir <= 0) {
+    fprintf(stderr, "usage: %s [--files=N] [--per-dir=N]\n", argv[0]);
+    return 1;
+  }
+
+  remove_tree();
+  if (!make_tree(files, per_dir)) {
+    remove_tree();
+    return 1;
+  }
+
+  printf("%ld files in %ld directories\n", files,
+         (files + per_dir - 1) / per_dir);
+  printf("%-18s %9s %9s %9s\n", "walk", "entries", "stats", "seconds");
+  ok &= walk("physical", FTS_PHYSICAL);
+  ok &= walk("physical,nostat", FTS_PHYSICAL | FTS_NOSTAT);
+  ok &= walk("logical", FTS_LOGICAL);
+  ok &= walk("logical,nostat", FTS_LOGICAL | FTS_NOSTAT);
+
+  remove_tree();
+  return ok ? 0 : 1;
+}
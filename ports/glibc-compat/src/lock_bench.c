@@ -0,0 +1,177 @@
+/*
+ * Copyright 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Contention benchmark for the lock table: threads, each with its own
+ * descriptor on one file, lock and unlock random overlapping byte ranges.
+ * Every lock is tried with F_SETLK first, and waited for with F_SETLKW only
+ * if that fails, so the report shows how many requests found the range
+ * taken as well as the lock/unlock pairs per second.
+ *
+ *   lock_bench [--threads=N] [--ops=N] [--span=BYTES] [--len=BYTES]
+ *              [--writes=PERCENT] [--hold=N]
+ *
+ * It runs 1, 2, 4, ... up to --threads threads (8 by default), each doing
+ * --ops lock/unlock pairs (100000) on ranges of up to --len bytes (64)
+ * within the first --span bytes (1024) of the file.  --writes percent of
+ * the locks (50) are exclusive, the rest shared.  Each lock is held for
+ * --hold turns of an empty loop (200).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "lock_table.h"
+
+#define BENCH_FILE "lock_bench.dat"
+
+static int g_ops = 100000;
+static int g_span = 1024;
+static int g_len = 64;
+static int g_writes = 50;
+static int g_hold = 200;
+
+struct worker {
+  pthread_t thread;
+  unsigned seed;
+  long contended;
+  int failed;
+};
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* A fixed sequence per thread, so that runs are comparable. */
+static unsigned next_random(unsigned* state) {
+  *state = *state * 1103515245 + 12345;
+  return *state >> 8;
+}
+
+static void* run_worker(void* arg) {
+  struct worker* w = arg;
+  struct flock lock;
+  volatile int spin;
+  int fd, i;
+
+  if ((fd = open(BENCH_FILE, O_RDWR)) < 0) {
+    w->failed = 1;
+    return NULL;
+  }
+  lock.l_whence = SEEK_SET;
+  for (i = 0; i < g_ops && !w->failed; i++) {
+    lock.l_start = next_random(&w->seed) % g_span;
+    lock.l_len = next_random(&w->seed) % g_len + 1;
+    lock.l_type = (int)(next_random(&w->seed) % 100) < g_writes ? F_WRLCK
+                                                                  : F_RDLCK;
+    if (__lock_table_setlk(fd, fd, F_SETLK, &lock) < 0) {
+      if (errno != EAGAIN ||
+          __lock_table_setlk(fd, fd, F_SETLKW, &lock) < 0) {
+        w->failed = 1;
+        break;
+      }
+      w->contended++;
+    }
+    for (spin = 0; spin < g_hold; spin++)
+      continue;
+    lock.l_type = F_UNLCK;
+    if (__lock_table_setlk(fd, fd, F_SETLK, &lock) < 0)
+      w->failed = 1;
+  }
+  close(fd);
+  return NULL;
+}
+
+/* Runs one round with nthreads threads; returns 0 if any of them failed. */
+static int run_round(int nthreads) {
+  struct worker* workers = calloc(nthreads, sizeof(*workers));
+  long contended = 0;
+  double start, elapsed;
+  int i, ok = 1;
+
+  if (!workers)
+    return 0;
+  start = now();
+  for (i = 0; i < nthreads; i++) {
+    workers[i].seed = i + 1;
+    if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) {
+      nthreads = i;
+      ok = 0;
+      break;
+    }
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    contended += workers[i].contended;
+    if (workers[i].failed)
+      ok = 0;
+  }
+  elapsed = now() - start;
+  free(workers);
+
+  if (!ok) {
+    printf("%7d  failed: %s\n", nthreads, strerror(errno));
+    return 0;
+  }
+  printf("%7d %12.0f %10.1f%%\n", nthreads,
+         (double)g_ops * nthreads / elapsed,
+         100.0 * contended / ((double)g_ops * nthreads));
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  int max_threads = 8;
+  int i, fd, ok = 1;
+
+  for (i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--threads=", 10) == 0) {
+      max_threads = atoi(argv[i] + 10);
+    } else if (strncmp(argv[i], "--ops=", 6) == 0) {
+      g_ops = atoi(argv[i] + 6);
+    } else if (strncmp(argv[i], "--span=", 7) == 0) {
+      g_span = atoi(argv[i] + 7);
+    } else if (strncmp(argv[i], "--len=", 6) == 0) {
+      g_len = atoi(argv[i] + 6);
+    } else if (strncmp(argv[i], "--writes=", 9) == 0) {
+      g_writes = atoi(argv[i] + 9);
+    } else if (strncmp(argv[i], "--hold=", 7) == 0) {
+      g_hold = atoi(argv[i] + 7);
+    } else {
+      max_threads = 0;
+      break;
+    }
+  }
+  if (max_threads <= 0 || g_ops <= 0 || g_span <= 0 || g_len <= 0) {
+    fprintf(stderr, "usage: %s [--threads=N] [--ops=N] [--span=BYTES] "
+            "[--len=BYTES] [--writes=PERCENT] [--hold=N]\n", argv[0]);
+    return 1;
+  }
+
+  if ((fd = open(BENCH_FILE, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) < 0) {
+    perror(BENCH_FILE);
+    return 1;
+  }
+  close(fd);
+
+  printf("%d lock/unlock pairs per thread, ranges of 1-%d bytes in %d, "
+         "%d%% exclusive\n", g_ops, g_len, g_span, g_writes);
+  printf("%7s %12s %11s\n", "threads", "pairs/s", "contended");
+  for (i = 1; i < max_threads; i *= 2)
+    ok &= run_round(i);
+  ok &= run_round(max_threads);
+
+  unlink(BENCH_FILE);
+  return ok ? 0 : 1;
+}
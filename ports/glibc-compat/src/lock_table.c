@@ -0,0 +1,292 @@
+/*
+ * Copyright 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "lock_table.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOCK_EOF INT64_MAX
+#define FILE_BUCKETS 64
+/* How often a waiter looks for locks whose descriptor was closed. */
+#define STALE_CHECK_MS 100
+
+/* A byte range [start, end) locked by owner, through descriptor fd. */
+struct range_lock {
+  struct range_lock* next;
+  int owner;
+  int fd;
+  int exclusive;
+  int64_t start;
+  int64_t end;
+};
+
+/* Lock state for one file, identified by device and inode. */
+struct locked_file {
+  struct locked_file* next;
+  dev_t dev;
+  ino_t ino;
+  int waiters;
+  pthread_cond_t released;
+  struct range_lock* locks;
+};
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct locked_file* files[FILE_BUCKETS];
+
+static struct locked_file** find_file(dev_t dev, ino_t ino) {
+  struct locked_file** fp = &files[(ino ^ dev) % FILE_BUCKETS];
+  while (*fp && ((*fp)->dev != dev || (*fp)->ino != ino))
+    fp = &(*fp)->next;
+  return fp;
+}
+
+/*
+ * close() does not come through here, so a lock can outlive the
+ * descriptor it was taken through.  It is known to be stale once that
+ * descriptor is closed or refers to another file.
+ */
+static int stale(struct locked_file* file, struct range_lock* lk) {
+  struct stat st;
+  return fstat(lk->fd, &st) < 0 || st.st_dev != file->dev ||
+         st.st_ino != file->ino;
+}
+
+/*
+ * Whether another owner's lock is in the way.  Stale locks in the way are
+ * dropped rather than waited for.
+ */
+static int conflicts(struct locked_file* file, int owner, int exclusive,
+                     int64_t start, int64_t end) {
+  struct range_lock** lp = &file->locks;
+  int found = 0, dropped = 0;
+  while (*lp) {
+    struct range_lock* lk = *lp;
+    if (lk->owner == owner || lk->end <= start || end <= lk->start ||
+        !(exclusive || lk->exclusive)) {
+      lp = &lk->next;
+    } else if (stale(file, lk)) {
+      *lp = lk->next;
+      free(lk);
+      dropped = 1;
+    } else {
+      found = 1;
+      break;
+    }
+  }
+  if (dropped && file->waiters)
+    pthread_cond_broadcast(&file->released);
+  return found;
+}
+
+/*
+ * Wait for a lock on the file to be released, or for STALE_CHECK_MS to
+ * pass, since a descriptor that is closed while locked wakes nobody.
+ */
+static void wait_released(struct locked_file* file) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += STALE_CHECK_MS * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  file->waiters++;
+  pthread_cond_timedwait(&file->released, &table_lock, &deadline);
+  file->waiters--;
+}
+
+/*
+ * Whether removing [start, end) from the owner's locks splits one of them
+ * in two, which takes a new entry for the tail.  The owner's locks never
+ * overlap each other, so at most one can be split.
+ */
+static int splits(struct locked_file* file, int owner, int64_t start,
+                  int64_t end) {
+  struct range_lock* lk;
+  for (lk = file->locks; lk; lk = lk->next) {
+    if (lk->owner == owner && lk->start < start && end < lk->end)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Remove the owner's locks from [start, end), trimming or splitting any
+ * that only partly overlap.  A split uses tail, which the caller allocates
+ * beforehand (see splits()) so that this cannot fail halfway; it is freed
+ * if not needed.
+ */
+static void unlock_range(struct locked_file* file, int owner, int64_t start,
+                         int64_t end, struct range_lock* tail) {
+  struct range_lock** lp = &file->locks;
+  while (*lp) {
+    struct range_lock* lk = *lp;
+    if (lk->owner != owner || lk->end <= start || end <= lk->start) {
+      lp = &lk->next;
+      continue;
+    }
+    if (lk->start < start && end < lk->end) {
+      *tail = *lk;
+      tail->start = end;
+      lk->end = start;
+      lk->next = tail;
+      return;
+    }
+    if (lk->start < start) {
+      lk->end = start;
+    } else if (end < lk->end) {
+      lk->start = end;
+    } else {
+      *lp = lk->next;
+      free(lk);
+      continue;
+    }
+    lp = &lk->next;
+  }
+  free(tail);
+}
+
+/* Convert the l_whence/l_start/l_len triple into an absolute range. */
+static int lock_range(int fd, const struct flock* lock, const struct stat* st,
+                      int64_t* start, int64_t* end) {
+  int64_t base;
+  switch (lock->l_whence) {
+    case SEEK_SET:
+      base = 0;
+      break;
+    case SEEK_CUR:
+      if ((base = lseek(fd, 0, SEEK_CUR)) < 0)
+        return -1;
+      break;
+    case SEEK_END:
+      base = st->st_size;
+      break;
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+  *start = base + lock->l_start;
+  if (lock->l_len > 0) {
+    *end = *start + lock->l_len;
+  } else if (lock->l_len < 0) {
+    *end = *start;
+    *start += lock->l_len;
+  } else {
+    *end = LOCK_EOF;
+  }
+  if (*start < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+int __lock_table_setlk(int fd, int owner, int cmd, const struct flock* lock) {
+  struct stat st;
+  struct locked_file** fp;
+  struct locked_file* file;
+  struct range_lock* lk;
+  struct range_lock* tail;
+  int64_t start, end;
+  int exclusive, result = 0;
+
+  if (cmd != F_SETLK && cmd != F_SETLKW) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (lock->l_type != F_RDLCK && lock->l_type != F_WRLCK &&
+      lock->l_type != F_UNLCK) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (fstat(fd, &st) < 0)
+    return -1;
+  if (lock_range(fd, lock, &st, &start, &end) < 0)
+    return -1;
+  exclusive = lock->l_type == F_WRLCK;
+
+  pthread_mutex_lock(&table_lock);
+  fp = find_file(st.st_dev, st.st_ino);
+  file = *fp;
+  if (lock->l_type == F_UNLCK) {
+    if (file) {
+      tail = NULL;
+      if (splits(file, owner, start, end) &&
+          !(tail = malloc(sizeof(*tail)))) {
+        errno = ENOLCK;
+        result = -1;
+        goto done;
+      }
+      unlock_range(file, owner, start, end, tail);
+      pthread_cond_broadcast(&file->released);
+    }
+    goto done;
+  }
+
+  if (!file) {
+    if (!(file = calloc(1, sizeof(*file)))) {
+      errno = ENOLCK;
+      result = -1;
+      goto done;
+    }
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    pthread_cond_init(&file->released, NULL);
+    *fp = file;
+  }
+
+  while (conflicts(file, owner, exclusive, start, end)) {
+    if (cmd == F_SETLK) {
+      errno = EAGAIN;
+      result = -1;
+      goto done;
+    }
+    wait_released(file);
+  }
+
+  /*
+   * Replace whatever the owner held in the range, which turns an existing
+   * shared lock into an exclusive one or vice versa.
+   */
+  lk = malloc(sizeof(*lk));
+  tail = NULL;
+  if (!lk ||
+      (splits(file, owner, start, end) && !(tail = malloc(sizeof(*tail))))) {
+    free(lk);
+    errno = ENOLCK;
+    result = -1;
+    goto done;
+  }
+  unlock_range(file, owner, start, end, tail);
+  lk->owner = owner;
+  lk->fd = fd;
+  lk->exclusive = exclusive;
+  lk->start = start;
+  lk->end = end;
+  lk->next = file->locks;
+  file->locks = lk;
+  /* A downgrade may let shared waiters in. */
+  if (!exclusive && file->waiters)
+    pthread_cond_broadcast(&file->released);
+
+done:
+  /* Drop the file's entry once nobody holds or waits for a lock on it. */
+  fp = find_file(st.st_dev, st.st_ino);
+  file = *fp;
+  if (file && !file->locks && !file->waiters) {
+    *fp = file->next;
+    pthread_cond_destroy(&file->released);
+    free(file);
+  }
+  pthread_mutex_unlock(&table_lock);
+  return result;
+}
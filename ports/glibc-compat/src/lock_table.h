@@ -0,0 +1,30 @@
+/*
+ * Copyright 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef GLIBCEMU_LOCK_TABLE_H
+#define GLIBCEMU_LOCK_TABLE_H 1
+
+#include <fcntl.h>
+
+/*
+ * In-process replacement for fcntl(F_SETLK / F_SETLKW), which NaCl does
+ * not implement.  Every lock has an owner: LOCK_TABLE_PROCESS for lockf(),
+ * whose locks belong to the process as fcntl() locks do, or the descriptor
+ * for flock().  Locks of different owners on the same file conflict, so
+ * threads flock()ing separate descriptors exclude each other, while the
+ * process never waits for its own lockf() locks.  Blocking requests sleep
+ * until a conflicting lock is released.
+ *
+ * close() does not come through here.  A lock whose descriptor has been
+ * closed, or reused for another file, is dropped as soon as it is in the
+ * way of another request.  A descriptor number reused for the same file
+ * takes over the old locks.
+ */
+#define LOCK_TABLE_PROCESS (-1)
+
+int __lock_table_setlk(int fd, int owner, int cmd, const struct flock *lock);
+
+#endif
@@ -9,6 +9,8 @@
 #include <stdio.h>
 #include <strings.h>
 
+#include "lock_table.h"
+
 int lockf(int fd, int command, off_t size) {
   struct flock params;
   bzero(&params, sizeof(params));
@@ -33,5 +35,5 @@ int lockf(int fd, int command, off_t size) {
       return -1;
   }
 
-  return fcntl(fd, fcntl_command, &params);
+  return __lock_table_setlk(fd, LOCK_TABLE_PROCESS, fcntl_command, &params);
 }
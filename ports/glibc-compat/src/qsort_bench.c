@@ -0,0 +1,121 @@
+/*
+ * Copyright 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Times qsort_r and mergesort_r, with the libc qsort for comparison, on
+ * --count ints (1000000) in random, sorted, reversed and organ-pipe order,
+ * and in few distinct values.  Reports milliseconds and comparisons per
+ * element for each, and checks that the result is sorted.
+ *
+ *   qsort_bench [--count=N]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static size_t g_compares;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int compare_ints(const void* a, const void* b) {
+  int x = *(const int*)a;
+  int y = *(const int*)b;
+  g_compares++;
+  return x < y ? -1 : x > y;
+}
+
+static int compare_ints_r(const void* a, const void* b, void* arg) {
+  int x = *(const int*)a;
+  int y = *(const int*)b;
+  ++*(size_t*)arg;
+  return x < y ? -1 : x > y;
+}
+
+static void fill(int* values, size_t n, const char* pattern) {
+  size_t i;
+  srand(1);
+  for (i = 0; i < n; i++) {
+    if (strcmp(pattern, "random") == 0)
+      values[i] = rand();
+    else if (strcmp(pattern, "sorted") == 0)
+      values[i] = i;
+    else if (strcmp(pattern, "reversed") == 0)
+      values[i] = n - i;
+    else if (strcmp(pattern, "organ-pipe") == 0)
+      values[i] = i < n / 2 ? i : n - i;
+    else
+      values[i] = rand() % 16;
+  }
+}
+
+/* Sorts values with the named function; returns 0 if the result is wrong. */
+static int run(const char* sort, int* values, size_t n) {
+  size_t compares = 0, i;
+  double start = now();
+
+  if (strcmp(sort, "qsort_r") == 0) {
+    qsort_r(values, n, sizeof(int), compare_ints_r, &compares);
+  } else if (strcmp(sort, "mergesort_r") == 0) {
+    if (mergesort_r(values, n, sizeof(int), compare_ints_r, &compares) < 0)
+      return 0;
+  } else {
+    g_compares = 0;
+    qsort(values, n, sizeof(int), compare_ints);
+    compares = g_compares;
+  }
+  printf(" %9.1f %6.1f", (now() - start) * 1e3, (double)compares / n);
+  for (i = 1; i < n; i++) {
+    if (values[i - 1] > values[i])
+      return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  static const char* const patterns[] = {
+    "random", "sorted", "reversed", "organ-pipe", "few-unique"
+  };
+  static const char* const sorts[] = { "qsort_r", "mergesort_r", "qsort" };
+  size_t count = 1000000;
+  size_t p, s;
+  int* values;
+  int ok = 1;
+
+  if (argc > 2 || (argc == 2 && strncmp(argv[1], "--count=", 8) != 0) ||
+      (argc == 2 && (count = atol(argv[1] + 8)) == 0)) {
+    fprintf(stderr, "usage: %s [--count=N]\n", argv[0]);
+    return 1;
+  }
+  if ((values = malloc(count * sizeof(int))) == NULL) {
+    perror("malloc");
+    return 1;
+  }
+
+  printf("%lu ints; ms and comparisons per element\n", (unsigned long)count);
+  printf("%-11s", "input");
+  for (s = 0; s < sizeof(sorts) / sizeof(sorts[0]); s++)
+    printf(" %16s", sorts[s]);
+  printf("\n");
+  for (p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+    printf("%-11s", patterns[p]);
+    for (s = 0; s < sizeof(sorts) / sizeof(sorts[0]); s++) {
+      fill(values, count, patterns[p]);
+      if (!run(sorts[s], values, count)) {
+        printf("\n%s: %s input not sorted\n", sorts[s], patterns[p]);
+        ok = 0;
+      }
+    }
+    printf("\n");
+  }
+  free(values);
+  return ok ? 0 : 1;
+}
@@ -1,9 +1,15 @@
 /*
- * This is an implementation of qsort_r that is copied from the newlib
+ * This is an implementation of qsort_r that is derived from the newlib
  * implementation of qsort.
  *
- * The only difference is that it takes a fifth argument, an opaque pointer,
- * which is passed to the comparison function as a third parameter.
+ * It takes a fifth argument, an opaque pointer, which is passed to the
+ * comparison function as a third parameter.  Unlike the newlib version it
+ * bounds the recursion depth and falls back to heapsort (introsort), so
+ * adversarial inputs can't make it go quadratic, and it has dedicated swap
+ * paths for 4, 8 and 16 byte elements.
+ *
+ * A stable merge sort with the same calling convention is provided as
+ * mergesort_r.
  */
 
 /*
@@ -83,17 +89,36 @@ PORTABILITY
  */
 
 #include <_ansi.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifndef __GNUC__
 #define inline
 #endif
 
 static inline char      *med3 _PARAMS((char *, char *, char *, int (*)(), void *));
-static inline void       swapfunc _PARAMS((char *, char *, int, int));
+static inline void       swapfunc _PARAMS((char *, char *, size_t, int));
+static inline int        swapinit _PARAMS((char *, size_t));
 
 #define min(a, b)       (a) < (b) ? a : b
 
+/*
+ * Element swap strategies, chosen once per call by swapinit.  The typed
+ * variants are only used when the base address is suitably aligned; since
+ * every element is a multiple of es away from the base they stay aligned.
+ */
+#define SWAP_LONG       0       /* one long */
+#define SWAP_LONGS      1       /* several longs */
+#define SWAP_BYTES      2       /* unaligned or odd sized */
+#define SWAP_INT32      3       /* one 32-bit word */
+#define SWAP_INT64      4       /* one 64-bit word */
+#define SWAP_INT128     5       /* two 64-bit words */
+
+/* Partitions smaller than this are finished with insertion sort. */
+#define INSERTION_THRESHOLD     7
+
+
 /*
  * Qsort routine from Bentley & McIlroy's "Engineering a Sort Function".
  */
@@ -108,29 +133,73 @@ static inline void       swapfunc _PARAMS((char *, char *, int, int));
         } while (--i > 0);                              \
 }
 
-#define SWAPINIT(a, es) swaptype = ((char *)a - (char *)0) % sizeof(long) || \
-        es % sizeof(long) ? 2 : es == sizeof(long)? 0 : 1;
+#define swapone(TYPE, a, b) {                           \
+        TYPE t = *(TYPE *)(a);                          \
+        *(TYPE *)(a) = *(TYPE *)(b);                    \
+        *(TYPE *)(b) = t;                               \
+}
+
+static inline int
+_DEFUN(swapinit, (a, es),
+        char *a _AND
+        size_t es)
+{
+        uintptr_t addr = (uintptr_t) a;
+
+        if (es == sizeof(uint32_t) && addr % sizeof(uint32_t) == 0)
+                return SWAP_INT32;
+        if ((es == sizeof(uint64_t) || es == 2 * sizeof(uint64_t)) &&
+            addr % sizeof(uint64_t) == 0)
+                return es == sizeof(uint64_t) ? SWAP_INT64 : SWAP_INT128;
+        if (addr % sizeof(long) || es % sizeof(long))
+                return SWAP_BYTES;
+        return es == sizeof(long) ? SWAP_LONG : SWAP_LONGS;
+}
 
 static inline void
 _DEFUN(swapfunc, (a, b, n, swaptype),
         char *a _AND
         char *b _AND
-        int n _AND
+        size_t n _AND
         int swaptype)
 {
-        if(swaptype <= 1) 
+        switch (swaptype) {
+        case SWAP_LONG:
+        case SWAP_LONGS:
                 swapcode(long, a, b, n)
-        else
+                break;
+        case SWAP_INT32:
+                swapcode(uint32_t, a, b, n)
+                break;
+        case SWAP_INT64:
+        case SWAP_INT128:
+                swapcode(uint64_t, a, b, n)
+                break;
+        default:
                 swapcode(char, a, b, n)
+                break;
+        }
 }
 
 #define swap(a, b)                                      \
-        if (swaptype == 0) {                            \
-                long t = *(long *)(a);                  \
-                *(long *)(a) = *(long *)(b);            \
-                *(long *)(b) = t;                       \
-        } else                                          \
-                swapfunc(a, b, es, swaptype)
+        switch (swaptype) {                             \
+        case SWAP_LONG:                                 \
+                swapone(long, a, b)                     \
+                break;                                  \
+        case SWAP_INT32:                                \
+                swapone(uint32_t, a, b)                 \
+                break;                                  \
+        case SWAP_INT64:                                \
+                swapone(uint64_t, a, b)                 \
+                break;                                  \
+        case SWAP_INT128:                               \
+                swapone(uint64_t, a, b)                 \
+                swapone(uint64_t, (a) + 8, (b) + 8)     \
+                break;                                  \
+        default:                                        \
+                swapfunc(a, b, es, swaptype);           \
+                break;                                  \
+        }
 
 #define vecswap(a, b, n)        if ((n) > 0) swapfunc(a, b, n, swaptype)
 
@@ -147,30 +216,110 @@ _DEFUN(med3, (a, b, c, cmp, arg),
               :(cmp(b, c, arg) > 0 ? b : (cmp(a, c, arg) < 0 ? a : c ));
 }
 
-void
-_DEFUN(qsort_r, (a, n, es, cmp, arg),
-        void *a _AND
+static void
+_DEFUN(insertion_sort, (a, n, es, cmp, arg, swaptype),
+        char *a _AND
         size_t n _AND
         size_t es _AND
         int (*cmp)() _AND
-        void *arg)
+        void *arg _AND
+        int swaptype)
+{
+        char *pl, *pm;
+
+        for (pm = a + es; pm < a + n * es; pm += es)
+                for (pl = pm; pl > a && cmp(pl - es, pl, arg) > 0; pl -= es)
+                        swap(pl, pl - es);
+}
+
+/*
+ * Insertion sort that gives up after n swaps, so trying it costs no more
+ * than a partitioning pass.  Returns 1 if the array ended up sorted;
+ * otherwise the array is left as some permutation of the input, which is
+ * still a valid partition for the caller to carry on with.
+ */
+static int
+_DEFUN(partial_insertion_sort, (a, n, es, cmp, arg, swaptype),
+        char *a _AND
+        size_t n _AND
+        size_t es _AND
+        int (*cmp)() _AND
+        void *arg _AND
+        int swaptype)
+{
+        char *pl, *pm;
+        size_t moves = 0;
+
+        for (pm = a + es; pm < a + n * es; pm += es) {
+                for (pl = pm; pl > a && cmp(pl - es, pl, arg) > 0; pl -= es) {
+                        swap(pl, pl - es);
+                        if (++moves > n)
+                                return 0;
+                }
+        }
+        return 1;
+}
+
+static void
+_DEFUN(heap_sort, (a, n, es, cmp, arg, swaptype),
+        char *a _AND
+        size_t n _AND
+        size_t es _AND
+        int (*cmp)() _AND
+        void *arg _AND
+        int swaptype)
+{
+        size_t i, root, child, end;
+
+        /* Build a max-heap, then repeatedly move its root to the end. */
+        for (end = n, i = n / 2; ; ) {
+                if (i > 0) {
+                        root = --i;
+                } else {
+                        if (--end == 0)
+                                return;
+                        swap(a, a + end * es);
+                        root = 0;
+                }
+                while ((child = 2 * root + 1) < end) {
+                        if (child + 1 < end &&
+                            cmp(a + child * es, a + (child + 1) * es, arg) < 0)
+                                child++;
+                        if (cmp(a + root * es, a + child * es, arg) >= 0)
+                                break;
+                        swap(a + root * es, a + child * es);
+                        root = child;
+                }
+        }
+}
+
+static void
+_DEFUN(introsort, (a, n, es, cmp, arg, swaptype, depth),
+        char *a _AND
+        size_t n _AND
+        size_t es _AND
+        int (*cmp)() _AND
+        void *arg _AND
+        int swaptype _AND
+        int depth)
 {
         char *pa, *pb, *pc, *pd, *pl, *pm, *pn;
-        int d, r, swaptype, swap_cnt;
+        size_t d, nl, nr;
+        int r, swap_cnt;
 
-loop:   SWAPINIT(a, es);
-        swap_cnt = 0;
-        if (n < 7) {
-                for (pm = (char *) a + es; pm < (char *) a + n * es; pm += es)
-                        for (pl = pm; pl > (char *) a && cmp(pl - es, pl, arg) > 0;
-                             pl -= es)
-                                swap(pl, pl - es);
+loop:   if (n < INSERTION_THRESHOLD) {
+                insertion_sort(a, n, es, cmp, arg, swaptype);
+                return;
+        }
+        if (depth-- == 0) {
+                heap_sort(a, n, es, cmp, arg, swaptype);
                 return;
         }
-        pm = (char *) a + (n / 2) * es;
+        swap_cnt = 0;
+        pm = a + (n / 2) * es;
         if (n > 7) {
                 pl = a;
-                pn = (char *) a + (n - 1) * es;
+                pn = a + (n - 1) * es;
                 if (n > 40) {
                         d = (n / 8) * es;
                         pl = med3(pl, pl + d, pl + 2 * d, cmp, arg);
@@ -180,9 +329,9 @@ loop:   SWAPINIT(a, es);
                 pm = med3(pl, pm, pn, cmp, arg);
         }
         swap(a, pm);
-        pa = pb = (char *) a + es;
+        pa = pb = a + es;
 
-        pc = pd = (char *) a + (n - 1) * es;
+        pc = pd = a + (n - 1) * es;
         for (;;) {
                 while (pb <= pc && (r = cmp(pb, a, arg)) <= 0) {
                         if (r == 0) {
@@ -207,26 +356,128 @@ loop:   SWAPINIT(a, es);
                 pb += es;
                 pc -= es;
         }
-        if (swap_cnt == 0) {  /* Switch to insertion sort */
-                for (pm = (char *) a + es; pm < (char *) a + n * es; pm += es)
-                        for (pl = pm; pl > (char *) a && cmp(pl - es, pl, arg) > 0; 
-                             pl -= es)
-                                swap(pl, pl - es);
-                return;
-        }
 
-        pn = (char *) a + n * es;
-        r = min(pa - (char *)a, pb - pa);
+        pn = a + n * es;
+        r = min(pa - a, pb - pa);
         vecswap(a, pb - r, r);
         r = min(pd - pc, pn - pd - es);
         vecswap(pb, pn - r, r);
-        if ((r = pb - pa) > es)
-                qsort_r(a, r / es, es, cmp, arg);
-        if ((r = pd - pc) > es) { 
-                /* Iterate rather than recurse to save stack space */
-                a = pn - r;
-                n = r / es;
+        nl = (pb - pa) / es;
+        nr = (pd - pc) / es;
+        /*
+         * If partitioning moved nothing the input is probably sorted
+         * already, so try finishing both sides with insertion sort.
+         */
+        if (swap_cnt == 0) {
+                if (partial_insertion_sort(a, nl, es, cmp, arg, swaptype) &&
+                    partial_insertion_sort(pn - nr * es, nr, es, cmp, arg,
+                                           swaptype))
+                        return;
+        }
+        /* Recurse into the smaller side and iterate on the larger one. */
+        if (nl < nr) {
+                if (nl > 1)
+                        introsort(a, nl, es, cmp, arg, swaptype, depth);
+                a = pn - nr * es;
+                n = nr;
+        } else {
+                if (nr > 1)
+                        introsort(pn - nr * es, nr, es, cmp, arg, swaptype,
+                                  depth);
+                n = nl;
+        }
+        if (n > 1)
                 goto loop;
+}
+
+void
+_DEFUN(qsort_r, (a, n, es, cmp, arg),
+        void *a _AND
+        size_t n _AND
+        size_t es _AND
+        int (*cmp)() _AND
+        void *arg)
+{
+        size_t i;
+        int depth;
+
+        if (n < 2 || es == 0)
+                return;
+        /* Allow 2 * log2(n) levels of partitioning before using heapsort. */
+        for (depth = 0, i = n; i > 1; i >>= 1)
+                depth += 2;
+        introsort(a, n, es, cmp, arg, swapinit(a, es), depth);
+}
+
+static void
+_DEFUN(merge_sort, (a, tmp, n, es, cmp, arg, swaptype),
+        char *a _AND
+        char *tmp _AND
+        size_t n _AND
+        size_t es _AND
+        int (*cmp)() _AND
+        void *arg _AND
+        int swaptype)
+{
+        char *pl, *pr, *pe, *out, *tl;
+        size_t m;
+
+        if (n < INSERTION_THRESHOLD) {
+                /* Only swaps strictly out-of-order neighbours: stable. */
+                insertion_sort(a, n, es, cmp, arg, swaptype);
+                return;
+        }
+        m = n / 2;
+        merge_sort(a, tmp, m, es, cmp, arg, swaptype);
+        merge_sort(a + m * es, tmp, n - m, es, cmp, arg, swaptype);
+        /* Halves that are already in order need no merge. */
+        if (cmp(a + (m - 1) * es, a + m * es, arg) <= 0)
+                return;
+
+        /*
+         * Move the left half aside and merge back into place.  The output
+         * never overtakes the right half, so it can be read in place.
+         */
+        memcpy(tmp, a, m * es);
+        pl = tmp;
+        tl = tmp + m * es;
+        pr = a + m * es;
+        pe = a + n * es;
+        out = a;
+        while (pl < tl && pr < pe) {
+                if (cmp(pr, pl, arg) < 0) {
+                        memcpy(out, pr, es);
+                        pr += es;
+                } else {
+                        memcpy(out, pl, es);
+                        pl += es;
+                }
+                out += es;
         }
-/*              qsort_r(pn - r, r / es, es, cmp, arg);*/
+        if (pl < tl)
+                memcpy(out, pl, tl - pl);
+}
+
+/*
+ * Stable sort with the same interface as qsort_r.  Needs nmemb / 2
+ * elements of scratch space; returns -1 with errno set to ENOMEM if that
+ * can't be allocated, and 0 on success.
+ */
+int
+_DEFUN(mergesort_r, (a, n, es, cmp, arg),
+        void *a _AND
+        size_t n _AND
+        size_t es _AND
+        int (*cmp)() _AND
+        void *arg)
+{
+        char *tmp;
+
+        if (n < 2 || es == 0)
+                return 0;
+        if ((tmp = malloc((n / 2) * es)) == NULL)
+                return -1;
+        merge_sort(a, tmp, n, es, cmp, arg, swapinit(a, es));
+        free(tmp);
+        return 0;
 }
@@ -0,0 +1,299 @@
+/* Copyright 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. */
+
+/*
+ * In-process answer cache for res_nsend.
+ *
+ * Responses are keyed by their question (name, type and class, plus the
+ * RD and CD header bits) and kept for the smallest TTL of the records they
+ * carry.  NXDOMAIN and NODATA responses are cached too, limited by the SOA
+ * MINIMUM of the authority section as described in RFC 2308; negative
+ * responses without an SOA are not cached.  The table is split into
+ * stripes with a lock each so that threads resolving different names
+ * rarely contend.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+
+#include <ctype.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_STRIPES		16
+#define CACHE_BUCKETS		64	/* hash chains per stripe */
+#define CACHE_MAXENTRIES	256	/* entries per stripe */
+#define CACHE_MAXTTL		86400	/* seconds */
+
+struct cache_key {
+	char		name[MAXDNAME + 1];
+	u_int32_t	hash;
+	u_int16_t	type;
+	u_int16_t	class;
+	u_int16_t	flags;
+};
+
+struct cache_entry {
+	struct cache_entry *next;
+	struct cache_key *key;
+	time_t		expires;
+	int		anslen;
+	u_char		*ans;
+};
+
+struct cache_stripe {
+	pthread_mutex_t	lock;
+	int		count;
+	struct cache_entry *buckets[CACHE_BUCKETS];
+};
+
+static struct cache_stripe stripes[CACHE_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+static void
+cache_init(void) {
+	int i;
+
+	for (i = 0; i < CACHE_STRIPES; i++)
+		pthread_mutex_init(&stripes[i].lock, NULL);
+}
+
+static time_t
+cache_now(void) {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return (time(NULL));
+	return (ts.tv_sec);
+}
+
+/*
+ * Extract the lookup key from a query.  Only plain single-question queries
+ * without additional records are cached; anything carrying EDNS options or
+ * signatures goes to the wire every time.
+ */
+static int
+cache_key(const u_char *msg, int msglen, struct cache_key *key) {
+	const HEADER *hp = (const HEADER *) msg;
+	const u_char *eom = msg + msglen;
+	const u_char *cp = msg + HFIXEDSZ;
+	char *p;
+	int n;
+
+	if (msglen < HFIXEDSZ || hp->opcode != ns_o_query ||
+	    ntohs(hp->qdcount) != 1 || hp->ancount != 0 ||
+	    hp->nscount != 0 || hp->arcount != 0)
+		return (-1);
+	n = dn_expand(msg, eom, cp, key->name, sizeof key->name);
+	if (n < 0)
+		return (-1);
+	cp += n;
+	if (cp + QFIXEDSZ > eom)
+		return (-1);
+	key->type = ns_get16(cp);
+	key->class = ns_get16(cp + INT16SZ);
+	key->flags = (hp->rd << 1) | hp->cd;
+
+	/* FNV-1a over the lower-cased name and the rest of the key. */
+	key->hash = 2166136261U;
+	for (p = key->name; *p != '\0'; p++) {
+		*p = tolower((unsigned char) *p);
+		key->hash = (key->hash ^ (u_char) *p) * 16777619U;
+	}
+	key->hash = (key->hash ^ key->type) * 16777619U;
+	key->hash = (key->hash ^ key->class) * 16777619U;
+	key->hash = (key->hash ^ key->flags) * 16777619U;
+	return (0);
+}
+
+static int
+cache_key_eq(const struct cache_key *a, const struct cache_key *b) {
+	return (a->hash == b->hash && a->type == b->type &&
+		a->class == b->class && a->flags == b->flags &&
+		strcmp(a->name, b->name) == 0);
+}
+
+/*
+ * Return how many seconds a response may be cached, or -1 if it must not
+ * be cached at all.
+ */
+static long
+cache_ttl(const u_char *ans, int anslen) {
+	const HEADER *hp = (const HEADER *) ans;
+	const u_char *eom = ans + anslen;
+	const u_char *cp = ans + HFIXEDSZ;
+	u_int32_t ttl, minttl = CACHE_MAXTTL;
+	int ancount, nscount, count, i, n, type, rdlen, have_soa = 0;
+
+	if (anslen < HFIXEDSZ || hp->tc ||
+	    (hp->rcode != NOERROR && hp->rcode != NXDOMAIN))
+		return (-1);
+	for (i = ntohs(hp->qdcount); i > 0; i--) {
+		if ((n = dn_skipname(cp, eom)) < 0)
+			return (-1);
+		cp += n + QFIXEDSZ;
+		if (cp > eom)
+			return (-1);
+	}
+	ancount = ntohs(hp->ancount);
+	nscount = ntohs(hp->nscount);
+	count = ancount + nscount + ntohs(hp->arcount);
+	for (i = 0; i < count; i++) {
+		if ((n = dn_skipname(cp, eom)) < 0 ||
+		    cp + n + RRFIXEDSZ > eom)
+			return (-1);
+		cp += n;
+		type = ns_get16(cp);
+		ttl = ns_get32(cp + 2 * INT16SZ);
+		rdlen = ns_get16(cp + 2 * INT16SZ + INT32SZ);
+		cp += RRFIXEDSZ;
+		if (cp + rdlen > eom)
+			return (-1);
+		if (type != ns_t_opt && ttl < minttl)
+			minttl = ttl;
+		if (type == ns_t_soa && i >= ancount && i < ancount + nscount &&
+		    rdlen >= 5 * INT32SZ) {
+			ttl = ns_get32(cp + rdlen - INT32SZ);
+			if (ttl < minttl)
+				minttl = ttl;
+			have_soa = 1;
+		}
+		cp += rdlen;
+	}
+	if ((ancount == 0 || hp->rcode == NXDOMAIN) && !have_soa)
+		return (-1);
+	return (minttl);
+}
+
+static struct cache_stripe *
+cache_stripe(const struct cache_key *key, struct cache_entry ***bucketp) {
+	struct cache_stripe *sp;
+
+	pthread_once(&stripes_once, cache_init);
+	sp = &stripes[key->hash % CACHE_STRIPES];
+	*bucketp = &sp->buckets[(key->hash / CACHE_STRIPES) % CACHE_BUCKETS];
+	return (sp);
+}
+
+/* Unlink and free *epp.  The stripe lock must be held. */
+static void
+cache_remove(struct cache_stripe *sp, struct cache_entry **epp) {
+	struct cache_entry *ep = *epp;
+
+	*epp = ep->next;
+	sp->count--;
+	free(ep);
+}
+
+/*
+ * Copy a cached answer for query into ans.  Returns the answer length, or
+ * -1 if there is no fresh entry that fits in anssiz bytes.
+ */
+int
+__res_cache_lookup(const u_char *query, int querylen, u_char *ans,
+		   int anssiz) {
+	struct cache_key key;
+	struct cache_stripe *sp;
+	struct cache_entry **epp;
+	int resplen = -1;
+
+	if (cache_key(query, querylen, &key) < 0)
+		return (-1);
+	sp = cache_stripe(&key, &epp);
+	pthread_mutex_lock(&sp->lock);
+	for (; *epp != NULL; epp = &(*epp)->next) {
+		if (!cache_key_eq((*epp)->key, &key))
+			continue;
+		if ((*epp)->expires <= cache_now())
+			cache_remove(sp, epp);
+		else if ((*epp)->anslen <= anssiz) {
+			memcpy(ans, (*epp)->ans, (*epp)->anslen);
+			resplen = (*epp)->anslen;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&sp->lock);
+
+	/* The cached response carries the id of the query that filled it. */
+	if (resplen > 0)
+		memcpy(ans, query, INT16SZ);
+	return (resplen);
+}
+
+/*
+ * Remember the response to query.  Truncated answers, server failures and
+ * answers with a zero TTL are ignored.
+ */
+void
+__res_cache_insert(const u_char *query, int querylen, const u_char *ans,
+		   int anslen) {
+	struct cache_key key;
+	struct cache_stripe *sp;
+	struct cache_entry *ep, **epp, **oldest;
+	time_t now;
+	long ttl;
+	int i;
+
+	if (cache_key(query, querylen, &key) < 0 ||
+	    res_queriesmatch(query, query + querylen, ans, ans + anslen) <= 0 ||
+	    (ttl = cache_ttl(ans, anslen)) <= 0)
+		return;
+
+	ep = malloc(sizeof *ep + sizeof key + anslen);
+	if (ep == NULL)
+		return;
+	ep->key = (struct cache_key *) (ep + 1);
+	ep->ans = (u_char *) (ep->key + 1);
+	memcpy(ep->key, &key, sizeof key);
+	memcpy(ep->ans, ans, anslen);
+	ep->anslen = anslen;
+	now = cache_now();
+	ep->expires = now + ttl;
+
+	sp = cache_stripe(&key, &epp);
+	pthread_mutex_lock(&sp->lock);
+	for (; *epp != NULL; epp = &(*epp)->next) {
+		if (cache_key_eq((*epp)->key, &key)) {
+			cache_remove(sp, epp);
+			break;
+		}
+	}
+	if (sp->count >= CACHE_MAXENTRIES) {
+		/* Make room by dropping the entry closest to expiry. */
+		oldest = NULL;
+		for (i = 0; i < CACHE_BUCKETS; i++)
+			for (epp = &sp->buckets[i]; *epp != NULL;
+			     epp = &(*epp)->next)
+				if (oldest == NULL ||
+				    (*epp)->expires < (*oldest)->expires)
+					oldest = epp;
+		if (oldest != NULL)
+			cache_remove(sp, oldest);
+	}
+	cache_stripe(&key, &epp);
+	ep->next = *epp;
+	*epp = ep;
+	sp->count++;
+	pthread_mutex_unlock(&sp->lock);
+}
+
+/* Forget every cached answer, e.g. because resolv.conf was re-read. */
+void
+__res_cache_flush(void) {
+	struct cache_stripe *sp;
+	int i;
+
+	pthread_once(&stripes_once, cache_init);
+	for (sp = stripes; sp < stripes + CACHE_STRIPES; sp++) {
+		pthread_mutex_lock(&sp->lock);
+		for (i = 0; i < CACHE_BUCKETS; i++)
+			while (sp->buckets[i] != NULL)
+				cache_remove(sp, &sp->buckets[i]);
+		pthread_mutex_unlock(&sp->lock);
+	}
+}
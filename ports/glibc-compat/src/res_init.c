@@ -517,6 +517,8 @@ res_setoptions(res_state statp, const char *options, const char *source) {
 		} else if (!strncmp(cp, "no-check-names",
 				    sizeof("no-check-names") - 1)) {
 			statp->options |= RES_NOCHECKNAME;
+		} else if (!strncmp(cp, "no-cache", sizeof("no-cache") - 1)) {
+			statp->options |= RES_NOCACHE;
 		} else {
 			/* XXX - print a warning here? */
 		}
@@ -54,6 +54,7 @@ __libc_lock_define_initialized (static, lock);
 #endif
 
 extern int __res_vinit(res_state, int);
+extern void __res_cache_flush(void);
 int
 res_init(void) {
 
@@ -103,6 +104,8 @@ res_init(void) {
 	   resolv.conf might have changed.  */
 	atomicinc (__res_initstamp);
 	atomicincunlock (lock);
+	/* Cached answers may have come from the old name servers.  */
+	__res_cache_flush ();
 
 	return (__res_vinit(&_res, 1));
 }
@@ -190,6 +190,13 @@ static void		Aerror(const res_state, FILE *, const char *, int,
 static void		Perror(const res_state, FILE *, const char *, int);
 #endif
 static int		sock_eq(struct sockaddr_in6 *, struct sockaddr_in6 *);
+static int		send_uncached(res_state, const u_char *, int,
+				      u_char *, int, u_char **);
+
+/* From res_cache.c. */
+extern int		__res_cache_lookup(const u_char *, int, u_char *, int);
+extern void		__res_cache_insert(const u_char *, int,
+					   const u_char *, int);
 
 /* Reachover. */
 
@@ -331,9 +338,42 @@ res_queriesmatch(const u_char *buf1, const u_char *eom1,
 }
 libresolv_hidden_def (res_queriesmatch)
 
+/*
+ * Answer from the in-process cache when possible, otherwise ask the name
+ * servers and remember what they said.  The cache is bypassed for
+ * RES_NOCACHE and for dig-style callers that set pfcode.
+ */
 int
 __libc_res_nsend(res_state statp, const u_char *buf, int buflen,
 		 u_char *ans, int anssiz, u_char **ansp)
+{
+	int cache, resplen;
+
+	cache = (statp->options & RES_NOCACHE) == 0 && statp->pfcode == 0;
+	if (cache) {
+		resplen = __res_cache_lookup(buf, buflen, ans, anssiz);
+		if (resplen > 0) {
+			Dprint(statp->options & RES_DEBUG,
+			       (stdout, ";; answer from cache\n"));
+			return (resplen);
+		}
+	}
+	resplen = send_uncached(statp, buf, buflen, ans, anssiz, ansp);
+	if (cache && resplen > 0) {
+		/* A larger answer buffer may have been allocated. */
+		if (ansp != NULL && *ansp != NULL && *ansp != ans) {
+			ans = *ansp;
+			anssiz = MAXPACKET;
+		}
+		if (resplen <= anssiz)
+			__res_cache_insert(buf, buflen, ans, resplen);
+	}
+	return (resplen);
+}
+
+static int
+send_uncached(res_state statp, const u_char *buf, int buflen,
+	      u_char *ans, int anssiz, u_char **ansp)
 {
 	int gotsomewhere, terrno, try, v_circuit, resplen, ns, n;
 
@@ -5,7 +5,13 @@
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -14,7 +20,9 @@
 #include <dirent.h>
 #include <sys/file.h>
 #include <err.h>
+#include <fts.h>
 #include <time.h>
+#include <unistd.h>
 
 #ifndef __GLIBC__
 #include <sys/endian.h>
@@ -140,7 +148,73 @@ TEST(TestReadv, readv_writev) {
 }
 #endif
 
-// No tests for funtions ended with at, e.g. openat, fts_*
+// fts walks by path under NaCl so it doesn't depend on fchdir.
+#ifndef __GLIBC__
+static void MakeTree(const char* root, int dirs, int files) {
+  char path[PATH_MAX];
+  ASSERT_EQ(0, mkdir(root, S_IRWXU));
+  for (int i = 0; i < dirs; i++) {
+    snprintf(path, sizeof(path), "%s/dir%d", root, i);
+    ASSERT_EQ(0, mkdir(path, S_IRWXU));
+    for (int j = 0; j < files; j++) {
+      snprintf(path, sizeof(path), "%s/dir%d/file%d", root, i, j);
+      int fd = open(path, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+      ASSERT_NE(-1, fd);
+      ASSERT_EQ(0, close(fd));
+    }
+  }
+}
+
+TEST(TestFts, fts_read) {
+  const int kDirs = 4;
+  const int kFiles = 100;
+  MakeTree("fts_tree", kDirs, kFiles);
+
+  char root[] = "fts_tree";
+  char* const paths[] = { root, NULL };
+  FTS* fts = fts_open(paths, FTS_PHYSICAL | FTS_NOSTAT, NULL);
+  ASSERT_NE((FTS*)NULL, fts);
+  int pre = 0, post = 0, files = 0;
+  while (FTSENT* ent = fts_read(fts)) {
+    switch (ent->fts_info) {
+      case FTS_D:
+        pre++;
+        break;
+      case FTS_DP:
+        post++;
+        break;
+      case FTS_F:
+      case FTS_NSOK:
+        files++;
+        ASSERT_EQ(0, strncmp("file", ent->fts_name, 4));
+        break;
+      default:
+        FAIL() << "unexpected fts_info " << ent->fts_info
+               << " for " << ent->fts_path;
+    }
+  }
+  ASSERT_EQ(0, errno);
+  ASSERT_EQ(0, fts_close(fts));
+  ASSERT_EQ(kDirs + 1, pre);
+  ASSERT_EQ(kDirs + 1, post);
+  ASSERT_EQ(kDirs * kFiles, files);
+
+  // Remove the tree again in post-order.
+  fts = fts_open(paths, FTS_PHYSICAL, NULL);
+  ASSERT_NE((FTS*)NULL, fts);
+  while (FTSENT* ent = fts_read(fts)) {
+    if (ent->fts_info == FTS_DP)
+      ASSERT_EQ(0, rmdir(ent->fts_accpath));
+    else if (ent->fts_info == FTS_F)
+      ASSERT_EQ(0, unlink(ent->fts_accpath));
+  }
+  ASSERT_EQ(0, fts_close(fts));
+  struct stat buf;
+  ASSERT_EQ(-1, stat("fts_tree", &buf));
+}
+#endif
+
+// No tests for funtions ended with at, e.g. openat
 // fchdir is not implemented in sel_ldr
 #if 0
 TEST(TestOpenat, openat) {
@@ -159,6 +233,161 @@ TEST(TestOpenat, openat) {
 }
 #endif
 
+#ifndef __GLIBC__
+TEST(TestLockf, lockf) {
+  int fd1 = open("lockf.txt", O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT_NE(-1, fd1);
+  int fd2 = open("lockf.txt", O_RDWR);
+  ASSERT_NE(-1, fd2);
+
+  // Lock bytes [0, 10) through the first descriptor.  The locks belong to
+  // the process, so the second descriptor does not conflict with them,
+  // and F_LOCK does not wait for them.
+  ASSERT_EQ(0, lockf(fd1, F_TLOCK, 10));
+  ASSERT_EQ(0, lockf(fd2, F_TLOCK, 5));
+  ASSERT_EQ(0, lockf(fd2, F_LOCK, 0));
+  // They do conflict with flock() locks, which belong to a descriptor.
+  ASSERT_EQ(-1, flock(fd2, LOCK_EX | LOCK_NB));
+  ASSERT_EQ(EWOULDBLOCK, errno);
+  ASSERT_EQ(0, lockf(fd2, F_ULOCK, 0));
+  ASSERT_EQ(0, flock(fd2, LOCK_EX | LOCK_NB));
+  ASSERT_EQ(-1, lockf(fd1, F_TLOCK, 10));
+  ASSERT_EQ(EAGAIN, errno);
+  ASSERT_EQ(0, flock(fd2, LOCK_UN));
+
+  // lockf ranges start at the current offset; unlocking the middle of a
+  // range leaves both ends locked.
+  ASSERT_EQ(0, lockf(fd1, F_TLOCK, 30));
+  ASSERT_EQ(10, lseek(fd2, 10, SEEK_SET));
+  ASSERT_EQ(0, lockf(fd2, F_ULOCK, 10));
+  ASSERT_EQ(0, lseek(fd2, 0, SEEK_SET));
+  ASSERT_EQ(-1, flock(fd2, LOCK_SH | LOCK_NB));
+  ASSERT_EQ(0, lockf(fd1, F_ULOCK, 10));
+  ASSERT_EQ(-1, flock(fd2, LOCK_SH | LOCK_NB));
+  ASSERT_EQ(20, lseek(fd1, 20, SEEK_SET));
+  ASSERT_EQ(0, lockf(fd1, F_ULOCK, 10));
+  ASSERT_EQ(0, flock(fd2, LOCK_SH | LOCK_NB));
+  ASSERT_EQ(0, flock(fd2, LOCK_UN));
+
+  ASSERT_EQ(-1, lockf(fd1, 42, 0));
+  ASSERT_EQ(EINVAL, errno);
+
+  ASSERT_EQ(0, close(fd1));
+  ASSERT_EQ(0, close(fd2));
+  ASSERT_EQ(0, unlink("lockf.txt"));
+}
+
+TEST(TestFlock, flock) {
+  int fd1 = open("flock.txt", O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT_NE(-1, fd1);
+  int fd2 = open("flock.txt", O_RDWR);
+  ASSERT_NE(-1, fd2);
+
+  // Shared locks coexist; an exclusive one has to wait for them.
+  ASSERT_EQ(0, flock(fd1, LOCK_SH));
+  ASSERT_EQ(0, flock(fd2, LOCK_SH | LOCK_NB));
+  ASSERT_EQ(-1, flock(fd2, LOCK_EX | LOCK_NB));
+  ASSERT_EQ(EWOULDBLOCK, errno);
+  ASSERT_EQ(0, flock(fd1, LOCK_UN));
+  ASSERT_EQ(0, flock(fd2, LOCK_EX | LOCK_NB));
+  ASSERT_EQ(-1, flock(fd1, LOCK_SH | LOCK_NB));
+  ASSERT_EQ(EWOULDBLOCK, errno);
+  ASSERT_EQ(0, flock(fd2, LOCK_UN));
+  ASSERT_EQ(-1, flock(fd1, 0));
+  ASSERT_EQ(EINVAL, errno);
+
+  ASSERT_EQ(0, close(fd1));
+  ASSERT_EQ(0, close(fd2));
+  ASSERT_EQ(0, unlink("flock.txt"));
+}
+
+static void* FlockWaiter(void* arg) {
+  int fd = *static_cast<int*>(arg);
+  return reinterpret_cast<void*>(static_cast<intptr_t>(flock(fd, LOCK_EX)));
+}
+
+TEST(TestFlock, closed_descriptor) {
+  int fd1 = open("flock_closed.txt", O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT_NE(-1, fd1);
+  int fd2 = open("flock_closed.txt", O_RDWR);
+  ASSERT_NE(-1, fd2);
+
+  // Closing a descriptor without unlocking it does not keep others out.
+  ASSERT_EQ(0, flock(fd1, LOCK_EX));
+  ASSERT_EQ(0, close(fd1));
+  ASSERT_EQ(0, flock(fd2, LOCK_EX | LOCK_NB));
+  ASSERT_EQ(0, flock(fd2, LOCK_UN));
+
+  // Someone already waiting gets the lock too.
+  fd1 = open("flock_closed.txt", O_RDWR);
+  ASSERT_NE(-1, fd1);
+  ASSERT_EQ(0, flock(fd1, LOCK_EX));
+  pthread_t waiter;
+  void* result;
+  ASSERT_EQ(0, pthread_create(&waiter, NULL, FlockWaiter, &fd2));
+  usleep(10000);
+  ASSERT_EQ(0, close(fd1));
+  ASSERT_EQ(0, pthread_join(waiter, &result));
+  ASSERT_EQ(NULL, result);
+  ASSERT_EQ(0, flock(fd2, LOCK_UN));
+
+  // Nor does its number being reused for another file.
+  fd1 = open("flock_closed.txt", O_RDWR);
+  ASSERT_NE(-1, fd1);
+  ASSERT_EQ(0, flock(fd1, LOCK_EX));
+  int fd1_number = fd1;
+  ASSERT_EQ(0, close(fd1));
+  int other = open("flock_other.txt", O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT_EQ(fd1_number, other);
+  ASSERT_EQ(0, flock(fd2, LOCK_EX));
+  ASSERT_EQ(0, flock(fd2, LOCK_UN));
+
+  ASSERT_EQ(0, close(other));
+  ASSERT_EQ(0, close(fd2));
+  ASSERT_EQ(0, unlink("flock_other.txt"));
+  ASSERT_EQ(0, unlink("flock_closed.txt"));
+}
+
+struct FlockCounter {
+  int holders;
+  int overlaps;
+  int count;
+};
+
+static void* FlockWorker(void* arg) {
+  FlockCounter* counter = static_cast<FlockCounter*>(arg);
+  int fd = open("flock_threads.txt", O_RDWR);
+  if (fd == -1)
+    return NULL;
+  for (int i = 0; i < 1000; i++) {
+    flock(fd, LOCK_EX);
+    if (__sync_add_and_fetch(&counter->holders, 1) != 1)
+      counter->overlaps++;
+    counter->count++;
+    __sync_sub_and_fetch(&counter->holders, 1);
+    flock(fd, LOCK_UN);
+  }
+  close(fd);
+  return NULL;
+}
+
+TEST(TestFlock, threads) {
+  const int kThreads = 8;
+  int fd = open("flock_threads.txt", O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(0, close(fd));
+
+  FlockCounter counter = { 0, 0, 0 };
+  pthread_t threads[kThreads];
+  for (int i = 0; i < kThreads; i++)
+    ASSERT_EQ(0, pthread_create(&threads[i], NULL, FlockWorker, &counter));
+  for (int i = 0; i < kThreads; i++)
+    ASSERT_EQ(0, pthread_join(threads[i], NULL));
+  ASSERT_EQ(0, counter.overlaps);
+  ASSERT_EQ(kThreads * 1000, counter.count);
+  ASSERT_EQ(0, unlink("flock_threads.txt"));
+}
+#else
 TEST(TestLockf, lockf) {
   // The fcntl() method underlying lockf() is not implemented in NaCl.
   ASSERT_EQ(-1, lockf(1, F_LOCK, 1));
@@ -178,11 +407,195 @@ TEST(TestFlock, flock) {
   ASSERT_EQ(-1, flock(1, LOCK_UN));
   ASSERT_EQ(ENOSYS, errno);
 }
+#endif
 
 /* Calling err will cause the test program exit with failure code if errno
  * is set. No tests for err.
  */
 
+#ifndef __GLIBC__
+static int CompareInts(const void* a, const void* b, void* arg) {
+  int x = *static_cast<const int*>(a);
+  int y = *static_cast<const int*>(b);
+  if (arg)
+    ++*static_cast<size_t*>(arg);
+  return x < y ? -1 : x > y;
+}
+
+static void CheckQsortR(int* values, size_t n) {
+  size_t compares = 0;
+  qsort_r(values, n, sizeof(int), CompareInts, &compares);
+  for (size_t i = 1; i < n; i++)
+    ASSERT_LE(values[i - 1], values[i]);
+  // Generous n log n bound; the old quicksort could go quadratic here.
+  ASSERT_LT(compares, 4 * n * 20);
+}
+
+TEST(TestQsortR, patterns) {
+  const size_t kCount = 100000;
+  int* values = new int[kCount];
+  srand(1);
+  for (size_t i = 0; i < kCount; i++)
+    values[i] = rand();
+  CheckQsortR(values, kCount);
+  // Sorted.
+  CheckQsortR(values, kCount);
+  for (size_t i = 0; i < kCount; i++)
+    values[i] = kCount - i;
+  CheckQsortR(values, kCount);
+  // Organ pipe.
+  for (size_t i = 0; i < kCount; i++)
+    values[i] = i < kCount / 2 ? i : kCount - i;
+  CheckQsortR(values, kCount);
+  for (size_t i = 0; i < kCount; i++)
+    values[i] = i % 7;
+  CheckQsortR(values, kCount);
+  delete[] values;
+}
+
+// McIlroy's "killer adversary", which makes any quicksort without a
+// recursion bound go quadratic by deciding the order of values lazily.
+struct Adversary {
+  int* val;
+  int gas;
+  int nsolid;
+  int candidate;
+  size_t compares;
+};
+
+static int CompareAdversary(const void* a, const void* b, void* arg) {
+  Adversary* adv = static_cast<Adversary*>(arg);
+  int x = *static_cast<const int*>(a);
+  int y = *static_cast<const int*>(b);
+  adv->compares++;
+  if (adv->val[x] == adv->gas && adv->val[y] == adv->gas)
+    adv->val[x == adv->candidate ? x : y] = adv->nsolid++;
+  if (adv->val[x] == adv->gas)
+    adv->candidate = x;
+  else if (adv->val[y] == adv->gas)
+    adv->candidate = y;
+  return adv->val[x] - adv->val[y];
+}
+
+TEST(TestQsortR, adversary) {
+  const int kCount = 50000;
+  int* items = new int[kCount];
+  Adversary adv = { new int[kCount], kCount - 1, 0, 0, 0 };
+  for (int i = 0; i < kCount; i++) {
+    items[i] = i;
+    adv.val[i] = adv.gas;
+  }
+  qsort_r(items, kCount, sizeof(int), CompareAdversary, &adv);
+  for (int i = 1; i < kCount; i++)
+    ASSERT_LT(adv.val[items[i - 1]], adv.val[items[i]]);
+  ASSERT_LT(adv.compares, 4u * kCount * 16);
+  delete[] adv.val;
+  delete[] items;
+}
+
+struct Record {
+  int64_t key;
+  int64_t seq;
+};
+
+static int CompareRecords(const void* a, const void* b, void* arg) {
+  int64_t x = static_cast<const Record*>(a)->key;
+  int64_t y = static_cast<const Record*>(b)->key;
+  return x < y ? -1 : x > y;
+}
+
+TEST(TestMergesortR, stable) {
+  const size_t kCount = 10000;
+  Record* records = new Record[kCount];
+  srand(1);
+  for (size_t i = 0; i < kCount; i++) {
+    records[i].key = rand() % 100;
+    records[i].seq = i;
+  }
+  ASSERT_EQ(0, mergesort_r(records, kCount, sizeof(Record), CompareRecords,
+                           NULL));
+  for (size_t i = 1; i < kCount; i++) {
+    ASSERT_LE(records[i - 1].key, records[i].key);
+    if (records[i - 1].key == records[i].key) {
+      ASSERT_LT(records[i - 1].seq, records[i].seq);
+    }
+  }
+  delete[] records;
+}
+#endif
+
+#ifndef __GLIBC__
+static int g_hook_queries;
+
+// Stand-in for a name server: answers every A query with 10.0.0.1 and the
+// TTL given by the first label of the name ("ttl300.example").
+static res_sendhookact FakeServer(struct sockaddr_in* const* ns,
+                                  const u_char** query, int* querylen,
+                                  u_char* ans, int anssiz, int* resplen) {
+  g_hook_queries++;
+  memcpy(ans, *query, *querylen);
+  HEADER* hp = reinterpret_cast<HEADER*>(ans);
+  hp->qr = 1;
+  hp->ancount = htons(1);
+  u_char* cp = ans + *querylen;
+  *cp++ = 0xc0;  // Compressed pointer to the question name.
+  *cp++ = HFIXEDSZ;
+  putshort(T_A, cp);
+  putshort(C_IN, cp + INT16SZ);
+  putlong(atoi(reinterpret_cast<const char*>(*query) + HFIXEDSZ + 4),
+          cp + 2 * INT16SZ);
+  putshort(4, cp + 2 * INT16SZ + INT32SZ);
+  cp += RRFIXEDSZ;
+  *cp++ = 10;
+  *cp++ = 0;
+  *cp++ = 0;
+  *cp++ = 1;
+  *resplen = cp - ans;
+  return res_done;
+}
+
+static int SendQuery(res_state statp, const char* name, u_char* ans,
+                     int anssiz) {
+  u_char query[PACKETSZ];
+  int len = res_nmkquery(statp, QUERY, name, C_IN, T_A, NULL, 0, NULL,
+                         query, sizeof(query));
+  if (len < 0)
+    return len;
+  return res_nsend(statp, query, len, ans, anssiz);
+}
+
+TEST(TestResolver, answer_cache) {
+  struct __res_state state;
+  memset(&state, 0, sizeof(state));
+  ASSERT_EQ(0, res_ninit(&state));
+  state.qhook = FakeServer;
+  u_char first[PACKETSZ];
+  u_char second[PACKETSZ];
+
+  g_hook_queries = 0;
+  int len = SendQuery(&state, "ttl300.example", first, sizeof(first));
+  ASSERT_GT(len, HFIXEDSZ);
+  ASSERT_EQ(1, g_hook_queries);
+  // The same question, spelled differently, is answered from the cache
+  // but with the id of the new query.
+  ASSERT_EQ(len, SendQuery(&state, "TTL300.Example", second, sizeof(second)));
+  ASSERT_EQ(1, g_hook_queries);
+  ASSERT_EQ(0, memcmp(first + INT16SZ, second + INT16SZ, len - INT16SZ));
+  ASSERT_NE(0, memcmp(first, second, INT16SZ));
+
+  // A zero TTL must not be cached.
+  ASSERT_GT(SendQuery(&state, "ttl0.example", first, sizeof(first)), 0);
+  ASSERT_GT(SendQuery(&state, "ttl0.example", first, sizeof(first)), 0);
+  ASSERT_EQ(3, g_hook_queries);
+
+  // RES_NOCACHE always goes to the server.
+  state.options |= RES_NOCACHE;
+  ASSERT_EQ(len, SendQuery(&state, "ttl300.example", first, sizeof(first)));
+  ASSERT_EQ(4, g_hook_queries);
+  res_nclose(&state);
+}
+#endif
+
 TEST(TestTimegm, timegm) {
   struct tm tmp;
   tmp.tm_sec = 1;
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+// Times round trips through the kernel's message channel.  kernel.py sends
+// anything on the 'echo' stream straight back without parsing it, so this
+// measures the channel alone: first with one {stream, json} dictionary per
+// message, then with ArrayBuffer batches (which also switches the kernel's
+// replies to batches for good).
+
+var SIZES = [64, 4096, 262144, 4194304];
+var ROUND_TRIPS = 20;
+var THROUGHPUT_MESSAGES = 64;
+var THROUGHPUT_SIZE = 262144;
+
+var kernel;
+var ready = false;
+var onEcho = null;
+
+function log(text) {
+  document.getElementById('log').textContent += text + '\n';
+}
+
+// A batch holds, per message, a little-endian uint32 length and the stream
+// name, then the same for the payload.
+function encodeBatch(messages) {
+  var total = 0;
+  messages.forEach(function(m) { total += 8 + m[0].length + m[1].length; });
+  var buffer = new ArrayBuffer(total);
+  var view = new DataView(buffer);
+  var bytes = new Uint8Array(buffer);
+  var pos = 0;
+  messages.forEach(function(m) {
+    view.setUint32(pos, m[0].length, true);
+    pos += 4;
+    for (var i = 0; i < m[0].length; i++)
+      bytes[pos + i] = m[0].charCodeAt(i);
+    pos += m[0].length;
+    view.setUint32(pos, m[1].length, true);
+    pos += 4;
+    bytes.set(m[1], pos);
+    pos += m[1].length;
+  });
+  return buffer;
+}
+
+function decodeBatch(buffer) {
+  var view = new DataView(buffer);
+  var messages = [];
+  var pos = 0;
+  while (pos < buffer.byteLength) {
+    var len = view.getUint32(pos, true);
+    var stream = String.fromCharCode.apply(
+        null, new Uint8Array(buffer, pos + 4, len));
+    pos += 4 + len;
+    len = view.getUint32(pos, true);
+    messages.push([stream, new Uint8Array(buffer, pos + 4, len)]);
+    pos += 4 + len;
+  }
+  return messages;
+}
+
+function handleMessage(event) {
+  var messages;
+  if (event.data instanceof ArrayBuffer)
+    messages = decodeBatch(event.data);
+  else if (event.data && event.data.stream)
+    messages = [[event.data.stream, event.data.json]];
+  else
+    return;
+
+  messages.forEach(function(m) {
+    if (m[0] == 'echo' && onEcho) {
+      onEcho(m[1]);
+    } else if (!ready && m[0] == 'iopub' && typeof m[1] == 'string' &&
+               JSON.parse(m[1]).content.execution_state == 'nacl_ready') {
+      ready = true;
+      runSteps(steps);
+    }
+  });
+}
+
+function makeString(size) {
+  return new Array(size + 1).join('x');
+}
+
+function makeBytes(size) {
+  var bytes = new Uint8Array(size);
+  for (var i = 0; i < size; i++)
+    bytes[i] = i & 0xff;
+  return bytes;
+}
+
+function sendJson(payloads) {
+  payloads.forEach(function(payload) {
+    kernel.postMessage({stream: 'echo', json: payload});
+  });
+}
+
+function sendBatch(payloads) {
+  kernel.postMessage(encodeBatch(payloads.map(function(payload) {
+    return ['echo', payload];
+  })));
+}
+
+// Sends count batches of payloads, one at a time, each once the previous
+// one has fully come back.  Calls done with the elapsed milliseconds.
+function roundTrips(send, payloads, count, done) {
+  var start = performance.now();
+  var sent = 0;
+  var waiting = 0;
+  onEcho = function() {
+    if (--waiting > 0)
+      return;
+    if (sent == count) {
+      onEcho = null;
+      done(performance.now() - start);
+      return;
+    }
+    sent++;
+    waiting = payloads.length;
+    send(payloads);
+  };
+  sent++;
+  waiting = payloads.length;
+  send(payloads);
+}
+
+function latencyStep(mode, send, make, size) {
+  return function(next) {
+    roundTrips(send, [make(size)], ROUND_TRIPS, function(ms) {
+      log(mode + ' ' + size + ' bytes: ' +
+          (ms / ROUND_TRIPS).toFixed(2) + ' ms per round trip');
+      next();
+    });
+  };
+}
+
+function throughputStep(mode, send, make) {
+  return function(next) {
+    var payloads = [];
+    for (var i = 0; i < THROUGHPUT_MESSAGES; i++)
+      payloads.push(make(THROUGHPUT_SIZE));
+    roundTrips(send, payloads, 1, function(ms) {
+      var mb = 2 * THROUGHPUT_MESSAGES * THROUGHPUT_SIZE / (1024 * 1024);
+      log(mode + ' ' + THROUGHPUT_MESSAGES + ' x ' + THROUGHPUT_SIZE +
+          ' bytes: ' + (mb * 1000 / ms).toFixed(1) + ' MB/s both ways');
+      next();
+    });
+  };
+}
+
+var steps = [];
+[['json', sendJson, makeString], ['batch', sendBatch, makeBytes]].forEach(
+    function(mode) {
+  SIZES.forEach(function(size) {
+    steps.push(latencyStep(mode[0], mode[1], mode[2], size));
+  });
+  steps.push(throughputStep(mode[0], mode[1], mode[2]));
+});
+
+function runSteps(remaining) {
+  if (remaining.length == 0) {
+    log('done');
+    return;
+  }
+  remaining[0](function() { runSteps(remaining.slice(1)); });
+}
+
+function startBenchmark(element) {
+  kernel = element;
+  log('Waiting for the kernel to start...');
+  element.addEventListener('message', handleMessage, true);
+}
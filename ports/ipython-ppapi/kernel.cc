@@ -9,10 +9,16 @@
 #include <fcntl.h>
 #include <sys/mount.h>
 #include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <vector>
 
 #include <ppapi/cpp/var.h>
 #include <ppapi/cpp/var_array.h>
+#include <ppapi/cpp/var_array_buffer.h>
 #include <ppapi/cpp/var_dictionary.h>
+#include <ppapi_simple/ps_event.h>
 #include <ppapi_simple/ps_interface.h>
 
 #include <nacl_io/nacl_io.h>
@@ -73,6 +79,182 @@ static int setup_unix_environment() {
     return 0;
 }
 
+/*
+ * Messages can also travel in batches: a single ArrayBuffer holding one
+ * record per message, each record being a little-endian uint32 length
+ * followed by that many bytes of stream name, then the same again for the
+ * payload.  One PostMessage then carries any number of messages, and
+ * payloads are bytes rather than strings so they need no UTF-8 conversion.
+ */
+
+/*
+ * A mapped ArrayBuffer exposed through the buffer protocol, so that the
+ * payloads of an incoming batch can be handed to Python as buffer objects
+ * pointing into it instead of as copies.  It is unmapped once the last of
+ * them goes away.
+ */
+typedef struct {
+  PyObject_HEAD
+  pp::VarArrayBuffer * array;
+  char * data;
+  Py_ssize_t size;
+} MappedArrayBuffer;
+
+static void mapped_array_buffer_dealloc(MappedArrayBuffer * self) {
+  if (self->array) {
+    self->array->Unmap();
+    delete self->array;
+  }
+  PyObject_Del(self);
+}
+
+static Py_ssize_t mapped_array_buffer_getreadbuf(MappedArrayBuffer * self,
+                                                 Py_ssize_t segment,
+                                                 void ** ptr) {
+  if (segment != 0) {
+    PyErr_SetString(PyExc_SystemError, "accessing non-existent segment");
+    return -1;
+  }
+  *ptr = self->data;
+  return self->size;
+}
+
+static Py_ssize_t mapped_array_buffer_getsegcount(MappedArrayBuffer * self,
+                                                  Py_ssize_t * lenp) {
+  if (lenp)
+    *lenp = self->size;
+  return 1;
+}
+
+static int mapped_array_buffer_getbuffer(MappedArrayBuffer * self,
+                                         Py_buffer * view, int flags) {
+  return PyBuffer_FillInfo(view, (PyObject *) self, self->data, self->size,
+                           1, flags);
+}
+
+static PyBufferProcs mapped_array_buffer_as_buffer = {
+  (readbufferproc) mapped_array_buffer_getreadbuf,
+  NULL,
+  (segcountproc) mapped_array_buffer_getsegcount,
+  (charbufferproc) mapped_array_buffer_getreadbuf,
+  (getbufferproc) mapped_array_buffer_getbuffer,
+  NULL,
+};
+
+static PyTypeObject MappedArrayBufferType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "ppmessage.ArrayBuffer",
+};
+
+static int init_mapped_array_buffer_type() {
+  MappedArrayBufferType.tp_basicsize = sizeof(MappedArrayBuffer);
+  MappedArrayBufferType.tp_dealloc = (destructor) mapped_array_buffer_dealloc;
+  MappedArrayBufferType.tp_as_buffer = &mapped_array_buffer_as_buffer;
+  MappedArrayBufferType.tp_flags = Py_TPFLAGS_DEFAULT |
+                                   Py_TPFLAGS_HAVE_NEWBUFFER;
+  MappedArrayBufferType.tp_doc = "A mapped ArrayBuffer received from the page";
+  return PyType_Ready(&MappedArrayBufferType);
+}
+
+/*
+ * Reads the next length-prefixed field of a batch at *pos.  Returns false
+ * if the batch ends before the field does.
+ */
+static bool read_batch_field(const char * data, Py_ssize_t size,
+                             Py_ssize_t * pos, Py_ssize_t * start,
+                             Py_ssize_t * len) {
+  uint32_t n;
+  if (size - *pos < (Py_ssize_t) sizeof(n))
+    return false;
+  memcpy(&n, data + *pos, sizeof(n));
+  *pos += sizeof(n);
+  if (size - *pos < (Py_ssize_t) n)
+    return false;
+  *start = *pos;
+  *len = n;
+  *pos += n;
+  return true;
+}
+
+static int append_message(PyObject * list, PyObject * stream,
+                          PyObject * payload, bool batched) {
+  PyObject * item = Py_BuildValue("(NNO)", stream, payload,
+                                  batched ? Py_True : Py_False);
+  if (!item)
+    return -1;
+  int ret = PyList_Append(list, item);
+  Py_DECREF(item);
+  return ret;
+}
+
+static int append_batch(PyObject * list, const pp::Var & message) {
+  MappedArrayBuffer * mapped =
+      PyObject_New(MappedArrayBuffer, &MappedArrayBufferType);
+  if (!mapped)
+    return -1;
+  mapped->array = new pp::VarArrayBuffer(message);
+  mapped->size = mapped->array->ByteLength();
+  mapped->data = static_cast<char *>(mapped->array->Map());
+  if (!mapped->data)
+    mapped->size = 0;
+
+  int ret = 0;
+  Py_ssize_t pos = 0;
+  while (ret == 0 && pos < mapped->size) {
+    Py_ssize_t stream_start, stream_len, payload_start, payload_len;
+    if (!read_batch_field(mapped->data, mapped->size, &pos,
+                          &stream_start, &stream_len) ||
+        !read_batch_field(mapped->data, mapped->size, &pos,
+                          &payload_start, &payload_len)) {
+      printf("dropping truncated message batch\n");
+      break;
+    }
+    PyObject * stream = PyString_FromStringAndSize(
+        mapped->data + stream_start, stream_len);
+    PyObject * payload = PyBuffer_FromObject(
+        (PyObject *) mapped, payload_start, payload_len);
+    if (!stream || !payload) {
+      Py_XDECREF(stream);
+      Py_XDECREF(payload);
+      ret = -1;
+      break;
+    }
+    ret = append_message(list, stream, payload, true);
+  }
+  Py_DECREF(mapped);
+  return ret;
+}
+
+/* Appends a {stream, json} dictionary as one message. */
+static int append_json(PyObject * list, const pp::Var & message) {
+  pp::VarDictionary request(message);
+  pp::Var stream(request.Get("stream"));
+  pp::Var json(request.Get("json"));
+  if (!stream.is_string() || !json.is_string())
+    return 0;
+
+  uint32_t len;
+  const char * utf8 = PSInterfaceVar()->VarToUtf8(json.pp_var(), &len);
+  return append_message(list,
+                        PyString_FromString(stream.AsString().c_str()),
+                        PyString_FromStringAndSize(utf8, len), false);
+}
+
+/*
+ * Waits up to timeout_ms for an event: forever if negative, not at all if
+ * zero.  ppapi_simple has no timed wait, so a positive timeout polls.
+ */
+static PSEvent * acquire_event(int timeout_ms) {
+  if (timeout_ms < 0)
+    return PSEventWaitAcquire();
+  PSEvent * event = PSEventTryAcquire();
+  for (int waited = 0; event == NULL && waited < timeout_ms; waited++) {
+    usleep(1000);
+    event = PSEventTryAcquire();
+  }
+  return event;
+}
+
 extern "C" {
 
 static PyObject * post_json_message(PyObject * self, PyObject * args) {
@@ -98,14 +280,15 @@ static PyObject * acquire_json_message_wait(PyObject *self, PyObject * args) {
     return NULL;
   }
 
-  const PPB_Messaging * messaging = PSInterfaceMessaging();
-  PP_Instance instance = PSGetInstanceId();
   PSEventSetFilter(PSE_INSTANCE_HANDLEMESSAGE);
-  PSEvent *event = PSEventWaitAcquire();
-  if (event->type != PSE_INSTANCE_HANDLEMESSAGE)
-    Py_RETURN_NONE;
-
-  pp::Var message(event->as_var);
+  PSEvent *event;
+  Py_BEGIN_ALLOW_THREADS
+  event = PSEventWaitAcquire();
+  Py_END_ALLOW_THREADS
+  pp::Var message;
+  if (event->type == PSE_INSTANCE_HANDLEMESSAGE)
+    message = pp::Var(event->as_var);
+  PSEventRelease(event);
 
   if (!message.is_dictionary())
     Py_RETURN_NONE;
@@ -115,7 +298,120 @@ static PyObject * acquire_json_message_wait(PyObject *self, PyObject * args) {
   if (!json.is_string())
     Py_RETURN_NONE;
 
-  return PyString_FromString(json.AsString().c_str());
+  uint32_t len;
+  const char * utf8 = PSInterfaceVar()->VarToUtf8(json.pp_var(), &len);
+  return PyString_FromStringAndSize(utf8, len);
+}
+
+static PyObject * post_messages(PyObject * self, PyObject * args) {
+  PyObject * messages;
+  if (!PyArg_ParseTuple(args, "O", &messages)) {
+    return NULL;
+  }
+  PyObject * seq = PySequence_Fast(messages,
+                                   "messages must be a sequence of pairs");
+  if (!seq) {
+    return NULL;
+  }
+
+  // Borrow the bytes of every stream name and payload; they are copied
+  // straight into the ArrayBuffer.
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+  std::vector<Py_buffer> views;
+  views.reserve(count * 2);
+  size_t total = 0;
+  bool ok = true;
+  for (Py_ssize_t i = 0; ok && i < count; i++) {
+    PyObject * item = PySequence_Fast_GET_ITEM(seq, i);
+    if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+      PyErr_SetString(PyExc_TypeError,
+                      "messages must be (stream, payload) pairs");
+      ok = false;
+      break;
+    }
+    for (int j = 0; j < 2; j++) {
+      Py_buffer view;
+      if (PyObject_GetBuffer(PyTuple_GET_ITEM(item, j), &view,
+                             PyBUF_SIMPLE) < 0) {
+        ok = false;
+        break;
+      }
+      views.push_back(view);
+      if ((size_t) view.len > UINT32_MAX - sizeof(uint32_t) - total) {
+        PyErr_SetString(PyExc_ValueError, "message batch too large");
+        ok = false;
+        break;
+      }
+      total += sizeof(uint32_t) + view.len;
+    }
+  }
+
+  if (ok && count > 0) {
+    Py_BEGIN_ALLOW_THREADS
+    pp::VarArrayBuffer batch(total);
+    char * out = static_cast<char *>(batch.Map());
+    for (size_t i = 0; i < views.size(); i++) {
+      uint32_t len = views[i].len;
+      memcpy(out, &len, sizeof(len));
+      memcpy(out + sizeof(len), views[i].buf, len);
+      out += sizeof(len) + len;
+    }
+    batch.Unmap();
+    PSInterfaceMessaging()->PostMessage(PSGetInstanceId(), batch.pp_var());
+    Py_END_ALLOW_THREADS
+  }
+
+  for (size_t i = 0; i < views.size(); i++)
+    PyBuffer_Release(&views[i]);
+  Py_DECREF(seq);
+  if (!ok)
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+static PyObject * acquire_messages(PyObject * self, PyObject * args) {
+  int timeout_ms = -1;
+  if (!PyArg_ParseTuple(args, "|i", &timeout_ms)) {
+    return NULL;
+  }
+
+  PyObject * list = PyList_New(0);
+  if (!list) {
+    return NULL;
+  }
+
+  PSEventSetFilter(PSE_INSTANCE_HANDLEMESSAGE);
+  PSEvent * event;
+  Py_BEGIN_ALLOW_THREADS
+  event = acquire_event(timeout_ms);
+  Py_END_ALLOW_THREADS
+
+  // Take everything else that is already queued along with the first.
+  int ret = 0;
+  for (; event != NULL; event = PSEventTryAcquire()) {
+    if (ret == 0 && event->type == PSE_INSTANCE_HANDLEMESSAGE) {
+      pp::Var message(event->as_var);
+      if (message.is_array_buffer())
+        ret = append_batch(list, message);
+      else if (message.is_dictionary())
+        ret = append_json(list, message);
+    }
+    PSEventRelease(event);
+  }
+
+  if (ret < 0) {
+    Py_DECREF(list);
+    return NULL;
+  }
+  return list;
+}
+
+static PyObject * wake(PyObject * self, PyObject * args) {
+  if (!PyArg_ParseTuple(args, "")) {
+    return NULL;
+  }
+  PSEventPostVar(PSE_INSTANCE_HANDLEMESSAGE, PP_MakeUndefined());
+  Py_RETURN_NONE;
 }
 
 const PPB_Messaging *setup_ppapi_connection(PP_Instance *instance) {
@@ -142,6 +438,26 @@ static PyMethodDef PPMessageMethods[] = {
     acquire_json_message_wait,
     METH_VARARGS,
     "Acquire a message encoded as JSON (blocking)"},
+  {
+    "_PostMessages",
+    post_messages,
+    METH_VARARGS,
+    "Post a list of (stream, payload) pairs as one ArrayBuffer batch"
+  },
+  {
+    "_AcquireMessages",
+    acquire_messages,
+    METH_VARARGS,
+    "Acquire all pending messages as (stream, payload, batched) tuples, "
+    "waiting up to timeout_ms for the first (forever if negative, not at "
+    "all if zero)"
+  },
+  {
+    "_Wake",
+    wake,
+    METH_VARARGS,
+    "Wake a thread blocked in _AcquireMessages"
+  },
   {NULL, NULL, 0, NULL}
 };
 
@@ -164,7 +480,12 @@ int main(int argc, char **argv) {
 
     // Load module that provides access to Pepper messaging API
     // from within the interpreter
-    Py_InitModule("ppmessage", PPMessageMethods);
+    PyObject * module = Py_InitModule("ppmessage", PPMessageMethods);
+    if (module && init_mapped_array_buffer_type() == 0) {
+      Py_INCREF(&MappedArrayBufferType);
+      PyModule_AddObject(module, "ArrayBuffer",
+                         (PyObject *) &MappedArrayBufferType);
+    }
 
      // Run the interpreter main loop.
     const char * main_filename = "/mnt/http/kernel.py";
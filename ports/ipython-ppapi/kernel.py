@@ -16,11 +16,21 @@ import sys
 import Queue
 import thread
 
+# module defined in kernel.cc for communicating via pepper API
+import ppmessage
+
+class WakingQueue(Queue.Queue):
+  """A queue that wakes the message loop whenever something is put on it."""
+
+  def put(self, item, block=True, timeout=None):
+    Queue.Queue.put(self, item, block, timeout)
+    ppmessage._Wake()
+
 stdin_input = Queue.Queue()
 shell_input = Queue.Queue()
-stdin_output = Queue.Queue()
-shell_output = Queue.Queue()
-iopub_output = Queue.Queue()
+stdin_output = WakingQueue()
+shell_output = WakingQueue()
+iopub_output = WakingQueue()
 
 sys_stdout = sys.stdout
 sys_stderr = sys.stderr
@@ -39,9 +49,6 @@ from IPython.utils.jsonutil import json_clean, encode_images
 from IPython.core.displaypub import DisplayPublisher
 from IPython.config.configurable import Configurable
 
-# module defined in shell.cc for communicating via pepper API
-from pyppapi import nacl_instance
-
 def CreateMessage(msg_type, parent_header=None, content=None):
   if parent_header is None:
     parent_header = {}
@@ -357,37 +364,53 @@ def main_loop():
 
 thread.start_new_thread(main_loop, ())
 
-def deal_message(msg):
-  channel = msg['stream']
-  content = json.loads(msg['json'])
+# The page gets one {stream, json} dictionary per message until it sends a
+# batch itself; from then on replies are batched too.
+batched = False
+pending = []
+
+def deal_message(stream, payload):
+  if stream == 'echo':
+    # Sent straight back, unparsed, so bench.html can time the channel.
+    pending.append((stream, payload))
+    return
+  content = json.loads(str(payload))
 
   queues = {'shell': shell_input, 'stdin': stdin_input}
-  queue = queues[channel]
+  queue = queues[stream]
 
   queue.put(content)
 
-def send_message(stream, msg):
-  nacl_instance.send_raw_object({
-    'stream': stream,
-    'json': json.dumps(msg)
-  })
+def send_messages(messages):
+  if batched:
+    ppmessage._PostMessages(messages)
+  else:
+    for stream, data in messages:
+      ppmessage._PostJSONMessage(stream, str(data))
 
-while 1:
-  msg = nacl_instance.wait_for_message(timeout=1, sleeptime=10000)
-  try:
-    deal_message(msg)
-  except:
-    pass
+output_streams = [
+  (stdin_output, 'stdin'),
+  (shell_output, 'shell'),
+  (iopub_output, 'iopub')
+]
 
-  output_streams = [
-    (stdin_output, 'stdin'),
-    (shell_output, 'shell'),
-    (iopub_output, 'iopub')
-  ]
-  for msg_queue, stream in output_streams:
-    msg = None
+while 1:
+  # Sleeps, without holding the interpreter lock, until the page sends
+  # something or one of the output queues is written to.
+  for stream, payload, is_batch in ppmessage._AcquireMessages():
+    batched = batched or is_batch
     try:
-      msg = msg_queue.get_nowait()
-      send_message(stream, msg)
-    except Queue.Empty:
+      deal_message(stream, payload)
+    except:
       pass
+
+  for msg_queue, stream in output_streams:
+    while 1:
+      try:
+        msg = msg_queue.get_nowait()
+      except Queue.Empty:
+        break
+      pending.append((stream, json.dumps(msg)))
+  if pending:
+    send_messages(pending)
+    del pending[:]
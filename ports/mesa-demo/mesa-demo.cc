@@ -26,6 +26,8 @@
 #include <ppapi/c/ppb_graphics_2d.h>
 #include <ppapi/c/ppb_image_data.h>
 #include <ppapi/c/ppb_instance.h>
+#include <ppapi/c/ppb_messaging.h>
+#include <ppapi/c/ppb_var.h>
 #include <ppapi/c/ppp.h>
 #include <ppapi/c/ppp_instance.h>
 
@@ -47,6 +49,8 @@ const PPB_Core* g_core_interface;
 const PPB_Graphics2D* g_graphics_2d_interface;
 const PPB_ImageData* g_image_data_interface;
 const PPB_Instance* g_instance_interface;
+const PPB_Messaging* g_messaging_interface;
+const PPB_Var* g_var_interface;
 struct GLDemo* gldemo;
 
 // PPP_Instance implementation -----------------------------------------------
@@ -86,12 +90,31 @@ void BindDeviceContext(PP_Instance instance, PP_Resource device_context) {
   }
 }
 
-void FlushCompletionCallback(void* user_data, int32_t result) {
-  // Don't need to do anything here.
+// Sends a line of text to the page's log.
+void PostLog(PP_Instance instance, const char* format, ...) {
+  char message[256];
+  int len = snprintf(message, sizeof(message), "log:");
+  va_list ap;
+  va_start(ap, format);
+  len += vsnprintf(message + len, sizeof(message) - len, format, ap);
+  va_end(ap);
+  if (len >= static_cast<int>(sizeof(message)))
+    len = sizeof(message) - 1;
+  struct PP_Var var = g_var_interface->VarFromUtf8(message, len);
+  g_messaging_interface->PostMessage(instance, var);
+  g_var_interface->Release(var);
 }
 
-// The Surface class owns a image resource and a Pepper 2D context, and owns the
-// Mesa OpenGL context that renders into that bitmap.
+// Number of ImageData buffers a Surface cycles through.  An image handed
+// to ReplaceContents stays the 2D context's backing store until the Flush
+// that replaces it has completed, so while one image is being flushed the
+// one before it is still on screen, and OpenGL needs a third to render into.
+const int kNumBuffers = 3;
+
+// The Surface class owns the image resources and a Pepper 2D context, and
+// owns the Mesa OpenGL context that renders into those bitmaps.  OpenGL
+// always renders into the back buffer, which SwapBuffers hands to the 2D
+// context before moving on to a buffer that the 2D context has let go of.
 class Surface {
  public:
   explicit Surface(struct InstanceInfo *instance);
@@ -108,22 +131,32 @@ class Surface {
   bool IsContextValid() const {
     return static_cast<bool>(g_graphics_2d_interface->IsGraphics2D(context2d_));
   }
-  void Flush();
+  // Puts the back buffer on screen.  |callback| runs once the browser has
+  // painted it, and must call FlushComplete before the next SwapBuffers.
+  void SwapBuffers(struct PP_CompletionCallback callback);
+  // Records that the last SwapBuffers' flush has completed, which releases
+  // the image that was on screen before it.
+  void FlushComplete();
   int width() const {
     return width_;
   }
   int height() const {
     return height_;
   }
+  // The back buffer.
   void* pixels() const {
-    return static_cast<void *>(g_image_data_interface->Map(image_));
+    return pixels_[back_];
   }
 
  private:
   InstanceInfo* info_;
   int width_;
   int height_;
-  PP_Resource image_;
+  PP_Resource images_[kNumBuffers];
+  void* pixels_[kNumBuffers];
+  int back_;
+  int screen_;    // Shown by the last completed flush, or -1.
+  int flushing_;  // Handed to the flush in progress, or -1.
   PP_Resource context2d_;  // The Pepper device context.
   // Mesa specific
   OSMesaContext mesa_context_;
@@ -133,9 +166,15 @@ Surface::Surface(InstanceInfo* info)
     : info_(info),
       width_(0),
       height_(0),
-      image_(0),
+      back_(0),
+      screen_(-1),
+      flushing_(-1),
       context2d_(0),
       mesa_context_(0) {
+  for (int i = 0; i < kNumBuffers; i++) {
+    images_[i] = 0;
+    pixels_[i] = NULL;
+  }
 }
 
 Surface::~Surface() {
@@ -147,8 +186,14 @@ bool Surface::CreateContext(const PP_Size* size) {
     return true;
   width_ = size->width;
   height_ = size->height;
-  image_ = g_image_data_interface->Create(
-      info_->pp_instance, PP_IMAGEDATAFORMAT_BGRA_PREMUL, size, PP_TRUE);
+  for (int i = 0; i < kNumBuffers; i++) {
+    images_[i] = g_image_data_interface->Create(
+        info_->pp_instance, PP_IMAGEDATAFORMAT_BGRA_PREMUL, size, PP_TRUE);
+    pixels_[i] = g_image_data_interface->Map(images_[i]);
+  }
+  back_ = 0;
+  screen_ = -1;
+  flushing_ = -1;
   context2d_ = CreateDeviceContext(info_->pp_instance, size);
   BindDeviceContext(info_->pp_instance, context2d_);
 
@@ -191,41 +236,140 @@ void Surface::DestroyContext() {
     return;
   g_core_interface->ReleaseResource(context2d_);
   printf("OpenGL: Device context released.\n");
-  g_core_interface->ReleaseResource(image_);
-  printf("OpenGL: Image context released.\n");
+  for (int i = 0; i < kNumBuffers; i++) {
+    if (pixels_[i])
+      g_image_data_interface->Unmap(images_[i]);
+    g_core_interface->ReleaseResource(images_[i]);
+    images_[i] = 0;
+    pixels_[i] = NULL;
+  }
+  printf("OpenGL: Image contexts released.\n");
+}
+
+void Surface::SwapBuffers(struct PP_CompletionCallback callback) {
+  assert(flushing_ < 0);
+  g_graphics_2d_interface->ReplaceContents(context2d_, images_[back_]);
+  g_graphics_2d_interface->Flush(context2d_, callback);
+  flushing_ = back_;
+  // Neither the image being flushed nor the one still on screen until that
+  // flush completes may be painted into.
+  do {
+    back_ = (back_ + 1) % kNumBuffers;
+  } while (back_ == flushing_ || back_ == screen_);
 }
 
-void Surface::Flush() {
-  g_graphics_2d_interface->ReplaceContents(context2d_, image_);
-  g_graphics_2d_interface->Flush(context2d_,
-      PP_MakeCompletionCallback(&FlushCompletionCallback, NULL));
+void Surface::FlushComplete() {
+  screen_ = flushing_;
+  flushing_ = -1;
 }
 
+// Frame times are posted to the page this often.
+const PP_TimeTicks kStatsInterval = 2.0;
+
 // GLDemo is an object that responds to calls from the browser to do the 3D
-// rendering.
+// rendering.  Once started it renders continuously, paced by the 2D
+// context: each frame is rendered while the one before it is being
+// painted, and put on screen when that flush completes.
 class GLDemo {
  public:
-  explicit GLDemo(InstanceInfo* info) : surf_(new Surface(info)) {}
+  explicit GLDemo(InstanceInfo* info)
+      : info_(info),
+        surf_(new Surface(info)),
+        running_(false) {
+    ResetStats(0);
+  }
   ~GLDemo() {
     delete surf_;
   }
 
-  void Display() {
-    surf_->Flush();
-  }
+  // Renders the first frame and starts the flush-driven loop, unless it
+  // is already running.
+  void Start();
   // Build a simple vertex buffer object
   void Setup(int width, int height);
 
-  // Called from the browser via Invoke() when the method name is "update".
+  // Renders a frame into the surface's back buffer.
   // All of the opengl rendering is done in this function.
   void Update();
 
  private:
+  static void FlushCompletionCallback(void* user_data, int32_t result);
+  // Puts the frame rendered last on screen and renders the next one.
+  void NextFrame();
+  void ResetStats(PP_TimeTicks now);
+  void ReportStats(PP_TimeTicks now);
+
+  InstanceInfo* info_;
   Surface* surf_;
   GLuint vbo_color_;
   GLuint vbo_vertex_;
+  bool running_;
+
+  // Frame statistics since stats_start_.
+  PP_TimeTicks stats_start_;
+  PP_TimeTicks last_flush_;
+  int frames_;
+  double frame_min_;
+  double frame_max_;
+  double render_total_;
 };
 
+void GLDemo::Start() {
+  if (running_ || !surf_->IsContextValid())
+    return;
+  running_ = true;
+  ResetStats(g_core_interface->GetTimeTicks());
+  last_flush_ = stats_start_;
+  Update();
+  NextFrame();
+}
+
+void GLDemo::NextFrame() {
+  surf_->SwapBuffers(PP_MakeCompletionCallback(&FlushCompletionCallback,
+                                               this));
+  PP_TimeTicks start = g_core_interface->GetTimeTicks();
+  Update();
+  render_total_ += g_core_interface->GetTimeTicks() - start;
+}
+
+void GLDemo::FlushCompletionCallback(void* user_data, int32_t result) {
+  GLDemo* demo = static_cast<GLDemo*>(user_data);
+  demo->surf_->FlushComplete();
+  if (result != PP_OK) {
+    // The context is gone or was never bound; stop until the next Start.
+    demo->running_ = false;
+    return;
+  }
+  PP_TimeTicks now = g_core_interface->GetTimeTicks();
+  double frame = now - demo->last_flush_;
+  demo->last_flush_ = now;
+  demo->frames_++;
+  if (frame < demo->frame_min_)
+    demo->frame_min_ = frame;
+  if (frame > demo->frame_max_)
+    demo->frame_max_ = frame;
+  if (now - demo->stats_start_ >= kStatsInterval)
+    demo->ReportStats(now);
+  demo->NextFrame();
+}
+
+void GLDemo::ResetStats(PP_TimeTicks now) {
+  stats_start_ = now;
+  frames_ = 0;
+  frame_min_ = 1e9;
+  frame_max_ = 0;
+  render_total_ = 0;
+}
+
+void GLDemo::ReportStats(PP_TimeTicks now) {
+  double elapsed = now - stats_start_;
+  PostLog(info_->pp_instance,
+          "%.1f fps, frame %.2f ms (min %.2f, max %.2f), render %.2f ms",
+          frames_ / elapsed, elapsed * 1e3 / frames_, frame_min_ * 1e3,
+          frame_max_ * 1e3, render_total_ * 1e3 / frames_);
+  ResetStats(now);
+}
+
 
 void GLDemo::Setup(int width, int height) {
   PP_Size size;
@@ -354,8 +498,7 @@ void Instance_DidChangeView(PP_Instance pp_instance,
       info->last_size.height != position->size.height) {
     // Got a resize, repaint the plugin.
     gldemo->Setup(position->size.width, position->size.height);
-    gldemo->Update();
-    gldemo->Display();
+    gldemo->Start();
     info->last_size.width = position->size.width;
     info->last_size.height = position->size.height;
   }
@@ -392,8 +535,12 @@ PP_EXPORT int32_t PPP_InitializeModule(PP_Module module,
       get_browser_interface(PPB_IMAGEDATA_INTERFACE);
   g_graphics_2d_interface = (const PPB_Graphics2D*)
       get_browser_interface(PPB_GRAPHICS_2D_INTERFACE);
+  g_messaging_interface = (const PPB_Messaging*)
+      get_browser_interface(PPB_MESSAGING_INTERFACE);
+  g_var_interface = (const PPB_Var*)
+      get_browser_interface(PPB_VAR_INTERFACE);
   if (!g_core_interface || !g_instance_interface || !g_image_data_interface ||
-      !g_graphics_2d_interface)
+      !g_graphics_2d_interface || !g_messaging_interface || !g_var_interface)
     return -1;
   return PP_OK;
 }
@@ -4,108 +4,160 @@
  * found in the LICENSE file.
  */
 
-#include <stdlib.h>
-#include <string.h>
+/* Incremental Ogg/Vorbis decoder.  The caller feeds the compressed stream
+ * in whatever pieces it arrives in and pulls out 16-bit interleaved PCM as
+ * far as the bytes so far allow, so neither the whole file nor the whole
+ * decoded track ever has to be in memory.  This uses the low level
+ * libogg/libvorbis API rather than vorbisfile, which wants to read (and
+ * seek) the stream itself.
+ */
 
-#include "vorbis/vorbisfile.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 
-/* Opaque structure passed through the callbacks. */
-typedef struct ogg_handle {
-  void* buffer;
-  size_t size;
-  off_t read_pos;
-} ogg_handle;
+#include "vorbis/codec.h"
 
-/*  reference:
+typedef struct OggStream {
+  ogg_sync_state oy;
+  ogg_stream_state os;
+  vorbis_info vi;
+  vorbis_comment vc;
+  vorbis_dsp_state vd;
+  vorbis_block vb;
+  int stream_init;  /* os is set up for the first page's serial number */
+  int headers;      /* Vorbis header packets seen; 3 once decoding */
+  int error;
+} OggStream;
 
-typedef struct {
-  size_t (*read_func)  (void *ptr, size_t size, size_t nmemb, void *datasource);
-  int    (*seek_func)  (void *datasource, ogg_int64_t offset, int whence);
-  int    (*close_func) (void *datasource);
-  long   (*tell_func)  (void *datasource);
-} ov_callbacks;
-*/
+OggStream* OggStreamCreate(void) {
+  OggStream* s = (OggStream*)calloc(1, sizeof(OggStream));
+  if (s == NULL)
+    return NULL;
+  ogg_sync_init(&s->oy);
+  vorbis_info_init(&s->vi);
+  vorbis_comment_init(&s->vc);
+  return s;
+}
 
-static size_t audio_read(void* buffer, size_t size, size_t nmemb, void* f) {
-  size_t actual_size = size * nmemb;
-  if (((ogg_handle*)f)->size - ((ogg_handle*)f)->read_pos < actual_size)
-    actual_size = ((ogg_handle*)f)->size - ((ogg_handle*)f)->read_pos;
-  if (actual_size != size * nmemb) {
-    nmemb = actual_size / size;
+void OggStreamDestroy(OggStream* s) {
+  if (s->headers == 3) {
+    vorbis_block_clear(&s->vb);
+    vorbis_dsp_clear(&s->vd);
   }
-  memcpy(buffer, ((ogg_handle*)f)->buffer + ((ogg_handle*)f)->read_pos,
-         size * nmemb);
-  ((ogg_handle*)f)->read_pos += size * nmemb;
-  return nmemb;
+  if (s->stream_init)
+    ogg_stream_clear(&s->os);
+  vorbis_comment_clear(&s->vc);
+  vorbis_info_clear(&s->vi);
+  ogg_sync_clear(&s->oy);
+  free(s);
 }
 
-static int audio_seek(void* f, ogg_int64_t off, int whence) {
-  switch (whence) {
-    case SEEK_SET:
-      ((ogg_handle*)f)->read_pos = off;
-      break;
-    case SEEK_CUR:
-      ((ogg_handle*)f)->read_pos += off;
-      break;
-    case SEEK_END:
-      ((ogg_handle*)f)->read_pos = (off_t)(((ogg_handle*)f)->size) + off;
-      break;
-  }
-  return ((ogg_handle*)f)->read_pos;
+/* Returns space for up to size more bytes of the compressed stream.  Call
+ * OggStreamWrote once they are there, before asking for more space.
+ */
+char* OggStreamBuffer(OggStream* s, size_t size) {
+  return ogg_sync_buffer(&s->oy, size);
 }
 
-static int audio_close(void* f) {
-  return 0;
+void OggStreamWrote(OggStream* s, size_t size) {
+  ogg_sync_wrote(&s->oy, size);
 }
 
-static long audio_tell(void* f) {
-  return ((ogg_handle*)f)->read_pos;
+/* Channels and sample rate; 0 until the headers have been decoded. */
+int OggStreamChannels(OggStream* s) {
+  return s->headers == 3 ? s->vi.channels : 0;
 }
 
-void DecodeOggBuffer(void* inBuffer,
-                     size_t size,
-                     char** outBuffer,
-                     int* outBufferSize,
-                     int* outChannels,
-                     int* outRate) {
-  OggVorbis_File ogg;
+long OggStreamRate(OggStream* s) {
+  return s->headers == 3 ? s->vi.rate : 0;
+}
 
-  ogg_handle oh;
-  oh.buffer = inBuffer;
-  oh.size = size;
-  oh.read_pos = 0;
+/* Bytes of compressed stream held, for memory accounting. */
+size_t OggStreamBufferedBytes(OggStream* s) {
+  return s->oy.storage + (s->stream_init ? s->os.body_storage : 0);
+}
 
-  /* Use custom callbacks to read the ogg file from a buffer in the absence of
-   * ordinary POSIX file functions.
-   */
-  ov_callbacks callbacks = {
-      (size_t (*)(void*, size_t, size_t, void*))audio_read,
-      (int (*)(void*, ogg_int64_t, int))audio_seek,
-      (int (*)(void*))audio_close,
-      (long (*)(void*))audio_tell,
-  };
+static int TakePacket(OggStream* s, ogg_packet* op) {
+  if (s->headers < 3) {
+    if (vorbis_synthesis_headerin(&s->vi, &s->vc, op) < 0) {
+      printf("ogg stream: bad Vorbis header\n");
+      return -1;
+    }
+    if (++s->headers == 3) {
+      printf("ogg stream, channels: %d, rate: %ld\n", s->vi.channels,
+             s->vi.rate);
+      if (vorbis_synthesis_init(&s->vd, &s->vi) != 0 ||
+          vorbis_block_init(&s->vd, &s->vb) != 0)
+        return -1;
+    }
+    return 0;
+  }
+  if (vorbis_synthesis(&s->vb, op) == 0)
+    vorbis_synthesis_blockin(&s->vd, &s->vb);
+  return 0;
+}
 
-  ov_open_callbacks(&oh, &ogg, NULL, 0, callbacks);
-  vorbis_info* info = ov_info(&ogg, -1);
-  printf("ogg file, channels: %d, rate: %ld\n", info->channels, info->rate);
-  ogg_int64_t num_samples = ov_pcm_total(&ogg, -1);
-#define SAMPLE_SIZE sizeof(short) /* assume 16-bit samples */
-  printf("\tnum_samples: %lld buffer size: %lld\n", num_samples,
-         info->channels * SAMPLE_SIZE * num_samples);
+/* Decodes into out, which has room for size bytes, as many whole sample
+ * frames as the input so far allows.  Returns the number of bytes written,
+ * which is less than size only when more input is needed (or the stream
+ * has ended), or -1 if the stream is not Ogg/Vorbis.
+ */
+int OggStreamRead(OggStream* s, char* out, size_t size) {
+  size_t pos = 0;
+  if (s->error)
+    return -1;
+  for (;;) {
+    if (s->headers == 3) {
+      float** pcm;
+      int frame_bytes = s->vi.channels * sizeof(short);
+      int room = (size - pos) / frame_bytes;
+      int samples = vorbis_synthesis_pcmout(&s->vd, &pcm);
+      if (samples > 0 && room > 0) {
+        int i, c;
+        short* dst = (short*)(out + pos);
+        if (samples > room)
+          samples = room;
+        for (i = 0; i < samples; i++) {
+          for (c = 0; c < s->vi.channels; c++) {
+            int v = (int)floor(pcm[c][i] * 32767.f + .5f);
+            if (v > 32767)
+              v = 32767;
+            else if (v < -32768)
+              v = -32768;
+            *dst++ = v;
+          }
+        }
+        vorbis_synthesis_read(&s->vd, samples);
+        pos += samples * frame_bytes;
+        continue;
+      }
+      if (room == 0)
+        return pos;
+    }
 
-  int buf_size = num_samples * SAMPLE_SIZE * info->channels;
-  /* Caller is responsible for freeing the resulting PCM buffer. */
-  char* pcm_buffer = (char*)malloc(buf_size);
-  int pos = 0;
-  while (pos < buf_size) {
-    int ret = ov_read(&ogg, pcm_buffer + pos, buf_size - pos, 0, 2, 1, NULL);
-    if (ret == OV_HOLE || ret == OV_EBADLINK || ret == OV_EINVAL)
-      continue;
-    pos += ret;
-  }
+    if (s->stream_init) {
+      ogg_packet op;
+      int ret = ogg_stream_packetout(&s->os, &op);
+      if (ret > 0) {
+        if (TakePacket(s, &op) < 0) {
+          s->error = 1;
+          return -1;
+        }
+        continue;
+      }
+      if (ret < 0)
+        continue;  /* a hole in the data; carry on with the next packet */
+    }
 
-  *outBuffer = pcm_buffer;
-  *outBufferSize = buf_size;
-  *outChannels = info->channels;
-  *outRate = info->rate;
+    ogg_page og;
+    if (ogg_sync_pageout(&s->oy, &og) != 1)
+      return pos;
+    if (!s->stream_init) {
+      ogg_stream_init(&s->os, ogg_page_serialno(&og));
+      s->stream_init = 1;
+    }
+    /* Pages of other logical streams are not ours; pagein rejects them. */
+    ogg_stream_pagein(&s->os, &og);
+  }
 }
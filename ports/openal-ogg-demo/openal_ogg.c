@@ -4,16 +4,21 @@
  * found in the LICENSE file.
  */
 
-/* This example loads an ogg file using the C Pepper URLLoader interface,
- * decodes the file using libvorbis/libogg, and loop plays the file using
- * OpenAL.  Various properties of the audio source and listener can be changed
- * through HTML controls which result in PostMessage calls interpreted below in
- * Messaging_HandleMessage.
+/* This example streams an ogg file using the C Pepper URLLoader interface,
+ * decodes it with libvorbis/libogg as the bytes arrive, and loop plays it
+ * through a small ring of OpenAL buffers queued on one source.  Playback
+ * starts as soon as the first buffer is full, and the whole file is never
+ * held in memory, compressed or decoded.  Various properties of the audio
+ * source and listener can be changed through HTML controls which result in
+ * PostMessage calls interpreted below in Messaging_HandleMessage.
  */
 
 #include <assert.h>
+#include <malloc.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "AL/al.h"
@@ -28,6 +33,7 @@
 #include "ppapi/c/ppb_audio_config.h"
 #include "ppapi/c/ppb_instance.h"
 #include "ppapi/c/ppb_core.h"
+#include "ppapi/c/ppb_messaging.h"
 #include "ppapi/c/ppb_url_loader.h"
 #include "ppapi/c/ppb_url_request_info.h"
 #include "ppapi/c/ppb_var.h"
@@ -42,6 +48,14 @@ PPB_GetInterface g_get_browser_interface = NULL;
 const size_t BUFFER_READ_SIZE = 4096;
 const char* OGG_FILE = "sample.ogg";
 
+/* The OpenAL buffers a stream cycles through, and the bytes of PCM in each.
+ * That is about 0.75s of 44.1kHz stereo in all, which SERVICE_INTERVAL_MS
+ * polling keeps topped up.
+ */
+#define NUM_STREAM_BUFFERS 4
+const size_t STREAM_BUFFER_SIZE = 32768;
+const int32_t SERVICE_INTERVAL_MS = 50;
+
 /* NOTE on PP_Instance: In general Pepper is designed such that a
  * single plugin process can implement multiple plugin instances.
  * This might occur, for example, if a plugin were instantiated by
@@ -57,11 +71,12 @@ struct PepperState {
   const struct PPB_URLRequestInfo_1_0* request_interface;
   const struct PPB_URLLoader_1_0* loader_interface;
   const struct PPB_Var_1_1* var_interface;
+  const struct PPB_Messaging_1_0* messaging_interface;
   PP_Instance instance;
   int ready;
   ALCdevice* alc_device;
   ALCcontext* alc_context;
-  ALuint buffer;
+  ALuint buffers[NUM_STREAM_BUFFERS];
   ALuint source;
   float source_pos[3];
   float source_vel[3];
@@ -73,17 +88,45 @@ struct PepperState {
 struct PepperState g_MyState;
 int g_MyStateIsValid = 0;
 
-char* ogg_file_contents = NULL;
-size_t ogg_file_size = 0;
-size_t ogg_file_alloced = 0;
-void ReadSome(void* data);
+typedef struct OggStream OggStream;
+extern OggStream* OggStreamCreate(void);
+extern void OggStreamDestroy(OggStream* s);
+extern char* OggStreamBuffer(OggStream* s, size_t size);
+extern void OggStreamWrote(OggStream* s, size_t size);
+extern int OggStreamChannels(OggStream* s);
+extern long OggStreamRate(OggStream* s);
+extern int OggStreamRead(OggStream* s, char* out, size_t size);
+extern size_t OggStreamBufferedBytes(OggStream* s);
+
+/* One pass through the file: the download and the decoder it feeds.  When
+ * the pass has been decoded to the end, a new one starts to loop the track;
+ * the browser cache serves the second download.
+ */
+struct StreamState {
+  OggStream* decoder;
+  PP_Resource loader;
+  int read_pending;
+  int download_done;
+  int failed;
+  /* PCM decoded but not yet handed to OpenAL. */
+  char* pcm;
+  size_t pcm_fill;
+  /* OpenAL buffers not queued on the source. */
+  ALuint free_buffers[NUM_STREAM_BUFFERS];
+  int num_free;
+
+  /* Measurements. */
+  PP_TimeTicks start_time;
+  int first_audio_reported;
+  size_t heap_baseline;
+  size_t heap_peak;
+  size_t ogg_peak;  /* Most compressed bytes the decoder held at once. */
+  int passes;
+};
+struct StreamState g_Stream;
 
-extern void DecodeOggBuffer(void* inBuffer,
-                            size_t size,
-                            char** outBuffer,
-                            int* outBufferSize,
-                            int* outChannels,
-                            int* outRate);
+void ReadSome();
+void StartDownload();
 
 void SetupAndPlayAudio() {
   g_MyState.source_pos[0] = 1.0f;
@@ -107,8 +150,6 @@ void SetupAndPlayAudio() {
 
   alDistanceModel(AL_LINEAR_DISTANCE_CLAMPED);
   assert(alGetError() == AL_NO_ERROR);
-  alSourcei(g_MyState.source, AL_LOOPING, AL_TRUE);
-  assert(alGetError() == AL_NO_ERROR);
   alSourcefv(g_MyState.source, AL_POSITION, g_MyState.source_pos);
   assert(alGetError() == AL_NO_ERROR);
   alSourcef(g_MyState.source, AL_REFERENCE_DISTANCE, 1.0f);
@@ -117,8 +158,6 @@ void SetupAndPlayAudio() {
   assert(alGetError() == AL_NO_ERROR);
   alSourcef(g_MyState.source, AL_GAIN, 1.0f);
   assert(alGetError() == AL_NO_ERROR);
-  alSourcei(g_MyState.source, AL_BUFFER, g_MyState.buffer);
-  assert(alGetError() == AL_NO_ERROR);
   alSourcef(g_MyState.source, AL_PITCH, g_MyState.pitch);
   assert(alGetError() == AL_NO_ERROR);
   alSourcef(g_MyState.source, AL_GAIN, g_MyState.gain);
@@ -127,72 +166,216 @@ void SetupAndPlayAudio() {
   assert(alGetError() == AL_NO_ERROR);
 }
 
-void DecodeAndPlayOggFile() {
-  char* pcm_buffer;
-  int buffer_size;
-  int num_channels;
-  int rate;
-  DecodeOggBuffer(ogg_file_contents, ogg_file_size, &pcm_buffer, &buffer_size,
-                  &num_channels, &rate);
-
-  /* Pass the decoded PCM buffer to OpenAL. */
-  alBufferData(g_MyState.buffer,
-               num_channels == 2 ? AL_FORMAT_STEREO16 : AL_FORMAT_MONO16,
-               pcm_buffer, buffer_size, rate);
+static void PostStats(const char* format, ...) {
+  char message[256];
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(message, sizeof(message), format, ap);
+  va_end(ap);
+  printf("%s\n", message);
+  struct PP_Var var =
+      g_MyState.var_interface->VarFromUtf8(message, strlen(message));
+  g_MyState.messaging_interface->PostMessage(g_MyState.instance, var);
+  g_MyState.var_interface->Release(var);
+}
+
+/* Heap in use, which includes the OpenAL buffers' copies of the PCM. */
+static size_t HeapInUse() {
+  struct mallinfo mi = mallinfo();
+  return mi.uordblks;
+}
+
+static void SampleHeap() {
+  size_t in_use = HeapInUse();
+  if (in_use > g_Stream.heap_peak)
+    g_Stream.heap_peak = in_use;
+  if (g_Stream.decoder) {
+    size_t buffered = OggStreamBufferedBytes(g_Stream.decoder);
+    if (buffered > g_Stream.ogg_peak)
+      g_Stream.ogg_peak = buffered;
+  }
+}
+
+/* Hands the decoded PCM to a free OpenAL buffer and queues that on the
+ * source, starting playback with the first one.
+ */
+static void QueuePcm() {
+  int channels = OggStreamChannels(g_Stream.decoder);
+  ALuint buffer = g_Stream.free_buffers[--g_Stream.num_free];
+  alBufferData(buffer, channels == 2 ? AL_FORMAT_STEREO16 : AL_FORMAT_MONO16,
+               g_Stream.pcm, g_Stream.pcm_fill,
+               OggStreamRate(g_Stream.decoder));
+  assert(alGetError() == AL_NO_ERROR);
+  alSourceQueueBuffers(g_MyState.source, 1, &buffer);
   assert(alGetError() == AL_NO_ERROR);
+  g_Stream.pcm_fill = 0;
 
-  free(pcm_buffer);
-  free(ogg_file_contents);
+  if (!g_MyState.ready) {
+    SetupAndPlayAudio();
+    g_MyState.ready = 1;
+  }
+  if (!g_Stream.first_audio_reported) {
+    PP_TimeTicks now = g_MyState.core_interface->GetTimeTicks();
+    g_Stream.first_audio_reported = 1;
+    PostStats("time to first audio: %.1f ms",
+              (now - g_Stream.start_time) * 1000.0);
+  }
+}
 
-  ogg_file_contents = NULL;
-  ogg_file_alloced = 0;
-  ogg_file_size = 0;
+/* Decodes as much as there is input for into the free OpenAL buffers.
+ * Returns 1 once the pass has been decoded and queued to the end.
+ */
+static int FillBuffers() {
+  while (g_Stream.num_free > 0) {
+    int n = OggStreamRead(g_Stream.decoder, g_Stream.pcm + g_Stream.pcm_fill,
+                          STREAM_BUFFER_SIZE - g_Stream.pcm_fill);
+    if (n < 0) {
+      printf("Cannot decode %s\n", OGG_FILE);
+      g_Stream.failed = 1;
+      return 0;
+    }
+    g_Stream.pcm_fill += n;
+    int frame_bytes = OggStreamChannels(g_Stream.decoder) * sizeof(short);
+    if (frame_bytes > 0 &&
+        STREAM_BUFFER_SIZE - g_Stream.pcm_fill < (size_t)frame_bytes) {
+      QueuePcm();
+    } else if (n == 0) {
+      if (!g_Stream.download_done)
+        return 0;
+      if (frame_bytes == 0) {
+        printf("%s has no Vorbis audio\n", OGG_FILE);
+        g_Stream.failed = 1;
+        return 0;
+      }
+      if (g_Stream.pcm_fill == 0)
+        return 1;
+      QueuePcm();
+    }
+  }
+  return 0;
+}
 
-  SetupAndPlayAudio();
-  g_MyState.ready = 1;
+/* Runs every SERVICE_INTERVAL_MS and whenever bytes arrive: takes back the
+ * buffers OpenAL has played, refills them, and asks for more of the file
+ * while there is somewhere for its PCM to go.
+ */
+static void ServiceStream() {
+  ALint processed = 0;
+  alGetSourcei(g_MyState.source, AL_BUFFERS_PROCESSED, &processed);
+  while (processed-- > 0) {
+    ALuint buffer;
+    alSourceUnqueueBuffers(g_MyState.source, 1, &buffer);
+    assert(alGetError() == AL_NO_ERROR);
+    g_Stream.free_buffers[g_Stream.num_free++] = buffer;
+  }
+  if (g_Stream.failed)
+    return;
+
+  if (FillBuffers()) {
+    /* This pass is all queued; loop the track with a new one. */
+    size_t peak = g_Stream.heap_peak - g_Stream.heap_baseline;
+    PostStats("pass %d decoded, heap high water: %lu KB above start, "
+              "%lu KB of it compressed", ++g_Stream.passes,
+              (unsigned long)(peak / 1024),
+              (unsigned long)(g_Stream.ogg_peak / 1024));
+    StartDownload();
+  } else if (!g_Stream.read_pending && !g_Stream.download_done &&
+             g_Stream.num_free > 0) {
+    ReadSome();
+  }
+
+  /* Restart after an underrun, which stops the source. */
+  ALint state, queued;
+  alGetSourcei(g_MyState.source, AL_SOURCE_STATE, &state);
+  alGetSourcei(g_MyState.source, AL_BUFFERS_QUEUED, &queued);
+  if (g_MyState.ready && state != AL_PLAYING && queued > 0)
+    alSourcePlay(g_MyState.source);
+  SampleHeap();
+}
+
+static void ServiceCallback(void* data, int32_t result) {
+  if (!g_MyStateIsValid)
+    return;
+  ServiceStream();
+  g_MyState.core_interface->CallOnMainThread(
+      SERVICE_INTERVAL_MS, PP_MakeCompletionCallback(ServiceCallback, NULL),
+      PP_OK);
 }
 
 static void ReadCallback(void* data, int32_t result) {
+  g_Stream.read_pending = 0;
   if (result == PP_OK) {
     /* We're done reading the file. */
-    DecodeAndPlayOggFile();
+    g_Stream.download_done = 1;
+    g_MyState.core_interface->ReleaseResource(g_Stream.loader);
+    g_Stream.loader = 0;
   } else if (result > 0) {
-    /* 'result' bytes were read into memory. */
-    ogg_file_size += (size_t)result;
-    ReadSome(data);
-  } else
-    assert(0);
+    /* 'result' bytes were read into the decoder's buffer. */
+    OggStreamWrote(g_Stream.decoder, (size_t)result);
+  } else {
+    printf("Reading %s failed: %d\n", OGG_FILE, result);
+    g_Stream.failed = 1;
+    return;
+  }
+  ServiceStream();
 }
 
 static void OpenCallback(void* data, int32_t result) {
-  assert(result == PP_OK);
-  ReadSome(data);
+  if (result != PP_OK) {
+    printf("Opening %s failed: %d\n", OGG_FILE, result);
+    g_Stream.failed = 1;
+    return;
+  }
+  ReadSome();
 }
 
-/* Read up to BUFFER_READ_SIZE bytes more from the URLLoader.
- * Allocate more space in the destination buffer if needed.
+/* Read up to BUFFER_READ_SIZE bytes more from the URLLoader, straight into
+ * the decoder's input buffer.
  */
-void ReadSome(void* data) {
-  while (ogg_file_alloced < ogg_file_size + BUFFER_READ_SIZE) {
-    /* The buffer isn't big enough to hold BUFFER_READ_SIZE more bytes. */
-    char* temp = (char*)malloc(ogg_file_alloced * 2);
-    memcpy(temp, ogg_file_contents, ogg_file_size);
-    free(ogg_file_contents);
-    ogg_file_contents = temp;
-    ogg_file_alloced *= 2;
-  }
-
+void ReadSome() {
   struct PP_CompletionCallback cb =
-      PP_MakeCompletionCallback(ReadCallback, data);
+      PP_MakeCompletionCallback(ReadCallback, NULL);
+  g_Stream.read_pending = 1;
 #ifndef NDEBUG
   int32_t read_ret =
 #endif
       g_MyState.loader_interface->ReadResponseBody(
-          (PP_Resource)data, ogg_file_contents + ogg_file_size,
+          g_Stream.loader, OggStreamBuffer(g_Stream.decoder, BUFFER_READ_SIZE),
           BUFFER_READ_SIZE, cb);
   assert(read_ret == PP_OK_COMPLETIONPENDING);
 }
 
+/* Starts a pass: a fresh decoder fed by a new download of OGG_FILE. */
+void StartDownload() {
+  if (g_Stream.decoder)
+    OggStreamDestroy(g_Stream.decoder);
+  g_Stream.decoder = OggStreamCreate();
+  g_Stream.download_done = 0;
+  g_Stream.pcm_fill = 0;
+  /* Each pass reports its own high water. */
+  g_Stream.heap_peak = HeapInUse();
+  g_Stream.ogg_peak = 0;
+
+  PP_Resource request = g_MyState.request_interface->Create(g_MyState.instance);
+  struct PP_Var url =
+      g_MyState.var_interface->VarFromUtf8(OGG_FILE, strlen(OGG_FILE));
+  g_MyState.request_interface->SetProperty(request, PP_URLREQUESTPROPERTY_URL,
+                                           url);
+  g_MyState.var_interface->Release(url);
+
+  g_Stream.loader = g_MyState.loader_interface->Create(g_MyState.instance);
+  struct PP_CompletionCallback cb =
+      PP_MakeCompletionCallback(OpenCallback, NULL);
+  g_Stream.read_pending = 1;
+  int32_t open_ret =
+      g_MyState.loader_interface->Open(g_Stream.loader, request, cb);
+  g_MyState.core_interface->ReleaseResource(request);
+  if (open_ret != PP_OK_COMPLETIONPENDING) {
+    printf("Cannot open %s: %d\n", OGG_FILE, open_ret);
+    g_Stream.failed = 1;
+  }
+}
+
 void InitializeOpenAL() {
   /* PPAPI should be the default device in NaCl, hence 'NULL'. */
   g_MyState.alc_device = alcOpenDevice(NULL);
@@ -202,7 +385,7 @@ void InitializeOpenAL() {
   assert(g_MyState.alc_context != NULL);
 
   alcMakeContextCurrent(g_MyState.alc_context);
-  alGenBuffers(1, &g_MyState.buffer);
+  alGenBuffers(NUM_STREAM_BUFFERS, g_MyState.buffers);
   assert(alGetError() == AL_NO_ERROR);
   alGenSources(1, &g_MyState.source);
   assert(alGetError() == AL_NO_ERROR);
@@ -229,21 +412,19 @@ static PP_Bool Instance_DidCreate(PP_Instance instance,
 
   InitializeOpenAL();
 
-  ogg_file_contents = (char*)malloc(BUFFER_READ_SIZE);
-  ogg_file_alloced = BUFFER_READ_SIZE;
-
-  PP_Resource request = g_MyState.request_interface->Create(instance);
-  g_MyState.request_interface->SetProperty(
-      request, PP_URLREQUESTPROPERTY_URL,
-      g_MyState.var_interface->VarFromUtf8(OGG_FILE, strlen(OGG_FILE)));
-
-  PP_Resource loader = g_MyState.loader_interface->Create(instance);
-  struct PP_CompletionCallback cb =
-      PP_MakeCompletionCallback(OpenCallback, (void*)loader);
-  int32_t open_ret = g_MyState.loader_interface->Open(loader, request, cb);
-  assert(open_ret == PP_OK_COMPLETIONPENDING);
-  if (open_ret != PP_OK_COMPLETIONPENDING)
+  memset(&g_Stream, 0, sizeof(g_Stream));
+  int i;
+  for (i = 0; i < NUM_STREAM_BUFFERS; i++)
+    g_Stream.free_buffers[i] = g_MyState.buffers[i];
+  g_Stream.num_free = NUM_STREAM_BUFFERS;
+  g_Stream.heap_baseline = HeapInUse();
+  g_Stream.pcm = (char*)malloc(STREAM_BUFFER_SIZE);
+  g_Stream.start_time = g_MyState.core_interface->GetTimeTicks();
+
+  StartDownload();
+  if (g_Stream.failed)
     return PP_FALSE;
+  ServiceCallback(NULL, PP_OK);
 
   return PP_TRUE;
 }
@@ -357,6 +538,7 @@ PPP_InitializeModule(PP_Module module, PPB_GetInterface get_browser_interface) {
   GET_INTERFFACE(request_interface, PPB_URLREQUESTINFO_INTERFACE_1_0);
   GET_INTERFFACE(loader_interface, PPB_URLLOADER_INTERFACE_1_0);
   GET_INTERFFACE(var_interface, PPB_VAR_INTERFACE_1_1);
+  GET_INTERFFACE(messaging_interface, PPB_MESSAGING_INTERFACE_1_0);
 
   /* These interfaces are used by OpenAL so check for them here
    * to make sure they're available.
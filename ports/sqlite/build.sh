@@ -44,6 +44,14 @@ RunTest() {
   naclport_test/test -g
 }
 
+# Throughput on nacl_io filesystems; see sqlite_bench.cc.  The sizes are
+# cut down to keep the build quick, and a failed configuration shows up in
+# the table without failing the build.
+RunBench() {
+  naclport_test/sqlite_bench --rows=5000 --lookups=5000 --commits=100 || \
+    echo "sqlite_bench: some configurations failed"
+}
+
 TestStep() {
   MakeDir naclport_test
 
@@ -63,8 +71,20 @@ TestStep() {
   LogExecute ${NACLCXX} ${NACLPORTS_LDFLAGS} \
     -o naclport_test/test${EXT} test.o gtest-all.o sqlite3.o ${NACLPORTS_LIBS}
 
-  [[ ${NACL_ARCH} == "pnacl" ]] && ${PNACLFINALIZE} \
-    -o naclport_test/test${NACL_EXEEXT} naclport_test/test${EXT}
+  LogExecute ${NACLCXX} -I${SRC_DIR} ${NACLPORTS_CPPFLAGS} \
+    ${NACLPORTS_CFLAGS} -o sqlite_bench.o -c ${START_DIR}/sqlite_bench.cc
+
+  LogExecute ${NACLCXX} ${NACLPORTS_LDFLAGS} \
+    -o naclport_test/sqlite_bench${EXT} sqlite_bench.o sqlite3.o \
+    ${NACLPORTS_LIBS}
+
+  if [[ ${NACL_ARCH} == "pnacl" ]]; then
+    ${PNACLFINALIZE} \
+      -o naclport_test/test${NACL_EXEEXT} naclport_test/test${EXT}
+    ${PNACLFINALIZE} \
+      -o naclport_test/sqlite_bench${NACL_EXEEXT} \
+      naclport_test/sqlite_bench${EXT}
+  fi
 
   echo "Running test"
 
@@ -79,9 +99,15 @@ TestStep() {
        test)
     RunTest
     echo "Tests OK"
+    (cd naclport_test;
+     TranslateAndWriteLauncherScript sqlite_bench${NACL_EXEEXT} x86-64 \
+       sqlite_bench.x86-64${EXT} sqlite_bench)
+    RunBench
   elif [ "$(uname -m)" = "${NACL_ARCH_ALT}" ]; then
     WriteLauncherScript naclport_test/test test${EXT}
     RunTest
     echo "Tests OK"
+    WriteLauncherScript naclport_test/sqlite_bench sqlite_bench${EXT}
+    RunBench
   fi
 }
@@ -0,0 +1,319 @@
+// Copyright 2016 The Native Client Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures sqlite throughput on nacl_io filesystems, so that regressions in
+// the VFS/nacl_io path show up as numbers.  For every combination of
+// filesystem, page size, journal mode and mmap size it times:
+//   insert: rows/s inserted in one transaction
+//   lookup: indexed point lookups/s
+//   commit: single-row autocommit transactions/s
+//
+//   sqlite_bench [--rows=N] [--lookups=N] [--commits=N] [--fs=a,b]
+//                [--page-sizes=a,b] [--journal-modes=a,b] [--mmap-sizes=a,b]
+//
+// Filesystems that cannot be mounted here (html5fs outside the browser) are
+// skipped.  sqlite only honours mmap_size from 3.7.17, so on older versions
+// only the 0 setting is run.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include "nacl_io/nacl_io.h"
+
+namespace {
+
+int g_rows = 20000;
+int g_lookups = 20000;
+int g_commits = 500;
+
+const int kValueSize = 100;
+const char kBenchDir[] = "/bench";
+
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// A fixed sequence, so that every configuration does the same work.
+unsigned Random(unsigned* state) {
+  *state = *state * 1103515245 + 12345;
+  return *state >> 8;
+}
+
+std::vector<std::string> SplitList(const char* list) {
+  std::vector<std::string> items;
+  std::string rest(list);
+  size_t pos;
+  while ((pos = rest.find(',')) != std::string::npos) {
+    items.push_back(rest.substr(0, pos));
+    rest = rest.substr(pos + 1);
+  }
+  if (!rest.empty())
+    items.push_back(rest);
+  return items;
+}
+
+bool Exec(sqlite3* db, const std::string& sql) {
+  char* error = NULL;
+  if (sqlite3_exec(db, sql.c_str(), NULL, NULL, &error) != SQLITE_OK) {
+    fprintf(stderr, "%s: %s\n", sql.c_str(), error);
+    sqlite3_free(error);
+    return false;
+  }
+  return true;
+}
+
+// Runs a pragma that reports its new value and returns that value.
+std::string QueryPragma(sqlite3* db, const std::string& sql) {
+  std::string value;
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK)
+    return value;
+  if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0))
+    value = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+  sqlite3_finalize(stmt);
+  return value;
+}
+
+bool MountFilesystem(const std::string& fs, const std::string& dir) {
+  mkdir(kBenchDir, 0777);
+  mkdir(dir.c_str(), 0777);
+  const char* data = NULL;
+  if (fs == "html5fs")
+    data = "type=TEMPORARY,expected_size=268435456";
+  return mount("", dir.c_str(), fs.c_str(), 0, data) == 0;
+}
+
+void RemoveDatabase(const std::string& path) {
+  unlink(path.c_str());
+  unlink((path + "-journal").c_str());
+  unlink((path + "-wal").c_str());
+  unlink((path + "-shm").c_str());
+}
+
+// Opens a fresh database with the given settings.  The port's VFS has no
+// shared memory, so WAL needs exclusive locking.
+sqlite3* OpenDatabase(const std::string& path, int page_size,
+                      const std::string& journal_mode, long mmap_size) {
+  RemoveDatabase(path);
+  sqlite3* db = NULL;
+  if (sqlite3_open(path.c_str(), &db) != SQLITE_OK) {
+    fprintf(stderr, "opening %s: %s\n", path.c_str(), sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+
+  char sql[64];
+  snprintf(sql, sizeof(sql), "PRAGMA page_size=%d", page_size);
+  bool ok = Exec(db, sql);
+  if (ok && journal_mode == "wal")
+    ok = Exec(db, "PRAGMA locking_mode=EXCLUSIVE");
+  if (ok) {
+    std::string mode = QueryPragma(db, "PRAGMA journal_mode=" + journal_mode);
+    if (strcasecmp(mode.c_str(), journal_mode.c_str()) != 0) {
+      fprintf(stderr, "journal_mode=%s not available (got '%s')\n",
+              journal_mode.c_str(), mode.c_str());
+      ok = false;
+    }
+  }
+  if (ok && mmap_size) {
+    snprintf(sql, sizeof(sql), "PRAGMA mmap_size=%ld", mmap_size);
+    ok = Exec(db, sql);
+  }
+  if (!ok) {
+    sqlite3_close(db);
+    return NULL;
+  }
+  return db;
+}
+
+// Inserts g_rows rows in one transaction, remembering their keys.  Returns
+// rows per second, or a negative number on error.
+double BulkInsert(sqlite3* db, std::vector<int>* keys) {
+  if (!Exec(db, "CREATE TABLE t(id INTEGER PRIMARY KEY, k INTEGER, v TEXT)"))
+    return -1;
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(db, "INSERT INTO t(k, v) VALUES (?, ?)", -1, &stmt,
+                         NULL) != SQLITE_OK)
+    return -1;
+
+  std::string value(kValueSize, 'v');
+  unsigned state = 1;
+  keys->clear();
+  double start = Now();
+  bool ok = Exec(db, "BEGIN");
+  for (int i = 0; ok && i < g_rows; i++) {
+    int key = Random(&state);
+    keys->push_back(key);
+    sqlite3_bind_int(stmt, 1, key);
+    sqlite3_bind_text(stmt, 2, value.data(), value.size(), SQLITE_STATIC);
+    ok = sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_reset(stmt);
+  }
+  ok = ok && Exec(db, "COMMIT");
+  double elapsed = Now() - start;
+  sqlite3_finalize(stmt);
+  return ok ? g_rows / elapsed : -1;
+}
+
+// Looks up g_lookups of the inserted keys through an index.  Building the
+// index is not timed.
+double IndexedLookup(sqlite3* db, const std::vector<int>& keys) {
+  if (keys.empty() || !Exec(db, "CREATE INDEX t_k ON t(k)"))
+    return -1;
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(db, "SELECT v FROM t WHERE k = ?", -1, &stmt,
+                         NULL) != SQLITE_OK)
+    return -1;
+
+  unsigned state = 2;
+  bool ok = true;
+  double start = Now();
+  for (int i = 0; ok && i < g_lookups; i++) {
+    sqlite3_bind_int(stmt, 1, keys[Random(&state) % keys.size()]);
+    ok = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_reset(stmt);
+  }
+  double elapsed = Now() - start;
+  sqlite3_finalize(stmt);
+  return ok ? g_lookups / elapsed : -1;
+}
+
+// Inserts g_commits rows, each in its own transaction.
+double Commits(sqlite3* db) {
+  sqlite3_stmt* stmt;
+  if (sqlite3_prepare_v2(db, "INSERT INTO t(k, v) VALUES (?, ?)", -1, &stmt,
+                         NULL) != SQLITE_OK)
+    return -1;
+
+  std::string value(kValueSize, 'c');
+  unsigned state = 3;
+  bool ok = true;
+  double start = Now();
+  for (int i = 0; ok && i < g_commits; i++) {
+    sqlite3_bind_int(stmt, 1, Random(&state));
+    sqlite3_bind_text(stmt, 2, value.data(), value.size(), SQLITE_STATIC);
+    ok = sqlite3_step(stmt) == SQLITE_DONE;
+    sqlite3_reset(stmt);
+  }
+  double elapsed = Now() - start;
+  sqlite3_finalize(stmt);
+  return ok ? g_commits / elapsed : -1;
+}
+
+void PrintRate(double rate) {
+  if (rate < 0)
+    printf(" %10s", "failed");
+  else
+    printf(" %10.0f", rate);
+}
+
+// Prints one row of results; returns false if anything in it failed.
+bool RunConfig(const std::string& path, const std::string& fs, int page_size,
+               const std::string& journal_mode, long mmap_size) {
+  printf("%-8s %6d %-8s %9ld", fs.c_str(), page_size, journal_mode.c_str(),
+         mmap_size);
+  fflush(stdout);
+  sqlite3* db = OpenDatabase(path, page_size, journal_mode, mmap_size);
+  if (!db) {
+    printf(" %10s\n", "failed");
+    return false;
+  }
+
+  std::vector<int> keys;
+  double insert = BulkInsert(db, &keys);
+  double lookup = IndexedLookup(db, keys);
+  double commit = Commits(db);
+  PrintRate(insert);
+  PrintRate(lookup);
+  PrintRate(commit);
+  printf("\n");
+
+  sqlite3_close(db);
+  RemoveDatabase(path);
+  return insert >= 0 && lookup >= 0 && commit >= 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* filesystems = "memfs,html5fs";
+  const char* page_sizes = "1024,4096,16384";
+  const char* journal_modes = "delete,wal";
+  const char* mmap_sizes = "0,67108864";
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--rows=", 7) == 0) {
+      g_rows = atoi(argv[i] + 7);
+    } else if (strncmp(argv[i], "--lookups=", 10) == 0) {
+      g_lookups = atoi(argv[i] + 10);
+    } else if (strncmp(argv[i], "--commits=", 10) == 0) {
+      g_commits = atoi(argv[i] + 10);
+    } else if (strncmp(argv[i], "--fs=", 5) == 0) {
+      filesystems = argv[i] + 5;
+    } else if (strncmp(argv[i], "--page-sizes=", 13) == 0) {
+      page_sizes = argv[i] + 13;
+    } else if (strncmp(argv[i], "--journal-modes=", 16) == 0) {
+      journal_modes = argv[i] + 16;
+    } else if (strncmp(argv[i], "--mmap-sizes=", 13) == 0) {
+      mmap_sizes = argv[i] + 13;
+    } else {
+      fprintf(stderr, "usage: %s [--rows=N] [--lookups=N] [--commits=N] "
+              "[--fs=a,b] [--page-sizes=a,b] [--journal-modes=a,b] "
+              "[--mmap-sizes=a,b]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  nacl_io_init();
+
+  bool have_mmap = sqlite3_libversion_number() >= 3007017;
+  printf("sqlite %s: %d rows, %d lookups, %d commits\n", sqlite3_libversion(),
+         g_rows, g_lookups, g_commits);
+  if (!have_mmap)
+    printf("mmap_size needs sqlite 3.7.17; only running mmap 0\n");
+  printf("%-8s %6s %-8s %9s %10s %10s %10s\n", "fs", "page", "journal",
+         "mmap", "insert/s", "lookup/s", "commit/s");
+
+  bool ok = true;
+  std::vector<std::string> fs_list = SplitList(filesystems);
+  std::vector<std::string> page_list = SplitList(page_sizes);
+  std::vector<std::string> journal_list = SplitList(journal_modes);
+  std::vector<std::string> mmap_list = SplitList(mmap_sizes);
+  for (size_t f = 0; f < fs_list.size(); f++) {
+    std::string dir = std::string(kBenchDir) + "/" + fs_list[f];
+    if (!MountFilesystem(fs_list[f], dir)) {
+      printf("%-8s skipped: mount failed: %s\n", fs_list[f].c_str(),
+             strerror(errno));
+      continue;
+    }
+    std::string path = dir + "/bench.db";
+    for (size_t p = 0; p < page_list.size(); p++) {
+      for (size_t j = 0; j < journal_list.size(); j++) {
+        for (size_t m = 0; m < mmap_list.size(); m++) {
+          long mmap_size = atol(mmap_list[m].c_str());
+          if (mmap_size && !have_mmap)
+            continue;
+          ok &= RunConfig(path, fs_list[f], atoi(page_list[p].c_str()),
+                          journal_list[j], mmap_size);
+        }
+      }
+    }
+    umount(dir.c_str());
+  }
+  return ok ? 0 : 1;
+}
@@ -11,6 +11,7 @@ ConfigureStep() {
   FILES="
 my_syslog.h
 syslog.cpp
+syslog_bench.cpp
 Makefile"
   for FILE in $FILES; do
     cp -f ${START_DIR}/${FILE} .
@@ -27,7 +28,7 @@ BuildStep() {
   export NACLPORTS_CFLAGS
   export NACLPORTS_LDFLAGS
   export NACLPORTS_LIBS
-  LogExecute make -j${OS_JOBS} thttpd
+  LogExecute make -j${OS_JOBS} thttpd syslog_bench
 }
 
 InstallStep() {
@@ -20,6 +20,32 @@ extern "C" {
 #endif
 void syslog(int level, const char* message, ...);
 void network_error();
+
+/* syslog() formats lines into a ring buffer that a background thread writes
+ * to stderr in batches.  Lines less severe than LOG_ERR are dropped, and
+ * counted, when the ring is full.
+ */
+
+/* Drops lines less severe than level; LOG_INFO keeps everything.  The
+ * THTTPD_LOG_LEVEL environment variable (info, notice, warn, err or crit)
+ * sets the initial level.
+ */
+void syslog_set_level(int level);
+
+/* Returns once everything logged so far has been written. */
+void syslog_flush();
+
+struct syslog_stats {
+  unsigned long written;
+  unsigned long writes;     /* to stderr, each a message to the page */
+  unsigned long dropped;    /* ring was full */
+  unsigned long filtered;   /* below the level set */
+  unsigned long truncated;  /* longer than a ring slot */
+};
+void syslog_get_stats(struct syslog_stats* stats);
+
+/* Generate debugging statistics syslog message. */
+void syslog_logstats(long secs);
 #ifdef __cplusplus
 }
 #endif
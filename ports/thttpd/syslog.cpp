@@ -4,6 +4,12 @@
  * found in the LICENSE file.
  */
 
+#include <pthread.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
@@ -14,32 +20,322 @@
 #include <ppapi_simple/ps.h>
 #include <ppapi_simple/ps_interface.h>
 
-#define MAX_FMT_SIZE 4096
-char formatted_string[MAX_FMT_SIZE];
+/* Every write to stderr becomes a message to the page, so lines are not
+ * written as they are logged.  The caller formats each line straight into a
+ * slot of a ring; a flusher thread copies whatever has accumulated into one
+ * buffer and writes that.  The ring is a bounded multi-producer queue in
+ * which each slot's sequence number says whether it is free for the
+ * producer at that position or filled for the consumer, so logging takes no
+ * lock; only every kWakeInterval lines does a caller take one, to wake the
+ * flusher early.
+ */
 
-void syslog(int level, const char* message, ...) {
+namespace {
+
+const unsigned kNumSlots = 1024;  // a power of two
+const int kLineSize = 512;
+const int kBatchSize = 64 * 1024;
+const unsigned kWakeInterval = kNumSlots / 4;
+const long kIdleWaitNs = 10 * 1000 * 1000;
+const int kFullWaitUs = 100;
+
+struct Slot {
+  unsigned sequence;
+  int length;
+  char text[kLineSize];
+};
+
+Slot g_slots[kNumSlots];
+unsigned g_enqueue_pos;
+unsigned g_dequeue_pos;   // only touched by the flusher
+unsigned g_written_pos;   // everything before this has been written
+char g_batch[kBatchSize];
+
+pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
+pthread_t g_flusher;
+pthread_mutex_t g_wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_wake_cond = PTHREAD_COND_INITIALIZER;
+bool g_flusher_running;
+int g_stop;
+int g_min_severity;
+
+unsigned long g_written;
+unsigned long g_writes;
+unsigned long g_dropped;
+unsigned long g_filtered;
+unsigned long g_truncated;
+
+template <typename T>
+T LoadAcquire(const T* p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template <typename T>
+void StoreRelease(T* p, T value) {
+  __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+void Count(unsigned long* counter, unsigned long n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// LOG_NOTICE and LOG_DEBUG share a value, which sorts above LOG_CRIT, so
+// levels are ranked explicitly.
+int Severity(int level) {
   switch (level) {
     case LOG_INFO:
-      fprintf(stderr, "INFO: ");
-      break;
+      return 0;
+    case LOG_NOTICE:
+      return 1;
     case LOG_WARN:
-      fprintf(stderr, "WARN: ");
-      break;
+      return 2;
     case LOG_ERR:
-      fprintf(stderr, "ERR: ");
-      break;
+      return 3;
     case LOG_CRIT:
-      fprintf(stderr, "CRIT: ");
+      return 4;
+  }
+  return 0;
+}
+
+const char* Prefix(int level) {
+  switch (level) {
+    case LOG_INFO:
+      return "INFO: ";
+    case LOG_WARN:
+      return "WARN: ";
+    case LOG_ERR:
+      return "ERR: ";
+    case LOG_CRIT:
+      return "CRIT: ";
+  }
+  return "";
+}
+
+int ParseLevel(const char* name) {
+  static const struct {
+    const char* name;
+    int level;
+  } kLevels[] = {
+    { "info", LOG_INFO },
+    { "notice", LOG_NOTICE },
+    { "warn", LOG_WARN },
+    { "warning", LOG_WARN },
+    { "err", LOG_ERR },
+    { "error", LOG_ERR },
+    { "crit", LOG_CRIT },
+  };
+  for (size_t i = 0; i < sizeof(kLevels) / sizeof(kLevels[0]); i++) {
+    if (strcasecmp(name, kLevels[i].name) == 0)
+      return kLevels[i].level;
+  }
+  return LOG_INFO;
+}
+
+void WriteBatch(const char* data, size_t length) {
+  fwrite(data, 1, length, stderr);
+  fflush(stderr);
+  Count(&g_writes, 1);
+}
+
+// Copies every filled slot into g_batch, writing it out whenever it fills
+// up and once at the end.  Returns the number of lines written.
+unsigned long Drain() {
+  unsigned start = g_dequeue_pos;
+  size_t length = 0;
+  unsigned long lines = 0;
+  for (;;) {
+    Slot* slot = &g_slots[g_dequeue_pos & (kNumSlots - 1)];
+    if (LoadAcquire(&slot->sequence) != g_dequeue_pos + 1)
       break;
+    if (length + slot->length > sizeof(g_batch)) {
+      WriteBatch(g_batch, length);
+      Count(&g_written, lines);
+      length = 0;
+      lines = 0;
+    }
+    memcpy(g_batch + length, slot->text, slot->length);
+    length += slot->length;
+    lines++;
+    StoreRelease(&slot->sequence, g_dequeue_pos + kNumSlots);
+    g_dequeue_pos++;
+  }
+  if (length > 0) {
+    WriteBatch(g_batch, length);
+    Count(&g_written, lines);
   }
+  StoreRelease(&g_written_pos, g_dequeue_pos);
+  return g_dequeue_pos - start;
+}
+
+void WakeFlusher() {
+  pthread_mutex_lock(&g_wake_mutex);
+  pthread_cond_signal(&g_wake_cond);
+  pthread_mutex_unlock(&g_wake_mutex);
+}
+
+// Sleeps until woken, or for kIdleWaitNs, so that quiet logging is still
+// written promptly.
+void WaitForLines() {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += kIdleWaitNs;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  pthread_mutex_lock(&g_wake_mutex);
+  pthread_cond_timedwait(&g_wake_cond, &g_wake_mutex, &deadline);
+  pthread_mutex_unlock(&g_wake_mutex);
+}
+
+void* FlushThread(void*) {
+  for (;;) {
+    // Read before draining, so that everything logged before the stop
+    // request is written.
+    int stop = LoadAcquire(&g_stop);
+    if (Drain() == 0) {
+      if (stop)
+        return NULL;
+      WaitForLines();
+    }
+  }
+}
+
+bool FlusherRunning() {
+  return LoadAcquire(&g_flusher_running);
+}
+
+void StopFlusher() {
+  StoreRelease(&g_stop, 1);
+  WakeFlusher();
+  pthread_join(g_flusher, NULL);
+  StoreRelease(&g_flusher_running, false);
+}
+
+void Init() {
+  for (unsigned i = 0; i < kNumSlots; i++)
+    g_slots[i].sequence = i;
+
+  const char* level = getenv("THTTPD_LOG_LEVEL");
+  if (level)
+    g_min_severity = Severity(ParseLevel(level));
+
+  if (pthread_create(&g_flusher, NULL, FlushThread, NULL) == 0) {
+    g_flusher_running = true;
+    atexit(StopFlusher);
+  }
+}
+
+// Claims the slot for the next line, setting *pos to its position.  When
+// the ring is full this returns NULL, or if wait is set, waits for the
+// flusher to free a slot.
+Slot* ClaimSlot(bool wait, unsigned* pos) {
+  unsigned p = __atomic_load_n(&g_enqueue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    Slot* slot = &g_slots[p & (kNumSlots - 1)];
+    int diff = static_cast<int>(LoadAcquire(&slot->sequence) - p);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&g_enqueue_pos, &p, p + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *pos = p;
+        return slot;
+      }
+    } else if (diff < 0) {
+      if (!wait || !FlusherRunning())
+        return NULL;
+      WakeFlusher();
+      usleep(kFullWaitUs);
+      p = __atomic_load_n(&g_enqueue_pos, __ATOMIC_RELAXED);
+    } else {
+      p = __atomic_load_n(&g_enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Formats a whole line, prefix and newline included, into text, and
+// returns its length.  Lines that do not fit end in "...".
+int FormatLine(char* text, int level, const char* message, va_list args) {
+  int length = snprintf(text, kLineSize, "%s", Prefix(level));
+  // Leave room for the newline.
+  int space = kLineSize - 1 - length;
+  int n = vsnprintf(text + length, space, message, args);
+  if (n >= space) {
+    length += space - 1;
+    memcpy(text + length - 3, "...", 3);
+    Count(&g_truncated, 1);
+  } else if (n > 0) {
+    length += n;
+  }
+  if (length == 0 || text[length - 1] != '\n')
+    text[length++] = '\n';
+  return length;
+}
+
+}  // namespace
+
+void syslog(int level, const char* message, ...) {
+  pthread_once(&g_init_once, Init);
+
+  if (Severity(level) < __atomic_load_n(&g_min_severity, __ATOMIC_RELAXED)) {
+    Count(&g_filtered, 1);
+    return;
+  }
+
   va_list argptr;
   va_start(argptr, message);
-  vsprintf(formatted_string, message, argptr);
-  va_end(argptr);
-  fprintf(stderr, "%s", formatted_string);
-  if (strlen(message) > 0 && message[strlen(message) - 1] != '\n') {
-    fprintf(stderr, "\n");
+  if (!FlusherRunning()) {
+    char text[kLineSize];
+    int length = FormatLine(text, level, message, argptr);
+    va_end(argptr);
+    WriteBatch(text, length);
+    Count(&g_written, 1);
+    return;
+  }
+
+  unsigned pos;
+  Slot* slot = ClaimSlot(Severity(level) >= Severity(LOG_ERR), &pos);
+  if (slot == NULL) {
+    va_end(argptr);
+    Count(&g_dropped, 1);
+    return;
   }
+  slot->length = FormatLine(slot->text, level, message, argptr);
+  va_end(argptr);
+  StoreRelease(&slot->sequence, pos + 1);
+  if (pos % kWakeInterval == kWakeInterval - 1)
+    WakeFlusher();
+}
+
+void syslog_set_level(int level) {
+  __atomic_store_n(&g_min_severity, Severity(level), __ATOMIC_RELAXED);
+}
+
+void syslog_flush() {
+  pthread_once(&g_init_once, Init);
+  if (!FlusherRunning())
+    return;
+  unsigned target = __atomic_load_n(&g_enqueue_pos, __ATOMIC_RELAXED);
+  WakeFlusher();
+  while (static_cast<int>(LoadAcquire(&g_written_pos) - target) < 0)
+    usleep(1000);
+}
+
+void syslog_get_stats(struct syslog_stats* stats) {
+  stats->written = __atomic_load_n(&g_written, __ATOMIC_RELAXED);
+  stats->writes = __atomic_load_n(&g_writes, __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n(&g_dropped, __ATOMIC_RELAXED);
+  stats->filtered = __atomic_load_n(&g_filtered, __ATOMIC_RELAXED);
+  stats->truncated = __atomic_load_n(&g_truncated, __ATOMIC_RELAXED);
+}
+
+void syslog_logstats(long secs) {
+  struct syslog_stats stats;
+  syslog_get_stats(&stats);
+  syslog(LOG_INFO,
+         "  syslog - %lu lines written in %lu writes, %lu dropped, "
+         "%lu filtered, %lu truncated",
+         stats.written, stats.writes, stats.dropped, stats.filtered,
+         stats.truncated);
 }
 
 extern "C" {
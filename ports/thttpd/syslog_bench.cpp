@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/* Logs a million thttpd-style lines through syslog() and reports how fast
+ * the callers got through them, how long writing them all out took, and
+ * how many were dropped because the ring was full.
+ *
+ *   syslog_bench [--lines=N] [--threads=N] [--pace=US] [output file]
+ *
+ * --pace sleeps that many microseconds every 100 lines, to model a server
+ * that does some work between log lines.  Output goes to syslog_bench.log
+ * unless a file is given.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+#include "my_syslog.h"
+
+static long g_lines = 1000000;
+static int g_threads = 1;
+static int g_pace_us = 0;
+
+static double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void* LogLines(void* arg) {
+  long thread = reinterpret_cast<long>(arg);
+  long count = g_lines / g_threads;
+  for (long i = 0; i < count; i++) {
+    if (i % 1000 == 999)
+      syslog(LOG_ERR, "%.80s connection timed out reading", "127.0.0.1");
+    else
+      syslog(LOG_INFO, "%.80s URL \"%.80s\" thread %ld line %ld",
+             "127.0.0.1", "/index.html", thread, i);
+    if (g_pace_us && i % 100 == 99)
+      usleep(g_pace_us);
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  const char* output = "syslog_bench.log";
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--lines=", 8) == 0)
+      g_lines = atol(argv[i] + 8);
+    else if (strncmp(argv[i], "--threads=", 10) == 0)
+      g_threads = atoi(argv[i] + 10);
+    else if (strncmp(argv[i], "--pace=", 7) == 0)
+      g_pace_us = atoi(argv[i] + 7);
+    else
+      output = argv[i];
+  }
+  if (g_lines <= 0 || g_threads <= 0) {
+    fprintf(stderr, "usage: %s [--lines=N] [--threads=N] [--pace=US] "
+            "[output file]\n", argv[0]);
+    return 1;
+  }
+
+  // The log goes to stderr, results to stdout.
+  if (freopen(output, "w", stderr) == NULL) {
+    perror(output);
+    return 1;
+  }
+
+  double start = Now();
+  pthread_t* threads = new pthread_t[g_threads];
+  for (long i = 1; i < g_threads; i++)
+    pthread_create(&threads[i], NULL, LogLines, reinterpret_cast<void*>(i));
+  LogLines(NULL);
+  for (int i = 1; i < g_threads; i++)
+    pthread_join(threads[i], NULL);
+  delete[] threads;
+  double logged = Now();
+  syslog_flush();
+  double flushed = Now();
+
+  struct syslog_stats stats;
+  syslog_get_stats(&stats);
+  long total = g_lines / g_threads * g_threads;
+  printf("%ld lines from %d thread(s)", total, g_threads);
+  if (g_pace_us)
+    printf(", pausing %d us every 100", g_pace_us);
+  printf("\n");
+  printf("  logging:  %.3f s, %.0f lines/s\n", logged - start,
+         total / (logged - start));
+  printf("  flushed:  %.3f s after the last line\n", flushed - logged);
+  printf("  written:  %lu lines in %lu writes\n", stats.written,
+         stats.writes);
+  printf("  dropped:  %lu, truncated: %lu\n", stats.dropped, stats.truncated);
+  return 0;
+}
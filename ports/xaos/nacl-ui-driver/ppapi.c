@@ -6,6 +6,7 @@
 #include "aconfig.h"
 
 /*includes */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +17,8 @@
 #include "ppapi/c/pp_instance.h"
 #include "ppapi/c/pp_module.h"
 #include "ppapi/c/pp_point.h"
+#include "ppapi/c/pp_rect.h"
+#include "ppapi/c/pp_size.h"
 #include "ppapi/c/pp_var.h"
 
 #include "ppapi/c/ppb.h"
@@ -32,28 +35,75 @@
 
 #include "ui_nacl.h"
 
+/* a power of two */
 #define kMaxEvents 1024
+/* input latency histogram buckets: under 1ms, 2ms, 4ms ... and the rest */
+#define kLatencyBuckets 10
 /* chrome cananot handle all that many refreshs */
 #define kRefreshInterval 40
+/* how often the benchmark mode reports, in seconds */
+#define kBenchInterval 2.0
+
+/*
+ * Input events go from the main thread (the only producer) to the xaos
+ * thread (the only consumer) through a preallocated ring.  head and tail
+ * count events ever put in and taken out.  A mouse move that finds the
+ * newest event still unread and also a move updates that one in place
+ * instead: the slot's state is flipped from kSlotReady to kSlotWriting
+ * with a compare-and-swap, which fails once the consumer has flipped it
+ * to kSlotTaken.  The mutex and condvar are only used when the consumer
+ * has to sleep.
+ */
+enum { kSlotTaken, kSlotReady, kSlotWriting };
+
+struct EventSlot {
+  struct PpapiEvent event;
+  PP_TimeTicks time;
+  int state;
+};
 
 static struct {
+  uint32_t head;
+  uint32_t tail;
+  int sleeping;
   pthread_mutex_t mutex;
   pthread_cond_t condvar;
-  int tail;
-  int num;
-  struct PpapiEvent* queue[kMaxEvents];
+  struct EventSlot slots[kMaxEvents];
+  /* producer only */
+  struct EventSlot* last_move;
+  int dropped;
+  /* benchmark mode */
+  int coalesced;
+  int latency[kLatencyBuckets];
 } EventQueue;
 
+/*
+ * XaoS renders straight into two mapped ImageData, one while the other is
+ * on screen.  PresentVideoBuffer makes a buffer pending, and the next
+ * screen refresh paints the rows of it that changed and flushes.  The
+ * mutex only guards this bookkeeping; nobody holds it during Flush.
+ */
 static struct {
-  pthread_mutex_t flush_mutex;
+  pthread_mutex_t mutex;
+  pthread_cond_t flushed;
   int width;
   int height;
 
-  void* image_data;
-  /* TODO make this atomic */
-  int dirty;
-  PP_Resource image;
+  PP_Resource images[2];
+  uint32_t* pixels[2];
+  int pending;        /* buffer waiting to be painted, or -1 */
+  int in_flight;      /* buffer being flushed, or -1 */
+  int last_presented; /* what XaoS does not draw into next, or -1 */
+  int dirty_top;      /* rows of pending that changed since the last */
+  int dirty_bottom;   /* painted frame, bottom exclusive */
   PP_Resource device;
+
+  /* benchmark mode */
+  int frames_presented;
+  int frames_painted;
+  int rows_painted;
+  double present_time;
+  double bench_start;
 } Video;
 
 /*  zero initialized */
@@ -71,6 +121,7 @@ static struct {
   pthread_t tid;
   int num_instances;
   int num_viewchanges;
+  int bench;
 } Global;
 
 int GetWidth() {
@@ -81,6 +132,14 @@ int GetHeight() {
   return Video.height;
 }
 
+int IsBenchmark() {
+  return Global.bench;
+}
+
+void* GetVideoBuffer(int index) {
+  return Video.pixels[index];
+}
+
 extern int original_main(int argc, char* argv[]);
 
 static void* ThreadForRunningXaosMain(void* arg) {
@@ -97,42 +156,151 @@ static void ScheduleScreenRefresh() {
   Global.if_core->CallOnMainThread(kRefreshInterval, ScreenUpdateCallback, 0);
 }
 
+static void ReportFrameRate() {
+  double now = Global.if_core->GetTimeTicks();
+  double elapsed = now - Video.bench_start;
+  if (elapsed < kBenchInterval)
+    return;
+
+  pthread_mutex_lock(&Video.mutex);
+  NaClLog(LOG_INFO,
+          "bench: %.1f frames/s rendered, %.1f painted, %.0f%% of rows, "
+          "%.2f ms to present\n",
+          Video.frames_presented / elapsed, Video.frames_painted / elapsed,
+          Video.frames_painted ?
+              100.0 * Video.rows_painted /
+                  ((double)Video.frames_painted * Video.height) : 0.0,
+          Video.frames_presented ?
+              1e3 * Video.present_time / Video.frames_presented : 0.0);
+  Video.frames_presented = 0;
+  Video.frames_painted = 0;
+  Video.rows_painted = 0;
+  Video.present_time = 0;
+  pthread_mutex_unlock(&Video.mutex);
+  Video.bench_start = now;
+
+  char histogram[16 * kLatencyBuckets];
+  int i, n = 0;
+  for (i = 0; i < kLatencyBuckets; i++) {
+    n += snprintf(histogram + n, sizeof histogram - n, " %s%d:%d",
+                  i < kLatencyBuckets - 1 ? "<" : ">=",
+                  1 << (i < kLatencyBuckets - 1 ? i : i - 1),
+                  __atomic_exchange_n(&EventQueue.latency[i], 0,
+                                      __ATOMIC_RELAXED));
+  }
+  NaClLog(LOG_INFO, "bench: input latency ms%s, %d moves coalesced\n",
+          histogram, EventQueue.coalesced);
+  EventQueue.coalesced = 0;
+}
+
 static void FlushCallbackFun(void* user_data, int32_t result) {
-  /* it is now safe to use the video buffer */
-  Video.dirty = 0;
-  pthread_mutex_unlock(&Video.flush_mutex);
+  /* it is now safe to draw into the buffer again */
+  pthread_mutex_lock(&Video.mutex);
+  Video.in_flight = -1;
+  pthread_cond_broadcast(&Video.flushed);
+  pthread_mutex_unlock(&Video.mutex);
+  if (Global.bench)
+    ReportFrameRate();
   ScheduleScreenRefresh();
 }
 
-void CopyImageDataToVideo(void* data) {
-  pthread_mutex_lock(&Video.flush_mutex);
-  Video.dirty = 1;
-  memcpy(Video.image_data, data, Video.width * Video.height * BYTES_PER_PIXEL);
+typedef uint32_t PixelVector __attribute__((vector_size(16)));
 
-  /* Set alpha to 0xff.  xaos generates zeros here */
-  int* pixels = (int*)Video.image_data;
-  int i;
-  for (i = 0; i < Video.width * Video.height; i++) {
-    pixels[i] |= 0xff000000;
+/* Set alpha to 0xff.  xaos generates zeros here */
+static void SetOpaque(uint32_t* row, int n) {
+  const PixelVector alpha = {0xff000000, 0xff000000, 0xff000000, 0xff000000};
+  PixelVector v;
+  int i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    memcpy(&v, row + i, sizeof v);
+    v |= alpha;
+    memcpy(row + i, &v, sizeof v);
+  }
+  for (; i < n; i++)
+    row[i] |= 0xff000000;
+}
+
+void PresentVideoBuffer(int index) {
+  uint32_t* pixels = Video.pixels[index];
+  uint32_t* previous = Video.pixels[index ^ 1];
+  const int width = Video.width;
+  double start = Global.bench ? Global.if_core->GetTimeTicks() : 0;
+  int top = Video.height, bottom = 0;
+  int full, y;
+
+  pthread_mutex_lock(&Video.mutex);
+  /* unless the other buffer is the frame before, compare nothing */
+  full = Video.last_presented != (index ^ 1);
+  while (Video.in_flight == index)
+    pthread_cond_wait(&Video.flushed, &Video.mutex);
+  pthread_mutex_unlock(&Video.mutex);
+
+  /* the other buffer holds the previous frame */
+  for (y = 0; y < Video.height; y++) {
+    uint32_t* row = pixels + y * width;
+    SetOpaque(row, width);
+    if (full || memcmp(row, previous + y * width, width * BYTES_PER_PIXEL)) {
+      if (y < top)
+        top = y;
+      bottom = y + 1;
+    }
   }
 
-  /* do not let anybody write into video buffer while flush in progress*/
-  pthread_mutex_unlock(&Video.flush_mutex);
+  pthread_mutex_lock(&Video.mutex);
+  if (Video.pending >= 0) {
+    /* the pending frame was never painted, so its changes carry over */
+    if (Video.dirty_top < top)
+      top = Video.dirty_top;
+    if (Video.dirty_bottom > bottom)
+      bottom = Video.dirty_bottom;
+    Video.pending = -1;
+  }
+  if (top < bottom) {
+    Video.pending = index;
+    Video.dirty_top = top;
+    Video.dirty_bottom = bottom;
+  }
+  Video.last_presented = index;
+  Video.frames_presented++;
+  if (Global.bench)
+    Video.present_time += Global.if_core->GetTimeTicks() - start;
+  /* XaoS draws the next frame into the other buffer */
+  while (Video.in_flight == (index ^ 1))
+    pthread_cond_wait(&Video.flushed, &Video.mutex);
+  pthread_mutex_unlock(&Video.mutex);
 }
 
 struct PP_CompletionCallback FlushCallback = {FlushCallbackFun, NULL};
 
 void ScreenUpdateCallbackFun(void* user_data, int32_t result) {
-  if (!Video.dirty) {
+  int index, top, bottom;
+
+  pthread_mutex_lock(&Video.mutex);
+  index = Video.pending;
+  top = Video.dirty_top;
+  bottom = Video.dirty_bottom;
+  if (index >= 0) {
+    Video.pending = -1;
+    Video.in_flight = index;
+    Video.frames_painted++;
+    Video.rows_painted += bottom - top;
+  }
+  pthread_mutex_unlock(&Video.mutex);
+  if (index < 0) {
+    if (Global.bench)
+      ReportFrameRate();
     ScheduleScreenRefresh();
     return;
   }
 
-  NaClLog(LOG_TRACE, "ScreenUpdateCallbackFun\n");
-  pthread_mutex_lock(&Video.flush_mutex);
+  NaClLog(LOG_TRACE, "ScreenUpdateCallbackFun %d rows %d-%d\n", index, top,
+          bottom);
   struct PP_Point top_left = PP_MakePoint(0, 0);
-  Global.if_graphics_2d->PaintImageData(Video.device, Video.image, &top_left,
-                                        NULL);
+  struct PP_Rect changed =
+      PP_MakeRectFromXYWH(0, top, Video.width, bottom - top);
+  Global.if_graphics_2d->PaintImageData(Video.device, Video.images[index],
+                                        &top_left, &changed);
 
   Global.if_graphics_2d->Flush(Video.device, FlushCallback);
 }
@@ -146,6 +314,62 @@ static void InitEvents() {
   pthread_cond_init(&EventQueue.condvar, NULL);
 }
 
+static int CoalesceMove(const struct PpapiEvent* event, PP_TimeTicks time) {
+  struct EventSlot* slot = EventQueue.last_move;
+  if (slot == NULL ||
+      !__atomic_compare_exchange_n(&slot->state, &(int){kSlotReady},
+                                   kSlotWriting, 0, __ATOMIC_ACQUIRE,
+                                   __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  slot->event = *event;
+  slot->time = time;
+  __atomic_store_n(&slot->state, kSlotReady, __ATOMIC_RELEASE);
+  ++EventQueue.coalesced;
+  return 1;
+}
+
+static void PutEvent(const struct PpapiEvent* event, PP_TimeTicks time) {
+  int is_move = event->type == PP_INPUTEVENT_TYPE_MOUSEMOVE;
+  if (is_move && CoalesceMove(event, time))
+    return;
+
+  uint32_t head = EventQueue.head;
+  if (head - __atomic_load_n(&EventQueue.tail, __ATOMIC_ACQUIRE) >=
+      kMaxEvents) {
+    if (EventQueue.dropped++ == 0)
+      NaClLog(LOG_ERROR, "dropping events because of overflow\n");
+    EventQueue.last_move = NULL;
+    return;
+  }
+  if (EventQueue.dropped) {
+    NaClLog(LOG_ERROR, "dropped %d events\n", EventQueue.dropped);
+    EventQueue.dropped = 0;
+  }
+
+  NaClLog(LOG_TRACE, "queue input event\n");
+  struct EventSlot* slot = &EventQueue.slots[head % kMaxEvents];
+  slot->event = *event;
+  slot->time = time;
+  slot->state = kSlotReady;
+  EventQueue.last_move = is_move ? slot : NULL;
+  /* publishes the slot, and orders against the consumer's sleeping */
+  __atomic_store_n(&EventQueue.head, head + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&EventQueue.sleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&EventQueue.mutex);
+    pthread_cond_signal(&EventQueue.condvar);
+    pthread_mutex_unlock(&EventQueue.mutex);
+  }
+}
+
+static void RecordLatency(PP_TimeTicks queued) {
+  double ms = 1e3 * (Global.if_core->GetTimeTicks() - queued);
+  int i = 0;
+  while (i < kLatencyBuckets - 1 && ms >= (1 << i))
+    i++;
+  __atomic_fetch_add(&EventQueue.latency[i], 1, __ATOMIC_RELAXED);
+}
+
 static void InitScreenRefresh(PP_Instance instance,
                               const struct PP_Size* size) {
   NaClLog(LOG_INFO, "initialize screen refresh %dx%d\n", size->width,
@@ -161,22 +385,33 @@ static void InitScreenRefresh(PP_Instance instance,
   NaClLog(LOG_INFO, "create PPAPI graphics device\n");
   Video.device = Global.if_graphics_2d->Create(instance, size, PP_TRUE);
   CHECK(Video.device != 0);
-  NaClLog(LOG_INFO, "create PPAPI image");
   CHECK(Global.if_instance->BindGraphics(Global.instance, Video.device));
-  Video.image = Global.if_image_data->Create(
-      instance, PP_IMAGEDATAFORMAT_BGRA_PREMUL, size, PP_TRUE);
-  CHECK(Video.image != 0);
-  NaClLog(LOG_INFO, "map image into shared memory\n");
-  Video.image_data = (void*)Global.if_image_data->Map(Video.image);
-  CHECK(Video.image_data != NULL);
-  NaClLog(LOG_INFO, "map is %p\n", Video.image_data);
 
-  /* assert some simplifying assumptions */
-  struct PP_ImageDataDesc desc;
-  Global.if_image_data->Describe(Video.image, &desc);
-  CHECK(desc.stride == size->width * BYTES_PER_PIXEL);
+  /* as much room as the malloc'ed xaos buffers used to have */
+  struct PP_Size image_size = PP_MakeSize(size->width, 2 * size->height);
+  int i;
+  for (i = 0; i < 2; i++) {
+    NaClLog(LOG_INFO, "create PPAPI image %d\n", i);
+    Video.images[i] = Global.if_image_data->Create(
+        instance, PP_IMAGEDATAFORMAT_BGRA_PREMUL, &image_size, PP_TRUE);
+    CHECK(Video.images[i] != 0);
+    NaClLog(LOG_INFO, "map image into shared memory\n");
+    Video.pixels[i] = (uint32_t*)Global.if_image_data->Map(Video.images[i]);
+    CHECK(Video.pixels[i] != NULL);
+    NaClLog(LOG_INFO, "map is %p\n", (void*)Video.pixels[i]);
+
+    /* assert some simplifying assumptions */
+    struct PP_ImageDataDesc desc;
+    Global.if_image_data->Describe(Video.images[i], &desc);
+    CHECK(desc.stride == size->width * BYTES_PER_PIXEL);
+  }
 
-  pthread_mutex_init(&Video.flush_mutex, NULL);
+  pthread_mutex_init(&Video.mutex, NULL);
+  pthread_cond_init(&Video.flushed, NULL);
+  Video.pending = -1;
+  Video.in_flight = -1;
+  Video.last_presented = -1;
+  Video.bench_start = Global.if_core->GetTimeTicks();
 
   ScheduleScreenRefresh();
 }
@@ -208,6 +443,14 @@ static PP_Bool DidCreate(PP_Instance instance,
   }
   ++Global.num_instances;
 
+  /* <embed bench="1"> zooms in forever and logs frame rates */
+  uint32_t i;
+  for (i = 0; i < argc; i++) {
+    if (0 == strcmp(argn[i], "bench") && 0 != strcmp(argv[i], "0")) {
+      Global.bench = 1;
+    }
+  }
+
   return PP_TRUE;
 }
 
@@ -237,8 +480,17 @@ static void DidChangeView(PP_Instance instance, PP_Resource view) {
 
 static void DidChangeFocus(PP_Instance instance, PP_Bool has_focus) {
   NaClLog(LOG_INFO, "DidChangeFocus\n");
-  /* force a refresh */
-  Video.dirty = 1;
+  if (Video.device == 0)
+    return;
+  /* force a refresh, of the buffer XaoS is not drawing into */
+  pthread_mutex_lock(&Video.mutex);
+  if (Video.pending < 0)
+    Video.pending = Video.last_presented;
+  if (Video.pending >= 0) {
+    Video.dirty_top = 0;
+    Video.dirty_bottom = Video.height;
+  }
+  pthread_mutex_unlock(&Video.mutex);
 }
 
 static PP_Bool HandleInputEvent(PP_Instance instance, PP_Resource input_event) {
@@ -252,45 +504,40 @@ static PP_Bool HandleInputEvent(PP_Instance instance, PP_Resource input_event) {
     return PP_FALSE;
   }
 
-  struct PpapiEvent* event = (struct PpapiEvent*)malloc(sizeof *event);
-  event->type = Global.if_input_event->GetType(input_event);
-  event->button = Global.if_mouse_input_event->GetButton(input_event);
-  event->position = Global.if_mouse_input_event->GetPosition(input_event);
-  event->clicks = Global.if_mouse_input_event->GetClickCount(input_event);
-
-  pthread_mutex_lock(&EventQueue.mutex);
-  if (EventQueue.num >= kMaxEvents) {
-    NaClLog(LOG_ERROR, "dropping events because of overflow\n");
-  } else {
-    NaClLog(LOG_TRACE, "queue input event\n");
-    int head = (EventQueue.tail + EventQueue.num) % kMaxEvents;
-    EventQueue.queue[head] = event;
-    ++EventQueue.num;
-    if (EventQueue.num >= kMaxEvents)
-      EventQueue.num -= kMaxEvents;
-    pthread_cond_signal(&EventQueue.condvar);
-  }
+  struct PpapiEvent event;
+  event.type = Global.if_input_event->GetType(input_event);
+  event.button = Global.if_mouse_input_event->GetButton(input_event);
+  event.position = Global.if_mouse_input_event->GetPosition(input_event);
+  event.clicks = Global.if_mouse_input_event->GetClickCount(input_event);
 
-  pthread_mutex_unlock(&EventQueue.mutex);
+  PutEvent(&event, Global.if_input_event->GetTimeStamp(input_event));
   return PP_TRUE;
 }
 
-struct PpapiEvent* GetEvent(int wait) {
-  struct PpapiEvent* event = NULL;
-  pthread_mutex_lock(&EventQueue.mutex);
-  if (EventQueue.num == 0 && wait) {
-    pthread_cond_wait(&EventQueue.condvar, &EventQueue.mutex);
+int GetEvent(int wait, struct PpapiEvent* event) {
+  uint32_t tail = EventQueue.tail;
+  if (__atomic_load_n(&EventQueue.head, __ATOMIC_ACQUIRE) == tail) {
+    if (!wait)
+      return 0;
+    pthread_mutex_lock(&EventQueue.mutex);
+    __atomic_store_n(&EventQueue.sleeping, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&EventQueue.head, __ATOMIC_SEQ_CST) == tail)
+      pthread_cond_wait(&EventQueue.condvar, &EventQueue.mutex);
+    __atomic_store_n(&EventQueue.sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&EventQueue.mutex);
   }
 
-  if (EventQueue.num > 0) {
-    event = EventQueue.queue[EventQueue.tail];
-    ++EventQueue.tail;
-    if (EventQueue.tail >= kMaxEvents)
-      EventQueue.tail -= kMaxEvents;
-    --EventQueue.num;
+  /* a move being coalesced into is only ever a few stores from done */
+  struct EventSlot* slot = &EventQueue.slots[tail % kMaxEvents];
+  while (!__atomic_compare_exchange_n(&slot->state, &(int){kSlotReady},
+                                      kSlotTaken, 0, __ATOMIC_ACQUIRE,
+                                      __ATOMIC_RELAXED)) {
   }
-  pthread_mutex_unlock(&EventQueue.mutex);
-  return event;
+  *event = slot->event;
+  if (Global.bench)
+    RecordLatency(slot->time);
+  __atomic_store_n(&EventQueue.tail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
 }
 
 static PP_Bool HandleDocumentLoad(PP_Instance instance,
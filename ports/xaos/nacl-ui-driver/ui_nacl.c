@@ -62,7 +62,7 @@ static void nacl_flush(void) {
   NaClLog(LOG_TRACE, "nacl_flush %d\n", VideoBuffers.current_buffer);
   if (!data)
     return;
-  CopyImageDataToVideo(data);
+  PresentVideoBuffer(VideoBuffers.current_buffer);
 }
 
 static void nacl_display() {
@@ -81,11 +81,10 @@ static void nacl_free_buffers(char* b1, char* b2) {
 
 static int nacl_alloc_buffers(char** b1, char** b2) {
   NaClLog(LOG_INFO, "nacl_alloc_buffers\n");
-  const int image_byte_size = GetHeight() * GetWidth() * BYTES_PER_PIXEL;
 
-  NaClLog(LOG_INFO, "allocate xaos video buffers (size %d)\n", image_byte_size);
-  VideoBuffers.buffers[0] = malloc(image_byte_size * 2);
-  VideoBuffers.buffers[1] = malloc(image_byte_size * 2);
+  /* xaos draws straight into the image data the screen is painted from */
+  VideoBuffers.buffers[0] = GetVideoBuffer(0);
+  VideoBuffers.buffers[1] = GetVideoBuffer(1);
 
   CHECK(VideoBuffers.buffers[0] != NULL && VideoBuffers.buffers[1] != NULL);
   NaClLog(LOG_INFO, "buffer1 %p\n", VideoBuffers.buffers[0]);
@@ -119,25 +118,41 @@ static void nacl_processevents(int wait, int* mx, int* my, int* mb, int* k) {
   static unsigned int mousex = 100;
   static unsigned int mousey = 0;
   static int iflag = 0; /* FIXEM*/
+  struct PpapiEvent event;
+
+  /* benchmark mode: hold the left button in the middle, zooming in */
+  if (IsBenchmark()) {
+    *mx = GetWidth() / 2;
+    *my = GetHeight() / 2;
+    *mb = BUTTON1;
+    *k = iflag;
+    while (GetEvent(0, &event)) {
+    }
+    return;
+  }
 
-  struct PpapiEvent* event = GetEvent(wait);
-  if (event != NULL) {
+  /*
+   * Take all pending moves so the pointer does not lag behind, but stop
+   * after a button change so that xaos gets to see every click.
+   */
+  while (GetEvent(wait, &event)) {
+    wait = 0;
     /* only support mouse events for now */
-    switch (event->type) {
+    switch (event.type) {
       default:
         break;
       case PP_INPUTEVENT_TYPE_MOUSEDOWN:
-        mousebuttons |= ButtonToMask(event->button);
+        mousebuttons |= ButtonToMask(event.button);
         break;
       case PP_INPUTEVENT_TYPE_MOUSEUP:
-        mousebuttons &= ~ButtonToMask(event->button);
+        mousebuttons &= ~ButtonToMask(event.button);
         break;
       case PP_INPUTEVENT_TYPE_MOUSEMOVE:
-        mousex = event->position.x;
-        mousey = event->position.y;
-        break;
+        mousex = event.position.x;
+        mousey = event.position.y;
+        continue;
     }
-    free(event);
+    break;
   }
 
   *mx = mousex;
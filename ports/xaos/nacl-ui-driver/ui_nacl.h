@@ -16,8 +16,14 @@
 int GetWidth();
 int GetHeight();
 
-/* flush video buffer to screen */
-void CopyImageDataToVideo(void* data);
+/* set when the page asks for benchmark mode */
+int IsBenchmark();
+
+/* the two buffers xaos draws into, mapped PPAPI image data */
+void* GetVideoBuffer(int index);
+
+/* send a buffer to the screen; may wait until the other one is free */
+void PresentVideoBuffer(int index);
 
 
 struct PpapiEvent {
@@ -27,8 +33,8 @@ struct PpapiEvent {
   int clicks;
 };
 
-/* get next ppapi event to process, may block if wait == 1 */
-struct PpapiEvent* GetEvent(int wait);
+/* get next ppapi event to process, may block if wait == 1; 0 if none */
+int GetEvent(int wait, struct PpapiEvent* event);
 
 #define CHECK(cond) do { \
   if (!(cond)) { fputs("ABORT: " #cond "\n", stderr); abort(); } \
@@ -39,6 +39,9 @@ PatchStep() {
   DefaultPatchStep
   MakeDir ${SRC_DIR}/hw/kdrive/sdl
   LogExecute cp ${START_DIR}/sdl.c \
+                ${START_DIR}/sdl_damage.c \
+                ${START_DIR}/sdl_damage.h \
+                ${START_DIR}/sdl_damage_bench.c \
                 ${START_DIR}/Makefile.am \
                 ${SRC_DIR}/hw/kdrive/sdl/
 }
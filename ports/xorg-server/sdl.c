@@ -32,6 +32,7 @@
 #include <X11/keysym.h>
 #include <sys/wait.h>
 #include <pthread.h>
+#include "sdl_damage.h"
 
 #ifdef __ANDROID__
 #include <SDL/SDL_screenkeyboard.h>
@@ -95,11 +96,25 @@ int mouseState = 0;
 enum { NUMRECTS = 32, FULLSCREEN_REFRESH_TIME = 1000 };
 //Uint32 nextFullScreenRefresh = 0;
 
+// Limits for XSDL_REFRESH=adaptive, in milliseconds between uploads.
+// Uploads are spaced ADAPTIVE_COST_FACTOR times as far apart as they take.
+enum { ADAPTIVE_MIN_INTERVAL = 1000 / 60, ADAPTIVE_MAX_INTERVAL = 1000 / 10,
+	   ADAPTIVE_COST_FACTOR = 4 };
+
 typedef struct
 {
 	SDL_Surface *screen;
 	Rotation randr;
 	Bool shadow;
+	// Refresh pacing: 0 uploads damage as soon as the shadow layer reports
+	// it; otherwise damage collects in pending and is uploaded at most
+	// every refreshInterval ms.
+	CARD32 refreshInterval;
+	Bool adaptive;
+	RegionRec pending;
+	CARD32 lastUpload;
+	CARD32 uploadCost;	// ms, smoothed; drives the adaptive interval
+	OsTimerPtr refreshTimer;
 } SdlDriver;
 
 //#undef RANDR
@@ -198,6 +213,23 @@ static Bool sdlScreenInit(KdScreenInfo *screen)
 	screen->fb.bitsPerPixel = driver->screen->format->BitsPerPixel;
 	//screen->fb.shadow = FALSE;
 	screen->rate=30; // 60 is too intense for CPU
+	{
+		// XSDL_REFRESH=<hz> caps uploads at that rate; XSDL_REFRESH=adaptive
+		// paces them by how long they take, between 10 and 60 Hz.
+		const char *refresh = getenv("XSDL_REFRESH");
+		if (refresh && strcmp(refresh, "adaptive") == 0)
+		{
+			driver->adaptive = TRUE;
+			driver->refreshInterval = ADAPTIVE_MIN_INTERVAL;
+			screen->rate = 60;
+		}
+		else if (refresh && atoi(refresh) > 0)
+		{
+			screen->rate = atoi(refresh);
+			driver->refreshInterval = 1000 / screen->rate;
+		}
+		RegionNull(&driver->pending);
+	}
 
 	SDL_WM_SetCaption("Freedesktop.org X server (SDL)", NULL);
 
@@ -206,14 +238,92 @@ static Bool sdlScreenInit(KdScreenInfo *screen)
 	return sdlMapFramebuffer (screen);
 }
 
+// Uploads a damaged region of the SDL surface: as merged rectangles, or as
+// a full flip when that is cheaper.
+static void sdlUploadRegion (SdlDriver *driver, RegionPtr region)
+{
+	static SdlDamageBox *boxes;
+	static int boxesSize;
+	SDL_Rect updateRects[NUMRECTS];
+	SdlDamagePlan plan;
+	pixman_box16_t * rects;
+	int amount, i;
+	CARD32 start, cost;
+
+	rects = pixman_region_rectangles(region, &amount);
+	if (amount == 0)
+		return;
+	if (amount > boxesSize)
+	{
+		SdlDamageBox *grown = realloc(boxes, amount * sizeof(*boxes));
+		if (!grown)
+		{
+			SDL_Flip(driver->screen);
+			return;
+		}
+		boxes = grown;
+		boxesSize = amount;
+	}
+	for ( i = 0; i < amount; i++ )
+	{
+		boxes[i].x1 = rects[i].x1;
+		boxes[i].y1 = rects[i].y1;
+		boxes[i].x2 = rects[i].x2;
+		boxes[i].y2 = rects[i].y2;
+	}
+	sdlDamagePlanUpload(boxes, amount, NUMRECTS, driver->screen->w, driver->screen->h, &plan);
+
+	start = SDL_GetTicks();
+	if ( plan.flip )
+	{
+		//printf("SDL_Flip\n");
+		SDL_Flip(driver->screen);
+	}
+	else
+	{
+		for ( i = 0; i < plan.count; i++ )
+		{
+			updateRects[i].x = boxes[i].x1;
+			updateRects[i].y = boxes[i].y1;
+			updateRects[i].w = boxes[i].x2 - boxes[i].x1;
+			updateRects[i].h = boxes[i].y2 - boxes[i].y1;
+			//printf("sdlShadowUpdate: rect %d: %04d:%04d:%04d:%04d", i, boxes[i].x1, boxes[i].y1, boxes[i].x2, boxes[i].y2);
+		}
+		//printf("SDL_UpdateRects %d\n", plan.count);
+		SDL_UpdateRects(driver->screen, plan.count, updateRects);
+	}
+
+	if (driver->adaptive)
+	{
+		cost = SDL_GetTicks() - start;
+		driver->uploadCost = (3 * driver->uploadCost + cost + 3) / 4;
+		driver->refreshInterval = ADAPTIVE_COST_FACTOR * driver->uploadCost;
+		if (driver->refreshInterval < ADAPTIVE_MIN_INTERVAL)
+			driver->refreshInterval = ADAPTIVE_MIN_INTERVAL;
+		if (driver->refreshInterval > ADAPTIVE_MAX_INTERVAL)
+			driver->refreshInterval = ADAPTIVE_MAX_INTERVAL;
+	}
+}
+
+static void sdlFlushPending (SdlDriver *driver)
+{
+	driver->lastUpload = GetTimeInMillis();
+	sdlUploadRegion(driver, &driver->pending);
+	RegionEmpty(&driver->pending);
+}
+
+static CARD32 sdlRefreshTimer (OsTimerPtr timer, CARD32 now, pointer arg)
+{
+	sdlFlushPending((SdlDriver *) arg);
+	return 0;
+}
+
 static void sdlShadowUpdate (ScreenPtr pScreen, shadowBufPtr pBuf)
 {
 	KdScreenPriv(pScreen);
 	KdScreenInfo *screen = pScreenPriv->screen;
 	SdlDriver *driver = screen->driver;
-	pixman_box16_t * rects;
-	int amount, i;
-	int updateRectsPixelCount = 0;
+	CARD32 now;
 
 	//printf("sdlShadowUpdate: time %d", SDL_GetTicks());
 
@@ -249,38 +359,20 @@ static void sdlShadowUpdate (ScreenPtr pScreen, shadowBufPtr pBuf)
 		update(pScreen, pBuf);
 	}
 
-	rects = pixman_region_rectangles(&pBuf->pDamage->damage, &amount);
-	for ( i = 0; i < amount; i++ )
+	if (!driver->refreshInterval)
 	{
-		updateRectsPixelCount += (pBuf->pDamage->damage.extents.x2 - pBuf->pDamage->damage.extents.x1) *
-						(pBuf->pDamage->damage.extents.y2 - pBuf->pDamage->damage.extents.y1);
+		sdlUploadRegion(driver, &pBuf->pDamage->damage);
+		return;
 	}
-	// Each subrect is copied into temp buffer before uploading to OpenGL texture,
-	// so if total area of pixels copied is more than 1/3 of the whole screen area,
-	// there will be performance hit instead of optimization.
 
-	if ( amount > NUMRECTS || updateRectsPixelCount * 3 > driver->screen->w * driver->screen->h )
-	{
-		//printf("SDL_Flip\n");
-		SDL_Flip(driver->screen);
-		//nextFullScreenRefresh = 0;
-	}
-	else
-	{
-		SDL_Rect updateRects[NUMRECTS];
-		//if ( ! nextFullScreenRefresh )
-		//	nextFullScreenRefresh = SDL_GetTicks() + FULLSCREEN_REFRESH_TIME;
-		for ( i = 0; i < amount; i++ )
-		{
-			updateRects[i].x = rects[i].x1;
-			updateRects[i].y = rects[i].y1;
-			updateRects[i].w = rects[i].x2 - rects[i].x1;
-			updateRects[i].h = rects[i].y2 - rects[i].y1;
-			//printf("sdlShadowUpdate: rect %d: %04d:%04d:%04d:%04d", i, rects[i].x1, rects[i].y1, rects[i].x2, rects[i].y2);
-		}
-		//printf("SDL_UpdateRects %d\n", amount);
-		SDL_UpdateRects(driver->screen, amount, updateRects);
-	}
+	RegionUnion(&driver->pending, &driver->pending, &pBuf->pDamage->damage);
+	now = GetTimeInMillis();
+	if (now - driver->lastUpload >= driver->refreshInterval)
+		sdlFlushPending(driver);
+	else if (!driver->refreshTimer || !TimerPending(driver->refreshTimer))
+		driver->refreshTimer = TimerSet(driver->refreshTimer, 0,
+										driver->refreshInterval - (now - driver->lastUpload),
+										sdlRefreshTimer, driver);
 }
 
 static void *sdlShadowWindow (ScreenPtr pScreen, CARD32 row, CARD32 offset, int mode, CARD32 *size, void *closure)
@@ -309,6 +401,11 @@ static Bool sdlCreateRes(ScreenPtr pScreen)
 
 	printf("%s\n", __func__);
 
+	// Damage collected for the old framebuffer does not apply to the new one.
+	if (driver->refreshTimer)
+		TimerCancel(driver->refreshTimer);
+	RegionEmpty(&driver->pending);
+
 	// Hack: Kdrive assumes we have dumb videobuffer, which updates automatically,
 	// and does not call update callback if shadow flag is not set.
 	screen->fb.shadow = TRUE;
@@ -690,11 +787,13 @@ static void sdlPollInput(void)
 #endif
 				else
 					KdEnqueueKeyboardEvent (sdlKeyboard, event.key.keysym.scancode, event.type==SDL_KEYUP);
+#ifdef __ANDROID__
 				// Force SDL screen update, so SDL virtual on-screen buttons will change their images
 				{
 					SDL_Rect r = {0, 0, 1, 1};
 					SDL_UpdateRects(SDL_GetVideoSurface(), 1, &r);
 				}
+#endif
 				break;
 			case SDL_JOYAXISMOTION:
 				if (event.jaxis.which == 0 && event.jaxis.axis == 4 && pressure != event.jaxis.value)
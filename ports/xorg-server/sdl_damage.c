@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <string.h>
+
+#include "sdl_damage.h"
+
+/*
+ * Regions beyond this many boxes are first folded into runs of neighbours,
+ * which keeps the quadratic pairwise merge cheap.
+ */
+enum { MERGE_INPUT = 256 };
+
+static long boxArea(const SdlDamageBox *b)
+{
+	return (long)(b->x2 - b->x1) * (b->y2 - b->y1);
+}
+
+static SdlDamageBox boxUnion(const SdlDamageBox *a, const SdlDamageBox *b)
+{
+	SdlDamageBox u;
+	u.x1 = a->x1 < b->x1 ? a->x1 : b->x1;
+	u.y1 = a->y1 < b->y1 ? a->y1 : b->y1;
+	u.x2 = a->x2 > b->x2 ? a->x2 : b->x2;
+	u.y2 = a->y2 > b->y2 ? a->y2 : b->y2;
+	return u;
+}
+
+static long mergeCost(const SdlDamageBox *a, const SdlDamageBox *b)
+{
+	SdlDamageBox u = boxUnion(a, b);
+	return boxArea(&u) - boxArea(a) - boxArea(b);
+}
+
+long sdlDamageArea(const SdlDamageBox *boxes, int n)
+{
+	long area = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		area += boxArea(&boxes[i]);
+	return area;
+}
+
+int sdlDamageMerge(SdlDamageBox *boxes, int n, int max)
+{
+	long cost[MERGE_INPUT];
+	int i, j, best;
+
+	if (max < 1)
+		max = 1;
+	if (n <= max)
+		return n;
+
+	if (n > MERGE_INPUT)
+	{
+		int run = (n + MERGE_INPUT - 1) / MERGE_INPUT, m = 0;
+		for (i = 0; i < n; i += run)
+		{
+			SdlDamageBox b = boxes[i];
+			for (j = i + 1; j < i + run && j < n; j++)
+				b = boxUnion(&b, &boxes[j]);
+			boxes[m++] = b;
+		}
+		n = m;
+	}
+
+	for (i = 0; i < n - 1; i++)
+		cost[i] = mergeCost(&boxes[i], &boxes[i + 1]);
+
+	while (n > max)
+	{
+		best = 0;
+		for (i = 1; i < n - 1; i++)
+			if (cost[i] < cost[best])
+				best = i;
+
+		boxes[best] = boxUnion(&boxes[best], &boxes[best + 1]);
+		memmove(&boxes[best + 1], &boxes[best + 2],
+				(n - best - 2) * sizeof(boxes[0]));
+		if (n - best - 3 > 0)
+			memmove(&cost[best + 1], &cost[best + 2],
+					(n - best - 3) * sizeof(cost[0]));
+		n--;
+		if (best > 0)
+			cost[best - 1] = mergeCost(&boxes[best - 1], &boxes[best]);
+		if (best < n - 1)
+			cost[best] = mergeCost(&boxes[best], &boxes[best + 1]);
+	}
+	return n;
+}
+
+void sdlDamagePlanUpload(SdlDamageBox *boxes, int n, int max, int w, int h,
+						 SdlDamagePlan *plan)
+{
+	plan->count = sdlDamageMerge(boxes, n, max);
+	plan->pixels = sdlDamageArea(boxes, plan->count);
+	plan->flip = plan->pixels * 3 > (long)w * h;
+	if (plan->flip)
+		plan->pixels = (long)w * h;
+}
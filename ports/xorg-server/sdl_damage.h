@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef SDL_DAMAGE_H
+#define SDL_DAMAGE_H
+
+/*
+ * Turning a damaged region into SDL uploads.  This has no X server or SDL
+ * dependencies, so that sdl_damage_bench can replay drawing traces through
+ * exactly what Xsdl does.
+ */
+
+/* Same layout as pixman_box16_t: [x1, x2) x [y1, y2). */
+typedef struct
+{
+	short x1, y1, x2, y2;
+} SdlDamageBox;
+
+typedef struct
+{
+	int flip;		/* upload the whole screen instead of the boxes */
+	int count;		/* boxes left after merging */
+	long pixels;	/* pixels uploaded, counting overlaps twice */
+} SdlDamagePlan;
+
+/* Sum of the boxes' own areas. */
+long sdlDamageArea(const SdlDamageBox *boxes, int n);
+
+/*
+ * Merges boxes, in place, down to at most max.  Each step joins the two
+ * neighbours (in the region's band order) whose bounding box adds the
+ * fewest pixels.  Returns the new number of boxes.
+ */
+int sdlDamageMerge(SdlDamageBox *boxes, int n, int max);
+
+/*
+ * Decides how to upload boxes on a w x h screen: at most max (merged)
+ * rectangles, or one full flip once they would cost more than a third of
+ * the screen.  Each rectangle goes through a temporary copy before the
+ * texture upload, which is what makes a flip cheaper past that point.
+ */
+void sdlDamagePlanUpload(SdlDamageBox *boxes, int n, int max, int w, int h,
+						 SdlDamagePlan *plan);
+
+#endif
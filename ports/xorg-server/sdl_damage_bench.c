@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Replays synthetic X drawing traces through Xsdl's damage upload logic and
+ * reports how many pixels each update pushes to SDL, before and after
+ * per-rectangle accounting and merging.  This needs neither an X server nor
+ * SDL:
+ *
+ *   cc -O2 -o sdl_damage_bench sdl_damage.c sdl_damage_bench.c
+ *   ./sdl_damage_bench [updates]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdl_damage.h"
+
+enum { WIDTH = 1024, HEIGHT = 768, NUMRECTS = 32, MAX_BOXES = 4096,
+	   UPDATES_PER_SECOND = 30 };
+
+typedef struct
+{
+	const char *name;
+	/* Fills boxes with the damage of update number i, returns the count. */
+	int (*update)(int i, SdlDamageBox *boxes);
+} Trace;
+
+static int addBox(SdlDamageBox *boxes, int n, int x, int y, int w, int h)
+{
+	if (n >= MAX_BOXES || w <= 0 || h <= 0)
+		return n;
+	boxes[n].x1 = x;
+	boxes[n].y1 = y;
+	boxes[n].x2 = x + w;
+	boxes[n].y2 = y + h;
+	return n + 1;
+}
+
+/* One glyph plus the cursor in a terminal, then a status bar clock. */
+static int traceTyping(int i, SdlDamageBox *boxes)
+{
+	int col = i % 80, row = 10 + (i / 80) % 40;
+	int n = 0;
+	n = addBox(boxes, n, 8 + col * 8, 40 + row * 14, 16, 14);
+	if (i % UPDATES_PER_SECOND == 0)
+		n = addBox(boxes, n, WIDTH - 80, 4, 72, 16);
+	return n;
+}
+
+/* A scrolling terminal: the whole text area moves, one new line appears. */
+static int traceScroll(int i, SdlDamageBox *boxes)
+{
+	return addBox(boxes, 0, 8, 40, 640, 560);
+}
+
+/* `ls` output: many separate glyph runs scattered over a few lines. */
+static int traceListing(int i, SdlDamageBox *boxes)
+{
+	int n = 0, line, word;
+
+	for (line = 0; line < 6; line++)
+	{
+		int y = 40 + ((i * 6 + line) % 40) * 14;
+		for (word = 0; word < 8; word++)
+			n = addBox(boxes, n, 8 + word * 96, y, 8 * (3 + (i + line + word) % 9), 14);
+	}
+	return n;
+}
+
+/* Dragging a 400x300 window diagonally, exposing what was underneath. */
+static int traceDrag(int i, SdlDamageBox *boxes)
+{
+	int step = i % 60;
+	int x = 100 + step * 6, y = 80 + step * 4;
+	int n = 0;
+	n = addBox(boxes, n, x - 6, y - 4, 400 + 6, 4);		/* exposed top */
+	n = addBox(boxes, n, x - 6, y, 6, 300);				/* exposed left */
+	n = addBox(boxes, n, x, y, 400, 300);				/* the window */
+	return n;
+}
+
+/* A menu popping up, the pointer walking down it, and the menu going away. */
+static int traceMenu(int i, SdlDamageBox *boxes)
+{
+	int step = i % 20;
+	int n = 0;
+	if (step == 0 || step == 19)
+		return addBox(boxes, 0, 200, 30, 180, 320);
+	n = addBox(boxes, n, 200, 30 + step * 16, 180, 16);
+	n = addBox(boxes, n, 200, 30 + (step - 1) * 16, 180, 16);
+	return n;
+}
+
+/* A clock face and a blinking cursor in opposite corners. */
+static int traceClock(int i, SdlDamageBox *boxes)
+{
+	int n = 0;
+	n = addBox(boxes, n, 20, 20, 120, 120);
+	if (i & 1)
+		n = addBox(boxes, n, WIDTH - 40, HEIGHT - 40, 8, 14);
+	return n;
+}
+
+static const Trace traces[] = {
+	{ "typing", traceTyping },
+	{ "scroll", traceScroll },
+	{ "listing", traceListing },
+	{ "drag", traceDrag },
+	{ "menu", traceMenu },
+	{ "clock", traceClock },
+};
+
+static int compareBoxes(const void *a, const void *b)
+{
+	const SdlDamageBox *x = a, *y = b;
+	if (x->y1 != y->y1)
+		return x->y1 - y->y1;
+	return x->x1 - y->x1;
+}
+
+/*
+ * What sdlShadowUpdate used to upload: every rectangle was charged the area
+ * of the whole damage extents, and it flipped past NUMRECTS rectangles or
+ * once that charge exceeded a third of the screen; otherwise it uploaded
+ * each rectangle as is.
+ */
+static void oldPlan(const SdlDamageBox *boxes, int n, SdlDamagePlan *plan)
+{
+	SdlDamageBox ext = boxes[0];
+	long charged;
+	int i;
+
+	for (i = 1; i < n; i++)
+	{
+		if (boxes[i].x1 < ext.x1) ext.x1 = boxes[i].x1;
+		if (boxes[i].y1 < ext.y1) ext.y1 = boxes[i].y1;
+		if (boxes[i].x2 > ext.x2) ext.x2 = boxes[i].x2;
+		if (boxes[i].y2 > ext.y2) ext.y2 = boxes[i].y2;
+	}
+	charged = sdlDamageArea(&ext, 1) * n;
+	plan->count = n;
+	plan->flip = n > NUMRECTS || charged * 3 > (long)WIDTH * HEIGHT;
+	plan->pixels = plan->flip ? (long)WIDTH * HEIGHT : sdlDamageArea(boxes, n);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	static SdlDamageBox boxes[MAX_BOXES];
+	int updates = argc > 1 ? atoi(argv[1]) : 3000;
+	size_t t;
+
+	if (updates <= 0)
+		updates = 3000;
+
+	printf("%d updates per trace on %dx%d, uploads at %d updates/s\n\n",
+		   updates, WIDTH, HEIGHT, UPDATES_PER_SECOND);
+	printf("%-8s %6s | %10s %6s %9s | %10s %6s %9s %8s\n",
+		   "trace", "boxes", "old px/upd", "flips", "Mpix/s",
+		   "new px/upd", "flips", "Mpix/s", "us/plan");
+
+	for (t = 0; t < sizeof(traces) / sizeof(traces[0]); t++)
+	{
+		long oldPixels = 0, newPixels = 0, inBoxes = 0;
+		int oldFlips = 0, newFlips = 0, i, n;
+		double planTime = 0, start;
+
+		for (i = 0; i < updates; i++)
+		{
+			SdlDamagePlan plan;
+
+			n = traces[t].update(i, boxes);
+			if (n == 0)
+				continue;
+			qsort(boxes, n, sizeof(boxes[0]), compareBoxes);
+			inBoxes += n;
+
+			oldPlan(boxes, n, &plan);
+			oldPixels += plan.pixels;
+			oldFlips += plan.flip;
+
+			start = now();
+			sdlDamagePlanUpload(boxes, n, NUMRECTS, WIDTH, HEIGHT, &plan);
+			planTime += now() - start;
+			newPixels += plan.pixels;
+			newFlips += plan.flip;
+		}
+
+		printf("%-8s %6.1f | %10ld %6d %9.2f | %10ld %6d %9.2f %8.2f\n",
+			   traces[t].name, (double)inBoxes / updates,
+			   oldPixels / updates, oldFlips,
+			   (double)oldPixels / updates * UPDATES_PER_SECOND / 1e6,
+			   newPixels / updates, newFlips,
+			   (double)newPixels / updates * UPDATES_PER_SECOND / 1e6,
+			   planTime / updates * 1e6);
+	}
+	return 0;
+}